@@ -11,12 +11,14 @@
 #import "TFPPrinter.h"
 #import "TFPDryRunPrinter.h"
 #import "TFPBedLevelCompensator.h"
+#import "TFPControlServer.h"
 
 #import "TFPExtras.h"
 
 
 @interface TFPApplicationDelegate ()
 @property NSWindow *mainWindow;
+@property TFPControlServer *controlServer;
 @property TFPPrinterContext *debugContext;
 @property (copy) void(^debugCancelBlock)();
 @end
@@ -27,6 +29,16 @@
 
 - (void)applicationDidFinishLaunching:(NSNotification *)notification {
 	self.mainWindow = [NSApp windows].firstObject;
+	
+	NSString *socketPath = [[NSUserDefaults standardUserDefaults] stringForKey:@"ControlSocketPath"];
+	if(socketPath) {
+		self.controlServer = [[TFPControlServer alloc] initWithSocketPath:socketPath printerManager:[TFPPrinterManager sharedManager]];
+		NSError *error;
+		if(![self.controlServer start:&error]) {
+			TFLog(@"Failed to start control server at %@: %@", socketPath, error);
+			self.controlServer = nil;
+		}
+	}
 }
 
 
@@ -12,6 +12,7 @@
 #import "TFPExtras.h"
 #import "TFPGCodeHelpers.h"
 #import "TFPPrinterManager.h"
+#import "TFPGCodeLibraryIndex.h"
 
 #import "MAKVONotificationCenter.h"
 
@@ -63,6 +64,14 @@ static NSString *const savedSettingsKey = @"SavedDocumentSettings";
 
 
 - (BOOL)readFromURL:(NSURL *)absoluteURL ofType:(NSString *)typeName error:(NSError **)outError {
+	// Document types go by the last extension only, so other .gz files get this far
+	if([absoluteURL.pathExtension.lowercaseString isEqual:@"gz"] && ![TFPGCodeLibraryIndex isGCodeFileName:absoluteURL.lastPathComponent]) {
+		if(outError) {
+			*outError = [NSError errorWithDomain:TFPErrorDomain code:TFPErrorCodeParseError userInfo:@{NSLocalizedRecoverySuggestionErrorKey: @"Only compressed G-code files (.gcode.gz) can be opened."}];
+		}
+		return NO;
+	}
+	
     dispatch_async(dispatch_get_main_queue(), ^{
         self.loadingWindowController = [[NSStoryboard storyboardWithName:@"Main" bundle:nil] instantiateControllerWithIdentifier:@"LoadingWindowController"];
         [self.loadingWindowController showWindow:nil];
@@ -74,7 +83,7 @@ static NSString *const savedSettingsKey = @"SavedDocumentSettings";
         });
     };
 
-    self.program = [[TFPGCodeProgram alloc] initWithFileURL:absoluteURL error:outError];
+    self.program = [[TFPGCodeProgram alloc] initWithFileURL:absoluteURL options:TFPGCodeProgramOptionSeparateComments | TFPGCodeProgramOptionCached error:outError];
     if(!self.program) {
         stopLoading();
         return NO;
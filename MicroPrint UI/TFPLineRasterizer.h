@@ -0,0 +1,45 @@
+//
+//  TFPLineRasterizer.h
+//  microprint
+//
+//
+
+#include <stdint.h>
+#include <stdbool.h>
+
+
+// Software rasterizer behind the print preview. Plain C with no framework dependencies, so it can run on any
+// queue and be checked against known pixels without a window server.
+
+// One byte of coverage per pixel, rows top to bottom. 0 is empty and 255 fully covered.
+typedef struct {
+	uint8_t *pixels;
+	int32_t width;
+	int32_t height;
+} TFPCoverageBitmap;
+
+
+// Max is exclusive. A rect with maxX <= minX or maxY <= minY is empty.
+typedef struct {
+	int32_t minX;
+	int32_t minY;
+	int32_t maxX;
+	int32_t maxY;
+} TFPPixelRect;
+
+extern const TFPPixelRect TFPPixelRectEmpty;
+extern bool TFPPixelRectIsEmpty(TFPPixelRect rect);
+extern TFPPixelRect TFPPixelRectUnion(TFPPixelRect a, TFPPixelRect b);
+extern TFPPixelRect TFPPixelRectIntersection(TFPPixelRect a, TFPPixelRect b);
+
+
+extern TFPCoverageBitmap TFPCoverageBitmapCreate(int32_t width, int32_t height);
+extern void TFPCoverageBitmapFree(TFPCoverageBitmap *bitmap);
+extern TFPPixelRect TFPCoverageBitmapBounds(const TFPCoverageBitmap *bitmap);
+
+// Strokes an antialiased line with round caps, in pixel coordinates. Pixels keep the highest coverage they've
+// had, so overlapping strokes don't darken each other. Returns the pixels that may have changed.
+extern TFPPixelRect TFPCoverageBitmapStrokeLine(TFPCoverageBitmap *bitmap, float x0, float y0, float x1, float y1, float lineWidth);
+
+// Scales all coverage by factor (0 to 1), like redrawing the bitmap onto itself at partial alpha
+extern void TFPCoverageBitmapFade(TFPCoverageBitmap *bitmap, float factor);
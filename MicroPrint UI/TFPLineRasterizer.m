@@ -0,0 +1,148 @@
+//
+//  TFPLineRasterizer.m
+//  microprint
+//
+//
+
+#include "TFPLineRasterizer.h"
+#include <stdlib.h>
+#include <math.h>
+
+
+const TFPPixelRect TFPPixelRectEmpty = {0, 0, 0, 0};
+
+
+bool TFPPixelRectIsEmpty(TFPPixelRect rect) {
+	return rect.maxX <= rect.minX || rect.maxY <= rect.minY;
+}
+
+
+TFPPixelRect TFPPixelRectUnion(TFPPixelRect a, TFPPixelRect b) {
+	if(TFPPixelRectIsEmpty(a)) {
+		return b;
+	}else if(TFPPixelRectIsEmpty(b)) {
+		return a;
+	}
+	return (TFPPixelRect){
+		.minX = a.minX < b.minX ? a.minX : b.minX,
+		.minY = a.minY < b.minY ? a.minY : b.minY,
+		.maxX = a.maxX > b.maxX ? a.maxX : b.maxX,
+		.maxY = a.maxY > b.maxY ? a.maxY : b.maxY,
+	};
+}
+
+
+TFPPixelRect TFPPixelRectIntersection(TFPPixelRect a, TFPPixelRect b) {
+	TFPPixelRect rect = {
+		.minX = a.minX > b.minX ? a.minX : b.minX,
+		.minY = a.minY > b.minY ? a.minY : b.minY,
+		.maxX = a.maxX < b.maxX ? a.maxX : b.maxX,
+		.maxY = a.maxY < b.maxY ? a.maxY : b.maxY,
+	};
+	return TFPPixelRectIsEmpty(rect) ? TFPPixelRectEmpty : rect;
+}
+
+
+TFPCoverageBitmap TFPCoverageBitmapCreate(int32_t width, int32_t height) {
+	width = width > 0 ? width : 0;
+	height = height > 0 ? height : 0;
+	return (TFPCoverageBitmap){
+		.pixels = calloc((size_t)width * height, 1),
+		.width = width,
+		.height = height,
+	};
+}
+
+
+void TFPCoverageBitmapFree(TFPCoverageBitmap *bitmap) {
+	free(bitmap->pixels);
+	bitmap->pixels = NULL;
+	bitmap->width = 0;
+	bitmap->height = 0;
+}
+
+
+TFPPixelRect TFPCoverageBitmapBounds(const TFPCoverageBitmap *bitmap) {
+	return (TFPPixelRect){0, 0, bitmap->width, bitmap->height};
+}
+
+
+static float TFPClamp(float value, float minValue, float maxValue) {
+	return value < minValue ? minValue : (value > maxValue ? maxValue : value);
+}
+
+
+// The stroke is a capsule: every point within radius of the segment. Pixels are sampled at their centers, with
+// coverage ramping from 1 to 0 over the pixel that straddles the edge. Each row only visits the span the capsule
+// can reach, so long diagonal lines cost their length, not their bounding box.
+TFPPixelRect TFPCoverageBitmapStrokeLine(TFPCoverageBitmap *bitmap, float x0, float y0, float x1, float y1, float lineWidth) {
+	float radius = lineWidth / 2;
+	float reach = radius + 0.5f;
+	// Lines thinner than a pixel fade instead of thinning further
+	float intensity = lineWidth < 1 ? lineWidth : 1;
+	
+	float dx = x1 - x0;
+	float dy = y1 - y0;
+	float lengthSquared = dx*dx + dy*dy;
+	float inverseLengthSquared = lengthSquared > 0 ? 1 / lengthSquared : 0;
+	
+	TFPPixelRect rect = {
+		.minX = (int32_t)floorf(fminf(x0, x1) - reach),
+		.minY = (int32_t)floorf(fminf(y0, y1) - reach),
+		.maxX = (int32_t)ceilf(fmaxf(x0, x1) + reach),
+		.maxY = (int32_t)ceilf(fmaxf(y0, y1) + reach),
+	};
+	rect = TFPPixelRectIntersection(rect, TFPCoverageBitmapBounds(bitmap));
+	if(TFPPixelRectIsEmpty(rect) || !(intensity > 0)) {
+		return TFPPixelRectEmpty;
+	}
+	
+	for(int32_t y = rect.minY; y < rect.maxY; y++) {
+		float py = y + 0.5f;
+		
+		// Range of t where the segment is within reach of this row
+		float t0 = 0, t1 = 1;
+		if(dy != 0) {
+			t0 = (py - reach - y0) / dy;
+			t1 = (py + reach - y0) / dy;
+			if(t0 > t1) {
+				float swap = t0; t0 = t1; t1 = swap;
+			}
+			t0 = TFPClamp(t0, 0, 1);
+			t1 = TFPClamp(t1, 0, 1);
+		}
+		float spanStart = fminf(x0 + t0*dx, x0 + t1*dx) - reach;
+		float spanEnd = fmaxf(x0 + t0*dx, x0 + t1*dx) + reach;
+		
+		int32_t minX = (int32_t)floorf(spanStart);
+		int32_t maxX = (int32_t)ceilf(spanEnd);
+		minX = minX < rect.minX ? rect.minX : minX;
+		maxX = maxX > rect.maxX ? rect.maxX : maxX;
+		
+		uint8_t *row = bitmap->pixels + (size_t)y * bitmap->width;
+		for(int32_t x = minX; x < maxX; x++) {
+			float px = x + 0.5f;
+			float t = TFPClamp(((px - x0)*dx + (py - y0)*dy) * inverseLengthSquared, 0, 1);
+			float ex = px - (x0 + t*dx);
+			float ey = py - (y0 + t*dy);
+			float coverage = TFPClamp(reach - sqrtf(ex*ex + ey*ey), 0, 1) * intensity;
+			
+			uint8_t value = (uint8_t)(coverage * 255 + 0.5f);
+			if(value > row[x]) {
+				row[x] = value;
+			}
+		}
+	}
+	return rect;
+}
+
+
+void TFPCoverageBitmapFade(TFPCoverageBitmap *bitmap, float factor) {
+	uint32_t scale = (uint32_t)(TFPClamp(factor, 0, 1) * 256);
+	size_t count = (size_t)bitmap->width * bitmap->height;
+	uint8_t *pixels = bitmap->pixels;
+	
+	for(size_t i=0; i<count; i++) {
+		pixels[i] = (pixels[i] * scale) >> 8;
+	}
+}
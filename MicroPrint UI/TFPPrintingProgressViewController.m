@@ -8,6 +8,7 @@
 
 #import "TFPPrintingProgressViewController.h"
 #import "TFPPrintJob.h"
+#import "TFPMotionOptimizer.h"
 #import "TFPExtras.h"
 #import "TFPGCodeProgram.h"
 #import "TFPPrinter.h"
@@ -162,10 +163,15 @@ static const CGFloat drawContainerExpandedBottomMargin = 20;
 }
 
 
-- (void)warnAboutOutOfBounds {
+- (void)warnAboutOutOfBoundsWithViolation:(TFPPrintableVolumeViolation*)violation {
+	NSString *location = [NSString stringWithFormat:@"Extrusion first leaves it at X %.01f, Y %.01f, Z %.01f (line %ld", violation.position.x, violation.position.y, violation.position.z, (long)violation.lineIndex+1];
+	if(violation.layerIndex != NSNotFound) {
+		location = [location stringByAppendingFormat:@", layer %ld", (long)violation.layerIndex];
+	}
+	
 	NSAlert *alert = [NSAlert new];
 	alert.messageText = @"The model appears to be outside of the printer's printable area.";
-	alert.informativeText = @"This may be due to the model being too large or positioned incorrectly. Make sure your slicer has the correct print area set.";
+	alert.informativeText = [NSString stringWithFormat:@"%@).\n\nThis may be due to the model being too large or positioned incorrectly. Make sure your slicer has the correct print area set.", location];
 	[alert addButtonWithTitle:@"Cancel"];
 	[alert addButtonWithTitle:@"Continue Anyway"];
 	
@@ -190,18 +196,24 @@ static const CGFloat drawContainerExpandedBottomMargin = 20;
 	
 	dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_HIGH, 0), ^{
 		TFPGCodeProgram *program = self.program;
-		BOOL withinBounds = [program withinM3DMicroPrintableVolume];
+		TFPPrintableVolumeViolation *violation = [program findPrintableVolumeViolations].firstObject;
+		
+		TFPMotionOptimizer *optimizer = [TFPMotionOptimizer optimizerForProgram:program parameters:params];
+		if(optimizer) {
+			program = optimizer.optimizedProgram;
+		}
 		
 		dispatch_async(dispatch_get_main_queue(), ^{
 			if(weakSelf.aborted) {
 				return;
 			}
 			weakSelf.printJob = [[TFPPrintJob alloc] initWithProgram:program printer:weakSelf.printer printParameters:params];
+			weakSelf.printJob.motionOptimizer = optimizer;
 			
-			if(withinBounds) {
+			if(!violation) {
 				[weakSelf configurePrintJob];
 			}else{
-				[weakSelf warnAboutOutOfBounds];
+				[weakSelf warnAboutOutOfBoundsWithViolation:violation];
 			}
 		});
 	});
@@ -229,12 +241,16 @@ static const CGFloat drawContainerExpandedBottomMargin = 20;
 	NSAlert *alert = [NSAlert new];
 	alert.alertStyle = NSCriticalAlertStyle;
 	alert.messageText = @"Are you sure you want to abort the print?";
+	alert.informativeText = @"Emergency Stop turns off the motors and heater right away, without retracting filament or moving the print head out of the way.";
 	[alert addButtonWithTitle:@"Don't Abort"];
 	[alert addButtonWithTitle:@"Abort Print"];
+	[alert addButtonWithTitle:@"Emergency Stop"];
 	
 	[alert beginSheetModalForWindow:self.view.window completionHandler:^(NSModalResponse returnCode) {
 		if(returnCode == NSAlertSecondButtonReturn) {
 			[self.printJob abort];
+		}else if(returnCode == NSAlertThirdButtonReturn) {
+			[self.printJob emergencyStop];
 		}
 	}];
 }
@@ -9,19 +9,83 @@
 #import "TFPVisualPrintProgressView.h"
 #import "TFPPrintJob.h"
 #import "TFPPrintStatusController.h"
+#import "TFPLineRasterizer.h"
 
+#include <stdatomic.h>
+
+
+static const NSTimeInterval frameInterval = 1.0 / 60;
+static const int32_t tileSize = 128; // Pixels
+static const float previousLayerAlpha = 0.5;
+
+enum { segmentBufferCapacity = 1 << 14 }; // Power of two
+
+
+typedef struct {
+	float x0, y0, x1, y1; // Pixels. NaN x0 marks a layer change.
+} TFPPreviewSegment;
+
+
+// Single producer (main thread) and single consumer (render queue). head and tail only grow; slots wrap.
+typedef struct {
+	TFPPreviewSegment segments[segmentBufferCapacity];
+	_Atomic uint32_t head;
+	_Atomic uint32_t tail;
+} TFPPreviewSegmentBuffer;
+
+
+static BOOL TFPPreviewSegmentBufferPush(TFPPreviewSegmentBuffer *buffer, TFPPreviewSegment segment) {
+	uint32_t head = atomic_load_explicit(&buffer->head, memory_order_relaxed);
+	uint32_t tail = atomic_load_explicit(&buffer->tail, memory_order_acquire);
+	if(head - tail == segmentBufferCapacity) {
+		return NO;
+	}
+	buffer->segments[head & (segmentBufferCapacity-1)] = segment;
+	atomic_store_explicit(&buffer->head, head+1, memory_order_release);
+	return YES;
+}
 
-@interface TFPVisualPrintProgressView ()
-@property id bitmap;
 
+static BOOL TFPPreviewSegmentBufferPop(TFPPreviewSegmentBuffer *buffer, TFPPreviewSegment *segment) {
+	uint32_t tail = atomic_load_explicit(&buffer->tail, memory_order_relaxed);
+	uint32_t head = atomic_load_explicit(&buffer->head, memory_order_acquire);
+	if(head == tail) {
+		return NO;
+	}
+	*segment = buffer->segments[tail & (segmentBufferCapacity-1)];
+	atomic_store_explicit(&buffer->tail, tail+1, memory_order_release);
+	return YES;
+}
+
+
+
+@interface TFPVisualPrintProgressView ()
 @property CALayer *drawLayer;
-@property CGAffineTransform drawTransform;
+@property NSArray<CALayer*> *tileLayers;
+@property int32_t tileColumns;
+
+@property CGAffineTransform drawTransform; // mm to bitmap pixels
 @property CGFloat drawScale;
+@property float lineWidth; // Pixels
+
+@property dispatch_queue_t renderQueue;
+@property TFPPixelRect dirtyRect; // On render queue
 @end
 
 
 
-@implementation TFPVisualPrintProgressView
+@implementation TFPVisualPrintProgressView {
+	TFPCoverageBitmap _bitmap; // Only touched on the render queue after setup
+	TFPPreviewSegmentBuffer *_segments;
+	atomic_bool _frameScheduled;
+	atomic_bool _displayEnabled;
+}
+
+
+- (void)dealloc {
+	TFPCoverageBitmapFree(&_bitmap);
+	free(_segments);
+}
 
 
 - (void)configureWithPrintStatusController:(TFPPrintStatusController*)statusController parameters:(TFPPrintParameters*)printParameters {
@@ -31,15 +95,17 @@
 	CGSize viewSize = self.fullViewSize;
 	
 	CGFloat drawScale = 2;
-	self.bitmap = CFBridgingRelease(CGBitmapContextCreate(NULL, viewSize.width * drawScale, viewSize.height * drawScale, 8, (viewSize.width*drawScale)*4, [NSColorSpace deviceRGBColorSpace].CGColorSpace, (CGBitmapInfo)kCGImageAlphaPremultipliedLast));
+	_bitmap = TFPCoverageBitmapCreate(viewSize.width * drawScale, viewSize.height * drawScale);
+	_segments = calloc(1, sizeof(TFPPreviewSegmentBuffer));
+	atomic_store(&_displayEnabled, !self.hiddenOrHasHiddenAncestor);
+	self.renderQueue = dispatch_queue_create("se.tomasf.microprint.printPreview", DISPATCH_QUEUE_SERIAL);
 	
 	self.drawLayer = [CALayer layer];
 	self.drawLayer.bounds = CGRectMake(0, 0, viewSize.width, viewSize.height);
 	self.drawLayer.backgroundColor = [NSColor whiteColor].CGColor;
 	self.drawLayer.anchorPoint = CGPointZero;
-	self.drawLayer.actions = @{@"contents": [NSNull null]};
-	self.drawLayer.contentsScale = drawScale;
 	[self.layer addSublayer:self.drawLayer];
+	[self createTileLayersWithScale:drawScale];
 	
 	CGFloat margin = 20;
 	viewSize.width -= 2*margin;
@@ -52,17 +118,16 @@
 	
 	CGFloat xOffset = (viewSize.width - (scale*boundingBox.xSize)) / 2 + margin;
 	CGFloat yOffset = (viewSize.height - (scale*boundingBox.ySize)) / 2 + margin;
+	
+	// Bitmap rows run top to bottom, so flip Y after scaling to pixels
+	transform = CGAffineTransformTranslate(transform, 0, _bitmap.height);
+	transform = CGAffineTransformScale(transform, drawScale, -drawScale);
 	transform = CGAffineTransformTranslate(transform, xOffset, yOffset);
 	transform = CGAffineTransformScale(transform, scale, scale);
 	transform = CGAffineTransformTranslate(transform, -boundingBox.x, -boundingBox.y);
 	self.drawScale = scale;
 	self.drawTransform = transform;
-	
-	CGContextRef context = (__bridge CGContextRef)self.bitmap;
-	CGContextSetLineCap(context, kCGLineCapRound);
-	CGContextSetLineWidth(context, self.drawScale * 0.8);
-	CGContextSetStrokeColorWithColor(context, [NSColor blackColor].CGColor);
-	CGContextScaleCTM(context, drawScale, drawScale);
+	self.lineWidth = scale * 0.8 * drawScale;
 	
 	
 	__block double xAdjustment = 0;
@@ -76,56 +141,159 @@
 			yAdjustment += from.y - to.y;
 		}
 		
-		CGAffineTransform transform = weakSelf.drawTransform;
-		CGPoint fromPoint = CGPointApplyAffineTransform(CGPointMake(from.x + xAdjustment, from.y + yAdjustment), transform);
-		CGPoint toPoint = CGPointApplyAffineTransform(CGPointMake(to.x + xAdjustment, to.y + yAdjustment), transform);
-		
-		/*
-		 double distance = sqrt(pow(to.x - from.x, 2) + pow(to.y - from.y, 2));
-		 double calculatedSpeed = (6288.78 * (feedRate-830))/((feedRate-828.465) * (feedRate+79.5622));
-		 NSTimeInterval estimatedDuration = distance / calculatedSpeed;
-		 estimatedDuration /= weakSelf.printer.speedMultiplier;
-		 */
-		
 		if(to.e > from.e && distance > FLT_EPSILON) {
-			CGMutablePathRef path = (CGMutablePathRef)CFAutorelease(CGPathCreateMutable());
-			CGPathMoveToPoint(path, NULL, fromPoint.x, fromPoint.y);
-			CGPathAddLineToPoint(path, NULL, toPoint.x, toPoint.y);
-			
-			CGContextRef context = (__bridge CGContextRef)weakSelf.bitmap;
-			
-			CGContextAddPath(context, path);
-			CGContextStrokePath(context);
-			[weakSelf updateImage];
+			CGAffineTransform transform = weakSelf.drawTransform;
+			CGPoint fromPoint = CGPointApplyAffineTransform(CGPointMake(from.x + xAdjustment, from.y + yAdjustment), transform);
+			CGPoint toPoint = CGPointApplyAffineTransform(CGPointMake(to.x + xAdjustment, to.y + yAdjustment), transform);
+			[weakSelf addSegment:(TFPPreviewSegment){fromPoint.x, fromPoint.y, toPoint.x, toPoint.y}];
 		}
 	};
 	
 	statusController.layerChangeHandler = ^{
-		CGContextRef context = (__bridge CGContextRef)weakSelf.bitmap;
-		CGRect entireRect = CGRectMake(0, 0, CGBitmapContextGetWidth(context), CGBitmapContextGetHeight(context));
-		CGImageRef image = (CGImageRef)CFAutorelease(CGBitmapContextCreateImage(context));
-		
-		CGContextSaveGState(context);
-		CGContextClearRect(context, entireRect);
-		CGContextSetAlpha(context, 0.5);
-		CGContextConcatCTM(context, CGAffineTransformInvert(CGContextGetCTM(context)));
-		CGContextDrawImage(context, entireRect, image);
-		CGContextRestoreGState(context);
+		[weakSelf addSegment:(TFPPreviewSegment){NAN, NAN, NAN, NAN}];
 	};
+}
+
+
+- (void)createTileLayersWithScale:(CGFloat)scale {
+	int32_t columns = (_bitmap.width + tileSize - 1) / tileSize;
+	int32_t rows = (_bitmap.height + tileSize - 1) / tileSize;
+	NSMutableArray *tiles = [NSMutableArray new];
+	
+	for(int32_t row=0; row<rows; row++) {
+		for(int32_t column=0; column<columns; column++) {
+			TFPPixelRect rect = [self pixelRectForTileAtIndex:tiles.count columns:columns];
+			
+			CALayer *tile = [CALayer layer];
+			tile.anchorPoint = CGPointZero;
+			tile.frame = CGRectMake(rect.minX / scale, (_bitmap.height - rect.maxY) / scale, (rect.maxX - rect.minX) / scale, (rect.maxY - rect.minY) / scale);
+			tile.contentsScale = scale;
+			tile.actions = @{@"contents": [NSNull null]};
+			[self.drawLayer addSublayer:tile];
+			[tiles addObject:tile];
+		}
+	}
+	
+	self.tileLayers = tiles;
+	self.tileColumns = columns;
+}
+
 
+- (TFPPixelRect)pixelRectForTileAtIndex:(NSUInteger)index columns:(int32_t)columns {
+	int32_t column = (int32_t)(index % columns);
+	int32_t row = (int32_t)(index / columns);
+	TFPPixelRect rect = {column * tileSize, row * tileSize, (column+1) * tileSize, (row+1) * tileSize};
+	return TFPPixelRectIntersection(rect, TFPCoverageBitmapBounds(&_bitmap));
 }
 
 
 - (void)setHidden:(BOOL)hidden {
 	[super setHidden:hidden];
-	[self updateImage];
+	if(!_segments) {
+		return;
+	}
+	
+	BOOL wasEnabled = atomic_exchange(&_displayEnabled, !self.hiddenOrHasHiddenAncestor);
+	if(!wasEnabled && !self.hiddenOrHasHiddenAncestor) {
+		// Dirty tiles were left alone while hidden
+		dispatch_async(self.renderQueue, ^{
+			[self renderFrame];
+		});
+	}
+}
+
+
+#pragma mark - Rendering
+
+
+// On main queue. Segments are rasterized in batches, at most once per frame.
+- (void)addSegment:(TFPPreviewSegment)segment {
+	while(!TFPPreviewSegmentBufferPush(_segments, segment)) {
+		// The render queue fell a whole buffer behind; catch up here rather than drop moves
+		dispatch_sync(self.renderQueue, ^{
+			[self rasterizePendingSegments];
+		});
+	}
+	
+	if(!atomic_exchange(&_frameScheduled, true)) {
+		__weak __typeof__(self) weakSelf = self;
+		dispatch_after(dispatch_time(DISPATCH_TIME_NOW, frameInterval * NSEC_PER_SEC), self.renderQueue, ^{
+			[weakSelf renderFrame];
+		});
+	}
+}
+
+
+// On render queue
+- (void)rasterizePendingSegments {
+	TFPPixelRect dirtyRect = self.dirtyRect;
+	TFPPreviewSegment segment;
+	
+	while(TFPPreviewSegmentBufferPop(_segments, &segment)) {
+		if(isnan(segment.x0)) {
+			TFPCoverageBitmapFade(&_bitmap, previousLayerAlpha);
+			dirtyRect = TFPCoverageBitmapBounds(&_bitmap);
+		}else{
+			TFPPixelRect rect = TFPCoverageBitmapStrokeLine(&_bitmap, segment.x0, segment.y0, segment.x1, segment.y1, self.lineWidth);
+			dirtyRect = TFPPixelRectUnion(dirtyRect, rect);
+		}
+	}
+	
+	self.dirtyRect = dirtyRect;
+}
+
+
+// On render queue. Only tiles that changed get new contents.
+- (void)renderFrame {
+	// Cleared first, so segments added while rasterizing schedule another frame
+	atomic_store(&_frameScheduled, false);
+	[self rasterizePendingSegments];
+	
+	TFPPixelRect dirtyRect = self.dirtyRect;
+	if(TFPPixelRectIsEmpty(dirtyRect) || !atomic_load(&_displayEnabled)) {
+		return;
+	}
+	self.dirtyRect = TFPPixelRectEmpty;
+	
+	NSMutableDictionary<NSNumber*, id> *images = [NSMutableDictionary new];
+	for(NSUInteger i=0; i<self.tileLayers.count; i++) {
+		TFPPixelRect tileRect = [self pixelRectForTileAtIndex:i columns:self.tileColumns];
+		if(!TFPPixelRectIsEmpty(TFPPixelRectIntersection(tileRect, dirtyRect))) {
+			images[@(i)] = [self imageForPixelRect:tileRect];
+		}
+	}
+	
+	dispatch_async(dispatch_get_main_queue(), ^{
+		[CATransaction begin];
+		[CATransaction setDisableActions:YES];
+		for(NSNumber *index in images) {
+			self.tileLayers[index.unsignedIntegerValue].contents = images[index];
+		}
+		[CATransaction commit];
+	});
 }
 
 
-- (void)updateImage {
-	if(!self.hiddenOrHasHiddenAncestor && self.bitmap) {
-		self.drawLayer.contents = CFBridgingRelease(CGBitmapContextCreateImage((CGContextRef)self.bitmap));
+// On render queue. Coverage becomes black on white.
+- (id)imageForPixelRect:(TFPPixelRect)rect {
+	size_t width = rect.maxX - rect.minX;
+	size_t height = rect.maxY - rect.minY;
+	NSMutableData *data = [NSMutableData dataWithLength:width * height];
+	uint8_t *output = data.mutableBytes;
+	
+	for(int32_t y = rect.minY; y < rect.maxY; y++) {
+		const uint8_t *input = _bitmap.pixels + (size_t)y * _bitmap.width + rect.minX;
+		for(size_t x=0; x<width; x++) {
+			*output++ = 255 - input[x];
+		}
 	}
+	
+	CGDataProviderRef provider = CGDataProviderCreateWithCFData((__bridge CFDataRef)data);
+	CGColorSpaceRef colorSpace = CGColorSpaceCreateDeviceGray();
+	CGImageRef image = CGImageCreate(width, height, 8, 8, width, colorSpace, (CGBitmapInfo)kCGImageAlphaNone, provider, NULL, false, kCGRenderingIntentDefault);
+	CGColorSpaceRelease(colorSpace);
+	CGDataProviderRelease(provider);
+	return CFBridgingRelease(image);
 }
 
 
@@ -117,6 +117,17 @@ NS_ASSUME_NONNULL_BEGIN
  *  ---------------------------------------------------------------------------------------
  */
 
+/**
+ *  If set, ports opened afterwards read from a single shared dispatch queue driven by
+ *  a read dispatch source, instead of each running a select() loop and polling the
+ *  modem lines every 10 ms. The CTS, DSR and DCD properties are not updated for these
+ *  ports. Defaults to NO.
+ *
+ *  @param flag YES to use the shared read queue for subsequently opened ports.
+ */
++ (void)setUsesSharedReadQueue:(BOOL)flag;
++ (BOOL)usesSharedReadQueue;
+
 /**
  *  Returns an `ORSSerialPort` instance representing the serial port at `devicePath`.
  *
@@ -336,6 +347,7 @@ NS_ASSUME_NONNULL_BEGIN
 
 @property (copy, readonly) NSNumber *USBVendorID;
 @property (copy, readonly) NSNumber *USBProductID;
+@property (copy, readonly) NSString *USBSerialNumber; // Stays with the device, unlike the path
 
 /** ---------------------------------------------------------------------------------------
  * @name Configuring the Serial Port
@@ -52,6 +52,7 @@
 #endif
 
 static __strong NSMutableArray *allSerialPorts;
+static BOOL usesSharedReadQueue;
 
 @interface ORSSerialPort ()
 {
@@ -65,6 +66,7 @@ static __strong NSMutableArray *allSerialPorts;
 
 @property (copy, readwrite) NSNumber *USBVendorID;
 @property (copy, readwrite) NSNumber *USBProductID;
+@property (copy, readwrite) NSString *USBSerialNumber;
 
 @property (strong) NSMutableData *receiveBuffer;
 
@@ -76,12 +78,17 @@ static __strong NSMutableArray *allSerialPorts;
 @property (nonatomic, readwrite) BOOL DSR;
 @property (nonatomic, readwrite) BOOL DCD;
 
+@property BOOL readSourceClosesDescriptor; // Set while the shared read queue is in use for this port
+@property BOOL readSourceCancelled;
+
 #if OS_OBJECT_USE_OBJC
+@property (nonatomic, strong) dispatch_source_t readSource;
 @property (nonatomic, strong) dispatch_source_t pinPollTimer;
 @property (nonatomic, strong) dispatch_source_t pendingRequestTimeoutTimer;
 @property (nonatomic, strong) dispatch_queue_t requestHandlingQueue;
 @property (nonatomic, strong) dispatch_semaphore_t selectSemaphore;
 #else
+@property (nonatomic) dispatch_source_t readSource;
 @property (nonatomic) dispatch_source_t pinPollTimer;
 @property (nonatomic) dispatch_source_t pendingRequestTimeoutTimer;
 @property (nonatomic) dispatch_queue_t requestHandlingQueue;
@@ -100,6 +107,26 @@ static __strong NSMutableArray *allSerialPorts;
 	});
 }
 
++ (void)setUsesSharedReadQueue:(BOOL)flag
+{
+	usesSharedReadQueue = flag;
+}
+
++ (BOOL)usesSharedReadQueue
+{
+	return usesSharedReadQueue;
+}
+
++ (dispatch_queue_t)sharedReadQueue
+{
+	static dispatch_queue_t queue;
+	static dispatch_once_t once;
+	dispatch_once(&once, ^{
+		queue = dispatch_queue_create("com.openreelsoftware.ORSSerialPort.sharedReadQueue", 0);
+	});
+	return queue;
+}
+
 + (void)addSerialPort:(ORSSerialPort *)port;
 {
 	[allSerialPorts addObject:[NSValue valueWithNonretainedObject:port]];
@@ -191,6 +218,7 @@ static __strong NSMutableArray *allSerialPorts;
 		
 		self.USBVendorID = CFBridgingRelease(IORegistryEntrySearchCFProperty(device, kIOServicePlane, CFSTR(kUSBVendorID), kCFAllocatorDefault, kIORegistryIterateRecursively | kIORegistryIterateParents));
 		self.USBProductID = CFBridgingRelease(IORegistryEntrySearchCFProperty(device, kIOServicePlane, CFSTR(kUSBProductID), kCFAllocatorDefault, kIORegistryIterateRecursively | kIORegistryIterateParents));
+		self.USBSerialNumber = CFBridgingRelease(IORegistryEntrySearchCFProperty(device, kIOServicePlane, CFSTR(kUSBSerialNumberString), kCFAllocatorDefault, kIORegistryIterateRecursively | kIORegistryIterateParents));
 	}
 	
 	[[self class] addSerialPort:self];
@@ -210,6 +238,11 @@ static __strong NSMutableArray *allSerialPorts;
 	[[self class] removeSerialPort:self];
 	self.IOKitDevice = 0;
 	
+	if (_readSource) {
+		dispatch_source_cancel(_readSource);
+		ORS_GCD_RELEASE(_readSource);
+	}
+	
 	if (_pinPollTimer) {
 		dispatch_source_cancel(_pinPollTimer);
 		ORS_GCD_RELEASE(_pinPollTimer);
@@ -292,6 +325,12 @@ static __strong NSMutableArray *allSerialPorts;
 		});
 	}
 	
+	if ([[self class] usesSharedReadQueue])
+	{
+		[self startReadSource];
+		return;
+	}
+	
 	// Start a read poller in the background
 	dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
 		
@@ -373,6 +412,57 @@ static __strong NSMutableArray *allSerialPorts;
 	ORS_GCD_RELEASE(timer);
 }
 
+// Instead of a select() thread per port and a pin poll timer, all ports share one read queue driven by
+// the kernel event queue. Nothing runs while ports are idle. CTS/DSR/DCD are not tracked in this mode.
+- (void)startReadSource
+{
+	int localPortFD = self.fileDescriptor;
+	dispatch_source_t source = dispatch_source_create(DISPATCH_SOURCE_TYPE_READ, localPortFD, 0, [[self class] sharedReadQueue]);
+	__weak ORSSerialPort *weakSelf = self;
+	dispatch_source_set_event_handler(source, ^{
+		ORSSerialPort *strongSelf = weakSelf;
+		if (!strongSelf.isOpen) return;
+		
+		char buf[1024];
+		long lengthRead = read(localPortFD, buf, MIN(sizeof(buf), MAX(dispatch_source_get_data(source), 1)));
+		if (lengthRead > 0)
+		{
+			[strongSelf receiveData:[NSData dataWithBytes:buf length:lengthRead]];
+		}
+		else if (lengthRead == 0 || errno == ENXIO)
+		{
+			// Device went away. Cancelling closes the descriptor; -close then only has to finish up.
+			strongSelf.readSourceCancelled = YES;
+			strongSelf.readSource = nil;
+			dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+				[strongSelf cleanupAfterSystemRemoval];
+			});
+		}
+		else if (errno != EAGAIN && errno != EINTR)
+		{
+			// Won't clear up by itself, and the source would fire again right away. Report it once and close the port.
+			[strongSelf notifyDelegateOfPosixError];
+			strongSelf.readSourceCancelled = YES;
+			strongSelf.readSource = nil;
+			dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+				[strongSelf close];
+			});
+		}
+	});
+	// The source watches the descriptor until it's cancelled, so it's only closed after that
+	dispatch_source_set_cancel_handler(source, ^{
+		if (close(localPortFD))
+		{
+			LOG_SERIAL_PORT_ERROR(@"Error closing serial port with file descriptor %i:%i", localPortFD, errno);
+		}
+	});
+	self.readSourceClosesDescriptor = YES;
+	self.readSourceCancelled = NO;
+	self.readSource = source;
+	dispatch_resume(self.readSource);
+	ORS_GCD_RELEASE(source);
+}
+
 - (BOOL)close;
 {
 	if (!self.isOpen) return YES;
@@ -380,22 +470,33 @@ static __strong NSMutableArray *allSerialPorts;
 	self.pinPollTimer = nil; // Stop polling CTS/DSR/DCD pins
 	
 	dispatch_semaphore_wait(self.selectSemaphore, DISPATCH_TIME_FOREVER);
-	// The next tcsetattr() call can fail if the port is waiting to send data. This is likely to happen
-	// e.g. if flow control is on and the CTS line is low. So, turn off flow control before proceeding
-	struct termios options;
-	tcgetattr(self.fileDescriptor, &options);
-	options.c_cflag &= ~CRTSCTS; // RTS/CTS Flow Control
-	options.c_cflag &= ~(CDTR_IFLOW | CDSR_OFLOW); // DTR/DSR Flow Control
-	options.c_cflag &= ~CCAR_OFLOW; // DCD Flow Control
-	tcsetattr(self.fileDescriptor, TCSANOW, &options);
-	
-	// Set port back the way it was before we used it
-	tcsetattr(self.fileDescriptor, TCSADRAIN, &originalPortAttributes);
+	// A cancelled read source has already closed the descriptor, and the number may have been reused since
+	if (!self.readSourceCancelled)
+	{
+		// The next tcsetattr() call can fail if the port is waiting to send data. This is likely to happen
+		// e.g. if flow control is on and the CTS line is low. So, turn off flow control before proceeding
+		struct termios options;
+		tcgetattr(self.fileDescriptor, &options);
+		options.c_cflag &= ~CRTSCTS; // RTS/CTS Flow Control
+		options.c_cflag &= ~(CDTR_IFLOW | CDSR_OFLOW); // DTR/DSR Flow Control
+		options.c_cflag &= ~CCAR_OFLOW; // DCD Flow Control
+		tcsetattr(self.fileDescriptor, TCSANOW, &options);
+		
+		// Set port back the way it was before we used it
+		tcsetattr(self.fileDescriptor, TCSADRAIN, &originalPortAttributes);
+	}
 	
 	int localFD = self.fileDescriptor;
 	self.fileDescriptor = 0; // So other threads know that the port should be closed and can stop I/O operations
 	
-	if (close(localFD))
+	if (self.readSourceClosesDescriptor)
+	{
+		// Stop reading on the shared queue. The cancel handler closes the descriptor once the source lets go of it.
+		self.readSourceClosesDescriptor = NO;
+		self.readSourceCancelled = YES;
+		self.readSource = nil;
+	}
+	else if (close(localFD))
 	{
 		self.fileDescriptor = localFD;
 		LOG_SERIAL_PORT_ERROR(@"Error closing serial port with file descriptor %i:%i", self.fileDescriptor, errno);
@@ -905,6 +1006,21 @@ static __strong NSMutableArray *allSerialPorts;
 
 #pragma mark Private Properties
 
+- (void)setReadSource:(dispatch_source_t)source
+{
+	if (source != _readSource)
+	{
+		if (_readSource)
+		{
+			dispatch_source_cancel(_readSource);
+			ORS_GCD_RELEASE(_readSource);
+		}
+		
+		ORS_GCD_RETAIN(source);
+		_readSource = source;
+	}
+}
+
 - (void)setPinPollTimer:(dispatch_source_t)timer
 {
 	if (timer != _pinPollTimer)
@@ -6,9 +6,12 @@
 
 #import <Foundation/Foundation.h>
 #import "TFPGCodeHelpers.h"
+#import "TFPVector.h"
 
+// Object wrapper around TFPVector, for scripting, UI and other places where allocations don't matter. nil means unset.
 @interface TFP3DVector : NSObject
 + (instancetype)vectorWithX:(NSNumber*)x Y:(NSNumber*)Y Z:(NSNumber*)Z;
++ (instancetype)vectorWithVector:(TFPVector)vector;
 
 + (instancetype)xyVectorWithX:(double)x y:(double)y;
 + (instancetype)zVector:(double)z;
@@ -23,6 +26,7 @@
 @property (readonly) NSNumber *x;
 @property (readonly) NSNumber *y;
 @property (readonly) NSNumber *z;
+@property (readonly) TFPVector vector;
 
 - (double)distanceToPoint:(TFP3DVector*)point;
 - (TFP3DVector*)vectorByDefaultingToValues:(TFP3DVector*)defaults;
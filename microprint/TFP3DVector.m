@@ -9,65 +9,81 @@
 
 
 @interface TFP3DVector ()
-@property (readwrite) NSNumber *x;
-@property (readwrite) NSNumber *y;
-@property (readwrite) NSNumber *z;
+@property (readwrite) TFPVector vector;
 @end
 
 
 @implementation TFP3DVector
 
 
-- (instancetype)initWithX:(NSNumber*)X Y:(NSNumber*)Y Z:(NSNumber*)Z {
+- (instancetype)initWithVector:(TFPVector)vector {
 	if(!(self = [super init])) return nil;
 	
-	self.x = X;
-	self.y = Y;
-	self.z = Z;
+	self.vector = vector;
 	
 	return self;
 }
 
 
++ (instancetype)vectorWithVector:(TFPVector)vector {
+	return [[self alloc] initWithVector:vector];
+}
+
+
 + (instancetype)vectorWithX:(NSNumber*)X Y:(NSNumber*)Y Z:(NSNumber*)Z {
-	return [[self alloc] initWithX:X Y:Y Z:Z];
+	TFPVectorFields fields = (X ? TFPVectorFieldX : 0) | (Y ? TFPVectorFieldY : 0) | (Z ? TFPVectorFieldZ : 0);
+	return [self vectorWithVector:(TFPVector){X.doubleValue, Y.doubleValue, Z.doubleValue, fields}];
 }
 
 
 + (instancetype)emptyVector {
-	return [self vectorWithX:nil Y:nil Z:nil];
+	return [self vectorWithVector:TFPVectorEmpty];
 }
 
 
 + (instancetype)zeroVector {
-	return [self vectorWithX:@0 Y:@0 Z:@0];
+	return [self vectorWithVector:TFPVectorMake(0, 0, 0)];
 }
 
 
 + (instancetype)zVector:(double)z {
-	return [self vectorWithX:nil Y:nil Z:@(z)];
+	return [self vectorWithVector:(TFPVector){0, 0, z, TFPVectorFieldZ}];
 }
 
 
 + (instancetype)xVector:(double)x {
-	return [self vectorWithX:@(x) Y:nil Z:nil];
+	return [self vectorWithVector:(TFPVector){x, 0, 0, TFPVectorFieldX}];
 }
 
 
 + (instancetype)yVector:(double)y {
-	return [self vectorWithX:nil Y:@(y) Z:nil];
+	return [self vectorWithVector:(TFPVector){0, y, 0, TFPVectorFieldY}];
 }
 
 
 + (instancetype)xyVectorWithX:(double)x y:(double)y {
-	return [self vectorWithX:@(x) Y:@(y) Z:nil];
+	return [self vectorWithVector:(TFPVector){x, y, 0, TFPVectorFieldX | TFPVectorFieldY}];
 }
 
 
 + (instancetype)vectorWithPosition:(TFPAbsolutePosition)position {
-	return [[self alloc] initWithX:isnan(position.x) ? nil : @(position.x)
-								 Y:isnan(position.y) ? nil : @(position.y)
-								 Z:isnan(position.z) ? nil : @(position.z)];
+	TFPVectorFields fields = (isnan(position.x) ? 0 : TFPVectorFieldX) | (isnan(position.y) ? 0 : TFPVectorFieldY) | (isnan(position.z) ? 0 : TFPVectorFieldZ);
+	return [self vectorWithVector:TFPVectorWithFields((TFPVector){position.x, position.y, position.z}, fields)];
+}
+
+
+- (NSNumber *)x {
+	return (self.vector.fields & TFPVectorFieldX) ? @(self.vector.x) : nil;
+}
+
+
+- (NSNumber *)y {
+	return (self.vector.fields & TFPVectorFieldY) ? @(self.vector.y) : nil;
+}
+
+
+- (NSNumber *)z {
+	return (self.vector.fields & TFPVectorFieldZ) ? @(self.vector.z) : nil;
 }
 
 
@@ -77,97 +93,86 @@
 
 
 - (TFP3DVector*)vectorByDefaultingToValues:(TFP3DVector*)defaults {
-	return [TFP3DVector vectorWithX:(self.x ?: defaults.x) Y:(self.y ?: defaults.y) Z:(self.z ?: defaults.z)];
+	return [TFP3DVector vectorWithVector:TFPVectorDefaultingToValues(self.vector, defaults.vector)];
 }
 
 
 - (TFP3DVector*)vectorByAdjustingZ:(double)delta {
-	return [TFP3DVector vectorWithX:self.x Y:self.y Z:self.z ? @(self.z.doubleValue + delta) : nil];
+	return [TFP3DVector vectorWithVector:TFPVectorAdd(self.vector, (TFPVector){0, 0, delta})];
 }
 
 
 - (double)distanceToPoint:(TFP3DVector*)point {
-	point = [point vectorByDefaultingToValues:self];
-	
-	return sqrt(pow(point.x.doubleValue - self.x.doubleValue, 2) + pow(point.y.doubleValue - self.y.doubleValue, 2) + pow(point.z.doubleValue - self.z.doubleValue, 2));
+	return TFPVectorDistance(self.vector, point.vector);
 }
 
 
 - (TFP3DVector*)vectorWithFieldsPresentInVector:(TFP3DVector*)otherVector {
-	return [TFP3DVector vectorWithX:(otherVector.x ? self.x : nil)
-								  Y:(otherVector.y ? self.y : nil)
-								  Z:(otherVector.z ? self.z : nil)
-			];
+	return [TFP3DVector vectorWithVector:TFPVectorWithFields(self.vector, self.vector.fields & otherVector.vector.fields)];
 }
 
 
 - (TFP3DVector*)vectorByAdding:(TFP3DVector*)vector {
-	return [TFP3DVector vectorWithX:(self.x ? @(self.x.doubleValue + vector.x.doubleValue) : nil)
-								  Y:(self.y ? @(self.y.doubleValue + vector.y.doubleValue) : nil)
-								  Z:(self.z ? @(self.z.doubleValue + vector.z.doubleValue) : nil)
-			];
+	return [TFP3DVector vectorWithVector:TFPVectorAdd(self.vector, vector.vector)];
 }
 
 
 - (TFP3DVector*)vectorBySubtracting:(TFP3DVector*)vector {
-	return [TFP3DVector vectorWithX:(self.x ? @(self.x.doubleValue - vector.x.doubleValue) : nil)
-								  Y:(self.y ? @(self.y.doubleValue - vector.y.doubleValue) : nil)
-								  Z:(self.z ? @(self.z.doubleValue - vector.z.doubleValue) : nil)
-			];
+	return [TFP3DVector vectorWithVector:TFPVectorSubtract(self.vector, vector.vector)];
 }
 
 
 - (TFP3DVector*)vectorByDividingBy:(TFP3DVector*)vector {
-	return [TFP3DVector vectorWithX:(self.x ? @(self.x.doubleValue / vector.x.doubleValue) : nil)
-								  Y:(self.y ? @(self.y.doubleValue / vector.y.doubleValue) : nil)
-								  Z:(self.z ? @(self.z.doubleValue / vector.z.doubleValue) : nil)
-			];
+	return [TFP3DVector vectorWithVector:TFPVectorDivide(self.vector, vector.vector)];
 }
 
 
 - (TFP3DVector*)vectorByMultiplyingBy:(TFP3DVector*)vector {
-	return [TFP3DVector vectorWithX:(self.x ? @(self.x.doubleValue * vector.x.doubleValue) : nil)
-								  Y:(self.y ? @(self.y.doubleValue * vector.y.doubleValue) : nil)
-								  Z:(self.z ? @(self.z.doubleValue * vector.z.doubleValue) : nil)
-			];
+	return [TFP3DVector vectorWithVector:TFPVectorMultiply(self.vector, vector.vector)];
 }
 
 
 - (TFP3DVector*)absoluteVector {
-	return [TFP3DVector vectorWithX:(self.x ? @(fabs(self.x.doubleValue)) : nil)
-								  Y:(self.y ? @(fabs(self.y.doubleValue)) : nil)
-								  Z:(self.z ? @(fabs(self.z.doubleValue)) : nil)
-			];
+	return [TFP3DVector vectorWithVector:TFPVectorAbsolute(self.vector)];
 }
 
 
 - (TFP3DVector*)vectorByMultiplyingByScalar:(double)value {
-	return [self vectorByMultiplyingBy:[TFP3DVector vectorWithX:@(value) Y:@(value) Z:@(value)]];
+	return [TFP3DVector vectorWithVector:TFPVectorScale(self.vector, value)];
 }
 
 
 - (TFP3DVector*)vectorByDividingByScalar:(double)value {
-	return [self vectorByDividingBy:[TFP3DVector vectorWithX:@(value) Y:@(value) Z:@(value)]];
+	return [TFP3DVector vectorWithVector:TFPVectorDivide(self.vector, TFPVectorMake(value, value, value))];
 }
 
 
 - (TFP3DVector*)vectorBySettingX:(double)x {
-	return [self.class vectorWithX:@(x) Y:self.y Z:self.z];
+	TFPVector vector = self.vector;
+	vector.x = x;
+	vector.fields |= TFPVectorFieldX;
+	return [self.class vectorWithVector:vector];
 }
 
 
 - (TFP3DVector*)vectorBySettingY:(double)y {
-	return [self.class vectorWithX:self.x Y:@(y) Z:self.z];
+	TFPVector vector = self.vector;
+	vector.y = y;
+	vector.fields |= TFPVectorFieldY;
+	return [self.class vectorWithVector:vector];
 }
 
 
 - (TFP3DVector*)vectorBySettingZ:(double)z {
-	return [self.class vectorWithX:self.x Y:self.y Z:@(z)];
+	TFPVector vector = self.vector;
+	vector.z = z;
+	vector.fields |= TFPVectorFieldZ;
+	return [self.class vectorWithVector:vector];
 }
 
 
 - (TFP3DVector*)vectorBySettingY:(double)y z:(double)z {
-	return [self.class vectorWithX:self.x Y:@(y) Z:@(z)];
+	return [[self vectorBySettingY:y] vectorBySettingZ:z];
 }
 
 
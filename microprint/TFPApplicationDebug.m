@@ -11,13 +11,24 @@
 #import "TFPPrinterManager.h"
 #import "TFPExtras.h"
 #import "TFPDryRunPrinter.h"
+#import "TFPDryRunPrinterConnection.h"
 #import "TFPBedLevelCompensator.h"
 #import "TFP3DVector.h"
+#import "TFPPrintSpooler.h"
+#import "TFPGCodeProgram.h"
+#import "TFPVirtualClock.h"
+#import "TFPSerialCapture.h"
+#import "TFPPrintJob.h"
+#import "TFPReplayPrinterConnection.h"
+
+#import <sys/resource.h>
 
 
 @interface TFPApplicationDelegate ()
 @property TFPPrinterContext *debugContext;
 @property (copy) void(^debugCancelBlock)();
+@property TFPPrintSpooler *benchmarkSpooler;
+@property TFPPrintJob *benchmarkPrintJob;
 @end
 
 
@@ -97,8 +108,14 @@
 }
 
 
+// Tag 0 runs dry run printers on the virtual clock instead
 - (IBAction)setDryRunSpeedMultiplier:(id)sender {
-	[TFPDryRunPrinter setSpeedMultiplier:[sender tag]];
+	if([sender tag] == 0) {
+		[TFPVirtualClock start];
+	}else{
+		[TFPVirtualClock stop];
+		[TFPDryRunPrinter setSpeedMultiplier:[sender tag]];
+	}
 }
 
 
@@ -244,4 +261,281 @@
 }
 
 
+- (NSURL*)writeFarmBenchmarkProgramWithMoveCount:(NSUInteger)count {
+	NSMutableArray *lines = [NSMutableArray arrayWithObject:[TFPGCode moveWithPosition:[TFP3DVector zVector:0.3] feedRate:3000]];
+	double E = 0;
+	
+	for(NSUInteger i=0; i<count; i++) {
+		double x = 20 + (i % 2) * 50;
+		double y = 20 + (i % 50);
+		E += 2.5;
+		[lines addObject:[TFPGCode moveWithPosition:[TFP3DVector xyVectorWithX:x y:y] extrusion:@(E) feedRate:2000]];
+	}
+	
+	NSURL *URL = [NSURL fileURLWithPath:[NSTemporaryDirectory() stringByAppendingPathComponent:@"FarmBenchmark.gcode"]];
+	[[TFPGCodeProgram programWithLines:lines] writeToFileURL:URL error:nil];
+	return URL;
+}
+
+
+static NSTimeInterval TFPProcessCPUTime(void) {
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 + usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
+
+
+// Runs one job per dry run printer for each printer count in the list and logs CPU time per code.
+// Per-code cost should stay flat as the farm grows.
+- (void)runFarmBenchmarkWithPrinterCounts:(NSArray<NSNumber*> *)printerCounts programURL:(NSURL*)programURL moveCount:(NSUInteger)moveCount {
+	__weak __typeof__(self) weakSelf = self;
+	NSString *const dryRunSerialNumber = @"DRYRUN0000123456";
+	
+	TFPPrinterManager *manager = [TFPPrinterManager sharedManager];
+	NSUInteger printerCount = printerCounts.firstObject.unsignedIntegerValue;
+	NSUInteger existingCount = [manager.printers tf_selectWithBlock:^BOOL(TFPPrinter *printer) {
+		return [printer.connection isKindOfClass:[TFPDryRunPrinterConnection class]];
+	}].count;
+	
+	for(NSUInteger i=existingCount; i<printerCount; i++) {
+		[manager startDryRunMode];
+	}
+	
+	self.benchmarkSpooler = [[TFPPrintSpooler alloc] initWithPrinterManager:manager spoolFileURL:nil];
+	__block NSUInteger remainingJobs = printerCount;
+	NSTimeInterval startCPUTime = TFPProcessCPUTime();
+	uint64_t start = TFNanosecondTime();
+	
+	self.benchmarkSpooler.jobEndedBlock = ^(TFPSpooledJob *job) {
+		if(--remainingJobs > 0) {
+			return;
+		}
+		
+		NSTimeInterval duration = (double)(TFNanosecondTime() - start) / NSEC_PER_SEC;
+		NSTimeInterval CPUTime = TFPProcessCPUTime() - startCPUTime;
+		NSUInteger codeCount = printerCount * moveCount;
+		TFLog(@"Farm benchmark: %ld printers, %ld codes in %.02f s. CPU: %.02f s total, %.03f ms per printer-second, %.01f µs per code",
+			  (long)printerCount, (long)codeCount, duration, CPUTime, CPUTime * 1000 / (printerCount * duration), CPUTime * 1e6 / codeCount);
+		
+		weakSelf.benchmarkSpooler = nil;
+		if(printerCounts.count > 1) {
+			[weakSelf runFarmBenchmarkWithPrinterCounts:[printerCounts subarrayWithRange:NSMakeRange(1, printerCounts.count-1)] programURL:programURL moveCount:moveCount];
+		}
+	};
+	
+	for(NSUInteger i=0; i<printerCount; i++) {
+		TFPSpooledJob *job = [[TFPSpooledJob alloc] initWithFileURL:programURL];
+		job.printerSerialNumber = dryRunSerialNumber;
+		[self.benchmarkSpooler addJob:job];
+	}
+}
+
+
+- (IBAction)farmBenchmark:(id)sender {
+	const NSUInteger moveCount = 2000;
+	NSURL *programURL = [self writeFarmBenchmarkProgramWithMoveCount:moveCount];
+	[self runFarmBenchmarkWithPrinterCounts:@[@1, @5, @10, @20] programURL:programURL moveCount:moveCount];
+}
+
+
+// Prints the same small job a number of times on a single dry run printer, with and without hot handoff
+- (void)runHandoffBenchmarkWithJobCount:(NSUInteger)jobCount hotHandoff:(BOOL)hot programURL:(NSURL*)programURL completionHandler:(void(^)(NSTimeInterval duration))completionHandler {
+	TFPPrinterManager *manager = [TFPPrinterManager sharedManager];
+	BOOL hasDryRunPrinter = [manager.printers tf_selectWithBlock:^BOOL(TFPPrinter *printer) {
+		return [printer.connection isKindOfClass:[TFPDryRunPrinterConnection class]];
+	}].count > 0;
+	if(!hasDryRunPrinter) {
+		[manager startDryRunMode];
+	}
+	
+	self.benchmarkSpooler = [[TFPPrintSpooler alloc] initWithPrinterManager:manager spoolFileURL:nil];
+	self.benchmarkSpooler.usesHotHandoff = hot;
+	__block NSUInteger remainingJobs = jobCount;
+	uint64_t start = TFNanosecondTime();
+	
+	self.benchmarkSpooler.jobEndedBlock = ^(TFPSpooledJob *job) {
+		if(--remainingJobs == 0) {
+			completionHandler((double)(TFNanosecondTime() - start) / NSEC_PER_SEC);
+		}
+	};
+	
+	for(NSUInteger i=0; i<jobCount; i++) {
+		TFPSpooledJob *job = [[TFPSpooledJob alloc] initWithFileURL:programURL];
+		job.printerSerialNumber = @"DRYRUN0000123456";
+		[self.benchmarkSpooler addJob:job];
+	}
+}
+
+
+- (IBAction)handoffBenchmark:(id)sender {
+	__weak __typeof__(self) weakSelf = self;
+	const NSUInteger jobCount = 5;
+	NSURL *programURL = [self writeFarmBenchmarkProgramWithMoveCount:200];
+	
+	[self runHandoffBenchmarkWithJobCount:jobCount hotHandoff:NO programURL:programURL completionHandler:^(NSTimeInterval coldDuration) {
+		[weakSelf runHandoffBenchmarkWithJobCount:jobCount hotHandoff:YES programURL:programURL completionHandler:^(NSTimeInterval hotDuration) {
+			TFLog(@"Handoff benchmark: %ld jobs took %.02f s with cool-down between jobs, %.02f s with hot handoff", (long)jobCount, coldDuration, hotDuration);
+			weakSelf.benchmarkSpooler = nil;
+		}];
+	}];
+}
+
+
+// Prints a long job on a dry run printer in simulated time and compares the simulated print time with the estimate
+- (IBAction)virtualTimeDryRun:(id)sender {
+	__weak __typeof__(self) weakSelf = self;
+	NSURL *programURL = [self writeFarmBenchmarkProgramWithMoveCount:20000];
+	TFPGCodeProgram *program = [[TFPGCodeProgram alloc] initWithFileURL:programURL error:nil];
+	NSTimeInterval estimate = [program estimateDurationWithLineDurations:NULL];
+	
+	TFPPrinterManager *manager = [TFPPrinterManager sharedManager];
+	BOOL hasDryRunPrinter = [manager.printers tf_selectWithBlock:^BOOL(TFPPrinter *printer) {
+		return [printer.connection isKindOfClass:[TFPDryRunPrinterConnection class]];
+	}].count > 0;
+	
+	[TFPVirtualClock start];
+	if(!hasDryRunPrinter) {
+		[manager startDryRunMode];
+	}
+	
+	NSDate *start = [NSDate date];
+	self.benchmarkSpooler = [[TFPPrintSpooler alloc] initWithPrinterManager:manager spoolFileURL:nil];
+	self.benchmarkSpooler.jobEndedBlock = ^(TFPSpooledJob *job) {
+		TFLog(@"Virtual time dry run: %.0f s of printing (%.0f s estimated for the program itself) in %.02f s",
+			  job.printJob.elapsedTime, estimate, -start.timeIntervalSinceNow);
+		weakSelf.benchmarkSpooler = nil;
+		[TFPVirtualClock stop];
+	};
+	
+	TFPSpooledJob *job = [[TFPSpooledJob alloc] initWithFileURL:programURL];
+	job.printerSerialNumber = @"DRYRUN0000123456";
+	[self.benchmarkSpooler addJob:job];
+}
+
+
+// A few layers of long moves, so there's enough print time ahead of each boundary to change temperature in
+- (TFPGCodeProgram*)thermalBondingBenchmarkProgramWithLayerCount:(NSUInteger)layerCount movesPerLayer:(NSUInteger)moveCount {
+	NSMutableArray *lines = [NSMutableArray new];
+	double E = 0;
+	
+	for(NSUInteger layer=0; layer<layerCount; layer++) {
+		[lines addObject:[TFPGCode codeWithComment:[NSString stringWithFormat:@"LAYER:%ld", (long)layer]]];
+		[lines addObject:[TFPGCode moveWithPosition:[TFP3DVector zVector:0.3 + layer*0.2] feedRate:3000]];
+		
+		for(NSUInteger i=0; i<moveCount; i++) {
+			double x = 20 + (i % 2) * 50;
+			double y = 20 + (i % 50);
+			E += 2.5;
+			[lines addObject:[TFPGCode moveWithPosition:[TFP3DVector xyVectorWithX:x y:y] extrusion:@(E) feedRate:2000]];
+		}
+	}
+	return [TFPGCodeProgram programWithLines:lines];
+}
+
+
+// Runs the program on the virtual clock with the given thermal bonding behavior
+- (void)runThermalBondingBenchmarkOnPrinter:(TFPPrinter*)printer program:(TFPGCodeProgram*)program waitAtBoundaries:(BOOL)wait completionHandler:(void(^)(TFPPrintJob *job))completionHandler {
+	__weak __typeof__(self) weakSelf = self;
+	TFPPrintParameters *parameters = [TFPPrintParameters new];
+	parameters.useThermalBonding = YES;
+	parameters.thermalBondingWaitsAtBoundaries = wait;
+	
+	TFPPrintJob *job = [[TFPPrintJob alloc] initWithProgram:program printer:printer printParameters:parameters];
+	job.completionBlock = ^{
+		weakSelf.benchmarkPrintJob = nil;
+		completionHandler(job);
+	};
+	self.benchmarkPrintJob = job;
+	[job start];
+}
+
+
+// Prints the same job in simulated time with blocking temperature changes at each layer boundary and with the
+// look-ahead schedule, and logs the idle time at the boundaries for each
+- (IBAction)thermalBondingBenchmark:(id)sender {
+	__weak __typeof__(self) weakSelf = self;
+	TFPPrinterManager *manager = [TFPPrinterManager sharedManager];
+	TFPPrinter *printer = [manager.printers tf_selectWithBlock:^BOOL(TFPPrinter *printer) {
+		return [printer.connection isKindOfClass:[TFPDryRunPrinterConnection class]] && printer.connection.state == TFPPrinterConnectionStateConnected;
+	}].firstObject;
+	
+	[TFPVirtualClock start];
+	if(!printer) {
+		// Try again once the new printer has connected
+		[manager startDryRunMode];
+		[TFPVirtualClock dispatchAfter:5 queue:dispatch_get_main_queue() block:^{
+			[weakSelf thermalBondingBenchmark:sender];
+		}];
+		return;
+	}
+	
+	TFPGCodeProgram *program = [self thermalBondingBenchmarkProgramWithLayerCount:4 movesPerLayer:300];
+	
+	[self runThermalBondingBenchmarkOnPrinter:printer program:program waitAtBoundaries:YES completionHandler:^(TFPPrintJob *blockingJob) {
+		[weakSelf runThermalBondingBenchmarkOnPrinter:printer program:program waitAtBoundaries:NO completionHandler:^(TFPPrintJob *scheduledJob) {
+			TFLog(@"Thermal bonding benchmark: %.01f s idle at layer boundaries waiting for the heater, %.01f s with look-ahead; %.01f s saved per print. Print time %.0f s vs %.0f s.",
+				  blockingJob.temperatureWaitTime, scheduledJob.temperatureWaitTime, blockingJob.temperatureWaitTime - scheduledJob.temperatureWaitTime,
+				  blockingJob.elapsedTime, scheduledJob.elapsedTime);
+			[TFPVirtualClock stop];
+		}];
+	}];
+}
+
+
+// Replays a made-up capture of a printer starting in bootloader mode, which closes and reopens the port when it
+// switches to firmware, and checks that the connection gets established on the other side of it
+- (IBAction)replayFirmwareSwitchCheck:(id)sender {
+	NSURL *URL = [NSURL fileURLWithPath:[NSTemporaryDirectory() stringByAppendingPathComponent:@"FirmwareSwitch.tfpcapture"]];
+	[[NSFileManager defaultManager] removeItemAtURL:URL error:nil];
+	NSData *handshake = [TFPGCode codeWithString:@"M115"].repetierV2Representation;
+	
+	TFPSerialCapture *capture = [[TFPSerialCapture alloc] initWithURL:URL];
+	[capture recordEvent:TFPSerialCaptureEventPortOpened data:nil];
+	[capture recordEvent:TFPSerialCaptureEventOutgoingData data:handshake];
+	[capture recordEvent:TFPSerialCaptureEventIncomingData data:[NSData tf_singleByte:'?']];
+	[capture recordEvent:TFPSerialCaptureEventOutgoingData data:[NSData tf_singleByte:'Q']];
+	[capture recordEvent:TFPSerialCaptureEventPortClosed data:nil];
+	[capture recordEvent:TFPSerialCaptureEventPortOpened data:nil];
+	[capture recordEvent:TFPSerialCaptureEventOutgoingData data:handshake];
+	[capture recordEvent:TFPSerialCaptureEventIncomingData data:[@"ok X-SERIAL_NUMBER:REPLAY0000000001\n" dataUsingEncoding:NSUTF8StringEncoding]];
+	[capture close];
+	
+	NSError *error;
+	TFPPrinter *printer = [[TFPPrinterManager sharedManager] startReplayWithCaptureURL:URL realTime:NO error:&error];
+	if(!printer) {
+		TFLog(@"Replay check failed: %@", error);
+		return;
+	}
+	
+	TFPPrinterConnection *connection = printer.connection;
+	((TFPReplayPrinterConnection*)connection).replayCompletionHandler = ^(NSTimeInterval duration) {
+		if(connection.state == TFPPrinterConnectionStateConnected) {
+			TFLog(@"Replay check passed: connected through the firmware switch in %.03f s", duration);
+		}else{
+			TFLog(@"Replay check FAILED: connection state is %ld after the firmware switch", (long)connection.state);
+		}
+	};
+}
+
+
+// Tag 1 replays at the recorded pace, tag 0 as fast as possible
+- (IBAction)replaySerialCapture:(id)sender {
+	BOOL realTime = [sender tag] == 1;
+	NSOpenPanel *panel = [NSOpenPanel openPanel];
+	panel.allowedFileTypes = @[@"tfpcapture"];
+	panel.directoryURL = [TFPSerialCapture defaultURLForPortName:@""].URLByDeletingLastPathComponent;
+	
+	[panel beginWithCompletionHandler:^(NSInteger result) {
+		if(result != NSFileHandlingPanelOKButton) {
+			return;
+		}
+		
+		NSError *error;
+		if(![[TFPPrinterManager sharedManager] startReplayWithCaptureURL:panel.URL realTime:realTime error:&error]) {
+			[[NSAlert alertWithError:error] runModal];
+		}
+	}];
+}
+
+
 @end
\ No newline at end of file
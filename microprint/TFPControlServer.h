@@ -0,0 +1,42 @@
+//
+//  TFPControlServer.h
+//  microprint
+//
+//
+
+#import <Foundation/Foundation.h>
+
+@class TFPPrinterManager;
+
+
+// Local control API over a Unix domain socket. One JSON object per line in each direction.
+// Requests carry an optional "id" that is echoed in the reply. Commands:
+//   {"command": "printers"}
+//   {"command": "jobs"} includes what motion optimization removed from each started job, if it was used
+//   {"command": "submit", "file": "/path.gcode", "filament": "PLA", "temperature": 215, "printer": "<serial>", "optimize": 0.01}
+//     "optimize" merges collinear moves within that many mm before printing; leave it out to send the file as is
+//   {"command": "submit", "query": {...}, ...} queues every printable library file that matches
+//   {"command": "scan", "directory": "/path"} indexes G-code files for the library, replying when done
+//   {"command": "library", "query": {"maxHeight": 50, "slicer": "Cura"}} lists library files matching every field.
+//     Fields: "name" (part of the file name), "slicer", "compatible", "fits", "minDuration" and "maxDuration" (s),
+//     "maxFilament" (mm), "maxWidth", "maxDepth", "maxHeight", "minLayerHeight" and "maxLayerHeight" (mm)
+//   {"command": "convert", "file": "/path.gcode"} converts a library file to a container next to it, or a container
+//     in a library directory back to G-code, replying with the output path and the sizes and load times of both files.
+//     Existing files are never replaced.
+//   {"command": "cancel", "job": "<uuid>"}
+//   {"command": "gcode", "printer": "<serial>", "code": "M105"}
+//   {"command": "metrics"}
+//   {"command": "subscribe"} streams {"event": "progress"} and {"event": "ended"} objects once a second
+
+@interface TFPControlServer : NSObject
+- (instancetype)initWithSocketPath:(NSString*)path printerManager:(TFPPrinterManager*)manager;
+
+@property (readonly, copy) NSString *socketPath;
+
+- (BOOL)start:(NSError**)error;
+- (void)stop;
+
+// Headless mode for the command-line tool: serves the shared printer manager from the main queue until SIGINT or
+// SIGTERM, then removes the socket and exits. Call on the main thread; never returns.
++ (void)runDaemonWithSocketPath:(NSString*)path __attribute__((noreturn));
+@end
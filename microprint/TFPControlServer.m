@@ -0,0 +1,715 @@
+//
+//  TFPControlServer.m
+//  microprint
+//
+//
+
+#import "TFPControlServer.h"
+#import "TFPPrinterManager.h"
+#import "TFPPrintSpooler.h"
+#import "TFPPrintJob.h"
+#import "TFPMotionOptimizer.h"
+#import "TFPPrinter.h"
+#import "TFPPrinterConnection.h"
+#import "TFPGCode.h"
+#import "TFPGCodeLibraryIndex.h"
+#import "TFPGCodeProgram.h"
+#import "TFPGCodeContainer.h"
+#import "TFPExtras.h"
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+
+static const NSTimeInterval subscriptionInterval = 1;
+static const NSUInteger maximumOutputBufferLength = 4 * 1024 * 1024; // A client this far behind is dropped
+static const NSUInteger maximumInputBufferLength = 1024 * 1024; // A client sending a longer request line is dropped
+
+
+@interface TFPControlClient : NSObject
+@property int fileDescriptor;
+@property dispatch_source_t readSource;
+@property dispatch_source_t writeSource; // Resumed only while outputBuffer has data
+@property NSMutableData *buffer;
+@property NSMutableData *outputBuffer;
+@property BOOL writing;
+@property BOOL subscribed;
+@end
+
+
+@implementation TFPControlClient
+@end
+
+
+
+@interface TFPControlServer ()
+@property (readwrite, copy) NSString *socketPath;
+@property TFPPrinterManager *printerManager;
+@property TFPPrintSpooler *spooler;
+
+@property dispatch_queue_t queue;
+@property int listeningSocket;
+@property dispatch_source_t acceptSource;
+@property dispatch_source_t subscriptionTimer;
+@property NSMutableArray<TFPControlClient*> *clients;
+
+@property NSArray<TFPSpooledJob*> *previousJobs;
+@property NSUInteger requestCount;
+@property uint64_t totalRequestTime;
+@end
+
+
+@implementation TFPControlServer
+
+
+- (instancetype)initWithSocketPath:(NSString*)path printerManager:(TFPPrinterManager*)manager {
+	if(!(self = [super init])) return nil;
+	
+	self.socketPath = path;
+	self.printerManager = manager;
+	self.spooler = manager.spooler; // Make sure it's created on the calling (main) queue
+	self.queue = dispatch_queue_create("se.tomasf.microprint.controlServer", DISPATCH_QUEUE_SERIAL);
+	self.clients = [NSMutableArray new];
+	self.listeningSocket = -1;
+	
+	return self;
+}
+
+
+- (NSError*)POSIXErrorWithDescription:(NSString*)description {
+	return [NSError errorWithDomain:NSPOSIXErrorDomain code:errno userInfo:@{NSLocalizedDescriptionKey: description}];
+}
+
+
+- (BOOL)start:(NSError**)outError {
+	struct sockaddr_un address = {0};
+	address.sun_family = AF_UNIX;
+	if(![self.socketPath getFileSystemRepresentation:address.sun_path maxLength:sizeof(address.sun_path)]) {
+		errno = ENAMETOOLONG;
+		if(outError) *outError = [self POSIXErrorWithDescription:@"Control socket path is too long"];
+		return NO;
+	}
+	
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	unlink(address.sun_path);
+	
+	// Anyone who can connect can drive the printers. Nobody can connect before listen(), so restricting it in between is enough.
+	if(fd < 0 || bind(fd, (struct sockaddr*)&address, sizeof(address)) < 0 || chmod(address.sun_path, S_IRUSR | S_IWUSR) < 0 || listen(fd, 16) < 0) {
+		if(outError) *outError = [self POSIXErrorWithDescription:@"Failed to open control socket"];
+		if(fd >= 0) close(fd);
+		return NO;
+	}
+	
+	self.listeningSocket = fd;
+	self.acceptSource = dispatch_source_create(DISPATCH_SOURCE_TYPE_READ, fd, 0, self.queue);
+	dispatch_source_set_event_handler(self.acceptSource, ^{
+		[self acceptClient];
+	});
+	dispatch_resume(self.acceptSource);
+	
+	self.subscriptionTimer = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, self.queue);
+	dispatch_source_set_timer(self.subscriptionTimer, DISPATCH_TIME_NOW, subscriptionInterval * NSEC_PER_SEC, 0.1 * NSEC_PER_SEC);
+	dispatch_source_set_event_handler(self.subscriptionTimer, ^{
+		[self sendSubscriptionEvents];
+	});
+	dispatch_resume(self.subscriptionTimer);
+	
+	return YES;
+}
+
+
+- (void)stop {
+	dispatch_sync(self.queue, ^{
+		for(TFPControlClient *client in [self.clients copy]) {
+			[self disconnectClient:client];
+		}
+		if(self.acceptSource) {
+			dispatch_source_cancel(self.acceptSource);
+			dispatch_source_cancel(self.subscriptionTimer);
+			self.acceptSource = nil;
+			self.subscriptionTimer = nil;
+			close(self.listeningSocket);
+			unlink(self.socketPath.fileSystemRepresentation);
+		}
+	});
+}
+
+
++ (void)runDaemonWithSocketPath:(NSString*)path {
+	TFPControlServer *server = [[self alloc] initWithSocketPath:path printerManager:[TFPPrinterManager sharedManager]];
+	NSError *error;
+	if(![server start:&error]) {
+		TFLog(@"%@: %@", error.localizedDescription, path);
+		exit(EXIT_FAILURE);
+	}
+	TFLog(@"Listening on %@", path);
+	
+	// Kept for the life of the process
+	static NSArray *signalSources;
+	signalSources = [@[@(SIGINT), @(SIGTERM)] tf_mapWithBlock:^id(NSNumber *signalNumber) {
+		signal(signalNumber.intValue, SIG_IGN);
+		dispatch_source_t source = dispatch_source_create(DISPATCH_SOURCE_TYPE_SIGNAL, signalNumber.intValue, 0, dispatch_get_main_queue());
+		dispatch_source_set_event_handler(source, ^{
+			[server stop];
+			exit(EXIT_SUCCESS);
+		});
+		dispatch_resume(source);
+		return source;
+	}];
+	
+	dispatch_main();
+}
+
+
+#pragma mark - Clients
+
+
+// On server queue
+- (void)acceptClient {
+	int fd = accept(self.listeningSocket, NULL, NULL);
+	if(fd < 0) {
+		return;
+	}
+	int noSigPipe = 1;
+	setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &noSigPipe, sizeof(noSigPipe)); // Clients going away shouldn't take us down
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK); // A client that stops reading can't stall the server queue
+	
+	TFPControlClient *client = [TFPControlClient new];
+	client.fileDescriptor = fd;
+	client.buffer = [NSMutableData new];
+	client.outputBuffer = [NSMutableData new];
+	client.readSource = dispatch_source_create(DISPATCH_SOURCE_TYPE_READ, fd, 0, self.queue);
+	client.writeSource = dispatch_source_create(DISPATCH_SOURCE_TYPE_WRITE, fd, 0, self.queue);
+	
+	__weak __typeof__(self) weakSelf = self;
+	__weak TFPControlClient *weakClient = client;
+	dispatch_source_set_event_handler(client.readSource, ^{
+		[weakSelf readFromClient:weakClient];
+	});
+	dispatch_source_set_event_handler(client.writeSource, ^{
+		[weakSelf writeToClient:weakClient];
+	});
+	
+	// Both sources watch the descriptor, so it's closed after the second one is cancelled
+	__block NSUInteger sourceCount = 2;
+	dispatch_block_t cancelHandler = ^{
+		if(--sourceCount == 0) {
+			close(fd);
+		}
+	};
+	dispatch_source_set_cancel_handler(client.readSource, cancelHandler);
+	dispatch_source_set_cancel_handler(client.writeSource, cancelHandler);
+	
+	[self.clients addObject:client];
+	dispatch_resume(client.readSource);
+}
+
+
+// On server queue
+- (void)disconnectClient:(TFPControlClient*)client {
+	dispatch_source_cancel(client.readSource);
+	dispatch_source_cancel(client.writeSource);
+	if(!client.writing) {
+		// A suspended source never gets to its cancel handler
+		client.writing = YES;
+		dispatch_resume(client.writeSource);
+	}
+	[self.clients removeObject:client];
+}
+
+
+// On server queue
+- (void)readFromClient:(TFPControlClient*)client {
+	char buffer[4096];
+	ssize_t length = read(client.fileDescriptor, buffer, sizeof(buffer));
+	if(length < 0 && (errno == EAGAIN || errno == EINTR)) {
+		return;
+	}else if(length <= 0) {
+		[self disconnectClient:client];
+		return;
+	}
+	[client.buffer appendBytes:buffer length:length];
+	
+	NSUInteger lineEnd;
+	while((lineEnd = [client.buffer tf_offsetOfData:[NSData tf_singleByte:'\n']]) != NSNotFound) {
+		NSData *line = [client.buffer subdataWithRange:NSMakeRange(0, lineEnd)];
+		[client.buffer replaceBytesInRange:NSMakeRange(0, lineEnd+1) withBytes:NULL length:0];
+		if(line.length) {
+			[self handleRequestData:line fromClient:client];
+		}
+	}
+	
+	if(client.buffer.length > maximumInputBufferLength) {
+		[self disconnectClient:client];
+	}
+}
+
+
+// Called on any queue
+- (void)sendObject:(NSDictionary*)object toClient:(TFPControlClient*)client {
+	NSMutableData *data = [[NSJSONSerialization dataWithJSONObject:object options:0 error:nil] mutableCopy];
+	[data appendData:[NSData tf_singleByte:'\n']];
+	
+	dispatch_async(self.queue, ^{
+		if(![self.clients containsObject:client]) {
+			return;
+		}
+		if(client.outputBuffer.length + data.length > maximumOutputBufferLength) {
+			[self disconnectClient:client];
+			return;
+		}
+		
+		[client.outputBuffer appendData:data];
+		if(!client.writing) {
+			client.writing = YES;
+			dispatch_resume(client.writeSource);
+		}
+	});
+}
+
+
+// On server queue. Writes whatever the socket takes and keeps the rest for the next round.
+- (void)writeToClient:(TFPControlClient*)client {
+	NSMutableData *outputBuffer = client.outputBuffer;
+	ssize_t length = write(client.fileDescriptor, outputBuffer.bytes, outputBuffer.length);
+	if(length < 0) {
+		if(errno != EAGAIN && errno != EINTR) {
+			[self disconnectClient:client];
+		}
+		return;
+	}
+	
+	[outputBuffer replaceBytesInRange:NSMakeRange(0, length) withBytes:NULL length:0];
+	if(!outputBuffer.length) {
+		client.writing = NO;
+		dispatch_suspend(client.writeSource);
+	}
+}
+
+
+#pragma mark - Requests
+
+
+// On server queue
+- (void)handleRequestData:(NSData*)data fromClient:(TFPControlClient*)client {
+	uint64_t start = TFNanosecondTime();
+	NSDictionary *request = [NSJSONSerialization JSONObjectWithData:data options:0 error:nil];
+	if(![request isKindOfClass:[NSDictionary class]]) {
+		[self sendObject:@{@"error": @"Malformed request"} toClient:client];
+		return;
+	}
+	
+	id requestID = request[@"id"] ?: [NSNull null];
+	void(^reply)(NSDictionary*) = ^(NSDictionary *values) {
+		NSMutableDictionary *response = [values mutableCopy];
+		response[@"id"] = requestID;
+		[self sendObject:response toClient:client];
+		
+		dispatch_async(self.queue, ^{
+			self.requestCount++;
+			self.totalRequestTime += TFNanosecondTime() - start;
+		});
+	};
+	
+	NSString *command = request[@"command"];
+	if([command isEqual:@"subscribe"]) {
+		client.subscribed = YES;
+		reply(@{@"ok": @YES});
+	
+	}else{
+		// Printer manager and spooler state belongs to the main queue
+		dispatch_async(dispatch_get_main_queue(), ^{
+			if([command isEqual:@"printers"]) {
+				reply(@{@"printers": [self printerDescriptions]});
+			}else if([command isEqual:@"jobs"]) {
+				reply(@{@"jobs": [self jobDescriptions]});
+			}else if([command isEqual:@"submit"]) {
+				reply([self submitJobForRequest:request]);
+			}else if([command isEqual:@"cancel"]) {
+				reply([self cancelJobForRequest:request]);
+			}else if([command isEqual:@"gcode"]) {
+				[self sendGCodeForRequest:request reply:reply];
+			}else if([command isEqual:@"metrics"]) {
+				reply([self metrics]);
+			}else if([command isEqual:@"library"]) {
+				reply([self libraryFilesForRequest:request]);
+			}else if([command isEqual:@"scan"]) {
+				[self scanLibraryForRequest:request reply:reply];
+			}else if([command isEqual:@"convert"]) {
+				[self convertFileForRequest:request reply:reply];
+			}else{
+				reply(@{@"error": [NSString stringWithFormat:@"Unknown command '%@'", command]});
+			}
+		});
+	}
+}
+
+
+- (TFPPrinter*)printerWithSerialNumber:(NSString*)serialNumber {
+	for(TFPPrinter *printer in self.printerManager.printers) {
+		if(!serialNumber || [printer.serialNumber isEqual:serialNumber]) {
+			return printer;
+		}
+	}
+	return nil;
+}
+
+
+- (NSArray*)printerDescriptions {
+	return [self.printerManager.printers tf_mapWithBlock:^NSDictionary*(TFPPrinter *printer) {
+		return @{@"serialNumber": printer.serialNumber ?: [NSNull null],
+				 @"color": [TFPPrinter nameForPrinterColor:printer.color] ?: [NSNull null],
+				 @"firmwareVersion": printer.firmwareVersion ?: [NSNull null],
+				 @"activity": printer.currentOperation.activityDescription ?: [NSNull null],
+				 @"temperature": @(printer.heaterTemperature),
+				 };
+	}];
+}
+
+
+- (NSDictionary*)descriptionForJob:(TFPSpooledJob*)job {
+	TFPMotionOptimizer *optimizer = job.printJob.motionOptimizer;
+	return @{@"job": job.identifier.UUIDString,
+			 @"file": job.fileURL.path,
+			 @"state": @(job.state),
+			 @"printer": job.printer.serialNumber ?: [NSNull null],
+			 @"completed": @(job.printJob.completedRequests),
+			 @"total": @(job.printJob.program.lines.count),
+			 @"optimization": optimizer ? @{@"removedLines": @(optimizer.removedLineCount),
+											@"removedFeedRates": @(optimizer.removedFeedRateCount),
+											@"estimatedTimeSaved": @(optimizer.estimatedTimeSaved),
+											} : [NSNull null],
+			 };
+}
+
+
+- (NSArray*)jobDescriptions {
+	return [self.spooler.jobs tf_mapWithBlock:^NSDictionary*(TFPSpooledJob *job) {
+		return [self descriptionForJob:job];
+	}];
+}
+
+
+// Returns an error reply if a job option in the request has the wrong type
+- (NSDictionary*)validateJobOptionsInRequest:(NSDictionary*)request {
+	NSDictionary<NSString*, Class> *optionClasses = @{@"filament": [NSString class],
+													  @"temperature": [NSNumber class],
+													  @"optimize": [NSNumber class],
+													  @"printer": [NSString class],
+													  };
+	for(NSString *key in optionClasses) {
+		if(request[key] && ![request[key] isKindOfClass:optionClasses[key]]) {
+			return @{@"error": [NSString stringWithFormat:@"Invalid value for \"%@\"", key]};
+		}
+	}
+	return nil;
+}
+
+
+- (void)configureJob:(TFPSpooledJob*)job forRequest:(NSDictionary*)request {
+	if(request[@"filament"]) {
+		job.filamentType = [TFPFilament typeForString:request[@"filament"]];
+	}
+	job.temperature = [request[@"temperature"] doubleValue];
+	job.motionOptimizationTolerance = [request[@"optimize"] doubleValue];
+	job.printerSerialNumber = request[@"printer"];
+}
+
+
+- (NSDictionary*)submitJobForRequest:(NSDictionary*)request {
+	NSDictionary *invalidOptions = [self validateJobOptionsInRequest:request];
+	if(invalidOptions) {
+		return invalidOptions;
+	}
+	
+	if(request[@"query"]) {
+		NSPredicate *predicate = [self predicateForQuery:request[@"query"]];
+		if(!predicate) {
+			return @{@"error": @"Invalid query"};
+		}
+		NSArray *jobs = [self.spooler addJobsForLibraryFilesMatchingPredicate:predicate configuration:^(TFPSpooledJob *job) {
+			[self configureJob:job forRequest:request];
+		}];
+		return @{@"jobs": [jobs valueForKeyPath:@"identifier.UUIDString"]};
+	}
+	
+	NSString *path = request[@"file"];
+	if(![path isKindOfClass:[NSString class]] || ![[NSFileManager defaultManager] fileExistsAtPath:path]) {
+		return @{@"error": @"File not found"};
+	}
+	
+	TFPSpooledJob *job = [[TFPSpooledJob alloc] initWithFileURL:[NSURL fileURLWithPath:path]];
+	[self configureJob:job forRequest:request];
+	
+	[self.spooler addJob:job];
+	return @{@"job": job.identifier.UUIDString};
+}
+
+
+- (NSDictionary*)cancelJobForRequest:(NSDictionary*)request {
+	for(TFPSpooledJob *job in self.spooler.jobs) {
+		if([job.identifier.UUIDString isEqual:request[@"job"]]) {
+			if(job.state == TFPSpooledJobStatePrinting) {
+				[job.printJob abort];
+			}else{
+				[self.spooler removeJob:job];
+			}
+			return @{@"ok": @YES};
+		}
+	}
+	return @{@"error": @"No such job"};
+}
+
+
+- (NSDictionary*)metrics {
+	NSArray *jobs = self.spooler.jobs;
+	NSArray *printingJobs = [jobs tf_selectWithBlock:^BOOL(TFPSpooledJob *job) {
+		return job.state == TFPSpooledJobStatePrinting;
+	}];
+	
+	__block NSUInteger requestCount;
+	__block uint64_t requestTime;
+	dispatch_sync(self.queue, ^{
+		requestCount = self.requestCount;
+		requestTime = self.totalRequestTime;
+	});
+	
+	return @{@"printers": @(self.printerManager.printers.count),
+			 @"waitingJobs": @(jobs.count - printingJobs.count),
+			 @"printingJobs": [printingJobs tf_mapWithBlock:^NSDictionary*(TFPSpooledJob *job) {
+				 return @{@"job": job.identifier.UUIDString,
+						  @"elapsedTime": @(job.printJob.elapsedTime),
+						  @"lastPauseLatency": @(job.printJob.lastPauseLatency),
+						  @"lastAbortLatency": @(job.printJob.lastAbortLatency),
+						  };
+			 }],
+			 @"requests": @(requestCount),
+			 @"averageRequestTime": @(requestCount ? (double)requestTime / requestCount / NSEC_PER_SEC : 0),
+			 @"connectionTimes": [TFPPrinterConnection connectionTimePercentiles],
+			 };
+}
+
+
+- (void)sendGCodeForRequest:(NSDictionary*)request reply:(void(^)(NSDictionary*))reply {
+	NSString *string = request[@"code"];
+	TFPGCode *code = [string isKindOfClass:[NSString class]] ? [TFPGCode codeWithString:string] : nil;
+	TFPPrinter *printer = [self printerWithSerialNumber:request[@"printer"]];
+	
+	if(!code.hasFields) {
+		reply(@{@"error": @"Invalid G-code"});
+	}else if(!printer) {
+		reply(@{@"error": @"No such printer"});
+	}else{
+		[printer sendGCode:code responseHandler:^(BOOL success, TFPGCodeResponseDictionary value) {
+			reply(@{@"ok": @(success), @"values": value ?: @{}});
+		}];
+	}
+}
+
+
+#pragma mark - Library
+
+
+// Query fields and the predicates they become. Clients only supply values, never predicate syntax.
++ (NSDictionary<NSString*, NSString*> *)queryFieldFormats {
+	return @{@"name": @"fileURL.lastPathComponent CONTAINS[cd] %@",
+			 @"slicer": @"slicer ==[c] %@",
+			 @"compatible": @"compatible == %@",
+			 @"fits": @"fitsPrintableVolume == %@",
+			 @"minDuration": @"estimatedDuration >= %@",
+			 @"maxDuration": @"estimatedDuration <= %@",
+			 @"maxFilament": @"filamentLength <= %@",
+			 @"maxWidth": @"width <= %@",
+			 @"maxDepth": @"depth <= %@",
+			 @"maxHeight": @"height <= %@",
+			 @"minLayerHeight": @"layerHeight >= %@",
+			 @"maxLayerHeight": @"layerHeight <= %@",
+			 };
+}
+
+
+// All fields have to match. Nil if the query has an unknown field or a value of the wrong type.
+- (NSPredicate*)predicateForQuery:(NSDictionary*)query {
+	if(![query isKindOfClass:[NSDictionary class]]) {
+		return nil;
+	}
+	
+	NSDictionary *formats = [self.class queryFieldFormats];
+	NSSet *stringFields = [NSSet setWithObjects:@"name", @"slicer", nil];
+	NSMutableArray *predicates = [NSMutableArray new];
+	
+	for(NSString *field in query) {
+		id value = query[field];
+		Class valueClass = [stringFields containsObject:field] ? [NSString class] : [NSNumber class];
+		if(!formats[field] || ![value isKindOfClass:valueClass]) {
+			return nil;
+		}
+		[predicates addObject:[NSPredicate predicateWithFormat:formats[field], value]];
+	}
+	return [NSCompoundPredicate andPredicateWithSubpredicates:predicates];
+}
+
+
+- (NSDictionary*)descriptionForFileSummary:(TFPGCodeFileSummary*)summary {
+	return @{@"file": summary.fileURL.path,
+			 @"slicer": summary.slicer ?: [NSNull null],
+			 @"profile": summary.profileValues ?: @{},
+			 @"layerHeight": @(summary.layerHeight),
+			 @"layerCount": @(summary.layerCount),
+			 @"size": @[@(summary.width), @(summary.depth), @(summary.height)],
+			 @"compatible": @(summary.compatible),
+			 @"fitsPrintableVolume": @(summary.fitsPrintableVolume),
+			 @"filamentLength": @(summary.filamentLength),
+			 @"estimatedDuration": @(summary.estimatedDuration),
+			 };
+}
+
+
+- (NSDictionary*)libraryFilesForRequest:(NSDictionary*)request {
+	NSPredicate *predicate;
+	if(request[@"query"]) {
+		predicate = [self predicateForQuery:request[@"query"]];
+		if(!predicate) {
+			return @{@"error": @"Invalid query"};
+		}
+	}
+	
+	NSArray *summaries = [self.printerManager.libraryIndex summariesMatchingPredicate:predicate];
+	return @{@"files": [summaries tf_mapWithBlock:^NSDictionary*(TFPGCodeFileSummary *summary) {
+		return [self descriptionForFileSummary:summary];
+	}]};
+}
+
+
+- (void)scanLibraryForRequest:(NSDictionary*)request reply:(void(^)(NSDictionary*))reply {
+	NSString *path = request[@"directory"];
+	BOOL isDirectory = NO;
+	if(![path isKindOfClass:[NSString class]] || ![[NSFileManager defaultManager] fileExistsAtPath:path isDirectory:&isDirectory] || !isDirectory) {
+		reply(@{@"error": @"Directory not found"});
+		return;
+	}
+	
+	TFPGCodeLibraryIndex *index = self.printerManager.libraryIndex;
+	[index scanDirectoryAtURL:[NSURL fileURLWithPath:path] completionHandler:^(NSUInteger analyzedFileCount) {
+		reply(@{@"analyzed": @(analyzedFileCount), @"files": @(index.summaries.count)});
+	}];
+}
+
+
+#pragma mark - Conversion
+
+
+// Every line is touched after loading, since containers only decode lines as they're used
+- (TFPGCodeProgram*)loadProgramAtURL:(NSURL*)URL duration:(NSTimeInterval*)outDuration error:(NSError**)outError {
+	uint64_t start = TFNanosecondTime();
+	TFPGCodeProgram *program = [[TFPGCodeProgram alloc] initWithFileURL:URL error:outError];
+	[program.lines enumerateObjectsUsingBlock:^(TFPGCode *code, NSUInteger index, BOOL *stop) {}];
+	*outDuration = (double)(TFNanosecondTime() - start) / NSEC_PER_SEC;
+	return program;
+}
+
+
+// Clients can only name library files, or containers in a library directory, and the output goes next to the input
+// under a name that isn't taken, so the socket can't be used to read or overwrite anything else.
+- (void)convertFileForRequest:(NSDictionary*)request reply:(void(^)(NSDictionary*))reply {
+	NSString *inputPath = request[@"file"];
+	if(![inputPath isKindOfClass:[NSString class]]) {
+		reply(@{@"error": @"Missing file"});
+		return;
+	}
+	
+	TFPGCodeLibraryIndex *index = self.printerManager.libraryIndex;
+	NSURL *inputURL = [NSURL fileURLWithPath:inputPath].URLByStandardizingPath;
+	BOOL fromContainer = [inputURL.pathExtension.lowercaseString isEqual:TFPGCodeContainerFileExtension];
+	if(fromContainer ? ![index hasFilesInDirectoryAtURL:inputURL.URLByDeletingLastPathComponent] : ![index summaryForFileAtURL:inputURL]) {
+		reply(@{@"error": @"Not a library file"});
+		return;
+	}
+	
+	NSString *baseName = inputURL.lastPathComponent.stringByDeletingPathExtension;
+	if([inputURL.pathExtension.lowercaseString isEqual:@"gz"]) {
+		baseName = baseName.stringByDeletingPathExtension;
+	}
+	NSString *outputExtension = fromContainer ? @"gcode" : TFPGCodeContainerFileExtension;
+	NSURL *outputURL = [inputURL.URLByDeletingLastPathComponent URLByAppendingPathComponent:[baseName stringByAppendingPathExtension:outputExtension]];
+	if([[NSFileManager defaultManager] fileExistsAtPath:outputURL.path]) {
+		reply(@{@"error": @"Output file already exists"});
+		return;
+	}
+	
+	dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+		NSTimeInterval inputLoadTime, outputLoadTime;
+		NSError *error;
+		
+		// Containers are checked frame by frame as they load, so a malformed one fails here rather than while writing
+		TFPGCodeProgram *program = [self loadProgramAtURL:inputURL duration:&inputLoadTime error:&error];
+		BOOL written = program && (fromContainer ? [program writeToFileURL:outputURL error:&error] : [TFPGCodeContainer writeProgram:program toURL:outputURL error:&error]);
+		if(!written || ![self loadProgramAtURL:outputURL duration:&outputLoadTime error:&error]) {
+			reply(@{@"error": error.localizedRecoverySuggestion ?: error.localizedDescription ?: @"Conversion failed"});
+			return;
+		}
+		
+		NSNumber *inputSize = [[NSFileManager defaultManager] attributesOfItemAtPath:inputURL.path error:nil][NSFileSize];
+		NSNumber *outputSize = [[NSFileManager defaultManager] attributesOfItemAtPath:outputURL.path error:nil][NSFileSize];
+		TFLog(@"Converted %@ (%@ bytes, loads in %.03f s) to %@ (%@ bytes, loads in %.03f s)", inputURL.lastPathComponent, inputSize, inputLoadTime, outputURL.lastPathComponent, outputSize, outputLoadTime);
+		
+		reply(@{@"output": outputURL.path,
+				@"lines": @(program.lines.count),
+				@"inputSize": inputSize ?: @0,
+				@"outputSize": outputSize ?: @0,
+				@"inputLoadTime": @(inputLoadTime),
+				@"outputLoadTime": @(outputLoadTime),
+				});
+	});
+}
+
+
+#pragma mark - Subscriptions
+
+
+// On server queue
+- (void)sendSubscriptionEvents {
+	NSArray *subscribers = [self.clients tf_selectWithBlock:^BOOL(TFPControlClient *client) {
+		return client.subscribed;
+	}];
+	if(!subscribers.count) {
+		return;
+	}
+	
+	dispatch_async(dispatch_get_main_queue(), ^{
+		[self sendJobEventsToClients:subscribers];
+	});
+}
+
+
+- (void)sendJobEventsToClients:(NSArray<TFPControlClient*> *)clients {
+	NSArray<TFPSpooledJob*> *jobs = self.spooler.jobs;
+	NSMutableArray *events = [NSMutableArray new];
+	
+	for(TFPSpooledJob *job in self.previousJobs) {
+		if(![jobs containsObject:job]) {
+			NSMutableDictionary *event = [[self descriptionForJob:job] mutableCopy];
+			event[@"event"] = @"ended";
+			[events addObject:event];
+		}
+	}
+	for(TFPSpooledJob *job in jobs) {
+		if(job.state == TFPSpooledJobStatePrinting) {
+			NSMutableDictionary *event = [[self descriptionForJob:job] mutableCopy];
+			event[@"event"] = @"progress";
+			[events addObject:event];
+		}
+	}
+	self.previousJobs = jobs;
+	
+	for(NSDictionary *event in events) {
+		for(TFPControlClient *client in clients) {
+			[self sendObject:event toClient:client];
+		}
+	}
+}
+
+
+@end
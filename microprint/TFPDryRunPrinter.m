@@ -7,7 +7,8 @@
 
 #import "TFPDryRunPrinter.h"
 #import "TFPExtras.h"
-#import "TFP3DVector.h"
+#import "TFPGCodeHelpers.h"
+#import "TFPVirtualClock.h"
 
 static double speedMultiplier = 10;
 
@@ -19,7 +20,7 @@ static double speedMultiplier = 10;
 
 
 @interface TFPDryRunPrinter ()
-@property TFP3DVector *simulatedPosition;
+@property TFPVector simulatedPosition;
 @property double feedRate;
 @property BOOL relativeMode;
 @end
@@ -39,7 +40,7 @@ static double speedMultiplier = 10;
 - (instancetype)init {
 	if(!(self = [super init])) return nil;
 	
-	self.simulatedPosition = [TFP3DVector zeroVector];
+	self.simulatedPosition = TFPVectorMake(0, 0, 0);
 	
 	return self;
 }
@@ -50,16 +51,10 @@ static double speedMultiplier = 10;
 	NSTimeInterval duration = 0.02;
 	
 	if(G == 0 || G == 1) {
-		TFP3DVector *movement = [[code movementVector] vectorByDefaultingToValues:self.simulatedPosition];
+		TFPVector movement = self.relativeMode ? TFPVectorAdd(self.simulatedPosition, code.movement) : TFPVectorDefaultingToValues(code.movement, self.simulatedPosition);
 		self.feedRate = [code valueForField:'F' fallback:self.feedRate];
 		
-		if(self.relativeMode) {
-			movement = [TFP3DVector vectorWithX:@(self.simulatedPosition.x.doubleValue + movement.x.doubleValue)
-											  Y:@(self.simulatedPosition.y.doubleValue + movement.y.doubleValue)
-											  Z:@(self.simulatedPosition.z.doubleValue + movement.z.doubleValue)];
-		}
-		
-		double distance = [self.simulatedPosition distanceToPoint:movement];
+		double distance = TFPVectorDistance(self.simulatedPosition, movement);
 		
 		double calculatedSpeed = (6288.78 * (self.feedRate-830))/((self.feedRate-828.465) * (self.feedRate+79.5622));
 		duration = distance / calculatedSpeed;
@@ -73,10 +68,10 @@ static double speedMultiplier = 10;
 		self.relativeMode = YES;
 		
     } else if(G == 30 || G == 28) {
-        TFP3DVector *movement = [TFP3DVector vectorWithX:@50 Y:@50 Z:(G == 30 ? @0 : self.simulatedPosition.z)];
+        TFPVector movement = TFPVectorMake(50, 50, (G == 30 ? 0 : self.simulatedPosition.z));
         self.feedRate = [code valueForField:'F' fallback:self.feedRate];
 
-        double distance = [self.simulatedPosition distanceToPoint:movement];
+        double distance = TFPVectorDistance(self.simulatedPosition, movement);
 
         double calculatedSpeed = (6288.78 * (self.feedRate-830))/((self.feedRate-828.465) * (self.feedRate+79.5622));
         duration = distance / calculatedSpeed;
@@ -84,11 +79,11 @@ static double speedMultiplier = 10;
         self.simulatedPosition = movement;
     }
 	
-	dispatch_after(dispatch_time(0, duration * NSEC_PER_SEC), queue, ^{
+	[TFPVirtualClock dispatchAfter:duration queue:queue block:^{
 		if(block) {
 			block(YES, @{});
 		}
-	});
+	}];
 }
 
 
@@ -103,28 +98,28 @@ static double speedMultiplier = 10;
 
 
 - (void)fetchBacklashValuesWithCompletionHandler:(void(^)(BOOL success, TFPBacklashValues values))completionHandler {
-	dispatch_after(dispatch_time(0, 0.1 * NSEC_PER_SEC), dispatch_get_main_queue(), ^{
+	[TFPVirtualClock dispatchAfter:0.1 queue:dispatch_get_main_queue() block:^{
 		completionHandler(YES, (TFPBacklashValues){0.33, 0.69, 1500});
-	});
+	}];
 }
 
 
 - (void)fetchBedOffsetsWithCompletionHandler:(void (^)(BOOL, TFPBedLevelOffsets))completionHandler {
-	dispatch_after(dispatch_time(0, 0.1 * NSEC_PER_SEC), dispatch_get_main_queue(), ^{
+	[TFPVirtualClock dispatchAfter:0.1 queue:dispatch_get_main_queue() block:^{
 		completionHandler(YES, (TFPBedLevelOffsets){-0.30, -0.4, -0.65, -1, -0.95});
-	});
+	}];
 }
 
 
 - (void)establishConnectionWithCompletionHandler:(void(^)(NSError *error))completionHandler {
 	self.pendingConnection = YES;
-	dispatch_after(dispatch_time(0, 1 * NSEC_PER_SEC), dispatch_get_main_queue(), ^{
+	[TFPVirtualClock dispatchAfter:1 queue:dispatch_get_main_queue() block:^{
 		self.serialNumber = @"TEST-00-00-00-00-123-456";
 		self.pendingConnection = NO;
 		if(completionHandler) {
 			completionHandler(nil);
 		}
-	});
+	}];
 };
 
 
@@ -134,8 +129,9 @@ static double speedMultiplier = 10;
 }
 
 
+// Simulated time has no need to hurry
 - (double)speedMultiplier {
-	return speedMultiplier;
+	return [TFPVirtualClock isRunning] ? 1 : speedMultiplier;
 }
 
 
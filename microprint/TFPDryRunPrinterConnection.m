@@ -11,6 +11,14 @@
 #import "TFPGCodeHelpers.h"
 #import "TFPExtras.h"
 #import "TFPPrinter+VirtualEEPROM.h"
+#import "TFPVirtualClock.h"
+
+
+static const double ambientTemperature = 25;
+static const NSTimeInterval heatingTimeConstant = 40;
+static const NSTimeInterval coolingTimeConstant = 120;
+static const double heaterSettledTolerance = 2;
+static const NSTimeInterval homingDuration = 4;
 
 
 @interface TFPPrinterConnection (Private)
@@ -23,17 +31,117 @@
 
 
 
+// Simulated machine. Only used on the virtual clock; in real time, codes are acknowledged right away.
+@interface TFPDryRunPrinterConnection ()
+@property TFPAbsolutePosition position;
+@property double feedRate;
+@property BOOL relativeMode;
+
+@property double heaterTemperature;
+@property double heaterTargetTemperature;
+@property uint64_t heaterUpdateTime;
+@end
+
+
+
 @implementation TFPDryRunPrinterConnection
 
 
 - (instancetype)init {
-	return [super initWithSerialPort:nil];
+	if(!(self = [super initWithSerialPort:nil])) return nil;
+	
+	self.heaterTemperature = ambientTemperature;
+	
+	return self;
+}
+
+
+- (void)updateHeaterTemperature {
+	uint64_t now = TFNanosecondTime();
+	NSTimeInterval elapsed = (double)(now - self.heaterUpdateTime) / NSEC_PER_SEC;
+	self.heaterTemperature = [self heaterTemperatureAfterInterval:elapsed];
+	self.heaterUpdateTime = now;
+}
+
+
+// First-order approach towards the target, or towards ambient temperature with the heater off
+- (double)heaterTemperatureAfterInterval:(NSTimeInterval)interval {
+	BOOL heating = self.heaterTargetTemperature > 0;
+	double goal = heating ? self.heaterTargetTemperature : ambientTemperature;
+	NSTimeInterval timeConstant = heating ? heatingTimeConstant : coolingTimeConstant;
+	return goal + (self.heaterTemperature - goal) * exp(-interval / timeConstant);
+}
+
+
+- (NSTimeInterval)heaterSettlingTime {
+	double difference = fabs(self.heaterTemperature - self.heaterTargetTemperature);
+	return difference > heaterSettledTolerance ? heatingTimeConstant * log(difference / heaterSettledTolerance) : 0;
+}
+
+
+// Returns how long the code takes on the simulated machine
+- (NSTimeInterval)simulateCode:(TFPGCode*)code {
+	NSInteger G = [code valueForField:'G' fallback:-1];
+	NSInteger M = [code valueForField:'M' fallback:-1];
+	[self updateHeaterTemperature];
+	
+	if(G == 0 || G == 1) {
+		TFPAbsolutePosition from = self.position;
+		TFPAbsolutePosition to;
+		double relative = self.relativeMode ? 1 : 0;
+		
+		to.x = [code hasField:'X'] ? [code valueForField:'X'] + relative * from.x : from.x;
+		to.y = [code hasField:'Y'] ? [code valueForField:'Y'] + relative * from.y : from.y;
+		to.z = [code hasField:'Z'] ? [code valueForField:'Z'] + relative * from.z : from.z;
+		to.e = [code hasField:'E'] ? [code valueForField:'E'] + relative * from.e : from.e;
+		
+		self.feedRate = [code valueForField:'F' fallback:self.feedRate];
+		self.position = to;
+		return TFPEstimatedMoveDuration(from, to, self.feedRate);
+	
+	}else if(G == 4) {
+		return [code valueForField:'P' fallback:0] / 1000 + [code valueForField:'S' fallback:0];
+	
+	}else if(G == 28 || G == 30) {
+		TFPAbsolutePosition from = self.position;
+		TFPAbsolutePosition to = {.x = 50, .y = 50, .z = (G == 30 ? 0 : from.z), .e = from.e};
+		self.position = to;
+		return TFPEstimatedMoveDuration(from, to, self.feedRate) + homingDuration;
+	
+	}else if(G == 90) {
+		self.relativeMode = NO;
+	
+	}else if(G == 91) {
+		self.relativeMode = YES;
+	
+	}else if(M == 104 || M == 109) {
+		self.heaterTargetTemperature = [code valueForField:'S' fallback:0];
+		
+		if(M == 109) {
+			NSTimeInterval duration = [self heaterSettlingTime];
+			for(NSUInteger second = 1; second < duration; second++) {
+				NSString *report = [NSString stringWithFormat:@"T:%.1f", [self heaterTemperatureAfterInterval:second]];
+				[TFPVirtualClock dispatchAfter:second queue:self.serialPortQueue block:^{
+					[self processIncomingString:report];
+				}];
+			}
+			return duration;
+		}
+	}
+	
+	return 0;
 }
 
 
 - (void)sendGCode:(TFPGCode*)code {
 	NSInteger M = [code valueForField:'M' fallback:-1];
 	NSDictionary *values = nil;
+	BOOL simulated = [TFPVirtualClock isRunning];
+	NSTimeInterval duration = 0.01;
+	
+	if(simulated) {
+		duration = MAX([self simulateCode:code], duration);
+	}
 	
 	switch(M) {
 		case 115:
@@ -60,16 +168,18 @@
 			break;
 		}
 			
-		case 105:
-			dispatch_after(dispatch_time(0, 0.1 * NSEC_PER_SEC), self.serialPortQueue, ^{
-				[self processIncomingString:@"T:300"];
-			});
+		case 105: {
+			NSString *report = simulated ? [NSString stringWithFormat:@"T:%.1f", self.heaterTemperature] : @"T:300";
+			[TFPVirtualClock dispatchAfter:0.1 queue:self.serialPortQueue block:^{
+				[self processIncomingString:report];
+			}];
 			break;
+		}
 	}
 	
-	dispatch_after(dispatch_time(0, 0.01 * NSEC_PER_SEC), self.serialPortQueue, ^{
+	[TFPVirtualClock dispatchAfter:duration queue:self.serialPortQueue block:^{
 		[self respondOKWithValues:values toCode:code];
-	});
+	}];
 }
 
 
@@ -88,9 +198,9 @@
 	self.state = TFPPrinterConnectionStatePending;
 	self.connectionCompletionHandler = completionHandler;
 
-	dispatch_after(dispatch_time(0, 2 * NSEC_PER_SEC), dispatch_get_main_queue(), ^{
+	[TFPVirtualClock dispatchAfter:2 queue:dispatch_get_main_queue() block:^{
 		[self finishEstablishment];
-	});
+	}];
 }
 
 
@@ -21,6 +21,7 @@
 + (instancetype)tf_singleByte:(uint8_t)byte;
 
 @property (readonly) NSData *tf_fletcher16Checksum;
+@property (readonly) NSString *tf_SHA256String; // Lowercase hex
 - (NSUInteger)tf_offsetOfData:(NSData*)subdata;
 - (NSData *)tf_dataByDecodingDeflate;
 @end
@@ -42,6 +43,9 @@ enum TFPErrorCodes {
 	TFPErrorCodeParseError = 1,
 	TFPErrorCodeIncompatibleCode,
 	TFPScriptExecutionError,
+	TFPErrorCodeJournalMismatch,
+	TFPErrorCodeInvalidCapture,
+	TFPErrorCodeInvalidContainer,
 };
 
 
@@ -5,7 +5,9 @@
 //
 
 #import "TFPExtras.h"
-#import "zlib.h"
+#import "TFPVirtualClock.h"
+#import "TFPInflateStream.h"
+#import <CommonCrypto/CommonDigest.h>
 @import MachO;
 
 
@@ -82,51 +84,43 @@ NSString *const TFPErrorGCodeLineKey = @"GCodeLine";
 }
 
 
+// Hashed in chunks, since CC_LONG lengths are 32-bit and mapped files can be larger
+- (NSString*)tf_SHA256String {
+	CC_SHA256_CTX context;
+	CC_SHA256_Init(&context);
+	const NSUInteger chunkSize = 16 * 1024 * 1024;
+	for(NSUInteger offset = 0; offset < self.length; offset += chunkSize) {
+		CC_SHA256_Update(&context, (const uint8_t*)self.bytes + offset, (CC_LONG)MIN(chunkSize, self.length - offset));
+	}
+	
+	uint8_t digest[CC_SHA256_DIGEST_LENGTH];
+	CC_SHA256_Final(digest, &context);
+	NSMutableString *string = [NSMutableString stringWithCapacity:CC_SHA256_DIGEST_LENGTH * 2];
+	for(NSUInteger i=0; i<CC_SHA256_DIGEST_LENGTH; i++) {
+		[string appendFormat:@"%02x", digest[i]];
+	}
+	return string;
+}
+
+
 - (NSUInteger)tf_offsetOfData:(NSData*)subdata {
 	return [self rangeOfData:subdata options:0 range:NSMakeRange(0, self.length)].location;
 }
 
 
 - (NSData *)tf_dataByDecodingDeflate {
-	NSData *data = self;
-	if ([data length] == 0) return data;
-	
-	NSUInteger full_length = [data length];
-	NSUInteger half_length = [data length] / 2;
+	if(self.length == 0) return self;
 	
-	NSMutableData *decompressed = [NSMutableData dataWithLength:full_length + half_length];
-	BOOL done = NO;
-	int status;
-	
-	z_stream strm;
-	strm.next_in = (Bytef *)[data bytes];
-	strm.avail_in = (uInt)[data length];
-	strm.total_out = 0;
-	strm.zalloc = Z_NULL;
-	strm.zfree = Z_NULL;
-	
-	if (inflateInit2(&strm, (15+32)) != Z_OK) return nil;
-	while (!done) {
-		// Make sure we have enough room and reset the lengths.
-		if (strm.total_out >= [decompressed length])
-			[decompressed increaseLengthBy: half_length];
-		strm.next_out = [decompressed mutableBytes] + strm.total_out;
-		strm.avail_out = (uInt)([decompressed length] - strm.total_out);
-		
-		// Inflate another chunk.
-		status = inflate (&strm, Z_SYNC_FLUSH);
-		if (status == Z_STREAM_END) done = YES;
-		else if (status != Z_OK) break;
-	}
-	if (inflateEnd (&strm) != Z_OK) return nil;
+	NSMutableData *decompressed = [NSMutableData dataWithCapacity:self.length * 2];
+	TFPInflateStream *inflater = [TFPInflateStream new];
+	BOOL valid = [inflater inflateBytes:self.bytes length:self.length outputHandler:^(const void *bytes, NSUInteger length) {
+		[decompressed appendBytes:bytes length:length];
+	}];
 	
-	// Set real length.
-	if (done) {
-		[decompressed setLength:strm.total_out];
-		return [NSData dataWithData: decompressed];
-	} else {
+	if(!valid || !inflater.finished) {
 		return nil;
 	}
+	return [decompressed copy];
 }
 
 
@@ -175,6 +169,11 @@ void TFLog(NSString *format, ...) {
 
 
 uint64_t TFNanosecondTime(void) {
+	uint64_t virtualTime = TFPVirtualClockTime();
+	if(virtualTime) {
+		return virtualTime;
+	}
+	
 	mach_timebase_info_data_t info;
 	mach_timebase_info(&info);
 	return (mach_absolute_time() * info.numer) / info.denom;
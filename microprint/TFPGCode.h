@@ -6,16 +6,44 @@
 
 #import <Foundation/Foundation.h>
 
+
+// Fields of a code in a fixed-size layout, for storing parsed programs. Comments are kept separately.
+typedef struct {
+	uint16_t fieldsSetMask;
+	int16_t N;
+	uint16_t M;
+	uint16_t G;
+	float X, Y, Z, E, F;
+	uint32_t S;
+	uint32_t P;
+} TFPPackedGCode;
+
+
+// Repetier v2 binary frames, as sent to the printer: a 4-byte header of flags for the fields that are set,
+// the values in a fixed order and size, and a 2-byte checksum. The functions below leave out the checksum.
+enum {
+	TFPRepetierV2MaximumFrameLength = 40, // Including the checksum
+};
+
+// Returns the length written, at most TFPRepetierV2MaximumFrameLength - 2
+extern NSUInteger TFPPackedGCodeEncodeRepetierV2(const TFPPackedGCode *code, uint8_t *buffer);
+
+// Returns the length of the frame at the start of bytes, or 0 if it isn't a valid frame
+extern NSUInteger TFPPackedGCodeDecodeRepetierV2(const uint8_t *bytes, NSUInteger length, TFPPackedGCode *code);
+
+
 @interface TFPGCode : NSObject
 + (instancetype)codeWithString:(NSString*)string;
 - (instancetype)initWithString:(NSString*)string;
 
 + (instancetype)codeWithField:(char)field value:(double)value;
 + (instancetype)codeWithComment:(NSString*)string;
+- (instancetype)initWithPackedCode:(TFPPackedGCode)packedCode comment:(NSString*)comment;
 
 - (TFPGCode*)codeBySettingField:(char)field toValue:(double)value;
 - (TFPGCode*)codeByAdjustingField:(char)field offset:(double)offset;
 - (TFPGCode*)codeBySettingComment:(NSString*)comment;
+- (TFPGCode*)codeByRemovingField:(char)field;
 
 @property (readonly, copy) NSString *comment;
 @property (readonly) BOOL hasFields;
@@ -40,6 +68,9 @@
 @property (nonatomic, readonly) uint32_t S;
 @property (nonatomic, readonly) uint32_t P;
 
+@property (readonly) TFPPackedGCode packedCode;
+
 @property (readonly) NSData *repetierV2Representation;
 @property (readonly) NSString *ASCIIRepresentation;
+- (void)appendASCIIRepresentationToData:(NSMutableData*)data; // UTF-8, no line break
 @end
\ No newline at end of file
@@ -6,7 +6,6 @@
 
 #import "TFPGCode.h"
 #import "TFPExtras.h"
-#import "TFDataBuilder.h"
 #import "TFStringScanner.h"
 
 
@@ -156,6 +155,37 @@ enum {
 }
 
 
+- (instancetype)initWithPackedCode:(TFPPackedGCode)packedCode comment:(NSString*)comment {
+	if(!(self = [self initWithComment:comment])) return nil;
+	
+	_fieldsSetMask = packedCode.fieldsSetMask;
+	_N = packedCode.N;
+	_M = packedCode.M;
+	_G = packedCode.G;
+	
+	_X = packedCode.X;
+	_Y = packedCode.Y;
+	_Z = packedCode.Z;
+	_E = packedCode.E;
+	_F = packedCode.F;
+	
+	_S = packedCode.S;
+	_P = packedCode.P;
+	
+	return self;
+}
+
+
+- (TFPPackedGCode)packedCode {
+	return (TFPPackedGCode){
+		.fieldsSetMask = self.fieldsSetMask,
+		.N = self.N, .M = self.M, .G = self.G,
+		.X = self.X, .Y = self.Y, .Z = self.Z, .E = self.E, .F = self.F,
+		.S = self.S, .P = self.P,
+	};
+}
+
+
 - (TFPGCode*)createCopy {
 	TFPGCode *copy = [self.class new];
 	
@@ -192,6 +222,16 @@ enum {
 }
 
 
+- (TFPGCode*)codeByRemovingField:(char)field {
+	TFPGCode *copy = [self createCopy];
+	int8_t offset = [self maskOffsetForField:field];
+	if(offset >= 0) {
+		copy.fieldsSetMask &= ~(1<<offset);
+	}
+	return copy;
+}
+
+
 - (TFPGCode*)codeByAdjustingField:(char)field offset:(double)offset {
 	return [self codeBySettingField:field toValue:[self valueForField:field]+offset];
 }
@@ -268,61 +308,222 @@ enum {
 }
 
 
-- (NSString *)ASCIIRepresentation {
-	static NSNumberFormatter *formatter;
-	if(!formatter) {
-		formatter = [NSNumberFormatter new];
-		formatter.locale = [NSLocale systemLocale];
-		formatter.maximumFractionDigits = 5;
-		formatter.minimumFractionDigits = 0;
-		formatter.minimumIntegerDigits = 1;
+// Writes the value with at most five decimals and no trailing zeros, ties to even, matching the NSNumberFormatter
+// this used to go through. Needs room for 48 characters. Returns the new end.
+static char *TFPGCodeFormatValue(double value, char *cursor) {
+	if(fabs(value) >= 1e13) {
+		int length = sprintf(cursor, "%.5f", value);
+		while(cursor[length-1] == '0') {
+			length--;
+		}
+		if(cursor[length-1] == '.') {
+			length--;
+		}
+		return cursor + length;
+	}
+	
+	long long scaled = llrint(value * 100000);
+	unsigned long long magnitude = llabs(scaled);
+	unsigned long long integer = magnitude / 100000;
+	unsigned long long fraction = magnitude % 100000;
+	
+	if(value < 0) {
+		*cursor++ = '-';
+	}
+	
+	char digits[20];
+	int digitCount = 0;
+	do {
+		digits[digitCount++] = '0' + integer % 10;
+		integer /= 10;
+	} while(integer);
+	while(digitCount) {
+		*cursor++ = digits[--digitCount];
+	}
+	
+	if(fraction) {
+		int fractionDigits = 5;
+		while(fraction % 10 == 0) {
+			fraction /= 10;
+			fractionDigits--;
+		}
+		
+		*cursor++ = '.';
+		for(int i=fractionDigits-1; i>=0; i--) {
+			cursor[i] = '0' + fraction % 10;
+			fraction /= 10;
+		}
+		cursor += fractionDigits;
 	}
 	
-	NSMutableArray *items = [NSMutableArray new];
+	return cursor;
+}
+
+
+- (void)appendASCIIRepresentationToData:(NSMutableData*)data {
+	const char *canonicalFieldOrder = "NMGXYZEFSP";
+	char buffer[10 * 50];
+	char *cursor = buffer;
 	
-	[self enumerateFieldsWithBlock:^(char field, double value, BOOL *stopFlag) {
-		[items addObject:[NSString stringWithFormat:@"%c%@", field, [formatter stringFromNumber:@(value)]]];
-	}];
+	for(const char *field = canonicalFieldOrder; *field; field++) {
+		if(![self hasField:*field]) {
+			continue;
+		}
+		if(cursor != buffer) {
+			*cursor++ = ' ';
+		}
+		*cursor++ = *field;
+		cursor = TFPGCodeFormatValue([self valueForField:*field], cursor);
+	}
 	
 	if(self.comment) {
-		[items addObject:[NSString stringWithFormat:@";%@", self.comment]];
+		if(cursor != buffer) {
+			*cursor++ = ' ';
+		}
+		*cursor++ = ';';
 	}
 	
-	return [items componentsJoinedByString:@" "];
+	[data appendBytes:buffer length:cursor - buffer];
+	if(self.comment) {
+		[data appendData:[self.comment dataUsingEncoding:NSUTF8StringEncoding]];
+	}
 }
 
 
-- (NSData*)repetierV2Representation {
-	__block uint16_t flags = 1<<7 | 1<<12; // non-ASCII indicator + v2 flag
+- (NSString *)ASCIIRepresentation {
+	NSMutableData *data = [NSMutableData dataWithCapacity:64];
+	[self appendASCIIRepresentationToData:data];
+	return [[NSString alloc] initWithData:data encoding:NSUTF8StringEncoding];
+}
+
+
+// Bit in the frame flags for each field offset. Bit 7 marks the frame as binary, bit 9 is T, which codes don't have.
+static const uint8_t TFPRepetierV2FieldBits[] = {0, 1, 2, 3, 4, 5, 6, 8, 10, 11};
+static const uint16_t TFPRepetierV2BinaryFlag = 1<<7;
+static const uint16_t TFPRepetierV2VersionFlag = 1<<12;
+
+
+static uint8_t *TFPRepetierV2WriteInt16(uint8_t *cursor, uint16_t value) {
+	value = NSSwapHostShortToLittle(value);
+	memcpy(cursor, &value, sizeof(value));
+	return cursor + sizeof(value);
+}
+
+
+static uint8_t *TFPRepetierV2WriteInt32(uint8_t *cursor, uint32_t value) {
+	value = NSSwapHostIntToLittle(value);
+	memcpy(cursor, &value, sizeof(value));
+	return cursor + sizeof(value);
+}
+
+
+static uint8_t *TFPRepetierV2WriteFloat(uint8_t *cursor, float value) {
+	NSSwappedFloat swapped = NSSwapHostFloatToLittle(value);
+	memcpy(cursor, &swapped, sizeof(swapped));
+	return cursor + sizeof(swapped);
+}
+
+
+NSUInteger TFPPackedGCodeEncodeRepetierV2(const TFPPackedGCode *code, uint8_t *buffer) {
+	uint16_t flags = TFPRepetierV2BinaryFlag | TFPRepetierV2VersionFlag;
+	uint8_t *cursor = buffer + 4;
+	
+	for(int offset = offsetN; offset <= offsetP; offset++) {
+		if(!(code->fieldsSetMask & (1<<offset))) {
+			continue;
+		}
+		flags |= 1 << TFPRepetierV2FieldBits[offset];
+		
+		switch(offset) {
+			case offsetN: cursor = TFPRepetierV2WriteInt16(cursor, code->N); break;
+			case offsetM: cursor = TFPRepetierV2WriteInt16(cursor, code->M); break;
+			case offsetG: cursor = TFPRepetierV2WriteInt16(cursor, code->G); break;
+			case offsetX: cursor = TFPRepetierV2WriteFloat(cursor, code->X); break;
+			case offsetY: cursor = TFPRepetierV2WriteFloat(cursor, code->Y); break;
+			case offsetZ: cursor = TFPRepetierV2WriteFloat(cursor, code->Z); break;
+			case offsetE: cursor = TFPRepetierV2WriteFloat(cursor, code->E); break;
+			case offsetF: cursor = TFPRepetierV2WriteFloat(cursor, code->F); break;
+			case offsetS: cursor = TFPRepetierV2WriteInt32(cursor, code->S); break;
+			case offsetP: cursor = TFPRepetierV2WriteInt32(cursor, code->P); break;
+		}
+	}
 	
-	TFDataBuilder *valueDataBuilder = [TFDataBuilder new];
-	valueDataBuilder.byteOrder = TFDataBuilderByteOrderLittleEndian;
+	TFPRepetierV2WriteInt16(buffer, flags);
+	TFPRepetierV2WriteInt16(buffer + 2, 0); // v2-specific flags
+	return cursor - buffer;
+}
+
+
+NSUInteger TFPPackedGCodeDecodeRepetierV2(const uint8_t *bytes, NSUInteger length, TFPPackedGCode *code) {
+	if(length < 4) {
+		return 0;
+	}
+	uint16_t flags;
+	memcpy(&flags, bytes, sizeof(flags));
+	flags = NSSwapLittleShortToHost(flags);
+	uint16_t knownFlags = TFPRepetierV2BinaryFlag | TFPRepetierV2VersionFlag;
+	for(int offset = offsetN; offset <= offsetP; offset++) {
+		knownFlags |= 1 << TFPRepetierV2FieldBits[offset];
+	}
+	if((flags & ~knownFlags) || !(flags & TFPRepetierV2BinaryFlag) || !(flags & TFPRepetierV2VersionFlag)) {
+		return 0;
+	}
 	
-	NSString *fieldBits = @"NMGXYZE FTSP";
-	char *fieldTypes = "sssffff fbii";
+	*code = (TFPPackedGCode){0};
+	const uint8_t *cursor = bytes + 4;
+	const uint8_t *end = bytes + length;
 	
-	[self enumerateFieldsWithBlock:^(char field, double value, BOOL *stopFlag) {
-		NSUInteger index = [fieldBits rangeOfString:[NSString stringWithFormat:@"%c", field]].location;
+	for(int offset = offsetN; offset <= offsetP; offset++) {
+		if(!(flags & (1 << TFPRepetierV2FieldBits[offset]))) {
+			continue;
+		}
+		code->fieldsSetMask |= 1<<offset;
 		
-		flags |= (1<<index);
+		NSUInteger size = (offset <= offsetG) ? 2 : 4;
+		if(cursor + size > end) {
+			return 0;
+		}
+		uint16_t value16;
+		uint32_t value32;
+		NSSwappedFloat swapped;
+		memcpy(&value16, cursor, sizeof(value16));
+		memcpy(&value32, cursor, sizeof(value32));
+		memcpy(&swapped, cursor, sizeof(swapped));
 		
-		switch(fieldTypes[index]) {
-			case 's': [valueDataBuilder appendInt16:value]; break;
-			case 'i': [valueDataBuilder appendInt32:value]; break;
-			case 'b': [valueDataBuilder appendByte:value]; break;
-			case 'f': [valueDataBuilder appendFloat:value]; break;
+		switch(offset) {
+			case offsetN: code->N = NSSwapLittleShortToHost(value16); break;
+			case offsetM: code->M = NSSwapLittleShortToHost(value16); break;
+			case offsetG: code->G = NSSwapLittleShortToHost(value16); break;
+			case offsetX: code->X = NSSwapLittleFloatToHost(swapped); break;
+			case offsetY: code->Y = NSSwapLittleFloatToHost(swapped); break;
+			case offsetZ: code->Z = NSSwapLittleFloatToHost(swapped); break;
+			case offsetE: code->E = NSSwapLittleFloatToHost(swapped); break;
+			case offsetF: code->F = NSSwapLittleFloatToHost(swapped); break;
+			case offsetS: code->S = NSSwapLittleIntToHost(value32); break;
+			case offsetP: code->P = NSSwapLittleIntToHost(value32); break;
 		}
-	}];
-	
-	TFDataBuilder *dataBuilder = [TFDataBuilder new];
-	dataBuilder.byteOrder = TFDataBuilderByteOrderLittleEndian;
-	[dataBuilder appendInt16:flags];
-	[dataBuilder appendInt16:0]; // v2-specific flags
+		cursor += size;
+	}
+	return cursor - bytes;
+}
+
+
+// Encoded straight from the fields into a buffer, since this runs for every code sent
+- (NSData*)repetierV2Representation {
+	TFPPackedGCode code = self.packedCode;
+	uint8_t buffer[TFPRepetierV2MaximumFrameLength];
+	NSUInteger length = TFPPackedGCodeEncodeRepetierV2(&code, buffer);
 	
-	[dataBuilder appendData:valueDataBuilder.data];
-	[dataBuilder appendData:dataBuilder.data.tf_fletcher16Checksum];
+	uint8_t check1 = 0;
+	uint8_t check2 = 0;
+	for(NSUInteger i=0; i<length; i++) {
+		check1 = (check1 + buffer[i]) % 255;
+		check2 = (check2 + check1) % 255;
+	}
+	buffer[length++] = check1;
+	buffer[length++] = check2;
 	
-	return dataBuilder.data;
+	return [NSData dataWithBytes:buffer length:length];
 }
 
 
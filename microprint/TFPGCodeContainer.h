@@ -0,0 +1,25 @@
+//
+//  TFPGCodeContainer.h
+//  microprint
+//
+//
+
+#import <Foundation/Foundation.h>
+#import "TFPGCodeProgram.h"
+
+
+extern NSString *const TFPGCodeContainerFileExtension; // "gcodebin"
+
+
+// Programs stored as the Repetier v2 frames the printer consumes, so opening one skips ASCII parsing. Frames
+// only take room for the fields that are set, which makes containers about half the size of the G-code text.
+// Comments and the layer/phase index are kept in separate sections. Containers are memory-mapped, and lines
+// are decoded a block at a time as they're used, so a print can start streaming right away.
+@interface TFPGCodeContainer : NSObject
++ (BOOL)fileIsContainerAtURL:(NSURL*)URL;
+
++ (TFPGCodeProgram*)programWithContentsOfURL:(NSURL*)URL options:(TFPGCodeProgramOptions)options error:(NSError**)outError;
+
+// Runs the analysis passes first, if they haven't run, so the index can be stored
++ (BOOL)writeProgram:(TFPGCodeProgram*)program toURL:(NSURL*)URL error:(NSError**)outError;
+@end
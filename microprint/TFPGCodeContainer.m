@@ -0,0 +1,515 @@
+//
+//  TFPGCodeContainer.m
+//  microprint
+//
+//
+
+#import "TFPGCodeContainer.h"
+#import "TFPGCode.h"
+#import "TFPGCodeHelpers.h"
+#import "TFPExtras.h"
+
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+NSString *const TFPGCodeContainerFileExtension = @"gcodebin";
+
+static const uint32_t containerMagic = 'TFPB';
+static const uint32_t containerFormatVersion = 1;
+
+// Stored analysis results are only used if they were made by the same passes. Bump along with parserVersion
+// in TFPGCodeProgramCache.
+static const uint32_t analysisVersion = 3;
+
+static const NSUInteger linesPerBlock = 1024;
+static const NSUInteger writeBufferSize = 1024 * 1024;
+
+
+typedef struct {
+	uint32_t magic;
+	uint32_t formatVersion;
+	uint64_t lineCount;
+	uint64_t framesOffset; // One frame per line, without checksums. Lines without fields have a bare header.
+	uint64_t framesLength;
+	uint64_t blockOffsetsOffset; // uint64_t offset into the frames for every linesPerBlock lines
+	uint64_t commentsOffset; // TFPGCodeContainerComment records, sorted by line
+	uint64_t commentCount;
+	uint64_t commentTextOffset; // UTF-8, not terminated
+	uint64_t commentTextLength;
+	uint64_t indexOffset; // Keyed archive of the layer/phase index and other analysis results
+	uint64_t indexLength;
+} TFPGCodeContainerHeader;
+
+
+typedef struct {
+	uint64_t line;
+	uint64_t textOffset;
+	uint64_t textLength;
+} TFPGCodeContainerComment;
+
+
+
+@interface TFPGCodeProgram (ContainerPrivate)
++ (NSIndexSet*)keptCommentLineIndexesInLines:(NSArray<TFPGCode*> *)lines;
+- (NSDictionary<NSNumber*, NSString*> *)cachedCommentsByLine;
+- (void)setCachedExecutableLineIndexes:(NSIndexSet*)indexes;
+- (void)setCachedCommentsByLine:(NSDictionary<NSNumber*, NSString*> *)comments;
+- (NSMutableDictionary<NSString*, id> *)analysisResults;
+- (void)setAnalysisResults:(NSMutableDictionary<NSString*, id> *)results;
+@end
+
+
+
+// Lines of a mapped container. The first access to a line decodes its whole block, since frames have to be
+// walked from the start of the block anyway. Codes are kept once created and the array is safe to use from any
+// thread, like the lines of a program cache entry.
+@interface TFPGCodeContainerLineArray : NSArray
+- (instancetype)initWithData:(NSData*)data keptCommentLines:(NSIndexSet*)keptCommentLines;
+- (NSString*)commentForLine:(NSUInteger)line;
+@end
+
+
+@implementation TFPGCodeContainerLineArray {
+	NSData *_data;
+	NSIndexSet *_keptCommentLines;
+	const uint8_t *_frames;
+	uint64_t _framesLength;
+	const uint64_t *_blockOffsets;
+	const TFPGCodeContainerComment *_comments;
+	NSUInteger _commentCount;
+	const char *_commentText;
+	uint64_t _commentTextLength;
+	NSUInteger _count;
+	_Atomic(void*) *_codes;
+}
+
+
+// Without keptCommentLines, every comment is kept. Otherwise, comment-only lines outside it become blank.
+- (instancetype)initWithData:(NSData*)data keptCommentLines:(NSIndexSet*)keptCommentLines {
+	if(!(self = [super init])) return nil;
+	
+	const TFPGCodeContainerHeader *header = data.bytes;
+	const uint8_t *bytes = data.bytes;
+	_data = data;
+	_keptCommentLines = keptCommentLines;
+	_count = header->lineCount;
+	_frames = bytes + header->framesOffset;
+	_framesLength = header->framesLength;
+	_blockOffsets = (const uint64_t *)(bytes + header->blockOffsetsOffset);
+	_comments = (const TFPGCodeContainerComment *)(bytes + header->commentsOffset);
+	_commentCount = header->commentCount;
+	_commentText = (const char *)bytes + header->commentTextOffset;
+	_commentTextLength = header->commentTextLength;
+	_codes = calloc(MAX(_count, 1), sizeof(*_codes));
+	
+	return self;
+}
+
+
+- (void)dealloc {
+	for(NSUInteger i=0; i<_count; i++) {
+		void *code = atomic_load_explicit(&_codes[i], memory_order_relaxed);
+		if(code) {
+			CFRelease(code);
+		}
+	}
+	free(_codes);
+}
+
+
+// Index of the first comment record at or after the line
+- (NSUInteger)commentIndexForLine:(NSUInteger)line {
+	NSUInteger low = 0, high = _commentCount;
+	while(low < high) {
+		NSUInteger middle = low + (high - low) / 2;
+		if(_comments[middle].line < line) {
+			low = middle + 1;
+		}else{
+			high = middle;
+		}
+	}
+	return low;
+}
+
+
+- (NSString*)commentTextForRecord:(const TFPGCodeContainerComment *)record {
+	if(record->textOffset > _commentTextLength || record->textLength > _commentTextLength - record->textOffset) {
+		return nil;
+	}
+	return [[NSString alloc] initWithBytes:_commentText + record->textOffset length:record->textLength encoding:NSUTF8StringEncoding];
+}
+
+
+- (NSString*)commentForLine:(NSUInteger)line {
+	NSUInteger index = [self commentIndexForLine:line];
+	if(index < _commentCount && _comments[index].line == line) {
+		return [self commentTextForRecord:&_comments[index]];
+	}
+	return nil;
+}
+
+
+- (void)decodeBlock:(NSUInteger)block {
+	NSUInteger start = block * linesPerBlock;
+	NSUInteger end = MIN(start + linesPerBlock, _count);
+	uint64_t offset = _blockOffsets[block];
+	NSUInteger commentIndex = [self commentIndexForLine:start];
+	
+	for(NSUInteger i=start; i<end; i++) {
+		TFPPackedGCode packedCode;
+		NSUInteger length = (offset < _framesLength) ? TFPPackedGCodeDecodeRepetierV2(_frames + offset, _framesLength - offset, &packedCode) : 0;
+		if(!length) {
+			[NSException raise:NSInternalInconsistencyException format:@"Malformed frame for line %ld in G-code container", (long)i];
+		}
+		offset += length;
+		
+		NSString *comment;
+		if(commentIndex < _commentCount && _comments[commentIndex].line == i) {
+			if(!_keptCommentLines || packedCode.fieldsSetMask || [_keptCommentLines containsIndex:i]) {
+				comment = [self commentTextForRecord:&_comments[commentIndex]];
+			}
+			commentIndex++;
+		}
+		
+		void *code = NULL;
+		void *newCode = (void*)CFBridgingRetain([[TFPGCode alloc] initWithPackedCode:packedCode comment:comment]);
+		if(!atomic_compare_exchange_strong(&_codes[i], &code, newCode)) {
+			CFRelease(newCode);
+		}
+	}
+}
+
+
+- (void*)codePointerAtIndex:(NSUInteger)index {
+	void *code = atomic_load_explicit(&_codes[index], memory_order_acquire);
+	if(code) {
+		return code;
+	}
+	@autoreleasepool {
+		[self decodeBlock:index / linesPerBlock];
+	}
+	return atomic_load_explicit(&_codes[index], memory_order_acquire);
+}
+
+
+- (NSUInteger)count {
+	return _count;
+}
+
+
+- (id)objectAtIndex:(NSUInteger)index {
+	if(index >= _count) {
+		[NSException raise:NSRangeException format:@"Index %ld beyond bounds of %ld lines", (long)index, (long)_count];
+	}
+	return (__bridge TFPGCode*)[self codePointerAtIndex:index];
+}
+
+
+// Items point straight into the code storage
+- (NSUInteger)countByEnumeratingWithState:(NSFastEnumerationState *)state objects:(id __unsafe_unretained [])buffer count:(NSUInteger)length {
+	NSUInteger start = state->state;
+	if(start >= _count) {
+		return 0;
+	}
+	
+	NSUInteger batchLength = MIN(MAX(length, linesPerBlock), _count - start);
+	for(NSUInteger i=start; i<start+batchLength; i++) {
+		[self codePointerAtIndex:i];
+	}
+	
+	state->state = start + batchLength;
+	state->itemsPtr = (__unsafe_unretained id *)(void*)&_codes[start];
+	state->mutationsPtr = &state->extra[0];
+	return batchLength;
+}
+
+
+- (void)enumerateObjectsUsingBlock:(void (^)(id object, NSUInteger index, BOOL *stop))block {
+	BOOL stop = NO;
+	for(NSUInteger i=0; i<_count && !stop; i++) {
+		block((__bridge TFPGCode*)[self codePointerAtIndex:i], i, &stop);
+	}
+}
+
+
+- (id)copyWithZone:(NSZone *)zone {
+	return self;
+}
+
+
+@end
+
+
+
+@implementation TFPGCodeContainer
+
+
++ (BOOL)fileIsContainerAtURL:(NSURL*)URL {
+	int fileDescriptor = open(URL.fileSystemRepresentation, O_RDONLY);
+	if(fileDescriptor < 0) {
+		return NO;
+	}
+	uint32_t magic = 0;
+	ssize_t length = read(fileDescriptor, &magic, sizeof(magic));
+	close(fileDescriptor);
+	return length == sizeof(magic) && magic == containerMagic;
+}
+
+
++ (NSError*)invalidContainerError {
+	return [NSError errorWithDomain:TFPErrorDomain code:TFPErrorCodeInvalidContainer userInfo:@{NSLocalizedRecoverySuggestionErrorKey: @"The file isn't a valid G-code container."}];
+}
+
+
+#pragma mark - Reading
+
+
++ (BOOL)isValidHeader:(const TFPGCodeContainerHeader *)header length:(NSUInteger)length {
+	if(length < sizeof(TFPGCodeContainerHeader)) {
+		return NO;
+	}
+	if(header->magic != containerMagic || header->formatVersion != containerFormatVersion) {
+		return NO;
+	}
+	
+	// Bounding every field by the length first keeps the sums below from overflowing
+	const uint64_t *fields = &header->lineCount;
+	for(NSUInteger i=0; i<(sizeof(TFPGCodeContainerHeader) - offsetof(TFPGCodeContainerHeader, lineCount)) / sizeof(uint64_t); i++) {
+		if(fields[i] > length) {
+			return NO;
+		}
+	}
+	
+	uint64_t blockCount = (header->lineCount + linesPerBlock - 1) / linesPerBlock;
+	return header->framesOffset == sizeof(TFPGCodeContainerHeader)
+		&& header->lineCount <= header->framesLength / 4
+		&& header->framesOffset + header->framesLength <= header->blockOffsetsOffset
+		&& header->blockOffsetsOffset % sizeof(uint64_t) == 0
+		&& header->blockOffsetsOffset + blockCount * sizeof(uint64_t) <= header->commentsOffset
+		&& header->commentsOffset + header->commentCount * sizeof(TFPGCodeContainerComment) <= header->commentTextOffset
+		&& header->commentTextOffset + header->commentTextLength <= header->indexOffset
+		&& header->indexOffset + header->indexLength == length;
+}
+
+
+// Lines are decoded lazily, possibly in the middle of a print, so every frame is checked up front. Frames have to
+// decode back to back, each block offset has to point at the first frame of its block, and the frames have to end
+// exactly at the end of the frame area.
++ (BOOL)hasValidFramesInData:(NSData*)data {
+	const TFPGCodeContainerHeader *header = data.bytes;
+	const uint8_t *frames = (const uint8_t *)data.bytes + header->framesOffset;
+	const uint64_t *blockOffsets = (const uint64_t *)((const uint8_t *)data.bytes + header->blockOffsetsOffset);
+	uint64_t offset = 0;
+	
+	for(uint64_t i=0; i<header->lineCount; i++) {
+		if(i % linesPerBlock == 0 && blockOffsets[i / linesPerBlock] != offset) {
+			return NO;
+		}
+		
+		TFPPackedGCode packedCode;
+		NSUInteger length = (offset < header->framesLength) ? TFPPackedGCodeDecodeRepetierV2(frames + offset, header->framesLength - offset, &packedCode) : 0;
+		if(!length) {
+			return NO;
+		}
+		offset += length;
+	}
+	return offset == header->framesLength;
+}
+
+
++ (TFPGCodeProgram*)programWithContentsOfURL:(NSURL*)URL options:(TFPGCodeProgramOptions)options error:(NSError**)outError {
+	NSData *data = [NSData dataWithContentsOfURL:URL options:NSDataReadingMappedAlways error:outError];
+	if(!data) {
+		return nil;
+	}
+	
+	const TFPGCodeContainerHeader *header = data.bytes;
+	if(![self isValidHeader:header length:data.length] || ![self hasValidFramesInData:data]) {
+		if(outError) {
+			*outError = [self invalidContainerError];
+		}
+		return nil;
+	}
+	
+	NSData *archive = [data subdataWithRange:NSMakeRange(header->indexOffset, header->indexLength)];
+	NSKeyedUnarchiver *unarchiver = [[NSKeyedUnarchiver alloc] initForReadingWithData:archive];
+	unarchiver.requiresSecureCoding = YES;
+	NSSet *classes = [NSSet setWithObjects:NSDictionary.class, NSArray.class, NSNumber.class, NSString.class, NSValue.class, NSData.class, NSIndexSet.class, TFPPrintLayer.class, nil];
+	
+	NSDictionary *index;
+	@try {
+		index = [unarchiver decodeObjectOfClasses:classes forKey:NSKeyedArchiveRootObjectKey];
+	} @catch(NSException *exception) {
+		TFLog(@"Failed to read G-code container index in %@: %@", URL.lastPathComponent, exception);
+	}
+	if(![index isKindOfClass:[NSDictionary class]]) {
+		if(outError) {
+			*outError = [self invalidContainerError];
+		}
+		return nil;
+	}
+	
+	NSIndexSet *keptCommentLines = (options & TFPGCodeProgramOptionSeparateComments) ? (index[@"keptCommentLines"] ?: [NSIndexSet indexSet]) : nil;
+	TFPGCodeContainerLineArray *lines = [[TFPGCodeContainerLineArray alloc] initWithData:data keptCommentLines:keptCommentLines];
+	TFPGCodeProgram *program = [[TFPGCodeProgram alloc] initWithLines:lines];
+	[program setCachedExecutableLineIndexes:index[@"executableLineIndexes"]];
+	
+	if(keptCommentLines) {
+		NSMutableDictionary *comments = [NSMutableDictionary new];
+		[keptCommentLines enumerateIndexesUsingBlock:^(NSUInteger line, BOOL *stop) {
+			comments[@(line)] = [lines commentForLine:line];
+		}];
+		[program setCachedCommentsByLine:comments];
+	}
+	
+	if([index[@"analysisVersion"] unsignedIntValue] == analysisVersion) {
+		[program setAnalysisResults:[index[@"analysis"] mutableCopy]];
+	}
+	return program;
+}
+
+
+#pragma mark - Writing
+
+
++ (BOOL)writeProgram:(TFPGCodeProgram*)program toURL:(NSURL*)URL error:(NSError**)outError {
+	NSString *directory = URL.path.stringByDeletingLastPathComponent;
+	NSString *temporaryTemplate = [directory stringByAppendingPathComponent:[NSString stringWithFormat:@".%@.XXXXXX", URL.lastPathComponent]];
+	char *temporaryPath = strdup(temporaryTemplate.fileSystemRepresentation);
+	
+	int fileDescriptor = mkstemp(temporaryPath);
+	if(fileDescriptor < 0) {
+		if(outError) {
+			*outError = [NSError errorWithDomain:NSPOSIXErrorDomain code:errno userInfo:nil];
+		}
+		free(temporaryPath);
+		return NO;
+	}
+	fchmod(fileDescriptor, 0644);
+	
+	BOOL success = [self writeProgram:program toFileDescriptor:fileDescriptor];
+	if(success) {
+		success = rename(temporaryPath, URL.fileSystemRepresentation) == 0;
+	}
+	if(!success && outError) {
+		*outError = [NSError errorWithDomain:NSPOSIXErrorDomain code:errno userInfo:nil];
+	}
+	close(fileDescriptor);
+	
+	if(!success) {
+		unlink(temporaryPath);
+	}
+	free(temporaryPath);
+	return success;
+}
+
+
+// Keeps the archive for the end, since it's the only part that isn't written as the lines are walked
++ (NSData*)indexArchiveForProgram:(TFPGCodeProgram*)program keptCommentLines:(NSIndexSet*)keptCommentLines {
+	[program precomputeAnalysis];
+	
+	NSDictionary *analysis;
+	@synchronized(program) {
+		analysis = [program.analysisResults copy];
+	}
+	return [NSKeyedArchiver archivedDataWithRootObject:@{
+		@"analysisVersion": @(analysisVersion),
+		@"analysis": analysis,
+		@"executableLineIndexes": program.executableLineIndexes,
+		@"keptCommentLines": keptCommentLines,
+	}];
+}
+
+
++ (BOOL)writeProgram:(TFPGCodeProgram*)program toFileDescriptor:(int)fileDescriptor {
+	uint64_t start = TFNanosecondTime();
+	NSArray<TFPGCode*> *lines = program.lines;
+	
+	// Programs loaded with separated comments keep the ones that matter outside the lines
+	NSDictionary<NSNumber*, NSString*> *separatedComments = program.cachedCommentsByLine;
+	
+	NSMutableData *frames = [NSMutableData dataWithCapacity:writeBufferSize + TFPRepetierV2MaximumFrameLength];
+	NSMutableData *blockOffsets = [NSMutableData new];
+	NSMutableData *comments = [NSMutableData new];
+	NSMutableData *commentText = [NSMutableData new];
+	NSMutableIndexSet *keptCommentLines = [NSMutableIndexSet indexSet];
+	NSIndexSet *keptLines = [TFPGCodeProgram keptCommentLineIndexesInLines:lines];
+	__block uint64_t framesLength = 0;
+	__block BOOL success = lseek(fileDescriptor, sizeof(TFPGCodeContainerHeader), SEEK_SET) >= 0;
+	
+	BOOL(^flushFrames)(void) = ^{
+		BOOL written = write(fileDescriptor, frames.bytes, frames.length) == (ssize_t)frames.length;
+		frames.length = 0;
+		return written;
+	};
+	
+	[lines enumerateObjectsUsingBlock:^(TFPGCode *code, NSUInteger index, BOOL *stop) {
+		if(index % linesPerBlock == 0) {
+			[blockOffsets appendBytes:&framesLength length:sizeof(framesLength)];
+		}
+		
+		TFPPackedGCode packedCode = code.packedCode;
+		uint8_t frame[TFPRepetierV2MaximumFrameLength];
+		NSUInteger frameLength = TFPPackedGCodeEncodeRepetierV2(&packedCode, frame);
+		[frames appendBytes:frame length:frameLength];
+		framesLength += frameLength;
+		
+		NSString *comment = code.comment;
+		BOOL separated = NO;
+		if(!comment && !code.hasFields) {
+			comment = separatedComments[@(index)];
+			separated = (comment != nil);
+		}
+		if(comment) {
+			NSUInteger length = [comment lengthOfBytesUsingEncoding:NSUTF8StringEncoding];
+			TFPGCodeContainerComment record = {.line = index, .textOffset = commentText.length, .textLength = length};
+			[comments appendBytes:&record length:sizeof(record)];
+			[commentText appendBytes:comment.UTF8String length:length];
+			
+			if(!code.hasFields && comment.length && (separated || [keptLines containsIndex:index])) {
+				[keptCommentLines addIndex:index];
+			}
+		}
+		
+		if(frames.length >= writeBufferSize && !flushFrames()) {
+			success = NO;
+			*stop = YES;
+		}
+	}];
+	
+	success = success && flushFrames();
+	NSData *archive = [self indexArchiveForProgram:program keptCommentLines:keptCommentLines];
+	
+	uint64_t padding = (sizeof(uint64_t) - framesLength % sizeof(uint64_t)) % sizeof(uint64_t);
+	TFPGCodeContainerHeader header = {
+		.magic = containerMagic,
+		.formatVersion = containerFormatVersion,
+		.lineCount = lines.count,
+		.framesOffset = sizeof(TFPGCodeContainerHeader),
+		.framesLength = framesLength,
+		.commentCount = comments.length / sizeof(TFPGCodeContainerComment),
+		.commentTextLength = commentText.length,
+		.indexLength = archive.length,
+	};
+	header.blockOffsetsOffset = header.framesOffset + framesLength + padding;
+	header.commentsOffset = header.blockOffsetsOffset + blockOffsets.length;
+	header.commentTextOffset = header.commentsOffset + comments.length;
+	header.indexOffset = header.commentTextOffset + commentText.length;
+	
+	uint64_t zero = 0;
+	for(NSData *section in @[[NSData dataWithBytes:&zero length:padding], blockOffsets, comments, commentText, archive]) {
+		success = success && write(fileDescriptor, section.bytes, section.length) == (ssize_t)section.length;
+	}
+	success = success && pwrite(fileDescriptor, &header, sizeof(header), 0) == sizeof(header);
+	
+	if(success) {
+		TFLog(@"Wrote %ld lines as a G-code container of %.01f MB in %.02f s", (long)header.lineCount, (double)(header.indexOffset + header.indexLength) / 1e6, (double)(TFNanosecondTime() - start) / NSEC_PER_SEC);
+	}
+	return success;
+}
+
+
+@end
@@ -8,6 +8,7 @@
 
 #import "TFPGCode.h"
 #import "TFPGCodeProgram.h"
+#import "TFPVector.h"
 
 @class TFP3DVector;
 
@@ -60,6 +61,7 @@
 
 @property (readonly) NSInteger layerIndexFromComment;
 
+@property (readonly) TFPVector movement; // X, Y and Z fields
 @property (readonly) TFP3DVector *movementVector;
 @end
 
@@ -72,7 +74,7 @@ typedef NS_ENUM(NSUInteger, TFPPrintPhase) {
 };
 
 
-@interface TFPPrintLayer : NSObject
+@interface TFPPrintLayer : NSObject <NSSecureCoding>
 @property (readonly) NSInteger layerIndex;
 @property (readonly) TFPPrintPhase phase;
 @property (readonly) NSRange lineRange;
@@ -100,7 +102,34 @@ typedef struct {
 } TFPCuboid;
 
 
+// Position tracking behind enumerateMovesWithBlock:, for analysis that streams codes instead of loading a program.
+// Positions are in the printer's coordinates, following G92 like the firmware does.
+typedef struct {
+	TFPAbsolutePosition position;
+	double feedRate;
+	BOOL relativeMode;
+} TFPMoveState;
+
+extern const TFPMoveState TFPMoveStateInitial;
+
+// Returns YES if the code is a move, with from set to the position before it
+extern BOOL TFPMoveStateApplyCode(TFPMoveState *state, TFPGCode *code, TFPAbsolutePosition *from);
+
+
+// Running bounds of extruding moves that lie within a limit, as measured by measureBoundingBoxWithinBox:
+typedef struct {
+	double minX, maxX;
+	double minY, maxY;
+	double minZ, maxZ;
+} TFPExtrusionBounds;
+
+extern const TFPExtrusionBounds TFPExtrusionBoundsEmpty;
+extern void TFPExtrusionBoundsAddMove(TFPExtrusionBounds *bounds, TFPCuboid limit, TFPAbsolutePosition from, TFPAbsolutePosition to);
+extern TFPCuboid TFPExtrusionBoundsCuboid(TFPExtrusionBounds bounds);
+
+
 extern double TFPAbsolutePositionDistance(TFPAbsolutePosition a, TFPAbsolutePosition b);
+extern NSTimeInterval TFPEstimatedMoveDuration(TFPAbsolutePosition from, TFPAbsolutePosition to, double feedRate);
 
 extern BOOL TFPCuboidContainsPosition(TFPCuboid cuboid, TFPAbsolutePosition position);
 extern BOOL TFPCuboidContainsCuboid(TFPCuboid outer, TFPCuboid inner);
@@ -109,20 +138,47 @@ extern TFPCuboid TFPCuboidInfinite;
 extern TFPCuboid TFPCuboidM3DMicroPrintVolumeLower;
 extern TFPCuboid TFPCuboidM3DMicroPrintVolumeUpper;
 
+// Extrusion below the break between the lower and upper print volume is checked against the lower one, and above
+// it against the upper one. If the move extrudes outside, returns YES with outPosition set to the endpoint outside.
+extern BOOL TFPMoveLeavesM3DMicroPrintableVolume(TFPAbsolutePosition from, TFPAbsolutePosition to, TFPAbsolutePosition *outPosition);
+
 extern double TFPBoundedTemperature(double temperature);
 extern BOOL TFPTemperatureWithinBounds(double temperature);
 
+
+@interface TFPPrintableVolumeViolation : NSObject
+@property (readonly) NSUInteger lineIndex;
+@property (readonly) NSInteger layerIndex; // NSNotFound if the line comes before the first layer
+@property (readonly) TFPAbsolutePosition position;
+@end
+
+
 @interface TFPGCodeProgram (TFPHelpers)
 - (TFPCuboid)measureBoundingBoxWithinBox:(TFPCuboid)limit;
 - (TFPCuboid)measureBoundingBox;
 - (BOOL)withinM3DMicroPrintableVolume;
 
+// Extruding moves outside the Micro's print volume, in line order. The pass stops after the first few, so this is
+// where the print starts going wrong, not every move that does.
+- (NSArray<TFPPrintableVolumeViolation*> *)findPrintableVolumeViolations;
+
 - (void)enumerateMovesWithBlock:(void(^)(TFPAbsolutePosition from, TFPAbsolutePosition to, double feedRate, TFPGCode *code, NSUInteger index))block;
 
+// Returns the estimated total duration. If lineDurations is non-NULL, it needs room for lines.count values.
+- (NSTimeInterval)estimateDurationWithLineDurations:(double *)lineDurations;
+
 - (BOOL)validateForM3D:(NSError**)error;
++ (NSIndexSet*)validM3DGValues;
++ (NSIndexSet*)validM3DMValues;
 
 // Keys are TFPPrintPhases; values are NSRanges
 - (NSDictionary <NSNumber*, NSValue*> *)determinePhaseRanges;
 
 - (NSArray <TFPPrintLayer*> *)determineLayers;
+
+// SHA-256 of the ASCII representation, in lowercase hex
+- (NSString*)contentHash;
+
+// Runs every memoized pass above, so later calls return immediately
+- (void)precomputeAnalysis;
 @end
\ No newline at end of file
@@ -50,15 +50,16 @@
 
 + (instancetype)moveWithPosition:(TFP3DVector*)position extrusion:(NSNumber*)E feedRate:(double)F {
 	TFPGCode *code = [TFPGCode codeWithString:@"G0"];
+	TFPVector vector = position.vector;
 	
-	if(position.x) {
-		code = [code codeBySettingField:'X' toValue:position.x.doubleValue];
+	if(vector.fields & TFPVectorFieldX) {
+		code = [code codeBySettingField:'X' toValue:vector.x];
 	}
-	if(position.y) {
-		code = [code codeBySettingField:'Y' toValue:position.y.doubleValue];
+	if(vector.fields & TFPVectorFieldY) {
+		code = [code codeBySettingField:'Y' toValue:vector.y];
 	}
-	if(position.z) {
-		code = [code codeBySettingField:'Z' toValue:position.z.doubleValue];
+	if(vector.fields & TFPVectorFieldZ) {
+		code = [code codeBySettingField:'Z' toValue:vector.z];
 	}
 	if(E) {
 		code = [code codeBySettingField:'E' toValue:E.doubleValue];
@@ -195,8 +196,14 @@
 }
 
 
+- (TFPVector)movement {
+	TFPVectorFields fields = ([self hasField:'X'] ? TFPVectorFieldX : 0) | ([self hasField:'Y'] ? TFPVectorFieldY : 0) | ([self hasField:'Z'] ? TFPVectorFieldZ : 0);
+	return (TFPVector){[self valueForField:'X' fallback:0], [self valueForField:'Y' fallback:0], [self valueForField:'Z' fallback:0], fields};
+}
+
+
 - (TFP3DVector*)movementVector {
-	return [TFP3DVector vectorWithX:[self numberForField:'X'] Y:[self numberForField:'Y'] Z:[self numberForField:'Z']];
+	return [TFP3DVector vectorWithVector:self.movement];
 }
 
 
@@ -226,6 +233,34 @@
 }
 
 
++ (BOOL)supportsSecureCoding {
+	return YES;
+}
+
+
+- (instancetype)initWithCoder:(NSCoder *)decoder {
+	if(!(self = [super init])) return nil;
+	
+	self.layerIndex = [decoder decodeIntegerForKey:@"layerIndex"];
+	self.phase = [decoder decodeIntegerForKey:@"phase"];
+	self.lineRange = NSMakeRange([decoder decodeIntegerForKey:@"lineLocation"], [decoder decodeIntegerForKey:@"lineLength"]);
+	self.minZ = [decoder decodeDoubleForKey:@"minZ"];
+	self.maxZ = [decoder decodeDoubleForKey:@"maxZ"];
+	
+	return self;
+}
+
+
+- (void)encodeWithCoder:(NSCoder *)coder {
+	[coder encodeInteger:self.layerIndex forKey:@"layerIndex"];
+	[coder encodeInteger:self.phase forKey:@"phase"];
+	[coder encodeInteger:self.lineRange.location forKey:@"lineLocation"];
+	[coder encodeInteger:self.lineRange.length forKey:@"lineLength"];
+	[coder encodeDouble:self.minZ forKey:@"minZ"];
+	[coder encodeDouble:self.maxZ forKey:@"maxZ"];
+}
+
+
 - (NSString *)description {
 	NSArray *phases = @[@"invalid", @"preamble", @"adhesion", @"model", @"postamble"];
 	return [NSString stringWithFormat:@"Layer %ld (%@), lines %d - %d, Z %.02f - %.02f",
@@ -238,12 +273,192 @@
 @end
 
 
+@interface TFPPrintableVolumeViolation ()
+@property (readwrite) NSUInteger lineIndex;
+@property (readwrite) NSInteger layerIndex;
+@property (readwrite) TFPAbsolutePosition position;
+@end
+
+
+@implementation TFPPrintableVolumeViolation
+
+
+- (NSString *)description {
+	return [NSString stringWithFormat:@"Line %d, layer %ld: X %.02f, Y %.02f, Z %.02f",
+			(int)self.lineIndex+1, (long)self.layerIndex, self.position.x, self.position.y, self.position.z];
+}
+
+
+@end
+
+
 double TFPAbsolutePositionDistance(TFPAbsolutePosition a, TFPAbsolutePosition b) {
 	return sqrt(pow(a.x - b.x, 2) + pow(a.y - b.y, 2) + pow(a.z - b.z, 2));
 
 }
 
 
+NSTimeInterval TFPEstimatedMoveDuration(TFPAbsolutePosition from, TFPAbsolutePosition to, double feedRate) {
+	if(feedRate < DBL_EPSILON) {
+		return 0;
+	}
+	
+	double distance = TFPAbsolutePositionDistance(from, to);
+	if(distance < DBL_EPSILON) {
+		distance = fabs(to.e - from.e);
+	}
+	return distance / (feedRate / 60.0);
+}
+
+
+const TFPMoveState TFPMoveStateInitial = {.position = {0,0,0,0}, .feedRate = 0, .relativeMode = NO};
+
+
+BOOL TFPMoveStateApplyCode(TFPMoveState *state, TFPGCode *code, TFPAbsolutePosition *from) {
+	if(![code hasField:'G']) {
+		return NO;
+	}
+	
+	switch ((int)[code valueForField:'G']) {
+		case 0:
+		case 1: {
+			BOOL extruding = [code hasField:'E'] && !isnan([code valueForField:'E']);
+			*from = state->position;
+			
+			if([code hasField:'F']) {
+				state->feedRate = [code valueForField:'F'];
+			}
+			
+			if(extruding) {
+				double thisE = [code valueForField:'E'];
+				if(state->relativeMode) {
+					state->position.e += thisE;
+				}else{
+					state->position.e = thisE;
+				}
+			}
+			
+			if([code hasField:'X']) {
+				double thisX = [code valueForField:'X'];
+				if(state->relativeMode) {
+					state->position.x += thisX;
+				}else{
+					state->position.x = thisX;
+				}
+			}
+			
+			if([code hasField:'Y']) {
+				double thisY = [code valueForField:'Y'];
+				if(state->relativeMode) {
+					state->position.y += thisY;
+				}else{
+					state->position.y = thisY;
+				}
+			}
+			
+			if([code hasField:'Z']) {
+				double thisZ = [code valueForField:'Z'];
+				if(state->relativeMode) {
+					state->position.z += thisZ;
+				}else{
+					state->position.z = thisZ;
+				}
+			}
+			
+			return YES;
+		}
+		
+		case 90:
+			state->relativeMode = NO;
+			break;
+		
+		case 91:
+			state->relativeMode = YES;
+			break;
+		
+		case 92: {
+			// Redefines the current position without moving, like the printer does. Without axes, all of them become 0.
+			BOOL hasAxis = [code hasField:'X'] || [code hasField:'Y'] || [code hasField:'Z'] || [code hasField:'E'];
+			if(!hasAxis || [code hasField:'X']) {
+				state->position.x = [code valueForField:'X' fallback:0];
+			}
+			if(!hasAxis || [code hasField:'Y']) {
+				state->position.y = [code valueForField:'Y' fallback:0];
+			}
+			if(!hasAxis || [code hasField:'Z']) {
+				state->position.z = [code valueForField:'Z' fallback:0];
+			}
+			if(!hasAxis || [code hasField:'E']) {
+				state->position.e = [code valueForField:'E' fallback:0];
+			}
+			break;
+		}
+	}
+	return NO;
+}
+
+
+const TFPExtrusionBounds TFPExtrusionBoundsEmpty = {.minX = 10000, .maxX = 0, .minY = 10000, .maxY = 0, .minZ = 10000, .maxZ = 0};
+
+
+void TFPExtrusionBoundsAddMove(TFPExtrusionBounds *bounds, TFPCuboid limit, TFPAbsolutePosition from, TFPAbsolutePosition to) {
+	if(to.e > from.e) {
+		if(TFPCuboidContainsPosition(limit, from) && TFPCuboidContainsPosition(limit, to)) {
+			bounds->minX = MIN(MIN(bounds->minX, from.x), to.x);
+			bounds->maxX = MAX(MAX(bounds->maxX, from.x), to.x);
+			
+			bounds->minY = MIN(MIN(bounds->minY, from.y), to.y);
+			bounds->maxY = MAX(MAX(bounds->maxY, from.y), to.y);
+			
+			bounds->minZ = MIN(MIN(bounds->minZ, from.z), to.z);
+			bounds->maxZ = MAX(MAX(bounds->maxZ, from.z), to.z);
+		}
+	}
+}
+
+
+TFPCuboid TFPExtrusionBoundsCuboid(TFPExtrusionBounds bounds) {
+	return (TFPCuboid) {
+		.x = bounds.minX,
+		.y = bounds.minY,
+		.z = bounds.minZ,
+		.xSize = bounds.maxX-bounds.minX,
+		.ySize = bounds.maxY-bounds.minY,
+		.zSize = bounds.maxZ-bounds.minZ
+	};
+}
+
+
+// Moves on the break itself have to fit both volumes. Moves across it aren't checked.
+BOOL TFPMoveLeavesM3DMicroPrintableVolume(TFPAbsolutePosition from, TFPAbsolutePosition to, TFPAbsolutePosition *outPosition) {
+	if(!(to.e > from.e)) {
+		return NO;
+	}
+	
+	double breakZ = TFPCuboidM3DMicroPrintVolumeUpper.z;
+	TFPCuboid volumes[2];
+	NSUInteger volumeCount = 0;
+	if(from.z <= breakZ && to.z <= breakZ) {
+		volumes[volumeCount++] = TFPCuboidM3DMicroPrintVolumeLower;
+	}
+	if(from.z >= breakZ && to.z >= breakZ) {
+		volumes[volumeCount++] = TFPCuboidM3DMicroPrintVolumeUpper;
+	}
+	
+	for(NSUInteger i=0; i<volumeCount; i++) {
+		if(!TFPCuboidContainsPosition(volumes[i], from)) {
+			*outPosition = from;
+			return YES;
+		}
+		if(!TFPCuboidContainsPosition(volumes[i], to)) {
+			*outPosition = to;
+			return YES;
+		}
+	}
+	return NO;
+}
+
+
 BOOL TFPCuboidContainsPosition(TFPCuboid cuboid, TFPAbsolutePosition position) {
 	return	position.x >= cuboid.x && position.x <= cuboid.x+cuboid.xSize &&
 			position.y >= cuboid.y && position.y <= cuboid.y+cuboid.ySize &&
@@ -282,133 +497,140 @@ double TFPBoundedTemperature(double temperature) {
 
 
 
+static NSString *const TFPAnalysisBoundingBoxKey = @"boundingBox";
+static NSString *const TFPAnalysisPrintableVolumeViolationsKey = @"printableVolumeViolations";
+static NSString *const TFPAnalysisDurationKey = @"duration";
+static NSString *const TFPAnalysisIncompatibleLineKey = @"incompatibleLine";
+static NSString *const TFPAnalysisPhaseRangesKey = @"phaseRanges";
+static NSString *const TFPAnalysisLayersKey = @"layers";
+static NSString *const TFPAnalysisContentHashKey = @"contentHash";
+
+static const NSUInteger maximumReportedVolumeViolations = 10;
+
+
+
 @implementation TFPGCodeProgram (TFPHelpers)
 
 
 - (BOOL)withinM3DMicroPrintableVolume {
-	TFPCuboid infiniteXYBelowBreak = {.x = -10000, .xSize = 20000, .y = -10000, .ySize = 20000, .z = -10000, .zSize = 10000 + TFPCuboidM3DMicroPrintVolumeUpper.z};
-	TFPCuboid infiniteXYAboveBreak = {.x = -10000, .xSize = 20000, .y = -10000, .ySize = 20000, .z = TFPCuboidM3DMicroPrintVolumeUpper.z, .zSize = 10000};
-	
-	TFPCuboid boundingBoxBelowBreak = [self measureBoundingBoxWithinBox:infiniteXYBelowBreak];
-	TFPCuboid boundingBoxAboveBreak = [self measureBoundingBoxWithinBox:infiniteXYAboveBreak];
-	
-	BOOL withinLower = TFPCuboidContainsCuboid(TFPCuboidM3DMicroPrintVolumeLower, boundingBoxBelowBreak);
-	BOOL withinUpper = TFPCuboidContainsCuboid(TFPCuboidM3DMicroPrintVolumeUpper, boundingBoxAboveBreak);
+	return [self measurePrintableVolumeViolations].count == 0;
+}
+
+
+- (NSArray<TFPPrintableVolumeViolation*> *)findPrintableVolumeViolations {
+	NSArray<TFPPrintLayer*> *layers = [self determineLayers];
 	
-	return withinLower && withinUpper;
+	return [[self measurePrintableVolumeViolations] tf_mapWithBlock:^TFPPrintableVolumeViolation*(NSArray<NSNumber*> *values) {
+		TFPPrintableVolumeViolation *violation = [TFPPrintableVolumeViolation new];
+		violation.lineIndex = values[0].unsignedIntegerValue;
+		violation.position = (TFPAbsolutePosition){.x = values[1].doubleValue, .y = values[2].doubleValue, .z = values[3].doubleValue};
+		violation.layerIndex = [self.class layerIndexForLine:violation.lineIndex inLayers:layers];
+		return violation;
+	}];
+}
+
+
++ (NSInteger)layerIndexForLine:(NSUInteger)line inLayers:(NSArray<TFPPrintLayer*> *)layers {
+	NSUInteger lower = 0, upper = layers.count;
+	while(lower < upper) {
+		NSUInteger middle = (lower + upper) / 2;
+		if(layers[middle].lineRange.location <= line) {
+			lower = middle + 1;
+		}else{
+			upper = middle;
+		}
+	}
+	return lower > 0 ? layers[lower-1].layerIndex : NSNotFound;
+}
+
+
+// A single pass that stops after maximumReportedVolumeViolations. Stored as [line, x, y, z] arrays, like the
+// bounding box, so they can be archived.
+- (NSArray<NSArray<NSNumber*>*> *)measurePrintableVolumeViolations {
+	return [self analysisResultForKey:TFPAnalysisPrintableVolumeViolationsKey computedWithBlock:^id{
+		NSMutableArray *violations = [NSMutableArray new];
+		TFPMoveState state = TFPMoveStateInitial;
+		NSUInteger index = 0;
+		
+		for(TFPGCode *code in self.lines) {
+			TFPAbsolutePosition from, outside;
+			if(TFPMoveStateApplyCode(&state, code, &from) && TFPMoveLeavesM3DMicroPrintableVolume(from, state.position, &outside)) {
+				[violations addObject:@[@(index), @(outside.x), @(outside.y), @(outside.z)]];
+				if(violations.count >= maximumReportedVolumeViolations) {
+					break;
+				}
+			}
+			index++;
+		}
+		return violations;
+	}];
 }
 
 
 - (TFPCuboid)measureBoundingBoxWithinBox:(TFPCuboid)limit {
-	__block double minX = 10000, maxX = 0;
-	__block double minY = 10000, maxY = 0;
-	__block double minZ = 10000, maxZ = 0;
+	__block TFPExtrusionBounds bounds = TFPExtrusionBoundsEmpty;
 	
 	[self enumerateMovesWithBlock:^(TFPAbsolutePosition from, TFPAbsolutePosition to, double feedRate, TFPGCode *code, NSUInteger index) {
-		if(to.e > from.e) {
-			if(TFPCuboidContainsPosition(limit, from) && TFPCuboidContainsPosition(limit, to)) {
-				minX = MIN(MIN(minX, from.x), to.x);
-				maxX = MAX(MAX(maxX, from.x), to.x);
-				
-				minY = MIN(MIN(minY, from.y), to.y);
-				maxY = MAX(MAX(maxY, from.y), to.y);
-				
-				minZ = MIN(MIN(minZ, from.z), to.z);
-				maxZ = MAX(MAX(maxZ, from.z), to.z);
-			}
-		}
+		TFPExtrusionBoundsAddMove(&bounds, limit, from, to);
 	}];
 	
-	return (TFPCuboid) {
-		.x = minX,
-		.y = minY,
-		.z = minZ,
-		.xSize = maxX-minX,
-		.ySize = maxY-minY,
-		.zSize = maxZ-minZ
-	};
+	return TFPExtrusionBoundsCuboid(bounds);
 }
 
 
+// Stored as an array rather than an NSValue, since keyed archiving doesn't handle arbitrary structs
 - (TFPCuboid)measureBoundingBox {
-	return [self measureBoundingBoxWithinBox:TFPCuboidInfinite];
+	NSArray<NSNumber*> *values = [self analysisResultForKey:TFPAnalysisBoundingBoxKey computedWithBlock:^id{
+		TFPCuboid box = [self measureBoundingBoxWithinBox:TFPCuboidInfinite];
+		return @[@(box.x), @(box.y), @(box.z), @(box.xSize), @(box.ySize), @(box.zSize)];
+	}];
+	
+	return (TFPCuboid){
+		.x = values[0].doubleValue, .y = values[1].doubleValue, .z = values[2].doubleValue,
+		.xSize = values[3].doubleValue, .ySize = values[4].doubleValue, .zSize = values[5].doubleValue,
+	};
 }
 
 
 
 - (void)enumerateMovesWithBlock:(void(^)(TFPAbsolutePosition from, TFPAbsolutePosition to, double feedRate, TFPGCode *code, NSUInteger index))block {
-	__block BOOL relativeMode = NO;
-	__block TFPAbsolutePosition position = {0,0,0,0};
-	__block double feedRate = 0;
+	__block TFPMoveState state = TFPMoveStateInitial;
 	
 	[self.lines enumerateObjectsUsingBlock:^(TFPGCode *code, NSUInteger index, BOOL *stop) {
-		if(![code hasField:'G']) {
-			return;
+		TFPAbsolutePosition from;
+		if(TFPMoveStateApplyCode(&state, code, &from)) {
+			block(from, state.position, state.feedRate, code, index);
 		}
-		
-		switch ((int)[code valueForField:'G']) {
-			case 0:
-			case 1: {
-				BOOL extruding = [code hasField:'E'] && !isnan([code valueForField:'E']);
-				TFPAbsolutePosition previous = position;
-				
-				if([code hasField:'F']) {
-					feedRate = [code valueForField:'F'];
-				}
-				
-				if(extruding) {
-					double thisE = [code valueForField:'E'];
-					if(relativeMode) {
-						position.e += thisE;
-					}else{
-						position.e = thisE;
-					}
-				}
-				
-				if([code hasField:'X']) {
-					double thisX = [code valueForField:'X'];
-					if(relativeMode) {
-						position.x += thisX;
-					}else{
-						position.x = thisX;
-					}
-				}
-				
-				if([code hasField:'Y']) {
-					double thisY = [code valueForField:'Y'];
-					if(relativeMode) {
-						position.y += thisY;
-					}else{
-						position.y = thisY;
-					}
-				}
-				
-				if([code hasField:'Z']) {
-					double thisZ = [code valueForField:'Z'];
-					if(relativeMode) {
-						position.z += thisZ;
-					}else{
-						position.z = thisZ;
-					}
-				}
-				
-				block(previous, position, feedRate, code, index);
-				break;
-			}
-    
-			case 90:
-				relativeMode = NO;
-				break;
-				
-			case 91:
-				relativeMode = YES;
-				break;
-				
-			case 92:
-				break;
+	}];
+}
+
+
+- (NSTimeInterval)estimateDurationWithLineDurations:(double *)lineDurations {
+	if(!lineDurations) {
+		return [[self analysisResultForKey:TFPAnalysisDurationKey computedWithBlock:^id{
+			return @([self measureDurationWithLineDurations:NULL]);
+		}] doubleValue];
+	}
+	return [self measureDurationWithLineDurations:lineDurations];
+}
+
+
+- (NSTimeInterval)measureDurationWithLineDurations:(double *)lineDurations {
+	__block NSTimeInterval total = 0;
+	
+	if(lineDurations) {
+		memset(lineDurations, 0, sizeof(double) * self.lines.count);
+	}
+	
+	[self enumerateMovesWithBlock:^(TFPAbsolutePosition from, TFPAbsolutePosition to, double feedRate, TFPGCode *code, NSUInteger index) {
+		NSTimeInterval duration = TFPEstimatedMoveDuration(from, to, feedRate);
+		if(lineDurations) {
+			lineDurations[index] = duration;
 		}
+		total += duration;
 	}];
 	
+	return total;
 }
 
 
@@ -425,11 +647,31 @@ double TFPBoundedTemperature(double temperature) {
 }
 
 
+// Only the line of the incompatible code is memoized; the error is recreated from it
 - (BOOL)validateForM3D:(NSError**)outError {
+	NSUInteger incompatibleLine = [[self analysisResultForKey:TFPAnalysisIncompatibleLineKey computedWithBlock:^id{
+		return @([self findIncompatibleLine]);
+	}] unsignedIntegerValue];
+	
+	if(incompatibleLine == NSNotFound) {
+		return YES;
+	}
+	
+	if(outError) {
+		TFPGCode *code = self.lines[incompatibleLine];
+		NSString *errorString = [NSString stringWithFormat:@"File contains G-code that is incompatible with the M3D Micro at line %d:\n%@", (int)incompatibleLine+1, code];
+		
+		*outError = [NSError errorWithDomain:TFPErrorDomain code:TFPErrorCodeIncompatibleCode userInfo:@{NSLocalizedRecoverySuggestionErrorKey: errorString, TFPErrorGCodeKey: code, TFPErrorGCodeLineKey: @(incompatibleLine+1)}];
+	}
+	return NO;
+}
+
+
+// Returns the last incompatible line, or NSNotFound
+- (NSUInteger)findIncompatibleLine {
 	NSIndexSet *Gset = [self.class validM3DGValues];
 	NSIndexSet *Mset = [self.class validM3DMValues];
-	__block BOOL valid = YES;
-	__block NSError *error;
+	__block NSUInteger incompatibleLine = NSNotFound;
 	
 	[self.lines enumerateObjectsUsingBlock:^(TFPGCode *code, NSUInteger index, BOOL *stop) {
 		if(code.hasFields) {
@@ -437,24 +679,23 @@ double TFPBoundedTemperature(double temperature) {
 			NSInteger M = [code valueForField:'M' fallback:-1];
 			
 			if((G > -1 && ![Gset containsIndex:G]) || (M > -1 && ![Mset containsIndex:M])) {
-				NSString *errorString = [NSString stringWithFormat:@"File contains G-code that is incompatible with the M3D Micro at line %d:\n%@", (int)index+1, code];
-					
-				error = [NSError errorWithDomain:TFPErrorDomain code:TFPErrorCodeIncompatibleCode userInfo:@{NSLocalizedRecoverySuggestionErrorKey: errorString, TFPErrorGCodeKey: code, TFPErrorGCodeLineKey: @(index+1)}];
-				
-				valid = NO;
+				incompatibleLine = index;
 			}
 		}
 	}];
 	
-	if(!valid && outError) {
-		*outError = error;
-	}
-	
-	return valid;
+	return incompatibleLine;
 }
 
 
 - (NSDictionary <NSNumber*, NSValue*> *)determinePhaseRanges {
+	return [self analysisResultForKey:TFPAnalysisPhaseRangesKey computedWithBlock:^id{
+		return [self measurePhaseRanges];
+	}];
+}
+
+
+- (NSDictionary <NSNumber*, NSValue*> *)measurePhaseRanges {
 	__block TFPPrintPhase phase = TFPPrintPhaseInvalid;
 	__block NSUInteger startLine = 0;
 	NSMutableDictionary <NSNumber*, NSValue*> *phaseRanges = [NSMutableDictionary new];
@@ -493,6 +734,13 @@ double TFPBoundedTemperature(double temperature) {
 
 
 - (NSArray <TFPPrintLayer*> *)determineLayers {
+	return [self analysisResultForKey:TFPAnalysisLayersKey computedWithBlock:^id{
+		return [self measureLayers];
+	}];
+}
+
+
+- (NSArray <TFPPrintLayer*> *)measureLayers {
 	NSMutableArray *layers = [NSMutableArray new];
 	__block TFPPrintLayer *currentLayer;
 	
@@ -534,4 +782,21 @@ double TFPBoundedTemperature(double temperature) {
 }
 
 
+- (NSString*)contentHash {
+	return [self analysisResultForKey:TFPAnalysisContentHashKey computedWithBlock:^id{
+		return [self.ASCIIRepresentation dataUsingEncoding:NSUTF8StringEncoding].tf_SHA256String;
+	}];
+}
+
+
+- (void)precomputeAnalysis {
+	[self measureBoundingBox];
+	[self withinM3DMicroPrintableVolume];
+	[self estimateDurationWithLineDurations:NULL];
+	[self validateForM3D:NULL];
+	[self determinePhaseRanges];
+	[self determineLayers];
+}
+
+
 @end
\ No newline at end of file
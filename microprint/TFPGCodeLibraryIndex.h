@@ -0,0 +1,51 @@
+//
+//  TFPGCodeLibraryIndex.h
+//  microprint
+//
+//
+
+#import <Foundation/Foundation.h>
+#import "TFPGCodeHelpers.h"
+
+
+// What a G-code file will print, measured without loading it as a program
+@interface TFPGCodeFileSummary : NSObject
+@property (readonly, copy) NSURL *fileURL;
+@property (readonly) uint64_t fileSize;
+@property (readonly) NSDate *modificationDate;
+@property (readonly, copy) NSString *contentHash; // SHA-256
+
+@property (readonly, copy) NSString *slicer; // "Cura", "Slic3r" or "Simplify3D"; nil without a profile
+@property (readonly, copy) NSDictionary<NSString*, NSString*> *profileValues; // Keyed like the print settings, e.g. "Layer Height"
+
+@property (readonly) double layerHeight; // From the profile, or measured between layers. 0 if unknown.
+@property (readonly) NSUInteger layerCount; // Model layers, not counting adhesion
+@property (readonly) TFPCuboid boundingBox;
+@property (readonly) double width; // X, Y and Z sizes of the bounding box, for predicates
+@property (readonly) double depth;
+@property (readonly) double height;
+
+@property (readonly) BOOL compatible; // Parses, and only uses codes the M3D Micro supports
+@property (readonly) BOOL fitsPrintableVolume;
+@property (readonly) double filamentLength; // mm
+@property (readonly) NSTimeInterval estimatedDuration;
+@end
+
+
+// Summaries of the G-code files in directory trees, for picking jobs without opening every file. Files are
+// analyzed in parallel, each with head and tail sampling for the slicer profile and one streaming pass for
+// everything else. The index is saved after each scan, and later scans only analyze files that changed.
+@interface TFPGCodeLibraryIndex : NSObject
+- (instancetype)initWithIndexURL:(NSURL*)URL; // Loads the index at URL, if any. A nil URL keeps it in memory only.
+
+// Summarizes new and changed .gcode and .gcode.gz files under the directory and drops ones that are gone.
+// Files with a new modification date but the same contents keep their summary. The handler is called on the main queue.
+- (void)scanDirectoryAtURL:(NSURL*)URL completionHandler:(void(^)(NSUInteger analyzedFileCount))completionHandler;
+
+@property (readonly, copy) NSArray<TFPGCodeFileSummary*> *summaries; // Sorted by path
+- (NSArray<TFPGCodeFileSummary*> *)summariesMatchingPredicate:(NSPredicate*)predicate;
+- (TFPGCodeFileSummary*)summaryForFileAtURL:(NSURL*)URL;
+- (BOOL)hasFilesInDirectoryAtURL:(NSURL*)URL; // Directly in the directory, not in subdirectories
+
++ (BOOL)isGCodeFileName:(NSString*)name; // .gcode, or .gcode.gz for compressed files
+@end
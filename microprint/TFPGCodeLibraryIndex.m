@@ -0,0 +1,488 @@
+//
+//  TFPGCodeLibraryIndex.m
+//  microprint
+//
+//
+
+#import "TFPGCodeLibraryIndex.h"
+#import "TFPGCode.h"
+#import "TFPGCodeProgram.h"
+#import "TFPSlicerProfile.h"
+#import "TFPGCodeLineReader.h"
+#import "TFPExtras.h"
+
+
+static const NSInteger indexFormatVersion = 2;
+
+// Slicers put their profile at the start or the end of the file
+static const NSUInteger profileSampleSize = 256 * 1024;
+
+
+static NSArray<NSString*> *TFPGCodeFileSummaryProfileKeys(void) {
+	return @[@"Layer Height", @"Wall Thickness", @"Fill Density", @"Bed Adhesion", @"Support", @"Print Speed"];
+}
+
+
+
+@interface TFPGCodeFileSummary ()
+@property (readwrite, copy) NSURL *fileURL;
+@property (readwrite) uint64_t fileSize;
+@property (readwrite) NSDate *modificationDate;
+@property (readwrite, copy) NSString *contentHash;
+
+@property (readwrite, copy) NSString *slicer;
+@property (readwrite, copy) NSDictionary<NSString*, NSString*> *profileValues;
+
+@property (readwrite) double layerHeight;
+@property (readwrite) NSUInteger layerCount;
+@property (readwrite) TFPCuboid boundingBox;
+
+@property (readwrite) BOOL compatible;
+@property (readwrite) BOOL fitsPrintableVolume;
+@property (readwrite) double filamentLength;
+@property (readwrite) NSTimeInterval estimatedDuration;
+@end
+
+
+
+@implementation TFPGCodeFileSummary
+
+
+- (instancetype)initWithEncodedValues:(NSDictionary*)values {
+	if(!(self = [super init])) return nil;
+	
+	NSString *path = values[@"path"];
+	NSArray<NSNumber*> *box = values[@"boundingBox"];
+	if(![path isKindOfClass:[NSString class]] || ![box isKindOfClass:[NSArray class]] || box.count != 6) {
+		return nil;
+	}
+	
+	self.fileURL = [NSURL fileURLWithPath:path];
+	self.fileSize = [values[@"fileSize"] unsignedLongLongValue];
+	self.modificationDate = values[@"modificationDate"];
+	self.contentHash = values[@"contentHash"];
+	
+	self.slicer = values[@"slicer"];
+	self.profileValues = values[@"profileValues"];
+	
+	self.layerHeight = [values[@"layerHeight"] doubleValue];
+	self.layerCount = [values[@"layerCount"] unsignedIntegerValue];
+	self.boundingBox = (TFPCuboid){
+		.x = box[0].doubleValue, .y = box[1].doubleValue, .z = box[2].doubleValue,
+		.xSize = box[3].doubleValue, .ySize = box[4].doubleValue, .zSize = box[5].doubleValue,
+	};
+	
+	self.compatible = [values[@"compatible"] boolValue];
+	self.fitsPrintableVolume = [values[@"fitsPrintableVolume"] boolValue];
+	self.filamentLength = [values[@"filamentLength"] doubleValue];
+	self.estimatedDuration = [values[@"estimatedDuration"] doubleValue];
+	
+	return self;
+}
+
+
+- (NSDictionary*)encodedValues {
+	TFPCuboid box = self.boundingBox;
+	NSMutableDictionary *values = [@{@"path": self.fileURL.path,
+									 @"fileSize": @(self.fileSize),
+									 @"modificationDate": self.modificationDate ?: [NSDate distantPast],
+									 @"contentHash": self.contentHash ?: @"",
+									 @"layerHeight": @(self.layerHeight),
+									 @"layerCount": @(self.layerCount),
+									 @"boundingBox": @[@(box.x), @(box.y), @(box.z), @(box.xSize), @(box.ySize), @(box.zSize)],
+									 @"compatible": @(self.compatible),
+									 @"fitsPrintableVolume": @(self.fitsPrintableVolume),
+									 @"filamentLength": @(self.filamentLength),
+									 @"estimatedDuration": @(self.estimatedDuration),
+									 } mutableCopy];
+	values[@"slicer"] = self.slicer;
+	values[@"profileValues"] = self.profileValues;
+	return values;
+}
+
+
+- (double)width {
+	return self.boundingBox.xSize;
+}
+
+
+- (double)depth {
+	return self.boundingBox.ySize;
+}
+
+
+- (double)height {
+	return self.boundingBox.zSize;
+}
+
+
+- (NSString *)description {
+	return [NSString stringWithFormat:@"<%@ %@: %ld layers of %.02f mm, %.0f x %.0f x %.0f mm, %.0f mm filament, %.0f s>",
+			self.class, self.fileURL.lastPathComponent, (long)self.layerCount, self.layerHeight,
+			self.width, self.depth, self.height, self.filamentLength, self.estimatedDuration];
+}
+
+
+#pragma mark - Analysis
+
+
+- (instancetype)initWithFileURL:(NSURL*)URL fileSize:(uint64_t)fileSize contentHash:(NSString*)hash {
+	if(!(self = [super init])) return nil;
+	
+	self.fileURL = URL;
+	self.fileSize = fileSize;
+	self.contentHash = hash;
+	
+	[self analyzeFileAtURL:URL];
+	
+	return self;
+}
+
+
+- (void)readProfileFromLines:(NSArray<TFPGCode*> *)lines {
+	TFPSlicerProfile *profile = [[TFPSlicerProfile alloc] initFromLines:lines];
+	if(!profile) {
+		return;
+	}
+	
+	NSArray *slicerNames = @[@"Cura", @"Slic3r", @"Simplify3D"];
+	self.slicer = slicerNames[profile.profileType];
+	
+	NSMutableDictionary *values = [NSMutableDictionary new];
+	for(NSString *key in TFPGCodeFileSummaryProfileKeys()) {
+		id value = [profile valueForKey:key];
+		if(value) {
+			values[key] = [value description];
+		}
+	}
+	self.profileValues = values;
+}
+
+
+// Same measurements as the TFPGCodeProgram helpers, in a single streaming pass. Compressed files are inflated
+// on the way, so the profile is sampled from whole lines at the start and the end of the text rather than the file.
+- (void)analyzeFileAtURL:(NSURL*)URL {
+	NSIndexSet *validG = [TFPGCodeProgram validM3DGValues];
+	NSIndexSet *validM = [TFPGCodeProgram validM3DMValues];
+	
+	__block TFPMoveState state = TFPMoveStateInitial;
+	__block TFPExtrusionBounds bounds = TFPExtrusionBoundsEmpty;
+	__block BOOL fitsPrintableVolume = YES;
+	__block NSTimeInterval duration = 0;
+	__block double filamentLength = 0;
+	__block BOOL compatible = YES;
+	__block BOOL parsed = YES;
+	NSMutableArray<NSNumber*> *layerZ = [NSMutableArray new];
+	
+	NSMutableArray<TFPGCode*> *headLines = [NSMutableArray new];
+	NSMutableArray<TFPGCode*> *tailLines = [NSMutableArray new];
+	NSMutableArray<NSNumber*> *tailLineSizes = [NSMutableArray new];
+	__block NSUInteger headSize = 0;
+	__block NSUInteger tailSize = 0;
+	
+	BOOL read = [TFPGCodeLineReader enumerateLinesInFileAtURL:URL error:nil usingBlock:^(NSString *line, BOOL *stop) {
+		TFPGCode *code = [TFPGCode codeWithString:line];
+		if(!code) {
+			TFLog(@"Failed to parse line in %@: %@", URL.lastPathComponent, line);
+			parsed = NO;
+			*stop = YES;
+			return;
+		}
+		
+		// Lines fill the head sample first; after that, the tail keeps the latest ones that fit
+		NSUInteger size = line.length + 1;
+		if(headSize + size <= profileSampleSize && !tailLines.count) {
+			[headLines addObject:code];
+			headSize += size;
+		}else{
+			[tailLines addObject:code];
+			[tailLineSizes addObject:@(size)];
+			tailSize += size;
+			while(tailSize > profileSampleSize) {
+				tailSize -= tailLineSizes.firstObject.unsignedIntegerValue;
+				[tailLines removeObjectAtIndex:0];
+				[tailLineSizes removeObjectAtIndex:0];
+			}
+		}
+		
+		if(!code.hasFields) {
+			NSInteger layerIndex = code.comment ? code.layerIndexFromComment : NSNotFound;
+			if(layerIndex != NSNotFound && layerIndex >= 0) {
+				[layerZ addObject:@(state.position.z)];
+			}
+			return;
+		}
+		
+		NSInteger G = [code valueForField:'G' fallback:-1];
+		NSInteger M = [code valueForField:'M' fallback:-1];
+		if((G > -1 && ![validG containsIndex:G]) || (M > -1 && ![validM containsIndex:M])) {
+			compatible = NO;
+		}
+		
+		TFPAbsolutePosition from;
+		if(!TFPMoveStateApplyCode(&state, code, &from)) {
+			return;
+		}
+		TFPAbsolutePosition to = state.position;
+		
+		duration += TFPEstimatedMoveDuration(from, to, state.feedRate);
+		filamentLength += MAX(to.e - from.e, 0);
+		TFPExtrusionBoundsAddMove(&bounds, TFPCuboidInfinite, from, to);
+		
+		TFPAbsolutePosition outside;
+		if(fitsPrintableVolume && TFPMoveLeavesM3DMicroPrintableVolume(from, to, &outside)) {
+			fitsPrintableVolume = NO;
+		}
+	}];
+	
+	[self readProfileFromLines:[headLines arrayByAddingObjectsFromArray:tailLines]];
+	
+	self.compatible = read && parsed && compatible;
+	self.boundingBox = TFPExtrusionBoundsCuboid(bounds);
+	self.fitsPrintableVolume = fitsPrintableVolume;
+	self.estimatedDuration = duration;
+	self.filamentLength = filamentLength;
+	self.layerCount = layerZ.count;
+	
+	double profileLayerHeight = [self.profileValues[@"Layer Height"] doubleValue];
+	self.layerHeight = (profileLayerHeight > 0) ? profileLayerHeight : [self.class medianLayerHeightForLayerZ:layerZ];
+}
+
+
+// Z is sampled where each layer starts, so the differences are the heights of the layers before
++ (double)medianLayerHeightForLayerZ:(NSArray<NSNumber*> *)layerZ {
+	NSMutableArray<NSNumber*> *heights = [NSMutableArray new];
+	for(NSUInteger i=1; i<layerZ.count; i++) {
+		double height = layerZ[i].doubleValue - layerZ[i-1].doubleValue;
+		if(height > 0) {
+			[heights addObject:@(height)];
+		}
+	}
+	
+	if(!heights.count) {
+		return 0;
+	}
+	[heights sortUsingSelector:@selector(compare:)];
+	return heights[heights.count / 2].doubleValue;
+}
+
+
+@end
+
+
+
+@interface TFPGCodeLibraryIndex ()
+@property (copy) NSURL *indexURL;
+@property dispatch_queue_t queue; // Scanning and saving
+
+// Keyed by standardized path. Guarded by @synchronized(self)
+@property NSMutableDictionary<NSString*, TFPGCodeFileSummary*> *summariesByPath;
+@end
+
+
+
+@implementation TFPGCodeLibraryIndex
+
+
+- (instancetype)initWithIndexURL:(NSURL*)URL {
+	if(!(self = [super init])) return nil;
+	
+	self.indexURL = URL;
+	self.queue = dispatch_queue_create("se.tomasf.microprint.libraryIndex", DISPATCH_QUEUE_SERIAL);
+	self.summariesByPath = [NSMutableDictionary new];
+	[self load];
+	
+	return self;
+}
+
+
+- (void)load {
+	NSData *data = self.indexURL ? [NSData dataWithContentsOfURL:self.indexURL] : nil;
+	if(!data) {
+		return;
+	}
+	
+	NSKeyedUnarchiver *unarchiver = [[NSKeyedUnarchiver alloc] initForReadingWithData:data];
+	unarchiver.requiresSecureCoding = YES;
+	NSSet *classes = [NSSet setWithObjects:NSDictionary.class, NSArray.class, NSNumber.class, NSString.class, NSDate.class, nil];
+	
+	NSDictionary *values;
+	@try {
+		values = [unarchiver decodeObjectOfClasses:classes forKey:NSKeyedArchiveRootObjectKey];
+	} @catch(NSException *exception) {
+		TFLog(@"Failed to read library index: %@", exception);
+	}
+	if(![values isKindOfClass:[NSDictionary class]] || [values[@"formatVersion"] integerValue] != indexFormatVersion || ![values[@"files"] isKindOfClass:[NSArray class]]) {
+		return;
+	}
+	
+	for(NSDictionary *summaryValues in values[@"files"]) {
+		if(![summaryValues isKindOfClass:[NSDictionary class]]) {
+			continue;
+		}
+		TFPGCodeFileSummary *summary = [[TFPGCodeFileSummary alloc] initWithEncodedValues:summaryValues];
+		if(summary) {
+			self.summariesByPath[summary.fileURL.path] = summary;
+		}
+	}
+}
+
+
+// On index queue
+- (void)save {
+	if(!self.indexURL) {
+		return;
+	}
+	
+	NSDictionary *values = @{@"formatVersion": @(indexFormatVersion),
+							 @"files": [self.summaries valueForKey:@"encodedValues"],
+							 };
+	
+	NSData *data = [NSKeyedArchiver archivedDataWithRootObject:values];
+	[[NSFileManager defaultManager] createDirectoryAtURL:self.indexURL.URLByDeletingLastPathComponent withIntermediateDirectories:YES attributes:nil error:nil];
+	
+	NSError *error;
+	if(![data writeToURL:self.indexURL options:NSDataWritingAtomic error:&error]) {
+		TFLog(@"Failed to save library index: %@", error);
+	}
+}
+
+
+- (NSArray<TFPGCodeFileSummary*> *)summaries {
+	@synchronized(self) {
+		return [self.summariesByPath.allValues sortedArrayUsingComparator:^NSComparisonResult(TFPGCodeFileSummary *a, TFPGCodeFileSummary *b) {
+			return [a.fileURL.path compare:b.fileURL.path];
+		}];
+	}
+}
+
+
+- (NSArray<TFPGCodeFileSummary*> *)summariesMatchingPredicate:(NSPredicate*)predicate {
+	return predicate ? [self.summaries filteredArrayUsingPredicate:predicate] : self.summaries;
+}
+
+
+- (TFPGCodeFileSummary*)summaryForFileAtURL:(NSURL*)URL {
+	@synchronized(self) {
+		return self.summariesByPath[URL.URLByStandardizingPath.path];
+	}
+}
+
+
+- (BOOL)hasFilesInDirectoryAtURL:(NSURL*)URL {
+	NSString *directory = URL.URLByStandardizingPath.path;
+	@synchronized(self) {
+		for(NSString *path in self.summariesByPath) {
+			if([path.stringByDeletingLastPathComponent isEqual:directory]) {
+				return YES;
+			}
+		}
+		return NO;
+	}
+}
+
+
+#pragma mark - Scanning
+
+
++ (BOOL)isGCodeFileName:(NSString*)name {
+	NSString *extension = name.pathExtension.lowercaseString;
+	if([extension isEqual:@"gz"]) {
+		extension = name.stringByDeletingPathExtension.pathExtension.lowercaseString;
+	}
+	return [extension isEqual:@"gcode"];
+}
+
+
+- (NSArray<NSURL*> *)GCodeFilesInDirectoryAtURL:(NSURL*)URL {
+	NSDirectoryEnumerator *enumerator = [[NSFileManager defaultManager] enumeratorAtURL:URL includingPropertiesForKeys:@[NSURLIsRegularFileKey] options:NSDirectoryEnumerationSkipsHiddenFiles | NSDirectoryEnumerationSkipsPackageDescendants errorHandler:nil];
+	NSMutableArray *files = [NSMutableArray new];
+	
+	for(NSURL *fileURL in enumerator) {
+		NSNumber *regularFile;
+		[fileURL getResourceValue:&regularFile forKey:NSURLIsRegularFileKey error:nil];
+		if(regularFile.boolValue && [self.class isGCodeFileName:fileURL.lastPathComponent]) {
+			[files addObject:fileURL.URLByStandardizingPath];
+		}
+	}
+	return files;
+}
+
+
+- (void)scanDirectoryAtURL:(NSURL*)URL completionHandler:(void(^)(NSUInteger analyzedFileCount))completionHandler {
+	dispatch_async(self.queue, ^{
+		uint64_t start = TFNanosecondTime();
+		NSArray<NSURL*> *fileURLs = [self GCodeFilesInDirectoryAtURL:URL];
+		__block NSUInteger analyzedCount = 0;
+		
+		// Files are independent, so they're summarized concurrently
+		dispatch_apply(fileURLs.count, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t i) {
+			@autoreleasepool {
+				if([self updateSummaryForFileAtURL:fileURLs[i]]) {
+					@synchronized(self) {
+						analyzedCount++;
+					}
+				}
+			}
+		});
+		
+		NSString *prefix = [URL.URLByStandardizingPath.path stringByAppendingString:@"/"];
+		NSSet *presentPaths = [[fileURLs valueForKey:@"path"] tf_set];
+		@synchronized(self) {
+			for(NSString *path in self.summariesByPath.allKeys) {
+				if([path hasPrefix:prefix] && ![presentPaths containsObject:path]) {
+					[self.summariesByPath removeObjectForKey:path];
+				}
+			}
+		}
+		
+		[self save];
+		TFLog(@"Indexed %ld G-code files in %@, analyzing %ld, in %.02f s", (long)fileURLs.count, URL.path, (long)analyzedCount, (double)(TFNanosecondTime() - start) / NSEC_PER_SEC);
+		
+		dispatch_async(dispatch_get_main_queue(), ^{
+			if(completionHandler) {
+				completionHandler(analyzedCount);
+			}
+		});
+	});
+}
+
+
+// Any queue. Returns YES if the file had to be analyzed.
+- (BOOL)updateSummaryForFileAtURL:(NSURL*)fileURL {
+	NSString *path = fileURL.path;
+	NSDictionary *attributes = [[NSFileManager defaultManager] attributesOfItemAtPath:path error:nil];
+	NSDate *modificationDate = attributes.fileModificationDate;
+	
+	TFPGCodeFileSummary *existing;
+	@synchronized(self) {
+		existing = self.summariesByPath[path];
+	}
+	if(existing && existing.fileSize == attributes.fileSize && [existing.modificationDate isEqual:modificationDate]) {
+		return NO;
+	}
+	
+	NSData *data = [NSData dataWithContentsOfURL:fileURL options:NSDataReadingMappedIfSafe error:nil];
+	if(!data) {
+		return NO;
+	}
+	
+	NSString *hash = data.tf_SHA256String;
+	TFPGCodeFileSummary *summary;
+	BOOL analyzed = NO;
+	if([existing.contentHash isEqual:hash]) {
+		summary = [[TFPGCodeFileSummary alloc] initWithEncodedValues:existing.encodedValues];
+	}else{
+		summary = [[TFPGCodeFileSummary alloc] initWithFileURL:fileURL fileSize:data.length contentHash:hash];
+		analyzed = YES;
+	}
+	summary.modificationDate = modificationDate;
+	
+	@synchronized(self) {
+		self.summariesByPath[path] = summary;
+	}
+	return analyzed;
+}
+
+
+@end
@@ -0,0 +1,18 @@
+//
+//  TFPGCodeLineReader.h
+//  microprint
+//
+//
+
+#import <Foundation/Foundation.h>
+
+
+// Reads G-code text line by line from plain or gzip/zlib-compressed files, recognized by their header rather than
+// their name. Plain files are memory-mapped and compressed ones are inflated chunk by chunk, so neither the whole
+// text nor a decompressed copy on disk is needed.
+@interface TFPGCodeLineReader : NSObject
++ (BOOL)fileIsCompressedAtURL:(NSURL*)URL;
+
+// Lines end at CR, LF or CRLF and are decoded as UTF-8
++ (BOOL)enumerateLinesInFileAtURL:(NSURL*)URL error:(NSError**)outError usingBlock:(void(^)(NSString *line, BOOL *stop))block;
+@end
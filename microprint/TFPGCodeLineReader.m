@@ -0,0 +1,194 @@
+//
+//  TFPGCodeLineReader.m
+//  microprint
+//
+//
+
+#import "TFPGCodeLineReader.h"
+#import "TFPInflateStream.h"
+#import "TFPExtras.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+
+static const NSUInteger readChunkSize = 1024 * 1024;
+
+
+@interface TFPGCodeLineReader ()
+@property (copy) void(^block)(NSString *line, BOOL *stop);
+@property NSMutableData *partialLine;
+@property BOOL skipLineFeed; // The last chunk ended with a CR that may be half of a CRLF
+@property BOOL stopped;
+@property BOOL invalidEncoding;
+@end
+
+
+
+@implementation TFPGCodeLineReader
+
+
++ (BOOL)headerIsCompressed:(const uint8_t *)header length:(NSUInteger)length {
+	if(length < 2) {
+		return NO;
+	}
+	BOOL gzip = (header[0] == 0x1F && header[1] == 0x8B);
+	BOOL zlib = (header[0] == 0x78 && ((header[0] << 8) | header[1]) % 31 == 0);
+	return gzip || zlib;
+}
+
+
++ (BOOL)fileIsCompressedAtURL:(NSURL*)URL {
+	int fileDescriptor = open(URL.fileSystemRepresentation, O_RDONLY);
+	if(fileDescriptor < 0) {
+		return NO;
+	}
+	uint8_t header[2];
+	ssize_t length = read(fileDescriptor, header, sizeof(header));
+	close(fileDescriptor);
+	return [self headerIsCompressed:header length:MAX(length, 0)];
+}
+
+
++ (BOOL)enumerateLinesInFileAtURL:(NSURL*)URL error:(NSError**)outError usingBlock:(void(^)(NSString *line, BOOL *stop))block {
+	TFPGCodeLineReader *reader = [self new];
+	reader.block = block;
+	reader.partialLine = [NSMutableData new];
+	
+	if([self fileIsCompressedAtURL:URL]) {
+		if(![reader readCompressedFileAtURL:URL error:outError]) {
+			return NO;
+		}
+	}else{
+		NSData *data = [NSData dataWithContentsOfURL:URL options:NSDataReadingMappedIfSafe error:outError];
+		if(!data) {
+			return NO;
+		}
+		[reader consumeBytes:data.bytes length:data.length];
+	}
+	
+	[reader finish];
+	if(reader.invalidEncoding) {
+		if(outError) {
+			*outError = [NSError errorWithDomain:TFPErrorDomain code:TFPErrorCodeParseError userInfo:@{NSLocalizedRecoverySuggestionErrorKey: @"Failed to parse G-code file. Invalid character encoding?"}];
+		}
+		return NO;
+	}
+	return YES;
+}
+
+
+- (BOOL)readCompressedFileAtURL:(NSURL*)URL error:(NSError**)outError {
+	int fileDescriptor = open(URL.fileSystemRepresentation, O_RDONLY);
+	if(fileDescriptor < 0) {
+		if(outError) {
+			*outError = [NSError errorWithDomain:NSPOSIXErrorDomain code:errno userInfo:nil];
+		}
+		return NO;
+	}
+	
+	TFPInflateStream *inflater = [TFPInflateStream new];
+	uint8_t *buffer = malloc(readChunkSize);
+	BOOL valid = YES;
+	ssize_t length = 0;
+	
+	while(!self.stopped && (length = read(fileDescriptor, buffer, readChunkSize)) > 0) {
+		valid = [inflater inflateBytes:buffer length:length outputHandler:^(const void *output, NSUInteger outputLength) {
+			[self consumeBytes:output length:outputLength];
+		}];
+		if(!valid) {
+			break;
+		}
+	}
+	int readError = (length < 0) ? errno : 0;
+	
+	free(buffer);
+	close(fileDescriptor);
+	
+	if(readError) {
+		if(outError) {
+			*outError = [NSError errorWithDomain:NSPOSIXErrorDomain code:readError userInfo:nil];
+		}
+		return NO;
+	}
+	if(!valid || (!self.stopped && !inflater.finished)) {
+		if(outError) {
+			*outError = [NSError errorWithDomain:TFPErrorDomain code:TFPErrorCodeParseError userInfo:@{NSLocalizedRecoverySuggestionErrorKey: @"The compressed G-code file is damaged or incomplete."}];
+		}
+		return NO;
+	}
+	return YES;
+}
+
+
+// The first CR or LF. A CR can only come first if it's before the next LF, so the search for it stops there.
+static const char *TFPGCodeLineReaderFindLineBreak(const char *bytes, NSUInteger length) {
+	const char *lineFeed = memchr(bytes, '\n', length);
+	const char *carriageReturn = memchr(bytes, '\r', lineFeed ? (NSUInteger)(lineFeed - bytes) : length);
+	return carriageReturn ?: lineFeed;
+}
+
+
+// CR, LF and CRLF all end a line. Lines that span chunks are collected in partialLine; everything else is decoded
+// straight from the input.
+- (void)consumeBytes:(const char *)bytes length:(NSUInteger)length {
+	NSUInteger offset = 0;
+	if(self.skipLineFeed && length) {
+		offset = (bytes[0] == '\n') ? 1 : 0;
+		self.skipLineFeed = NO;
+	}
+	
+	while(offset < length && !self.stopped) {
+		const char *lineBreak = TFPGCodeLineReaderFindLineBreak(bytes + offset, length - offset);
+		if(!lineBreak) {
+			[self.partialLine appendBytes:bytes + offset length:length - offset];
+			return;
+		}
+		
+		NSUInteger lineLength = lineBreak - (bytes + offset);
+		if(self.partialLine.length) {
+			[self.partialLine appendBytes:bytes + offset length:lineLength];
+			[self emitLine:self.partialLine.bytes length:self.partialLine.length];
+			self.partialLine.length = 0;
+		}else{
+			[self emitLine:bytes + offset length:lineLength];
+		}
+		offset += lineLength + 1;
+		
+		if(*lineBreak == '\r') {
+			if(offset == length) {
+				self.skipLineFeed = YES;
+			}else if(bytes[offset] == '\n') {
+				offset++;
+			}
+		}
+	}
+}
+
+
+// A last line without a line break still counts
+- (void)finish {
+	if(self.partialLine.length && !self.stopped) {
+		[self emitLine:self.partialLine.bytes length:self.partialLine.length];
+	}
+	self.partialLine.length = 0;
+}
+
+
+- (void)emitLine:(const char *)bytes length:(NSUInteger)length {
+	@autoreleasepool {
+		NSString *line = [[NSString alloc] initWithBytes:bytes length:length encoding:NSUTF8StringEncoding];
+		if(!line) {
+			self.invalidEncoding = YES;
+			self.stopped = YES;
+			return;
+		}
+		
+		BOOL stop = NO;
+		self.block(line, &stop);
+		self.stopped = stop;
+	}
+}
+
+
+@end
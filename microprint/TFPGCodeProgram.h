@@ -7,14 +7,37 @@
 @class TFP3DVector, TFPGCode;
 
 
+typedef NS_OPTIONS(NSUInteger, TFPGCodeProgramOptions) {
+	// Comment-only lines are replaced by blank lines, except layer markers and slicer profile data.
+	// Line numbering is preserved. The kept comments are available through commentsByLine.
+	TFPGCodeProgramOptionSeparateComments = 1<<0,
+	
+	// Files are loaded through TFPGCodeProgramCache, so reopening an unchanged file skips parsing and analysis
+	TFPGCodeProgramOptionCached = 1<<1,
+};
+
+
 @interface TFPGCodeProgram : NSObject
 + (instancetype)programWithLines:(NSArray<TFPGCode *> *)lines;
 - (instancetype)initWithLines:(NSArray<TFPGCode *> *)lines;
 - (instancetype)initWithString:(NSString*)string error:(NSError**)outError;
+- (instancetype)initWithString:(NSString*)string options:(TFPGCodeProgramOptions)options error:(NSError**)outError;
 - (instancetype)initWithFileURL:(NSURL*)URL error:(NSError**)outError;
+- (instancetype)initWithFileURL:(NSURL*)URL options:(TFPGCodeProgramOptions)options error:(NSError**)outError;
 
 @property (copy, readonly) NSArray<TFPGCode *> *lines;
 
+// Indexes of lines that have fields, i.e. the lines that are actually sent to a printer
+@property (readonly) NSIndexSet *executableLineIndexes;
+
+// Sparse map of comment-only lines, keyed by line index
+@property (readonly) NSDictionary<NSNumber*, NSString*> *commentsByLine;
+
+// Analysis passes in TFPGCodeHelpers memoize their results here. Results need to support NSSecureCoding,
+// since TFPGCodeProgramCache stores them along with the program.
+- (id)analysisResultForKey:(NSString*)key computedWithBlock:(id(^)(void))block;
+- (void)replaceAnalysisResult:(id)result forKey:(NSString*)key; // For a stored result that turned out to be unusable
+
 - (BOOL)writeToFileURL:(NSURL*)URL error:(NSError**)outError;
 - (NSString *)ASCIIRepresentation;
 @end
\ No newline at end of file
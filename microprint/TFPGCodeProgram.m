@@ -7,9 +7,21 @@
 #import "TFPGCodeProgram.h"
 #import "TFPGCode.h"
 #import "TFPExtras.h"
+#import "TFPGCodeHelpers.h"
+#import "TFPSlicerProfile.h"
+#import "TFPGCodeWriter.h"
+#import "TFPGCodeProgramCache.h"
+#import "TFPGCodeLineReader.h"
+#import "TFPGCodeContainer.h"
+
+#include <sys/stat.h>
+#include <unistd.h>
 
 @interface TFPGCodeProgram ()
 @property (copy, readwrite) NSArray<TFPGCode *> *lines;
+@property NSIndexSet *cachedExecutableLineIndexes;
+@property NSDictionary<NSNumber*, NSString*> *cachedCommentsByLine;
+@property NSMutableDictionary<NSString*, id> *analysisResults;
 @end
 
 
@@ -20,6 +32,7 @@
 	if(!(self = [super init])) return nil;
 	
 	self.lines = lines;
+	self.analysisResults = [NSMutableDictionary new];
 	
 	return self;
 }
@@ -31,11 +44,27 @@
 
 
 - (instancetype)initWithString:(NSString*)string error:(NSError**)outError {
+	return [self initWithString:string options:0 error:outError];
+}
+
+
+- (instancetype)initWithString:(NSString*)string options:(TFPGCodeProgramOptions)options error:(NSError**)outError {
+	return [self initWithLineEnumerator:^BOOL(void(^block)(NSString *line, BOOL *stop), NSError **enumerationError) {
+		[string enumerateLinesUsingBlock:block];
+		return YES;
+	} options:options error:outError];
+}
+
+
+// Parses lines as the enumerator produces them, so sources don't need to hold all of the text at once
+- (instancetype)initWithLineEnumerator:(BOOL(^)(void(^block)(NSString *line, BOOL *stop), NSError **enumerationError))enumerator options:(TFPGCodeProgramOptions)options error:(NSError**)outError {
 	NSMutableArray *lines = [NSMutableArray new];
 	__block BOOL failed = NO;
 	__block NSString *failedLine;
+	NSIndexSet *executableLineIndexes;
+	NSDictionary *commentsByLine;
 	
-	[string enumerateLinesUsingBlock:^(NSString *lineString, BOOL *stop) {
+	BOOL enumerated = enumerator(^(NSString *lineString, BOOL *stop) {
 		TFPGCode *line = [[TFPGCode alloc] initWithString:lineString];
 		if(!line) {
 			*stop = YES;
@@ -44,7 +73,11 @@
 			return;
 		}
 		[lines addObject:line];
-	}];
+	}, outError);
+	
+	if(!enumerated) {
+		return nil;
+	}
 	
 	if(failed) {
 		if(outError) {
@@ -54,31 +87,175 @@
 		return nil;
 	}
 	
-	return [self initWithLines:lines];
+	if(options & TFPGCodeProgramOptionSeparateComments) {
+		[self.class separateCommentsInLines:lines executableLineIndexes:&executableLineIndexes commentsByLine:&commentsByLine];
+	}
+	
+	if(!(self = [self initWithLines:lines])) return nil;
+	
+	self.cachedExecutableLineIndexes = executableLineIndexes;
+	self.cachedCommentsByLine = commentsByLine;
+	
+	return self;
+}
+
+
+// Layer markers anywhere, plus the comment lines a slicer profile is read from
++ (NSIndexSet*)keptCommentLineIndexesInLines:(NSArray<TFPGCode*> *)lines {
+	NSMutableIndexSet *indexes = [[TFPSlicerProfile profileLineIndexesInLines:lines] mutableCopy];
+	[lines enumerateObjectsUsingBlock:^(TFPGCode *code, NSUInteger index, BOOL *stop) {
+		if(!code.hasFields && code.layerIndexFromComment != NSNotFound) {
+			[indexes addIndex:index];
+		}
+	}];
+	return indexes;
+}
+
+
+// Replaces discarded comment lines in place with a shared blank code, keeping the line count intact
++ (void)separateCommentsInLines:(NSMutableArray<TFPGCode*> *)lines executableLineIndexes:(NSIndexSet**)outIndexes commentsByLine:(NSDictionary<NSNumber*, NSString*> **)outComments {
+	TFPGCode *blankCode = [TFPGCode codeWithComment:nil];
+	NSMutableIndexSet *indexes = [NSMutableIndexSet indexSet];
+	NSMutableDictionary *comments = [NSMutableDictionary new];
+	NSIndexSet *keptLines = [self keptCommentLineIndexesInLines:lines];
+	
+	for(NSUInteger i=0; i<lines.count; i++) {
+		TFPGCode *code = lines[i];
+		if(code.hasFields) {
+			[indexes addIndex:i];
+		}else if(code.comment.length && [keptLines containsIndex:i]) {
+			comments[@(i)] = code.comment;
+		}else{
+			lines[i] = blankCode;
+		}
+	}
+	
+	*outIndexes = indexes;
+	*outComments = comments;
+}
+
+
+- (NSIndexSet *)executableLineIndexes {
+	@synchronized(self) {
+		if(!self.cachedExecutableLineIndexes) {
+			self.cachedExecutableLineIndexes = [self.lines indexesOfObjectsPassingTest:^BOOL(TFPGCode *code, NSUInteger index, BOOL *stop) {
+				return code.hasFields;
+			}];
+		}
+		return self.cachedExecutableLineIndexes;
+	}
+}
+
+
+- (NSDictionary<NSNumber*, NSString*> *)commentsByLine {
+	@synchronized(self) {
+		if(!self.cachedCommentsByLine) {
+			NSMutableDictionary *comments = [NSMutableDictionary new];
+			[self.lines enumerateObjectsUsingBlock:^(TFPGCode *code, NSUInteger index, BOOL *stop) {
+				if(!code.hasFields && code.comment.length) {
+					comments[@(index)] = code.comment;
+				}
+			}];
+			self.cachedCommentsByLine = comments;
+		}
+		return self.cachedCommentsByLine;
+	}
 }
 
 
 - (instancetype)initWithFileURL:(NSURL*)URL error:(NSError**)outError {
-	NSString *string = [NSString stringWithContentsOfURL:URL encoding:NSUTF8StringEncoding error:NULL];
-	if(!string) {
-		if(outError) {
-			NSString *errorString = @"Failed to parse G-code file. Invalid character encoding?";
-			*outError = [NSError errorWithDomain:TFPErrorDomain code:TFPErrorCodeParseError userInfo:@{NSLocalizedRecoverySuggestionErrorKey: errorString}];
+	return [self initWithFileURL:URL options:0 error:outError];
+}
+
+
+- (instancetype)initWithFileURL:(NSURL*)URL options:(TFPGCodeProgramOptions)options error:(NSError**)outError {
+	// Containers are mapped and decoded as they're used, which is already as quick as the cache
+	if([TFPGCodeContainer fileIsContainerAtURL:URL]) {
+		return [TFPGCodeContainer programWithContentsOfURL:URL options:options & ~TFPGCodeProgramOptionCached error:outError];
+	}
+	
+	if(options & TFPGCodeProgramOptionCached) {
+		return [[TFPGCodeProgramCache sharedCache] programWithFileURL:URL options:options & ~TFPGCodeProgramOptionCached error:outError];
+	}
+	
+	// Compressed files are inflated as they're parsed
+	return [self initWithLineEnumerator:^BOOL(void(^block)(NSString *line, BOOL *stop), NSError **enumerationError) {
+		return [TFPGCodeLineReader enumerateLinesInFileAtURL:URL error:enumerationError usingBlock:block];
+	} options:options error:outError];
+}
+
+
+// Passes run outside the lock; if two threads race, the first result stored wins
+- (id)analysisResultForKey:(NSString*)key computedWithBlock:(id(^)(void))block {
+	@synchronized(self) {
+		id result = self.analysisResults[key];
+		if(result) {
+			return result;
 		}
-		return nil;
 	}
 	
-	return [self initWithString:string error:outError];
+	id result = block();
+	
+	@synchronized(self) {
+		if(!self.analysisResults[key]) {
+			self.analysisResults[key] = result;
+		}
+		return self.analysisResults[key];
+	}
 }
 
 
+- (void)replaceAnalysisResult:(id)result forKey:(NSString*)key {
+	@synchronized(self) {
+		self.analysisResults[key] = result;
+	}
+}
+
+
+// Streams to a temporary file next to the destination and moves it into place, so readers never see a partial file
 - (BOOL)writeToFileURL:(NSURL*)URL error:(NSError**)outError {
-	return [[self ASCIIRepresentation] writeToURL:URL atomically:YES encoding:NSUTF8StringEncoding error:outError];
+	NSString *directory = URL.path.stringByDeletingLastPathComponent;
+	NSString *temporaryTemplate = [directory stringByAppendingPathComponent:[NSString stringWithFormat:@".%@.XXXXXX", URL.lastPathComponent]];
+	char *temporaryPath = strdup(temporaryTemplate.fileSystemRepresentation);
+	
+	int fileDescriptor = mkstemp(temporaryPath);
+	if(fileDescriptor < 0) {
+		if(outError) {
+			*outError = [NSError errorWithDomain:NSPOSIXErrorDomain code:errno userInfo:nil];
+		}
+		free(temporaryPath);
+		return NO;
+	}
+	fchmod(fileDescriptor, 0644);
+	
+	TFPGCodeWriter *writer = [[TFPGCodeWriter alloc] initWithFileDescriptor:fileDescriptor];
+	BOOL success = [writer writeProgram:self error:outError];
+	close(fileDescriptor);
+	
+	if(success && rename(temporaryPath, URL.fileSystemRepresentation) != 0) {
+		if(outError) {
+			*outError = [NSError errorWithDomain:NSPOSIXErrorDomain code:errno userInfo:nil];
+		}
+		success = NO;
+	}
+	
+	if(!success) {
+		unlink(temporaryPath);
+	}
+	free(temporaryPath);
+	return success;
 }
 
 
 - (NSString *)ASCIIRepresentation {
-	return [[self.lines valueForKey:@"ASCIIRepresentation"] componentsJoinedByString:@"\n"];
+	NSMutableData *data = [NSMutableData dataWithCapacity:self.lines.count * 24];
+	[self.lines enumerateObjectsUsingBlock:^(TFPGCode *code, NSUInteger index, BOOL *stop) {
+		if(index > 0) {
+			[data appendBytes:"\n" length:1];
+		}
+		[code appendASCIIRepresentationToData:data];
+	}];
+	return [[NSString alloc] initWithData:data encoding:NSUTF8StringEncoding];
 }
 
 
@@ -0,0 +1,23 @@
+//
+//  TFPGCodeProgramCache.h
+//  microprint
+//
+//
+
+#import <Foundation/Foundation.h>
+#import "TFPGCodeProgram.h"
+
+
+// Parsed programs and their analysis results, kept on disk so reopening a large file doesn't parse it again.
+// Entries are keyed by a SHA-256 of the file contents along with the parser version and options, and are
+// memory-mapped on load; lines only become TFPGCode objects as they're used. When the cache grows past
+// maximumSize, the least recently used entries are removed.
+@interface TFPGCodeProgramCache : NSObject
++ (instancetype)sharedCache; // Caches/MicroPrint/Programs
+- (instancetype)initWithDirectoryURL:(NSURL*)URL;
+
+@property NSUInteger maximumSize; // Bytes; default 2 GB
+
+// Any queue. Files that aren't cached yet are parsed right away and stored in the background.
+- (TFPGCodeProgram*)programWithFileURL:(NSURL*)URL options:(TFPGCodeProgramOptions)options error:(NSError**)outError;
+@end
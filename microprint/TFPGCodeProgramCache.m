@@ -0,0 +1,523 @@
+//
+//  TFPGCodeProgramCache.m
+//  microprint
+//
+//
+
+#import "TFPGCodeProgramCache.h"
+#import "TFPGCode.h"
+#import "TFPGCodeHelpers.h"
+#import "TFPExtras.h"
+
+#include <stdatomic.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+static const uint32_t cacheMagic = 'TFPC';
+static const uint32_t cacheFormatVersion = 1;
+
+// Bump whenever parsing or an analysis pass changes, so entries made by older code are ignored. TFPGCodeContainer
+// has an analysisVersion that needs the same treatment.
+static const uint32_t parserVersion = 3;
+
+static const NSUInteger defaultMaximumSize = 2UL * 1024 * 1024 * 1024;
+static const NSUInteger writeBatchLineCount = 64 * 1024;
+static const uint32_t noComment = UINT32_MAX;
+
+static NSString *const entryExtension = @"tfpprogram";
+static NSString *const indexFileName = @"Index.plist";
+
+
+typedef struct {
+	uint32_t magic;
+	uint32_t formatVersion;
+	uint32_t parserVersion;
+	uint32_t options;
+	uint64_t lineCount; // Lines follow the header directly
+	uint64_t commentsOffset; // UTF-8, not terminated
+	uint64_t commentsLength;
+	uint64_t archiveOffset; // Keyed archive of line indexes and analysis results
+	uint64_t archiveLength;
+} TFPGCodeProgramCacheHeader;
+
+
+typedef struct {
+	TFPPackedGCode code;
+	uint32_t commentOffset; // Into the comment area, or noComment
+	uint32_t commentLength;
+} TFPGCodeProgramCacheLine;
+
+
+
+@interface TFPGCodeProgram (CachePrivate)
+- (void)setCachedExecutableLineIndexes:(NSIndexSet*)indexes;
+- (void)setCachedCommentsByLine:(NSDictionary<NSNumber*, NSString*> *)comments;
+- (NSMutableDictionary<NSString*, id> *)analysisResults;
+- (void)setAnalysisResults:(NSMutableDictionary<NSString*, id> *)results;
+@end
+
+
+
+// Lines of a mapped cache entry. Codes are created on first access and kept, so every pass over the program
+// sees the same objects. Safe to use from any thread. Fast enumeration and enumerateObjectsUsingBlock: hand
+// out codes without autoreleasing them, which matters for passes over millions of lines.
+@interface TFPPackedGCodeArray : NSArray
+- (instancetype)initWithEntryData:(NSData*)data;
+@end
+
+
+@implementation TFPPackedGCodeArray {
+	NSData *_data;
+	const TFPGCodeProgramCacheLine *_lines;
+	const char *_comments;
+	NSUInteger _count;
+	_Atomic(void*) *_codes;
+}
+
+
+- (instancetype)initWithEntryData:(NSData*)data {
+	if(!(self = [super init])) return nil;
+	
+	const TFPGCodeProgramCacheHeader *header = data.bytes;
+	_data = data;
+	_count = header->lineCount;
+	_lines = (const TFPGCodeProgramCacheLine *)((const uint8_t*)data.bytes + sizeof(TFPGCodeProgramCacheHeader));
+	_comments = (const char *)data.bytes + header->commentsOffset;
+	_codes = calloc(MAX(_count, 1), sizeof(*_codes));
+	
+	return self;
+}
+
+
+- (void)dealloc {
+	for(NSUInteger i=0; i<_count; i++) {
+		void *code = atomic_load_explicit(&_codes[i], memory_order_relaxed);
+		if(code) {
+			CFRelease(code);
+		}
+	}
+	free(_codes);
+}
+
+
+// Retained by the array. If two threads create the same code, the second one is thrown away.
+- (void*)codePointerAtIndex:(NSUInteger)index {
+	void *code = atomic_load_explicit(&_codes[index], memory_order_acquire);
+	if(code) {
+		return code;
+	}
+	
+	const TFPGCodeProgramCacheLine *line = &_lines[index];
+	NSString *comment;
+	if(line->commentOffset != noComment) {
+		comment = [[NSString alloc] initWithBytes:_comments + line->commentOffset length:line->commentLength encoding:NSUTF8StringEncoding];
+	}
+	
+	void *newCode = (void*)CFBridgingRetain([[TFPGCode alloc] initWithPackedCode:line->code comment:comment]);
+	if(!atomic_compare_exchange_strong(&_codes[index], &code, newCode)) {
+		CFRelease(newCode);
+		return code;
+	}
+	return newCode;
+}
+
+
+- (NSUInteger)count {
+	return _count;
+}
+
+
+- (id)objectAtIndex:(NSUInteger)index {
+	if(index >= _count) {
+		[NSException raise:NSRangeException format:@"Index %ld beyond bounds of %ld lines", (long)index, (long)_count];
+	}
+	return (__bridge TFPGCode*)[self codePointerAtIndex:index];
+}
+
+
+// Items point straight into the code storage
+- (NSUInteger)countByEnumeratingWithState:(NSFastEnumerationState *)state objects:(id __unsafe_unretained [])buffer count:(NSUInteger)length {
+	NSUInteger start = state->state;
+	if(start >= _count) {
+		return 0;
+	}
+	
+	NSUInteger batchLength = MIN(MAX(length, 1024), _count - start);
+	for(NSUInteger i=start; i<start+batchLength; i++) {
+		[self codePointerAtIndex:i];
+	}
+	
+	state->state = start + batchLength;
+	state->itemsPtr = (__unsafe_unretained id *)(void*)&_codes[start];
+	state->mutationsPtr = &state->extra[0];
+	return batchLength;
+}
+
+
+- (void)enumerateObjectsUsingBlock:(void (^)(id object, NSUInteger index, BOOL *stop))block {
+	BOOL stop = NO;
+	for(NSUInteger i=0; i<_count && !stop; i++) {
+		block((__bridge TFPGCode*)[self codePointerAtIndex:i], i, &stop);
+	}
+}
+
+
+- (id)copyWithZone:(NSZone *)zone {
+	return self;
+}
+
+
+@end
+
+
+
+@interface TFPGCodeProgramCache ()
+@property NSURL *directoryURL;
+@property dispatch_queue_t queue;
+
+// Path -> size, modification time, inode and content hash. Lets unchanged files skip hashing.
+// Guarded by @synchronized(self)
+@property NSMutableDictionary<NSString*, NSDictionary*> *fileIndex;
+@end
+
+
+
+@implementation TFPGCodeProgramCache
+
+
++ (instancetype)sharedCache {
+	static TFPGCodeProgramCache *singleton;
+	static dispatch_once_t once;
+	dispatch_once(&once, ^{
+		NSURL *cachesURL = [[NSFileManager defaultManager] URLsForDirectory:NSCachesDirectory inDomains:NSUserDomainMask].firstObject;
+		singleton = [[self alloc] initWithDirectoryURL:[cachesURL URLByAppendingPathComponent:@"MicroPrint/Programs"]];
+	});
+	return singleton;
+}
+
+
+- (instancetype)initWithDirectoryURL:(NSURL*)URL {
+	if(!(self = [super init])) return nil;
+	
+	self.directoryURL = URL;
+	self.maximumSize = defaultMaximumSize;
+	self.queue = dispatch_queue_create("se.tomasf.microprint.programCache", DISPATCH_QUEUE_SERIAL);
+	
+	[[NSFileManager defaultManager] createDirectoryAtURL:URL withIntermediateDirectories:YES attributes:nil error:nil];
+	NSDictionary *index = [NSDictionary dictionaryWithContentsOfURL:[URL URLByAppendingPathComponent:indexFileName]];
+	self.fileIndex = index ? [index mutableCopy] : [NSMutableDictionary new];
+	
+	return self;
+}
+
+
+- (TFPGCodeProgram*)programWithFileURL:(NSURL*)URL options:(TFPGCodeProgramOptions)options error:(NSError**)outError {
+	NSString *hash = [self contentHashForFileAtURL:URL];
+	if(!hash) {
+		return [[TFPGCodeProgram alloc] initWithFileURL:URL options:options error:outError];
+	}
+	
+	NSString *entryName = [NSString stringWithFormat:@"%@-v%u-%lu.%@", hash, parserVersion, (unsigned long)options, entryExtension];
+	NSURL *entryURL = [self.directoryURL URLByAppendingPathComponent:entryName];
+	
+	uint64_t start = TFNanosecondTime();
+	TFPGCodeProgram *program = [self programFromEntryAtURL:entryURL options:options];
+	if(program) {
+		TFLog(@"Loaded %@ from program cache in %.03f s", URL.lastPathComponent, (double)(TFNanosecondTime() - start) / NSEC_PER_SEC);
+		// Modification dates order entries by last use
+		[entryURL setResourceValue:[NSDate date] forKey:NSURLContentModificationDateKey error:nil];
+		return program;
+	}
+	
+	program = [[TFPGCodeProgram alloc] initWithFileURL:URL options:options error:outError];
+	if(program) {
+		dispatch_async(self.queue, ^{
+			if([self writeEntryForProgram:program options:options toURL:entryURL]) {
+				[self evictEntries];
+			}
+		});
+	}
+	return program;
+}
+
+
+#pragma mark - Keys
+
+
+- (NSDictionary*)fileAttributesForURL:(NSURL*)URL {
+	struct stat info;
+	if(stat(URL.fileSystemRepresentation, &info) != 0) {
+		return nil;
+	}
+	return @{@"size": @(info.st_size),
+			 @"modified": @(info.st_mtimespec.tv_sec * NSEC_PER_SEC + info.st_mtimespec.tv_nsec),
+			 @"inode": @(info.st_ino)};
+}
+
+
+// Files that haven't changed since they were last hashed use the hash from the index
+- (NSString*)contentHashForFileAtURL:(NSURL*)URL {
+	NSString *path = URL.URLByResolvingSymlinksInPath.path;
+	NSDictionary *attributes = [self fileAttributesForURL:URL];
+	if(!attributes) {
+		return nil;
+	}
+	
+	@synchronized(self) {
+		NSDictionary *entry = self.fileIndex[path];
+		if([[entry dictionaryWithValuesForKeys:attributes.allKeys] isEqual:attributes]) {
+			return entry[@"hash"];
+		}
+	}
+	
+	NSData *data = [NSData dataWithContentsOfURL:URL options:NSDataReadingMappedIfSafe error:nil];
+	if(!data) {
+		return nil;
+	}
+	
+	NSString *hash = data.tf_SHA256String;
+	
+	NSMutableDictionary *entry = [attributes mutableCopy];
+	entry[@"hash"] = hash;
+	@synchronized(self) {
+		self.fileIndex[path] = entry;
+	}
+	dispatch_async(self.queue, ^{
+		[self saveFileIndex];
+	});
+	
+	return hash;
+}
+
+
+// On cache queue. Paths whose files are gone are dropped.
+- (void)saveFileIndex {
+	NSDictionary *index;
+	@synchronized(self) {
+		for(NSString *path in self.fileIndex.allKeys) {
+			if(![[NSFileManager defaultManager] fileExistsAtPath:path]) {
+				[self.fileIndex removeObjectForKey:path];
+			}
+		}
+		index = [self.fileIndex copy];
+	}
+	[index writeToURL:[self.directoryURL URLByAppendingPathComponent:indexFileName] atomically:YES];
+}
+
+
+#pragma mark - Reading
+
+
+- (TFPGCodeProgram*)programFromEntryAtURL:(NSURL*)URL options:(TFPGCodeProgramOptions)options {
+	NSData *data = [NSData dataWithContentsOfURL:URL options:NSDataReadingMappedAlways error:nil];
+	if(!data) {
+		return nil;
+	}
+	
+	const TFPGCodeProgramCacheHeader *header = data.bytes;
+	if(![self isValidHeader:header length:data.length options:options] || ![self hasValidCommentRangesInData:data]) {
+		TFLog(@"Removing invalid program cache entry %@", URL.lastPathComponent);
+		[[NSFileManager defaultManager] removeItemAtURL:URL error:nil];
+		return nil;
+	}
+	
+	NSData *archive = [data subdataWithRange:NSMakeRange(header->archiveOffset, header->archiveLength)];
+	NSKeyedUnarchiver *unarchiver = [[NSKeyedUnarchiver alloc] initForReadingWithData:archive];
+	unarchiver.requiresSecureCoding = YES;
+	NSSet *classes = [NSSet setWithObjects:NSDictionary.class, NSArray.class, NSNumber.class, NSString.class, NSValue.class, NSData.class, NSIndexSet.class, TFPPrintLayer.class, nil];
+	
+	NSDictionary *contents;
+	@try {
+		contents = [unarchiver decodeObjectOfClasses:classes forKey:NSKeyedArchiveRootObjectKey];
+	} @catch(NSException *exception) {
+		TFLog(@"Failed to read program cache entry %@: %@", URL.lastPathComponent, exception);
+	}
+	if(![contents isKindOfClass:[NSDictionary class]]) {
+		return nil;
+	}
+	
+	TFPGCodeProgram *program = [[TFPGCodeProgram alloc] initWithLines:[[TFPPackedGCodeArray alloc] initWithEntryData:data]];
+	[program setCachedExecutableLineIndexes:contents[@"executableLineIndexes"]];
+	[program setCachedCommentsByLine:contents[@"commentsByLine"]];
+	[program setAnalysisResults:[contents[@"analysis"] mutableCopy]];
+	return program;
+}
+
+
+- (BOOL)isValidHeader:(const TFPGCodeProgramCacheHeader *)header length:(NSUInteger)length options:(TFPGCodeProgramOptions)options {
+	if(length < sizeof(TFPGCodeProgramCacheHeader)) {
+		return NO;
+	}
+	if(header->magic != cacheMagic || header->formatVersion != cacheFormatVersion || header->parserVersion != parserVersion || header->options != options) {
+		return NO;
+	}
+	
+	uint64_t linesEnd = sizeof(TFPGCodeProgramCacheHeader) + header->lineCount * sizeof(TFPGCodeProgramCacheLine);
+	return header->lineCount <= length / sizeof(TFPGCodeProgramCacheLine)
+		&& linesEnd <= header->commentsOffset
+		&& header->commentsOffset + header->commentsLength <= header->archiveOffset
+		&& header->archiveOffset + header->archiveLength == length;
+}
+
+
+// Lines create their comments lazily, so a bad range has to be caught before the entry is used
+- (BOOL)hasValidCommentRangesInData:(NSData*)data {
+	const TFPGCodeProgramCacheHeader *header = data.bytes;
+	const TFPGCodeProgramCacheLine *lines = (const TFPGCodeProgramCacheLine *)((const uint8_t*)data.bytes + sizeof(TFPGCodeProgramCacheHeader));
+	
+	for(uint64_t i=0; i<header->lineCount; i++) {
+		if(lines[i].commentOffset != noComment && (uint64_t)lines[i].commentOffset + lines[i].commentLength > header->commentsLength) {
+			return NO;
+		}
+	}
+	return YES;
+}
+
+
+#pragma mark - Writing
+
+
+// On cache queue. Written next to its final name and moved into place, so readers only ever see complete entries.
+- (BOOL)writeEntryForProgram:(TFPGCodeProgram*)program options:(TFPGCodeProgramOptions)options toURL:(NSURL*)URL {
+	uint64_t start = TFNanosecondTime();
+	[program precomputeAnalysis];
+	
+	NSDictionary *analysis;
+	@synchronized(program) {
+		analysis = [program.analysisResults copy];
+	}
+	NSData *archive = [NSKeyedArchiver archivedDataWithRootObject:@{
+		@"executableLineIndexes": program.executableLineIndexes,
+		@"commentsByLine": program.commentsByLine,
+		@"analysis": analysis,
+	}];
+	
+	NSString *temporaryTemplate = [self.directoryURL.path stringByAppendingPathComponent:@".entry.XXXXXX"];
+	char *temporaryPath = strdup(temporaryTemplate.fileSystemRepresentation);
+	int fileDescriptor = mkstemp(temporaryPath);
+	if(fileDescriptor < 0) {
+		TFLog(@"Failed to create program cache entry: %s", strerror(errno));
+		free(temporaryPath);
+		return NO;
+	}
+	
+	TFPGCodeProgramCacheHeader header = {
+		.magic = cacheMagic,
+		.formatVersion = cacheFormatVersion,
+		.parserVersion = parserVersion,
+		.options = (uint32_t)options,
+		.lineCount = program.lines.count,
+	};
+	
+	BOOL success = [self writeLines:program.lines header:&header toFileDescriptor:fileDescriptor];
+	if(success) {
+		header.archiveOffset = header.commentsOffset + header.commentsLength;
+		header.archiveLength = archive.length;
+		success = write(fileDescriptor, archive.bytes, archive.length) == (ssize_t)archive.length
+			&& pwrite(fileDescriptor, &header, sizeof(header), 0) == sizeof(header);
+	}
+	close(fileDescriptor);
+	
+	if(success) {
+		success = rename(temporaryPath, URL.fileSystemRepresentation) == 0;
+	}
+	if(!success) {
+		TFLog(@"Failed to write program cache entry: %s", strerror(errno));
+		unlink(temporaryPath);
+	}else{
+		TFLog(@"Stored %ld lines in program cache in %.02f s", (long)header.lineCount, (double)(TFNanosecondTime() - start) / NSEC_PER_SEC);
+	}
+	free(temporaryPath);
+	return success;
+}
+
+
+// Writes the lines after room for the header, followed by the comment area, and fills in the comment offsets
+- (BOOL)writeLines:(NSArray<TFPGCode*> *)lines header:(TFPGCodeProgramCacheHeader*)header toFileDescriptor:(int)fileDescriptor {
+	if(lseek(fileDescriptor, sizeof(TFPGCodeProgramCacheHeader), SEEK_SET) < 0) {
+		return NO;
+	}
+	
+	NSMutableData *comments = [NSMutableData new];
+	TFPGCodeProgramCacheLine *batch = malloc(writeBatchLineCount * sizeof(TFPGCodeProgramCacheLine));
+	__block NSUInteger batchCount = 0;
+	__block BOOL success = YES;
+	
+	BOOL(^writeBatch)(void) = ^{
+		size_t length = batchCount * sizeof(TFPGCodeProgramCacheLine);
+		batchCount = 0;
+		return (BOOL)(write(fileDescriptor, batch, length) == (ssize_t)length);
+	};
+	
+	[lines enumerateObjectsUsingBlock:^(TFPGCode *code, NSUInteger index, BOOL *stop) {
+		TFPGCodeProgramCacheLine *line = &batch[batchCount++];
+		line->code = code.packedCode;
+		line->commentOffset = noComment;
+		line->commentLength = 0;
+		
+		NSString *comment = code.comment;
+		if(comment) {
+			NSUInteger length = [comment lengthOfBytesUsingEncoding:NSUTF8StringEncoding];
+			if(comments.length + length >= noComment) {
+				success = NO;
+				*stop = YES;
+				return;
+			}
+			line->commentOffset = (uint32_t)comments.length;
+			line->commentLength = (uint32_t)length;
+			[comments appendBytes:comment.UTF8String length:length];
+		}
+		
+		if(batchCount == writeBatchLineCount && !writeBatch()) {
+			success = NO;
+			*stop = YES;
+		}
+	}];
+	
+	if(success && batchCount) {
+		success = writeBatch();
+	}
+	free(batch);
+	
+	header->commentsOffset = sizeof(TFPGCodeProgramCacheHeader) + lines.count * sizeof(TFPGCodeProgramCacheLine);
+	header->commentsLength = comments.length;
+	return success && write(fileDescriptor, comments.bytes, comments.length) == (ssize_t)comments.length;
+}
+
+
+#pragma mark - Eviction
+
+
+// On cache queue. Removes the least recently used entries until the cache fits within maximumSize.
+- (void)evictEntries {
+	NSArray *keys = @[NSURLContentModificationDateKey, NSURLTotalFileAllocatedSizeKey];
+	NSArray<NSURL*> *entries = [[NSFileManager defaultManager] contentsOfDirectoryAtURL:self.directoryURL includingPropertiesForKeys:keys options:NSDirectoryEnumerationSkipsHiddenFiles error:nil];
+	entries = [entries tf_selectWithBlock:^BOOL(NSURL *entry) {
+		return [entry.pathExtension isEqual:entryExtension];
+	}];
+	
+	NSDate *(^lastUse)(NSURL*) = ^(NSURL *entry) {
+		NSDate *date;
+		[entry getResourceValue:&date forKey:NSURLContentModificationDateKey error:nil];
+		return date ?: [NSDate distantPast];
+	};
+	entries = [entries sortedArrayUsingComparator:^NSComparisonResult(NSURL *a, NSURL *b) {
+		return [lastUse(b) compare:lastUse(a)];
+	}];
+	
+	uint64_t totalSize = 0;
+	for(NSURL *entry in entries) {
+		NSNumber *size;
+		[entry getResourceValue:&size forKey:NSURLTotalFileAllocatedSizeKey error:nil];
+		totalSize += size.unsignedLongLongValue;
+		
+		if(totalSize > self.maximumSize) {
+			TFLog(@"Evicting %@ from program cache", entry.lastPathComponent);
+			[[NSFileManager defaultManager] removeItemAtURL:entry error:nil];
+		}
+	}
+}
+
+
+@end
@@ -0,0 +1,20 @@
+//
+//  TFPGCodeWriter.h
+//  microprint
+//
+//
+
+#import <Foundation/Foundation.h>
+
+@class TFPGCode, TFPGCodeProgram;
+
+
+// Streams G-code text to a file in large buffered writes, so big programs are exported without building the text in memory.
+// Lines are separated by line breaks, with none after the last one, like -[TFPGCodeProgram ASCIIRepresentation].
+@interface TFPGCodeWriter : NSObject
+- (instancetype)initWithFileDescriptor:(int)fileDescriptor; // The caller owns and closes the descriptor
+
+- (BOOL)writeCode:(TFPGCode*)code error:(NSError**)outError;
+- (BOOL)writeProgram:(TFPGCodeProgram*)program error:(NSError**)outError;
+- (BOOL)flushWithError:(NSError**)outError;
+@end
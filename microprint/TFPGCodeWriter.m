@@ -0,0 +1,87 @@
+//
+//  TFPGCodeWriter.m
+//  microprint
+//
+//
+
+#import "TFPGCodeWriter.h"
+#import "TFPGCode.h"
+#import "TFPGCodeProgram.h"
+
+#include <unistd.h>
+
+
+static const NSUInteger bufferSize = 256 * 1024;
+
+
+
+@interface TFPGCodeWriter ()
+@property int fileDescriptor;
+@property NSMutableData *buffer;
+@property BOOL wroteFirstLine;
+@end
+
+
+
+@implementation TFPGCodeWriter
+
+
+- (instancetype)initWithFileDescriptor:(int)fileDescriptor {
+	if(!(self = [super init])) return nil;
+	
+	self.fileDescriptor = fileDescriptor;
+	self.buffer = [NSMutableData dataWithCapacity:bufferSize];
+	
+	return self;
+}
+
+
+- (BOOL)writeCode:(TFPGCode*)code error:(NSError**)outError {
+	if(self.wroteFirstLine) {
+		[self.buffer appendBytes:"\n" length:1];
+	}
+	self.wroteFirstLine = YES;
+	[code appendASCIIRepresentationToData:self.buffer];
+	
+	if(self.buffer.length >= bufferSize) {
+		return [self flushWithError:outError];
+	}
+	return YES;
+}
+
+
+- (BOOL)writeProgram:(TFPGCodeProgram*)program error:(NSError**)outError {
+	for(TFPGCode *code in program.lines) {
+		if(![self writeCode:code error:outError]) {
+			return NO;
+		}
+	}
+	return [self flushWithError:outError];
+}
+
+
+- (BOOL)flushWithError:(NSError**)outError {
+	const uint8_t *bytes = self.buffer.bytes;
+	NSUInteger remaining = self.buffer.length;
+	
+	while(remaining > 0) {
+		ssize_t written = write(self.fileDescriptor, bytes, remaining);
+		if(written < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+			if(outError) {
+				*outError = [NSError errorWithDomain:NSPOSIXErrorDomain code:errno userInfo:nil];
+			}
+			return NO;
+		}
+		bytes += written;
+		remaining -= written;
+	}
+	
+	self.buffer.length = 0;
+	return YES;
+}
+
+
+@end
@@ -0,0 +1,18 @@
+//
+//  TFPInflateStream.h
+//  microprint
+//
+//
+
+#import <Foundation/Foundation.h>
+
+
+// Incremental zlib or gzip decompression, detected from the header. Input can be fed in pieces of any size,
+// and output is handed out in fixed-size chunks as it's produced, so nothing grows with the decompressed size.
+// Concatenated gzip members are decoded as one stream, and anything else after the end of the data is ignored.
+@interface TFPInflateStream : NSObject
+// The bytes passed to the handler are only valid during the call. Returns NO if the data is corrupt.
+- (BOOL)inflateBytes:(const void*)bytes length:(NSUInteger)length outputHandler:(void(^)(const void *bytes, NSUInteger length))handler;
+
+@property (readonly) BOOL finished; // The end of the compressed data was reached
+@end
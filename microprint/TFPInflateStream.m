@@ -0,0 +1,98 @@
+//
+//  TFPInflateStream.m
+//  microprint
+//
+//
+
+#import "TFPInflateStream.h"
+#import "zlib.h"
+
+
+static const NSUInteger outputChunkSize = 256 * 1024;
+
+
+@interface TFPInflateStream ()
+@property (readwrite) BOOL finished;
+@property BOOL failed;
+@property BOOL ignoringTrailingData;
+@end
+
+
+
+@implementation TFPInflateStream {
+	z_stream _stream;
+	uint8_t *_output;
+}
+
+
+- (instancetype)init {
+	if(!(self = [super init])) return nil;
+	
+	// 32 added to the window bits makes zlib detect zlib and gzip headers
+	if(inflateInit2(&_stream, 15 + 32) != Z_OK) {
+		return nil;
+	}
+	_output = malloc(outputChunkSize);
+	
+	return self;
+}
+
+
+- (void)dealloc {
+	inflateEnd(&_stream);
+	free(_output);
+}
+
+
+- (BOOL)inflateBytes:(const void*)bytes length:(NSUInteger)length outputHandler:(void(^)(const void *bytes, NSUInteger length))handler {
+	if(self.failed) {
+		return NO;
+	}else if(self.ignoringTrailingData) {
+		return YES;
+	}
+	
+	_stream.next_in = (Bytef *)bytes;
+	_stream.avail_in = (uInt)length;
+	
+	while(_stream.avail_in > 0 || !self.finished) {
+		// Another gzip member may follow. Anything else, like padding, is ignored, as gzip does.
+		if(self.finished) {
+			if(![self inputStartsGzipMember]) {
+				self.ignoringTrailingData = YES;
+				break;
+			}
+			inflateReset(&_stream);
+			self.finished = NO;
+		}
+		
+		_stream.next_out = _output;
+		_stream.avail_out = (uInt)outputChunkSize;
+		int status = inflate(&_stream, Z_NO_FLUSH);
+		
+		NSUInteger produced = outputChunkSize - _stream.avail_out;
+		if(produced) {
+			handler(_output, produced);
+		}
+		
+		if(status == Z_STREAM_END) {
+			self.finished = YES;
+		}else if(status == Z_BUF_ERROR || (status == Z_OK && produced == 0 && _stream.avail_in == 0)) {
+			// Needs more input
+			break;
+		}else if(status != Z_OK) {
+			self.failed = YES;
+			return NO;
+		}
+	}
+	
+	return YES;
+}
+
+
+// A lone first byte that matches is given the benefit of the doubt
+- (BOOL)inputStartsGzipMember {
+	return _stream.next_in[0] == 0x1F && (_stream.avail_in < 2 || _stream.next_in[1] == 0x8B);
+}
+
+
+@end
@@ -0,0 +1,33 @@
+//
+//  TFPMotionOptimizer.h
+//  microprint
+//
+//
+
+#import <Foundation/Foundation.h>
+#import "TFPGCodeHelpers.h"
+
+@class TFPPrintParameters;
+
+
+// Removes moves that cost a round trip to the printer without doing anything: zero-length moves, F values that
+// restate the current feed rate, and runs of collinear segments, which are merged into one move if no point
+// strays more than maximumDeviation from it and the segments extrude at the same rate.
+// Only moves in absolute mode are merged or removed, and never across a line that isn't a move, so comments,
+// layer markers and phase boundaries all stay where they are relative to the moves around them.
+@interface TFPMotionOptimizer : NSObject
+- (instancetype)initWithProgram:(TFPGCodeProgram*)program maximumDeviation:(double)maximumDeviation; // mm
+
+// Nil if the parameters leave optimization off. Takes a while for big programs, so run it off the main queue where the
+// program is loaded, then give the job the optimized program and the optimizer.
++ (instancetype)optimizerForProgram:(TFPGCodeProgram*)program parameters:(TFPPrintParameters*)parameters;
+
+// The original program if nothing could be removed
+@property (readonly) TFPGCodeProgram *optimizedProgram;
+
+@property (readonly) NSUInteger removedLineCount;
+@property (readonly) NSUInteger removedFeedRateCount; // F fields stripped from lines that were kept
+
+// Round trips saved plus any difference in estimated move time
+@property (readonly) NSTimeInterval estimatedTimeSaved;
+@end
@@ -0,0 +1,357 @@
+//
+//  TFPMotionOptimizer.m
+//  microprint
+//
+//
+
+#import "TFPMotionOptimizer.h"
+#import "TFPPrintParameters.h"
+#import "TFPExtras.h"
+
+
+// Rough time for the Micro to acknowledge one code over USB
+static const NSTimeInterval roundTripTime = 0.01;
+
+// Segments in a merged run extrude within this fraction of the run's average rate
+static const double extrusionRatioTolerance = 0.02;
+
+// Moves shorter than this, in mm, stand still
+static const double minimumMoveLength = 1e-6;
+
+// Keeps the collinearity check cheap on long curves
+static const NSUInteger maximumRunLength = 256;
+
+
+typedef struct {
+	TFPAbsolutePosition to;
+	double length;
+	double extrusion;
+} TFPMotionSegment;
+
+
+static TFPAbsolutePosition TFPAbsolutePositionSubtract(TFPAbsolutePosition a, TFPAbsolutePosition b) {
+	return (TFPAbsolutePosition){.x = a.x - b.x, .y = a.y - b.y, .z = a.z - b.z, .e = a.e - b.e};
+}
+
+
+static double TFPAbsolutePositionDot(TFPAbsolutePosition a, TFPAbsolutePosition b) {
+	return a.x * b.x + a.y * b.y + a.z * b.z;
+}
+
+
+// The segments, starting at start, can be replaced by a straight move to the end of the last one
+static BOOL TFPMotionSegmentsCanMerge(TFPAbsolutePosition start, const TFPMotionSegment *segments, NSUInteger count, double maximumDeviation) {
+	TFPAbsolutePosition chord = TFPAbsolutePositionSubtract(segments[count-1].to, start);
+	double chordLength = sqrt(TFPAbsolutePositionDot(chord, chord));
+	if(chordLength < minimumMoveLength) {
+		return NO;
+	}
+	
+	double pathLength = 0;
+	for(NSUInteger i=0; i<count; i++) {
+		pathLength += segments[i].length;
+	}
+	double ratio = chord.e / pathLength;
+	
+	TFPAbsolutePosition previous = start;
+	for(NSUInteger i=0; i<count; i++) {
+		const TFPMotionSegment *segment = &segments[i];
+		
+		// Every segment has to move forward along the chord; one that doubles back has no deviation but isn't a no-op
+		TFPAbsolutePosition step = TFPAbsolutePositionSubtract(segment->to, previous);
+		if(TFPAbsolutePositionDot(step, chord) <= 0) {
+			return NO;
+		}
+		previous = segment->to;
+		
+		TFPAbsolutePosition offset = TFPAbsolutePositionSubtract(segment->to, start);
+		double along = TFPAbsolutePositionDot(offset, chord) / chordLength;
+		double deviation = sqrt(MAX(TFPAbsolutePositionDot(offset, offset) - along * along, 0));
+		if(deviation > maximumDeviation) {
+			return NO;
+		}
+		
+		double segmentRatio = segment->extrusion / segment->length;
+		if(fabs(segmentRatio - ratio) > extrusionRatioTolerance * fabs(ratio)) {
+			return NO;
+		}
+	}
+	return YES;
+}
+
+
+
+@interface TFPMotionOptimizer ()
+@property (readwrite) TFPGCodeProgram *optimizedProgram;
+@property (readwrite) NSUInteger removedLineCount;
+@property (readwrite) NSUInteger removedFeedRateCount;
+@property (readwrite) NSTimeInterval estimatedTimeSaved;
+
+@property double maximumDeviation;
+@property NSMutableArray<TFPGCode*> *lines;
+
+@property double emittedFeedRate; // What the printer will have after the lines so far. NaN if unknown.
+@property BOOL feedRateCarried; // A removed line changed the feed rate, so the next move has to
+@property double carriedFeedRate;
+
+@property BOOL relativeMode;
+@property BOOL relativeExtrusion;
+
+@property TFPAbsolutePosition runStart;
+@property double runFeedRate;
+@property NSMutableArray<TFPGCode*> *runCodes;
+@property NSMutableArray<TFPGCode*> *runBlankLines;
+@end
+
+
+@implementation TFPMotionOptimizer {
+	TFPMotionSegment *_runSegments;
+}
+
+
+- (instancetype)initWithProgram:(TFPGCodeProgram*)program maximumDeviation:(double)maximumDeviation {
+	if(!(self = [super init])) return nil;
+	
+	uint64_t start = TFNanosecondTime();
+	self.maximumDeviation = maximumDeviation;
+	self.lines = [NSMutableArray arrayWithCapacity:program.lines.count];
+	self.emittedFeedRate = NAN;
+	self.runCodes = [NSMutableArray new];
+	self.runBlankLines = [NSMutableArray new];
+	_runSegments = malloc(maximumRunLength * sizeof(TFPMotionSegment));
+	
+	NSArray<TFPGCode*> *lines = program.lines;
+	__block NSUInteger nextLine = 0;
+	
+	[program enumerateMovesWithBlock:^(TFPAbsolutePosition from, TFPAbsolutePosition to, double feedRate, TFPGCode *code, NSUInteger index) {
+		for(; nextLine < index; nextLine++) {
+			[self addOtherLine:lines[nextLine]];
+		}
+		[self addMove:code from:from to:to feedRate:feedRate];
+		nextLine = index + 1;
+	}];
+	
+	for(; nextLine < lines.count; nextLine++) {
+		[self addOtherLine:lines[nextLine]];
+	}
+	[self flushRun];
+	
+	TFPGCodeProgram *optimizedProgram = [TFPGCodeProgram programWithLines:self.lines];
+	self.lines = nil;
+	
+	if(!self.removedLineCount && !self.removedFeedRateCount) {
+		self.optimizedProgram = program;
+		return self;
+	}
+	
+	if(![self program:optimizedProgram hasSameLayersAsProgram:program]) {
+		TFLog(@"Motion optimization changed the layers of the program; using the original");
+		self.optimizedProgram = program;
+		self.removedLineCount = 0;
+		self.removedFeedRateCount = 0;
+		return self;
+	}
+	
+	self.optimizedProgram = optimizedProgram;
+	NSTimeInterval moveTimeSaved = [program estimateDurationWithLineDurations:NULL] - [optimizedProgram estimateDurationWithLineDurations:NULL];
+	self.estimatedTimeSaved = self.removedLineCount * roundTripTime + moveTimeSaved;
+	
+	TFLog(@"Optimized motion in %.02f s: removed %ld of %ld lines and %ld feed rates, saving an estimated %.0f s",
+		  (double)(TFNanosecondTime() - start) / NSEC_PER_SEC, (long)self.removedLineCount, (long)lines.count, (long)self.removedFeedRateCount, self.estimatedTimeSaved);
+	
+	return self;
+}
+
+
++ (instancetype)optimizerForProgram:(TFPGCodeProgram*)program parameters:(TFPPrintParameters*)parameters {
+	if(!program || !(parameters.motionOptimizationTolerance > 0)) {
+		return nil;
+	}
+	return [[self alloc] initWithProgram:program maximumDeviation:parameters.motionOptimizationTolerance];
+}
+
+
+- (void)dealloc {
+	free(_runSegments);
+}
+
+
+// Merges never cross a layer marker, so this only fails if the passes above have a bug
+- (BOOL)program:(TFPGCodeProgram*)optimizedProgram hasSameLayersAsProgram:(TFPGCodeProgram*)program {
+	NSArray *layerIndexes = [[program determineLayers] valueForKey:@"layerIndex"];
+	NSArray *optimizedLayerIndexes = [[optimizedProgram determineLayers] valueForKey:@"layerIndex"];
+	NSSet *phases = [NSSet setWithArray:[program determinePhaseRanges].allKeys];
+	NSSet *optimizedPhases = [NSSet setWithArray:[optimizedProgram determinePhaseRanges].allKeys];
+	return [layerIndexes isEqual:optimizedLayerIndexes] && [phases isEqual:optimizedPhases];
+}
+
+
+// Comments are kept, so a move with one can't be removed or merged away
++ (BOOL)codeHasOnlyMoveFields:(TFPGCode*)code {
+	return !code.comment && ![code hasField:'N'] && ![code hasField:'M'] && ![code hasField:'S'] && ![code hasField:'P'];
+}
+
+
+#pragma mark - Lines
+
+
+// Anything that isn't a move ends the current run, except blank lines, which never reach the printer
+- (void)addOtherLine:(TFPGCode*)code {
+	if(!code.hasFields && !code.comment) {
+		if(self.runCodes.count) {
+			[self.runBlankLines addObject:code];
+		}else{
+			[self.lines addObject:code];
+		}
+		return;
+	}
+	
+	[self flushRun];
+	
+	NSInteger G = [code valueForField:'G' fallback:-1];
+	NSInteger M = [code valueForField:'M' fallback:-1];
+	BOOL resetsFeedRate = (G > -1 && G != 4 && G != 90 && G != 91 && G != 92);
+	
+	// Homing and the like may leave the printer with any feed rate. TFPPrinter puts back the last F it sent
+	// afterwards, so an F that a removed line would have set has to be sent before it.
+	if(resetsFeedRate && self.feedRateCarried) {
+		[self.lines addObject:[TFPGCode codeForSettingFeedRate:self.carriedFeedRate]];
+		self.removedLineCount--;
+	}
+	[self.lines addObject:code];
+	
+	if(G == 90) {
+		self.relativeMode = NO;
+	}else if(G == 91) {
+		self.relativeMode = YES;
+	}else if(resetsFeedRate) {
+		self.emittedFeedRate = NAN;
+		self.feedRateCarried = NO;
+	}
+	
+	if(M == 82) {
+		self.relativeExtrusion = NO;
+	}else if(M == 83) {
+		self.relativeExtrusion = YES;
+	}
+}
+
+
+- (void)addMove:(TFPGCode*)code from:(TFPAbsolutePosition)from to:(TFPAbsolutePosition)to feedRate:(double)feedRate {
+	BOOL eligible = !self.relativeMode && !self.relativeExtrusion && [self.class codeHasOnlyMoveFields:code];
+	double length = TFPAbsolutePositionDistance(from, to);
+	double extrusion = to.e - from.e;
+	
+	if(eligible && length < minimumMoveLength && fabs(extrusion) < minimumMoveLength) {
+		// Stands still. Any feed rate it sets is passed on to the next move.
+		if([code hasField:'F']) {
+			self.feedRateCarried = YES;
+			self.carriedFeedRate = feedRate;
+		}
+		self.removedLineCount++;
+		return;
+	}
+	
+	BOOL mergeable = eligible && length >= minimumMoveLength;
+	TFPMotionSegment segment = {.to = to, .length = length, .extrusion = extrusion};
+	if(mergeable && [self extendRunWithCode:code segment:segment feedRate:feedRate]) {
+		return;
+	}
+	
+	[self flushRun];
+	if(mergeable) {
+		self.runStart = from;
+		self.runFeedRate = feedRate;
+		_runSegments[0] = segment;
+		[self.runCodes addObject:code];
+	}else{
+		[self emitMove:code feedRate:feedRate];
+	}
+}
+
+
+- (BOOL)extendRunWithCode:(TFPGCode*)code segment:(TFPMotionSegment)segment feedRate:(double)feedRate {
+	NSUInteger count = self.runCodes.count;
+	if(!count || count >= maximumRunLength || feedRate != self.runFeedRate || code.G != self.runCodes.firstObject.G) {
+		return NO;
+	}
+	
+	_runSegments[count] = segment;
+	if(!TFPMotionSegmentsCanMerge(self.runStart, _runSegments, count + 1, self.maximumDeviation)) {
+		return NO;
+	}
+	[self.runCodes addObject:code];
+	return YES;
+}
+
+
+// A merged run becomes the code of its last segment, with every axis that any segment in the run moved
+- (void)flushRun {
+	NSArray<TFPGCode*> *codes = self.runCodes;
+	if(!codes.count) {
+		return;
+	}
+	
+	if(codes.count == 1) {
+		[self emitMove:codes.firstObject feedRate:self.runFeedRate];
+		[self.lines addObjectsFromArray:self.runBlankLines];
+	
+	}else{
+		TFPGCode *mergedCode = codes.lastObject;
+		for(const char *axis = "XYZE"; *axis; axis++) {
+			if([mergedCode hasField:*axis]) {
+				continue;
+			}
+			for(TFPGCode *code in codes.reverseObjectEnumerator) {
+				if([code hasField:*axis]) {
+					mergedCode = [mergedCode codeBySettingField:*axis toValue:[code valueForField:*axis]];
+					break;
+				}
+			}
+		}
+		
+		for(NSUInteger i=0; i<codes.count-1; i++) {
+			if([codes[i] hasField:'F']) {
+				self.feedRateCarried = YES;
+				self.carriedFeedRate = self.runFeedRate;
+			}
+		}
+		
+		[self.lines addObjectsFromArray:self.runBlankLines];
+		[self emitMove:mergedCode feedRate:self.runFeedRate];
+		self.removedLineCount += codes.count - 1;
+	}
+	
+	[self.runCodes removeAllObjects];
+	[self.runBlankLines removeAllObjects];
+}
+
+
+// F is left out where the printer already has it, and added where a removed line would have set it
+- (void)emitMove:(TFPGCode*)code feedRate:(double)feedRate {
+	if([code hasField:'F']) {
+		if([code valueForField:'F'] == self.emittedFeedRate) {
+			code = [code codeByRemovingField:'F'];
+			self.removedFeedRateCount++;
+			
+			// A bare G0 or G1 does nothing at all
+			if(![code hasField:'X'] && ![code hasField:'Y'] && ![code hasField:'Z'] && ![code hasField:'E'] && [self.class codeHasOnlyMoveFields:code]) {
+				self.removedFeedRateCount--;
+				self.removedLineCount++;
+				self.feedRateCarried = NO;
+				return;
+			}
+		}
+	}else if(feedRate > 0 && feedRate != self.emittedFeedRate && (!isnan(self.emittedFeedRate) || self.feedRateCarried)) {
+		code = [code codeBySettingField:'F' toValue:feedRate];
+	}
+	
+	if([code hasField:'F']) {
+		self.emittedFeedRate = [code valueForField:'F'];
+	}
+	self.feedRateCarried = NO;
+	[self.lines addObject:code];
+}
+
+
+@end
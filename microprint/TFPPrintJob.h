@@ -11,6 +11,8 @@
 #import "TFPPrintParameters.h"
 #import "TFPOperation.h"
 
+@class TFPMotionOptimizer;
+
 
 typedef NS_ENUM(NSUInteger, TFPPrintJobState) {
 	TFPPrintJobStatePreparing,
@@ -28,9 +30,13 @@ typedef NS_ENUM(NSUInteger, TFPPrintJobState) {
 - (instancetype)initWithProgram:(TFPGCodeProgram*)program printer:(TFPPrinter*)printer printParameters:(TFPPrintParameters*)params;
 
 @property (readonly) TFPGCodeProgram *program;
+@property TFPMotionOptimizer *motionOptimizer; // Whatever optimized the program before it was handed over, for reporting. Set before -start.
 
 @property (readonly) NSUInteger completedRequests; //Observable
 @property (readonly) NSTimeInterval elapsedTime;
+@property (readonly) NSTimeInterval lastPauseLatency; // From the latest pause request until the printer stopped taking job codes
+@property (readonly) NSTimeInterval lastAbortLatency; // From the abort or emergency stop request until its stop codes were done
+@property (readonly) NSTimeInterval temperatureWaitTime; // Spent waiting at layer boundaries for thermal bonding temperature changes
 
 @property (readonly) TFPPrintJobState state;
 @property (copy, readonly) NSArray<TFPPrintLayer*> *layers;
@@ -40,6 +46,15 @@ typedef NS_ENUM(NSUInteger, TFPPrintJobState) {
 @property (copy) void(^abortionBlock)(void);
 
 - (void)abort;
+- (void)emergencyStop; // Cuts motors, heater and fan right away instead of raising the head and parking first. Ends like an abort.
 - (void)pause;
 - (void)resume;
+
+// For when the printer has gone away. Stops without sending anything more and keeps the journal, so a new job for the
+// same file can continue from the last checkpoint once the printer is back. Neither completion nor abortion block is called.
+- (void)abandon;
+
+// Continues from the last checkpoint in parameters.journalURL instead of starting over. Call before -start.
+- (BOOL)prepareToResumeFromJournal:(NSError**)outError;
+@property (readonly) BOOL resumingFromJournal;
 @end
\ No newline at end of file
@@ -12,11 +12,23 @@
 #import "TFPGCodeHelpers.h"
 #import "TFPStopwatch.h"
 #import "TFP3DVector.h"
+#import "TFPThermalBondingScheduler.h"
+#import "TFPPrintJournal.h"
+#import "TFPVirtualClock.h"
 
 @import IOKit.pwr_mgt;
 #import "MAKVONotificationCenter.h"
 
 
+// Time from a pause or abort request until the printer has stopped taking new codes from the job
+static const NSTimeInterval maximumPauseLatency = 2;
+
+
+// Codes cancelled by a preemption are dealt with in its cancellation handler
+static BOOL TFPResponseWasCancelled(BOOL success, TFPGCodeResponseDictionary value) {
+	return !success && [value[(NSString*)TFPPrinterResponseErrorCodeKey] integerValue] == TFPPrinterResponseErrorCodeCancelled;
+}
+
 
 @interface TFPPrintJob ()
 @property dispatch_queue_t printQueue;
@@ -32,18 +44,36 @@
 @property (copy) void(^heatingCancelBlock)();
 
 @property BOOL pendingRequest;
+@property NSUInteger unpublishedRequestCount;
+@property BOOL progressUpdatePending;
+@property TFPGCode *pendingCode;
+@property NSInteger pendingCodeOffset;
 @property (readwrite) NSUInteger completedRequests;
 
 @property (readwrite) TFPOperationStage stage;
 @property TFPStopwatch *stopwatch;
 
 @property (copy, readwrite) NSArray<TFPPrintLayer*> *layers;
-@property NSUInteger previousLayerIndex;
+@property TFPThermalBondingScheduler *temperatureScheduler;
+@property NSUInteger temperatureChangeIndex;
+@property BOOL temperatureChangeIssued;
+@property (readwrite) NSTimeInterval temperatureWaitTime;
+@property TFPGCode *temperatureChangeCode;
+@property TFPGCode *temperatureCheckCode;
 
 @property BOOL paused;
 @property TFPAbsolutePosition pausePosition;
 @property double pauseTemperature;
 @property double pauseFeedRate;
+@property (readwrite) NSTimeInterval lastPauseLatency;
+@property (readwrite) NSTimeInterval lastAbortLatency;
+
+@property TFPPrintJournal *journal;
+@property TFPMoveState acknowledgedMoveState; // On print queue. Where the job's acknowledged codes have taken the head.
+@property double acknowledgedTemperature;
+@property NSUInteger checkpointLayerIndex;
+@property TFPPrintCheckpoint resumeCheckpoint;
+@property (readwrite) BOOL resumingFromJournal;
 @end
 
 
@@ -56,12 +86,18 @@
 	if(!(self = [super initWithPrinter:printer])) return nil;
 	
 	self.printQueue = dispatch_queue_create("se.tomasf.microprint.printJob", DISPATCH_QUEUE_SERIAL);
+	[TFPVirtualClock registerQueue:self.printQueue];
+	
 	self.program = program;
 	self.parameters = params;
 	
 	self.stopwatch = [TFPStopwatch new];
 	self.layers = [program determineLayers];
 	
+	if(params.useThermalBonding) {
+		self.temperatureScheduler = [[TFPThermalBondingScheduler alloc] initWithProgram:program layers:self.layers parameters:params];
+	}
+	
 	return self;
 }
 
@@ -88,6 +124,14 @@
 - (void)jobDidComplete {
 	[self.stopwatch stop];
 	[self jobEnded];
+	[self.journal closeRemovingFile:YES];
+	
+	if(self.parameters.verbose && self.temperatureScheduler) {
+		// Only the fallback waits are measured here. The blocking baseline comes from the scheduler's heater model;
+		// the thermal bonding benchmark in the debug menu measures it on a dry run printer.
+		NSTimeInterval blockingTime = self.temperatureScheduler.estimatedBlockingWaitTime;
+		TFLog(@"Thermal bonding: measured %.01f s of fallback waits; blocking M109s would have taken an estimated %.01f s (heater model, not measured)", self.temperatureWaitTime, blockingTime);
+	}
 	
 	if(self.completionBlock) {
 		self.completionBlock();
@@ -116,6 +160,9 @@
 		
 	} else {
 		[self.context sendGCode:code responseHandler:^(BOOL success, NSDictionary *value) {
+			if(TFPResponseWasCancelled(success, value)) {
+				return;
+			}
 			completionHandler();
 		}];
 	}
@@ -128,44 +175,114 @@
 	
 	uint64_t sendTime = TFNanosecondTime();
 	self.pendingRequest = YES;
+	self.pendingCode = code;
+	self.pendingCodeOffset = self.codeOffset-1;
 	
 	[self sendCode:code completionHandler:^{
 		weakSelf.pendingRequest = NO;
+		weakSelf.pendingCode = nil;
 		
-		dispatch_async(dispatch_get_main_queue(), ^{
-			weakSelf.completedRequests++;
-		});
+		TFPMoveState moveState = weakSelf.acknowledgedMoveState;
+		TFPAbsolutePosition from;
+		TFPMoveStateApplyCode(&moveState, code, &from);
+		weakSelf.acknowledgedMoveState = moveState;
 		
+		[weakSelf recordCheckpoint];
+		[weakSelf publishCompletedRequests:1];
 		[weakSelf sendMoreIfNeeded];
 		if(weakSelf.parameters.verbose) {
 			TFLog(@"%d of %d codes. Got response for %@ after %.03f s", (int)weakSelf.completedRequests, (int)weakSelf.program.lines.count, code, ((double)(TFNanosecondTime()-sendTime)) / NSEC_PER_SEC);
 		}
-		if(weakSelf.progressBlock && !self.aborted) {
-			dispatch_async(dispatch_get_main_queue(), ^{
-				if(weakSelf.progressBlock) {
-					weakSelf.progressBlock();
-				}
-			});
-		}
 	}];
 }
 
 
 // Called on print queue
-- (TFPGCode*)popNextLine {
-	while(self.codeOffset < self.program.lines.count && !self.program.lines[self.codeOffset].hasFields) {
-		TFPGCode *code = self.program.lines[self.codeOffset];
-		if(code.comment.length) {
-			[self.printer sendNotice:@"Comment: %@", code.comment];
+// With many printers on one host, a main queue hop per code adds up. Keep at most one progress update in flight and let it pick up everything completed since.
+- (void)publishCompletedRequests:(NSUInteger)count {
+	__weak __typeof__(self) weakSelf = self;
+	
+	@synchronized(self) {
+		self.unpublishedRequestCount += count;
+		if(self.progressUpdatePending) {
+			return;
+		}
+		self.progressUpdatePending = YES;
+	}
+	
+	dispatch_async(dispatch_get_main_queue(), ^{
+		NSUInteger completedCount;
+		@synchronized(weakSelf) {
+			completedCount = weakSelf.unpublishedRequestCount;
+			weakSelf.unpublishedRequestCount = 0;
+			weakSelf.progressUpdatePending = NO;
+		}
+		
+		weakSelf.completedRequests += completedCount;
+		if(weakSelf.progressBlock && !weakSelf.aborted) {
+			weakSelf.progressBlock();
+		}
+	});
+}
+
+
+// Called on print queue
+- (void)recordCheckpoint {
+	if(!self.journal) {
+		return;
+	}
+	
+	NSArray<TFPPrintLayer*> *layers = self.layers;
+	while(self.checkpointLayerIndex+1 < layers.count && self.codeOffset >= layers[self.checkpointLayerIndex+1].lineRange.location) {
+		self.checkpointLayerIndex++;
+	}
+	
+	// The printer's own state is updated on its queue and can be ahead of or behind this point
+	TFPMoveState moveState = self.acknowledgedMoveState;
+	TFPPrintCheckpoint checkpoint = {
+		.lineOffset = self.codeOffset,
+		.position = moveState.position,
+		.feedRate = moveState.feedRate,
+		.temperature = self.acknowledgedTemperature,
+		.layerIndex = (uint32_t)self.checkpointLayerIndex,
+		.relativeMode = moveState.relativeMode,
+	};
+	[self.journal recordCheckpoint:checkpoint];
+}
+
+
+// Called on print queue
+- (void)reportCommentsInRange:(NSRange)range {
+	NSDictionary<NSNumber*, NSString*> *comments = self.program.commentsByLine;
+	for(NSUInteger i=range.location; i<NSMaxRange(range); i++) {
+		NSString *comment = comments[@(i)];
+		if(comment) {
+			[self.printer sendNotice:@"Comment: %@", comment];
 		}
+	}
+}
 
-		self.codeOffset++;
-		dispatch_async(dispatch_get_main_queue(), ^{
-			self.completedRequests++;
-		});
+
+// Called on print queue
+- (TFPGCode*)popNextLine {
+	NSUInteger lineCount = self.program.lines.count;
+	NSUInteger nextIndex = [self.program.executableLineIndexes indexGreaterThanOrEqualToIndex:self.codeOffset];
+	if(nextIndex == NSNotFound) {
+		nextIndex = lineCount;
+	}
+	
+	// Skip past non-executable lines in one go, but keep progress in terms of original line numbers
+	NSUInteger skipCount = nextIndex - self.codeOffset;
+	if(skipCount > 0) {
+		if(self.parameters.reportComments) {
+			[self reportCommentsInRange:NSMakeRange(self.codeOffset, skipCount)];
+		}
+		
+		self.codeOffset = nextIndex;
+		[self publishCompletedRequests:skipCount];
 	}
 	
-	if(self.codeOffset >= self.program.lines.count) {
+	if(self.codeOffset >= lineCount) {
 		return nil;
 	}
 	
@@ -176,34 +293,63 @@
 }
 
 
-- (NSUInteger)layerIndexAtCodeOffset:(NSUInteger)offset {
-	return [self.layers indexesOfObjectsPassingTest:^BOOL(TFPPrintLayer *layer, NSUInteger index, BOOL *stop) {
-		return NSLocationInRange(offset, layer.lineRange);
-	}].firstIndex;
+// Called on print queue
+- (void)verifyTemperatureForChange:(TFPTemperatureChange*)change {
+	const double temperatureTolerance = 3;
+	
+	self.temperatureCheckCode = [TFPGCode codeForReadingHeaterTemperature];
+	[self.context sendGCode:self.temperatureCheckCode responseHandler:^(BOOL success, TFPGCodeResponseDictionary value) {
+		if(TFPResponseWasCancelled(success, value)) {
+			return;
+		}
+		self.temperatureCheckCode = nil;
+		double temperature = value[@"T"] ? value[@"T"].doubleValue : self.printer.heaterTemperature;
+		
+		if(fabs(temperature - change.temperature) <= temperatureTolerance) {
+			[self sendMoreIfNeeded];
+			return;
+		}
+		
+		// Didn't make it in time; fall back to waiting for the remainder
+		uint64_t waitStart = TFNanosecondTime();
+		self.temperatureCheckCode = [TFPGCode codeForHeaterTemperature:change.temperature waitUntilDone:YES];
+		[self.context sendGCode:self.temperatureCheckCode responseHandler:^(BOOL success, TFPGCodeResponseDictionary value) {
+			if(TFPResponseWasCancelled(success, value)) {
+				return;
+			}
+			self.temperatureCheckCode = nil;
+			self.temperatureWaitTime += (double)(TFNanosecondTime() - waitStart) / NSEC_PER_SEC;
+			[self sendMoreIfNeeded];
+		}];
+	}];
 }
 
 
+// Called on print queue
 - (BOOL)adjustTemperatureIfNeeded {
-	if (!self.parameters.useThermalBonding) {
+	NSArray<TFPTemperatureChange*> *changes = self.temperatureScheduler.changes;
+	if(self.temperatureChangeIndex >= changes.count) {
 		return NO;
 	}
+	TFPTemperatureChange *change = changes[self.temperatureChangeIndex];
 	
-	NSUInteger layerIndex = [self layerIndexAtCodeOffset:self.codeOffset];
-	if(layerIndex != self.previousLayerIndex) {
-		self.previousLayerIndex = layerIndex;
-		
-		if(layerIndex == 0 || layerIndex == 1) {
-			double temperature = self.parameters.temperature;
-			if(layerIndex == 0) {
-				temperature = TFPBoundedTemperature(temperature + self.parameters.filament.temperatureIncreaseForFirstLayer);
+	if(!self.temperatureChangeIssued && self.codeOffset >= change.issueLine) {
+		self.temperatureChangeIssued = YES;
+		self.temperatureChangeCode = [TFPGCode codeForHeaterTemperature:change.temperature waitUntilDone:NO];
+		[self.context sendGCode:self.temperatureChangeCode responseHandler:^(BOOL success, TFPGCodeResponseDictionary value) {
+			if(TFPResponseWasCancelled(success, value)) {
+				return;
 			}
-			
-			[self.context sendGCode:[TFPGCode codeForHeaterTemperature:temperature waitUntilDone:YES] responseHandler:^(BOOL success, TFPGCodeResponseDictionary value) {
-				[self sendMoreIfNeeded];
-			}];
-			
-			return YES;
-		}
+			self.temperatureChangeCode = nil;
+			self.acknowledgedTemperature = change.temperature;
+		}];
+	}
+	
+	if(self.codeOffset >= change.boundaryLine) {
+		self.temperatureChangeIndex++;
+		self.temperatureChangeIssued = NO;
+		[self verifyTemperatureForChange:change];
+		return YES;
 	}
 	return NO;
 }
@@ -240,8 +386,13 @@
 	}
 	
 	self.stage = TFPOperationStageRunning;
+	TFPPrinter *printer = self.printer;
 	
 	dispatch_async(self.printQueue, ^{
+		// The preamble has been acknowledged and nothing else is in flight, so the printer's state is settled here.
+		// From now on, checkpoints follow the job's own codes.
+		self.acknowledgedMoveState = (TFPMoveState){.position = printer.position, .feedRate = printer.feedrate, .relativeMode = printer.relativeMode};
+		self.acknowledgedTemperature = printer.heaterTargetTemperature;
 		[self sendMoreIfNeeded];
 	});
 }
@@ -253,17 +404,25 @@
 
 	TFPPrintParameters *parameters = self.parameters;
 	
-	NSArray *part1 = @[[TFPGCode codeForSettingFanSpeed:parameters.filament.fanSpeed],
-					   [TFPGCode codeForHeaterTemperature:TFPBoundedTemperature(parameters.temperature) waitUntilDone:NO],
-					   [TFPGCode absoluteModeCode],
-					   [TFPGCode moveWithPosition:[TFP3DVector zVector:5] feedRate:2900],
-					   [TFPGCode moveHomeCode]];
+	NSMutableArray *part1 = [@[[TFPGCode codeForSettingFanSpeed:parameters.filament.fanSpeed],
+							   [TFPGCode codeForHeaterTemperature:TFPBoundedTemperature(parameters.temperature) waitUntilDone:NO],
+							   [TFPGCode absoluteModeCode]] mutableCopy];
 	
-	NSArray *part2 = @[[TFPGCode relativeModeCode],
-					   [TFPGCode codeForExtrusion:2 feedRate:2000],
-					   [TFPGCode resetExtrusionCode],
-					   [TFPGCode absoluteModeCode],
-					   [TFPGCode codeForSettingFeedRate:2400]];
+	// A warm start is already homed and hot, so heating below finishes right away
+	if(!parameters.startsWarm) {
+		[part1 addObject:[TFPGCode moveWithPosition:[TFP3DVector zVector:5] feedRate:2900]];
+		[part1 addObject:[TFPGCode moveHomeCode]];
+	}
+	
+	double purgeLength = parameters.startsWarm ? parameters.handoffPurgeLength : 2;
+	NSMutableArray *part2 = [NSMutableArray new];
+	if(purgeLength > 0) {
+		[part2 addObject:[TFPGCode relativeModeCode]];
+		[part2 addObject:[TFPGCode codeForExtrusion:purgeLength feedRate:2000]];
+	}
+	[part2 addObjectsFromArray:@[[TFPGCode resetExtrusionCode],
+								 [TFPGCode absoluteModeCode],
+								 [TFPGCode codeForSettingFeedRate:2400]]];
 	
 	[self.context runGCodeProgram:[TFPGCodeProgram programWithLines:part1] completionHandler:^(BOOL success, NSArray<TFPGCodeResponseDictionary> *values) {
 		if(self.aborted) {
@@ -288,6 +447,98 @@
 }
 
 
+- (BOOL)prepareToResumeFromJournal:(NSError**)outError {
+	if(!self.parameters.journalURL) {
+		return NO;
+	}
+	
+	TFPPrintCheckpoint checkpoint;
+	if(![TFPPrintJournal readLatestCheckpoint:&checkpoint fromURL:self.parameters.journalURL program:self.program error:outError]) {
+		return NO;
+	}
+	
+	self.resumeCheckpoint = checkpoint;
+	self.resumingFromJournal = YES;
+	return YES;
+}
+
+
+- (void)skipToCheckpoint:(TFPPrintCheckpoint)checkpoint {
+	self.codeOffset = checkpoint.lineOffset;
+	self.completedRequests = checkpoint.lineOffset;
+	self.checkpointLayerIndex = checkpoint.layerIndex;
+	
+	// Changes for layers we're already past are done; one right at the boundary still needs verifying
+	for(TFPTemperatureChange *change in self.temperatureScheduler.changes) {
+		if(change.boundaryLine < checkpoint.lineOffset) {
+			self.temperatureChangeIndex++;
+		}
+	}
+}
+
+
+- (void)openJournal {
+	if(!self.parameters.journalURL) {
+		return;
+	}
+	
+	NSError *error;
+	self.journal = [[TFPPrintJournal alloc] initWithURL:self.parameters.journalURL program:self.program error:&error];
+	if(!self.journal) {
+		TFLog(@"Failed to open print journal: %@", error);
+	}else if(self.resumingFromJournal) {
+		[self.journal recordCheckpoint:self.resumeCheckpoint];
+	}
+}
+
+
+// Like the regular preamble, but puts the head back where the last acknowledged line left it.
+// Relies on the firmware still knowing Z, which holds after a USB drop or a host crash but not a printer power cycle.
+- (void)runResumePreamble {
+	self.stage = TFPOperationStagePreparation;
+	[self setStateOnMainQueue:TFPPrintJobStatePreparing];
+	
+	TFPPrintParameters *parameters = self.parameters;
+	TFPPrintCheckpoint checkpoint = self.resumeCheckpoint;
+	const double clearance = 2;
+	
+	NSArray *part1 = @[[TFPGCode codeForSettingFanSpeed:parameters.filament.fanSpeed],
+					   [TFPGCode codeForHeaterTemperature:checkpoint.temperature waitUntilDone:NO],
+					   [TFPGCode absoluteModeCode],
+					   [TFPGCode moveWithPosition:[TFP3DVector zVector:MIN(checkpoint.position.z + clearance, 110)] feedRate:2900],
+					   [TFPGCode moveHomeCode]];
+	
+	NSArray *part2 = @[[TFPGCode moveWithPosition:[TFP3DVector xyVectorWithX:checkpoint.position.x y:checkpoint.position.y] feedRate:2900],
+					   [TFPGCode moveWithPosition:[TFP3DVector zVector:checkpoint.position.z] feedRate:2900],
+					   [TFPGCode codeForResettingPosition:nil extrusion:@(checkpoint.position.e)],
+					   [TFPGCode codeForSettingFeedRate:checkpoint.feedRate],
+					   checkpoint.relativeMode ? [TFPGCode relativeModeCode] : [TFPGCode absoluteModeCode]];
+	
+	TFLog(@"Resuming at line %ld from X %.02f, Y %.02f, Z %.02f, E %.02f, temperature %.0f, feed rate %.0f",
+		  (long)checkpoint.lineOffset+1, checkpoint.position.x, checkpoint.position.y, checkpoint.position.z, checkpoint.position.e, checkpoint.temperature, checkpoint.feedRate);
+	
+	[self.context runGCodeProgram:[TFPGCodeProgram programWithLines:part1] completionHandler:^(BOOL success, NSArray<TFPGCodeResponseDictionary> *values) {
+		if(self.aborted) {
+			return;
+		}
+		
+		TFMainThread(^{
+			[self setStateOnMainQueue:TFPPrintJobStateHeating];
+			self.heatingCancelBlock = [self.context setHeaterTemperatureAsynchronously:checkpoint.temperature progressBlock:^(double currentTemperature) {
+			
+			} completionBlock:^{
+				self.heatingCancelBlock = nil;
+				[self setStateOnMainQueue:TFPPrintJobStatePrinting];
+				
+				[self.context runGCodeProgram:[TFPGCodeProgram programWithLines:part2] completionHandler:^(BOOL success, NSArray<TFPGCodeResponseDictionary> *values) {
+					[self startMainProgram];
+				}];
+			}];
+		});
+	}];
+}
+
+
 - (void)runPostamble {
 	self.stage = TFPOperationStageEnding;
 	[self setStateOnMainQueue:TFPPrintJobStateFinishing];
@@ -308,6 +559,15 @@
 						   [TFPGCode turnOffMotorsCode],
 						   ];
 	
+	// Clear the bed for a plate swap but stay hot and keep the motors holding position for the next job
+	if(self.parameters.finishesWarm) {
+		postamble = @[
+					  [TFPGCode moveWithPosition:firstPosition feedRate:2900],
+					  [TFPGCode moveWithPosition:finalPosition feedRate:-1],
+					  [TFPGCode waitForCompletionCode],
+					  ];
+	}
+	
 	[self.context runGCodeProgram:[TFPGCodeProgram programWithLines:postamble] completionHandler:^(BOOL success, NSArray<TFPGCodeResponseDictionary> *values) {
 		TFMainThread(^{
 			[self jobDidComplete];
@@ -323,10 +583,24 @@
 	
 	self.codeOffset = 0;
 	self.pendingRequest = NO;
+	self.pendingCode = nil;
 	self.completedRequests = 0;
+	self.unpublishedRequestCount = 0;
+	self.temperatureChangeIndex = 0;
+	self.temperatureChangeIssued = NO;
+	self.checkpointLayerIndex = 0;
+	
+	if(self.resumingFromJournal) {
+		[self skipToCheckpoint:self.resumeCheckpoint];
+	}
+	[self openJournal];
 
 	[self.stopwatch start];
-	[self runPreamble];
+	if(self.resumingFromJournal) {
+		[self runResumePreamble];
+	}else{
+		[self runPreamble];
+	}
 	
 	IOReturn asserted = IOPMAssertionCreateWithName(kIOPMAssertionTypePreventUserIdleSystemSleep, kIOPMAssertionLevelOn, CFSTR("MicroPrint print job"), &(self->_powerAssertionID));
 	if (asserted != kIOReturnSuccess) {
@@ -338,6 +612,7 @@
 }
 
 
+// Called on print queue
 - (void)sendAbortSequenceWithRetraction:(BOOL)retract completionHandler:(void(^)())completionHandler {
 	const double retractFeedRate = 1500;
 	const double raiseFeedRate = 870;
@@ -354,7 +629,14 @@
 					   [TFPGCode codeForTurningOffHeater],
 					   ];
 	
-	[self.context runGCodeProgram:[TFPGCodeProgram programWithLines:codes] completionHandler:^(BOOL success, NSArray *valueDictionaries) {
+	// Anything of ours still waiting in the printer queue is moot now
+	uint64_t abortStart = TFNanosecondTime();
+	[self.context preemptWithGCodeProgram:[TFPGCodeProgram programWithLines:codes] cancellationHandler:^(NSArray<TFPGCode*> *cancelledCodes) {
+		self.pendingCode = nil;
+		self.pendingRequest = NO;
+	} completionHandler:^(BOOL success) {
+		self.lastAbortLatency = (double)(TFNanosecondTime() - abortStart) / NSEC_PER_SEC;
+		[self recordPreemptLatency:self.lastAbortLatency action:@"Stopping"];
 		completionHandler();
 	}];
 }
@@ -378,29 +660,133 @@
 		self.aborted = YES;
 
 		[self sendAbortSequenceWithRetraction:extrude completionHandler:^{
-			dispatch_async(dispatch_get_main_queue(), ^{
-				[self jobEnded];
-				
-				if(self.abortionBlock) {
-					self.abortionBlock();
-				}
+			[self abortionDidComplete];
+		}];
+		
+	});
+}
+
+
+// Called on print queue
+- (void)abortionDidComplete {
+	[self.journal closeRemovingFile:YES];
+	dispatch_async(dispatch_get_main_queue(), ^{
+		[self jobEnded];
+		
+		if(self.abortionBlock) {
+			self.abortionBlock();
+		}
+	});
+}
+
+
+- (void)emergencyStop {
+	// An abort already under way ends once its cancelled codes come back
+	if(self.state == TFPPrintJobStateAborting) {
+		[self.printer emergencyStopWithCompletionHandler:nil];
+		return;
+	}
+	
+	if(self.state != TFPPrintJobStatePrinting && self.state != TFPPrintJobStatePaused && self.state != TFPPrintJobStateHeating) {
+		return;
+	}
+	self.stage = TFPOperationStageEnding;
+	[self setStateOnMainQueue:TFPPrintJobStateAborting];
+	[self.stopwatch stop];
+	
+	if(self.heatingCancelBlock) {
+		self.heatingCancelBlock();
+		self.heatingCancelBlock = nil;
+	}
+	
+	uint64_t stopStart = TFNanosecondTime();
+	dispatch_async(self.printQueue, ^{
+		self.aborted = YES;
+		
+		[self.printer emergencyStopWithCompletionHandler:^{
+			dispatch_async(self.printQueue, ^{
+				self.pendingCode = nil;
+				self.pendingRequest = NO;
+				self.lastAbortLatency = (double)(TFNanosecondTime() - stopStart) / NSEC_PER_SEC;
+				[self recordPreemptLatency:self.lastAbortLatency action:@"Emergency stop"];
+				[self abortionDidComplete];
 			});
 		}];
+	});
+}
+
+
+- (void)abandon {
+	[self.stopwatch stop];
+	if(self.heatingCancelBlock) {
+		self.heatingCancelBlock();
+		self.heatingCancelBlock = nil;
+	}
+	
+	dispatch_async(self.printQueue, ^{
+		self.aborted = YES;
+		[self.journal closeRemovingFile:NO];
+		self.journal = nil;
 		
+		dispatch_async(dispatch_get_main_queue(), ^{
+			[self jobEnded];
+		});
 	});
 }
 
 
+// Called on print queue
+- (void)rewindForCancelledCodes:(NSArray<TFPGCode*> *)cancelledCodes {
+	if(self.pendingCode && [cancelledCodes indexOfObjectIdenticalTo:self.pendingCode] != NSNotFound) {
+		// Never reached the printer; send it again after resuming
+		self.codeOffset = self.pendingCodeOffset;
+		self.pendingCode = nil;
+		self.pendingRequest = NO;
+	}
+	
+	if(self.temperatureCheckCode && [cancelledCodes indexOfObjectIdenticalTo:self.temperatureCheckCode] != NSNotFound) {
+		self.temperatureCheckCode = nil;
+		self.temperatureChangeIndex--;
+		self.temperatureChangeIssued = NO;
+	}
+	
+	if(self.temperatureChangeCode && [cancelledCodes indexOfObjectIdenticalTo:self.temperatureChangeCode] != NSNotFound) {
+		self.temperatureChangeCode = nil;
+		self.temperatureChangeIssued = NO;
+	}
+}
+
+
+// Called on print queue
+- (void)recordPreemptLatency:(NSTimeInterval)latency action:(NSString*)action {
+	TFLog(@"%@ took %.03f s", action, latency);
+	
+	if(latency > maximumPauseLatency) {
+		[self.printer sendNotice:@"Warning: %@ took %.01f s", action, latency];
+	}
+}
+
+
 - (void)pause {
 	if(self.state != TFPPrintJobStatePrinting) {
 		return;
 	}
 	[self setStateOnMainQueue:TFPPrintJobStatePausing];
 	[self.stopwatch stop];
+	uint64_t pauseStart = TFNanosecondTime();
 	
 	dispatch_async(self.printQueue, ^{
 		self.paused = YES;
-		[self.context sendGCode:[TFPGCode waitForCompletionCode] responseHandler:^(BOOL success, TFPGCodeResponseDictionary value) {
+		
+		// Jump ahead of our own queued codes instead of waiting for them to drain
+		TFPGCodeProgram *program = [TFPGCodeProgram programWithLines:@[[TFPGCode waitForCompletionCode]]];
+		[self.context preemptWithGCodeProgram:program cancellationHandler:^(NSArray<TFPGCode*> *cancelledCodes) {
+			[self rewindForCancelledCodes:cancelledCodes];
+		
+		} completionHandler:^(BOOL success) {
+			self.lastPauseLatency = (double)(TFNanosecondTime() - pauseStart) / NSEC_PER_SEC;
+			[self recordPreemptLatency:self.lastPauseLatency action:@"Pausing"];
+			
 			self.pausePosition = self.printer.position;
 			self.pauseFeedRate = self.printer.feedrate;
 			self.pauseTemperature = self.printer.heaterTargetTemperature;
@@ -0,0 +1,34 @@
+//
+//  TFPPrintJournal.h
+//  microprint
+//
+//
+
+#import <Foundation/Foundation.h>
+#import "TFPGCodeHelpers.h"
+
+
+typedef struct {
+	uint64_t lineOffset; // First line that hasn't been acknowledged
+	TFPAbsolutePosition position;
+	double feedRate;
+	double temperature;
+	uint32_t layerIndex;
+	BOOL relativeMode;
+} TFPPrintCheckpoint;
+
+
+// Append-only journal of print progress. Checkpoints are cheap to record; they're written at most
+// a few times per second and synced to disk in batches on a separate queue.
+@interface TFPPrintJournal : NSObject
+// Starts a new journal for the program, replacing any existing file
+- (instancetype)initWithURL:(NSURL*)URL program:(TFPGCodeProgram*)program error:(NSError**)outError;
+
+- (void)recordCheckpoint:(TFPPrintCheckpoint)checkpoint;
+
+// Syncs and closes the journal. Finished prints have nothing to resume, so their journals can be removed.
+- (void)closeRemovingFile:(BOOL)remove;
+
+// Reads the last complete checkpoint of a journal written for the same program
++ (BOOL)readLatestCheckpoint:(TFPPrintCheckpoint*)checkpoint fromURL:(NSURL*)URL program:(TFPGCodeProgram*)program error:(NSError**)outError;
+@end
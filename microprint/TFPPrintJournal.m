@@ -0,0 +1,204 @@
+//
+//  TFPPrintJournal.m
+//  microprint
+//
+//
+
+#import "TFPPrintJournal.h"
+#import "TFPGCodeProgram.h"
+#import "TFPExtras.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+
+static const uint32_t journalMagic = 'TFPJ';
+static const uint32_t journalVersion = 2;
+static const uint32_t recordMarker = 'CKPT';
+
+static const NSTimeInterval writeInterval = 0.5;
+static const NSTimeInterval syncInterval = 5;
+
+
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t lineCount;
+	char contentHash[64]; // Hex SHA-256 of the program, not terminated
+} TFPPrintJournalHeader;
+
+
+typedef struct {
+	uint32_t marker;
+	uint32_t sequence;
+	TFPPrintCheckpoint checkpoint;
+} TFPPrintJournalRecord;
+
+
+
+@interface TFPPrintJournal ()
+@property (copy) NSURL *URL;
+@property int fileDescriptor;
+@property dispatch_queue_t syncQueue;
+@property dispatch_source_t syncTimer;
+
+@property uint32_t sequence;
+@property uint64_t lastWriteTime;
+@property BOOL needsSync;
+@end
+
+
+// Retries short writes, so a record is never left half written with more following it
+static BOOL TFPPrintJournalWrite(int fileDescriptor, const void *data, size_t length) {
+	const uint8_t *bytes = data;
+	while(length > 0) {
+		ssize_t written = write(fileDescriptor, bytes, length);
+		if(written < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+			return NO;
+		}
+		bytes += written;
+		length -= written;
+	}
+	return YES;
+}
+
+
+static TFPPrintJournalHeader TFPPrintJournalHeaderForProgram(TFPGCodeProgram *program) {
+	TFPPrintJournalHeader header = {journalMagic, journalVersion, program.lines.count};
+	NSData *hash = [program.contentHash dataUsingEncoding:NSASCIIStringEncoding];
+	memcpy(header.contentHash, hash.bytes, MIN(hash.length, sizeof(header.contentHash)));
+	return header;
+}
+
+
+@implementation TFPPrintJournal
+
+
+- (instancetype)initWithURL:(NSURL*)URL program:(TFPGCodeProgram*)program error:(NSError**)outError {
+	if(!(self = [super init])) return nil;
+	
+	self.URL = URL;
+	self.fileDescriptor = open(URL.fileSystemRepresentation, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+	if(self.fileDescriptor < 0) {
+		if(outError) {
+			*outError = [NSError errorWithDomain:NSPOSIXErrorDomain code:errno userInfo:nil];
+		}
+		return nil;
+	}
+	
+	TFPPrintJournalHeader header = TFPPrintJournalHeaderForProgram(program);
+	if(!TFPPrintJournalWrite(self.fileDescriptor, &header, sizeof(header))) {
+		if(outError) {
+			*outError = [NSError errorWithDomain:NSPOSIXErrorDomain code:errno userInfo:nil];
+		}
+		close(self.fileDescriptor);
+		self.fileDescriptor = -1;
+		unlink(URL.fileSystemRepresentation);
+		return nil;
+	}
+	
+	self.syncQueue = dispatch_queue_create("se.tomasf.microprint.printJournal", DISPATCH_QUEUE_SERIAL);
+	self.syncTimer = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, self.syncQueue);
+	dispatch_source_set_timer(self.syncTimer, dispatch_time(DISPATCH_TIME_NOW, syncInterval * NSEC_PER_SEC), syncInterval * NSEC_PER_SEC, 1 * NSEC_PER_SEC);
+	
+	__weak __typeof__(self) weakSelf = self;
+	dispatch_source_set_event_handler(self.syncTimer, ^{
+		[weakSelf syncIfNeeded];
+	});
+	dispatch_resume(self.syncTimer);
+	
+	return self;
+}
+
+
+// Called on sync queue
+- (void)syncIfNeeded {
+	if(self.needsSync && self.fileDescriptor >= 0) {
+		self.needsSync = NO;
+		fsync(self.fileDescriptor);
+	}
+}
+
+
+// Called on print queue. Most calls return after a clock read.
+- (void)recordCheckpoint:(TFPPrintCheckpoint)checkpoint {
+	uint64_t now = TFNanosecondTime();
+	if(self.fileDescriptor < 0 || (now - self.lastWriteTime) < writeInterval * NSEC_PER_SEC) {
+		return;
+	}
+	self.lastWriteTime = now;
+	
+	TFPPrintJournalRecord record = {recordMarker, ++self.sequence, checkpoint};
+	if(!TFPPrintJournalWrite(self.fileDescriptor, &record, sizeof(record))) {
+		// Anything appended after a failed write could be misaligned. Keep what's there and stop recording.
+		TFLog(@"Failed to write print journal: %s", strerror(errno));
+		dispatch_sync(self.syncQueue, ^{
+			[self syncIfNeeded];
+			close(self.fileDescriptor);
+			self.fileDescriptor = -1;
+		});
+		return;
+	}
+	self.needsSync = YES;
+}
+
+
+- (void)closeRemovingFile:(BOOL)remove {
+	dispatch_source_cancel(self.syncTimer);
+	dispatch_sync(self.syncQueue, ^{
+		[self syncIfNeeded];
+		close(self.fileDescriptor);
+		self.fileDescriptor = -1;
+	});
+	
+	if(remove) {
+		[[NSFileManager defaultManager] removeItemAtURL:self.URL error:nil];
+	}
+}
+
+
+- (void)dealloc {
+	if(self.fileDescriptor >= 0) {
+		close(self.fileDescriptor);
+	}
+}
+
+
++ (BOOL)readLatestCheckpoint:(TFPPrintCheckpoint*)checkpoint fromURL:(NSURL*)URL program:(TFPGCodeProgram*)program error:(NSError**)outError {
+	NSData *data = [NSData dataWithContentsOfURL:URL options:0 error:outError];
+	if(!data) {
+		return NO;
+	}
+	
+	const TFPPrintJournalHeader *header = data.bytes;
+	TFPPrintJournalHeader expectedHeader = TFPPrintJournalHeaderForProgram(program);
+	if(data.length < sizeof(TFPPrintJournalHeader) || header->magic != journalMagic || header->version != journalVersion || header->lineCount != program.lines.count
+	   || memcmp(header->contentHash, expectedHeader.contentHash, sizeof(expectedHeader.contentHash)) != 0) {
+		if(outError) {
+			*outError = [NSError errorWithDomain:TFPErrorDomain code:TFPErrorCodeJournalMismatch userInfo:@{NSLocalizedRecoverySuggestionErrorKey: @"The print journal doesn't belong to this G-code file."}];
+		}
+		return NO;
+	}
+	
+	// A torn record at the end is ignored; walk back to the last complete one
+	NSUInteger recordCount = (data.length - sizeof(TFPPrintJournalHeader)) / sizeof(TFPPrintJournalRecord);
+	const TFPPrintJournalRecord *records = (const TFPPrintJournalRecord *)(header + 1);
+	
+	for(NSInteger i = recordCount-1; i >= 0; i--) {
+		if(records[i].marker == recordMarker && records[i].checkpoint.lineOffset <= program.lines.count) {
+			*checkpoint = records[i].checkpoint;
+			return YES;
+		}
+	}
+	
+	if(outError) {
+		*outError = [NSError errorWithDomain:TFPErrorDomain code:TFPErrorCodeJournalMismatch userInfo:@{NSLocalizedRecoverySuggestionErrorKey: @"The print journal doesn't contain any checkpoints."}];
+	}
+	return NO;
+}
+
+
+@end
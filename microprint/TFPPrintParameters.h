@@ -32,10 +32,19 @@ extern NSString *TFPBacklashValuesDescription(TFPBacklashValues values);
 
 @interface TFPPrintParameters : NSObject
 @property (readwrite) BOOL verbose;
+@property (readwrite) BOOL reportComments; // Sends a printer notice for each comment line passed while printing
 
 @property (readwrite) TFPFilament *filament;
 @property (readwrite) BOOL useThermalBonding;
+@property (readwrite) BOOL thermalBondingWaitsAtBoundaries; // Changes temperature at each layer boundary and waits for it instead of ahead of time. Baseline for benchmarks.
 @property (readwrite, nonatomic) double temperature;
+@property (readwrite) double motionOptimizationTolerance; // Collinear moves within this many mm are merged. 0 disables. See TFPMotionOptimizer.
 
 @property (readwrite) TFPCuboid boundingBox;
+@property (readwrite, copy) NSURL *journalURL; // Progress checkpoints are written here while printing, if set
+
+// Back-to-back jobs on one printer
+@property (readwrite) BOOL startsWarm; // The previous job left the printer hot and homed
+@property (readwrite) BOOL finishesWarm; // Another job follows; leave heater and motors on
+@property (readwrite) double handoffPurgeLength; // Extruded before a warm start, in mm
 @end
\ No newline at end of file
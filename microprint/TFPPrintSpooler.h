@@ -0,0 +1,68 @@
+//
+//  TFPPrintSpooler.h
+//  microprint
+//
+//
+
+#import <Foundation/Foundation.h>
+#import "TFPPrinter.h"
+#import "TFPFilament.h"
+
+@class TFPPrinterManager, TFPPrintJob;
+
+
+typedef NS_ENUM(NSUInteger, TFPSpooledJobState) {
+	TFPSpooledJobStateWaiting,
+	TFPSpooledJobStatePrinting,
+	TFPSpooledJobStateCompleted,
+	TFPSpooledJobStateAborted,
+	TFPSpooledJobStateFailed,
+};
+
+
+@interface TFPSpooledJob : NSObject
+- (instancetype)initWithFileURL:(NSURL*)fileURL;
+
+@property (readonly) NSUUID *identifier;
+@property (readonly, copy) NSURL *fileURL;
+
+@property TFPFilamentType filamentType;
+@property double temperature; // 0 means filament default
+@property BOOL useThermalBonding;
+@property double motionOptimizationTolerance; // mm, 0 disables
+
+// Affinity. Unset values match any printer.
+@property TFPPrinterColor printerColor;
+@property (copy) NSString *printerSerialNumber;
+
+@property (readonly) TFPSpooledJobState state; // Observable
+@property (readonly, weak) TFPPrinter *printer;
+@property (readonly) TFPPrintJob *printJob;
+@property (readonly) NSError *error;
+@end
+
+
+@interface TFPPrintSpooler : NSObject
+// Jobs are saved to spoolFileURL, if given, and reloaded on init. Unfinished jobs that were printing are put back in line,
+// as are jobs whose printer disconnects mid-print. Either kind resumes from its journal.
+- (instancetype)initWithPrinterManager:(TFPPrinterManager*)manager spoolFileURL:(NSURL*)spoolFileURL;
+
+@property (readonly, copy) NSArray<TFPSpooledJob*> *jobs; // Observable
+- (void)addJob:(TFPSpooledJob*)job;
+- (void)removeJob:(TFPSpooledJob*)job; // Printing jobs can't be removed
+
+// Queues a job for each file in the printer manager's library index that matches the predicate, skipping files
+// that are incompatible or don't fit the printable volume. The block, if given, sets up each job before it's added.
+- (NSArray<TFPSpooledJob*> *)addJobsForLibraryFilesMatchingPredicate:(NSPredicate*)predicate configuration:(void(^)(TFPSpooledJob *job))configuration;
+
+// Filament loaded in a printer, by serial number. Printers without an entry accept any filament type.
+- (void)setLoadedFilamentType:(TFPFilamentType)type forPrinterWithSerialNumber:(NSString*)serialNumber;
+
+// Back-to-back jobs on the same printer skip the cool-down, rehoming and reheating in between.
+// The plate swap handler, if set, is called before each such job and must call completionHandler once the bed is clear.
+@property BOOL usesHotHandoff;
+@property (copy) void(^plateSwapHandler)(TFPPrinter *printer, void(^completionHandler)(void));
+
+@property BOOL verbose;
+@property (copy) void(^jobEndedBlock)(TFPSpooledJob *job);
+@end
@@ -0,0 +1,480 @@
+//
+//  TFPPrintSpooler.m
+//  microprint
+//
+//
+
+#import "TFPPrintSpooler.h"
+#import "TFPPrinterManager.h"
+#import "TFPPrintJob.h"
+#import "TFPMotionOptimizer.h"
+#import "TFPPrintParameters.h"
+#import "TFPGCodeProgram.h"
+#import "TFPGCodeHelpers.h"
+#import "TFPGCodeLibraryIndex.h"
+#import "TFPExtras.h"
+
+#import "MAKVONotificationCenter.h"
+
+
+static NSArray *encodedJobKeys;
+static NSDictionary<NSString*, Class> *encodedJobClasses; // NSNumber for any key not listed
+static const double handoffPurgeLength = 1;
+
+
+@interface TFPSpooledJob ()
+@property (readwrite) NSUUID *identifier;
+@property (readwrite, copy) NSURL *fileURL;
+
+@property (readwrite) TFPSpooledJobState state;
+@property (readwrite, weak) TFPPrinter *printer;
+@property (readwrite) TFPPrintJob *printJob;
+@property (readwrite) NSError *error;
+@end
+
+
+@implementation TFPSpooledJob
+
+
++ (void)initialize {
+	encodedJobKeys = @[@"identifier", @"fileURL", @"filamentType", @"temperature", @"useThermalBonding", @"motionOptimizationTolerance", @"printerColor", @"printerSerialNumber"];
+	encodedJobClasses = @{@"identifier": [NSUUID class], @"fileURL": [NSURL class], @"printerSerialNumber": [NSString class]};
+}
+
+
+- (instancetype)initWithFileURL:(NSURL*)fileURL {
+	if(!(self = [super init])) return nil;
+	
+	self.identifier = [NSUUID UUID];
+	self.fileURL = fileURL;
+	self.filamentType = TFPFilamentTypePLA;
+	self.useThermalBonding = YES;
+	
+	return self;
+}
+
+
+- (instancetype)initWithEncodedValues:(NSDictionary*)values {
+	if(!(self = [self initWithFileURL:nil])) return nil;
+	
+	values = [values dictionaryWithValuesForKeys:encodedJobKeys];
+	for(NSString *key in values) {
+		id value = values[key];
+		if(![value isKindOfClass:encodedJobClasses[key] ?: [NSNumber class]]) {
+			continue;
+		}
+		[self setValue:value forKey:key];
+	}
+	
+	return self.fileURL ? self : nil;
+}
+
+
+- (NSDictionary*)encodedValues {
+	return [self dictionaryWithValuesForKeys:encodedJobKeys];
+}
+
+
+- (BOOL)acceptsPrinter:(TFPPrinter*)printer loadedFilamentType:(TFPFilamentType)filamentType {
+	if(self.printerSerialNumber && ![self.printerSerialNumber isEqual:printer.serialNumber]) {
+		return NO;
+	}
+	if(self.printerColor != TFPPrinterColorUndetermined && self.printerColor != printer.color) {
+		return NO;
+	}
+	if(filamentType != TFPFilamentTypeUnknown && filamentType != self.filamentType) {
+		return NO;
+	}
+	return YES;
+}
+
+
+- (TFPPrintParameters*)printParameters {
+	TFPPrintParameters *parameters = [TFPPrintParameters new];
+	parameters.filament = [TFPFilament filamentForType:self.filamentType];
+	parameters.temperature = self.temperature;
+	parameters.useThermalBonding = self.useThermalBonding;
+	parameters.motionOptimizationTolerance = self.motionOptimizationTolerance;
+	return parameters;
+}
+
+
+- (NSString *)description {
+	return [NSString stringWithFormat:@"<%@ %@ %@>", self.class, self.identifier.UUIDString, self.fileURL.lastPathComponent];
+}
+
+
+@end
+
+
+
+@interface TFPPrintSpooler ()
+@property TFPPrinterManager *printerManager;
+@property (copy) NSURL *spoolFileURL;
+
+@property (readwrite, copy) NSArray<TFPSpooledJob*> *jobs;
+@property NSMutableDictionary<NSString*, NSNumber*> *loadedFilamentTypes;
+@property NSHashTable<TFPPrinter*> *observedPrinters;
+@property NSHashTable<TFPPrinter*> *warmPrinters;
+@end
+
+
+@implementation TFPPrintSpooler
+
+
+- (instancetype)initWithPrinterManager:(TFPPrinterManager*)manager spoolFileURL:(NSURL*)spoolFileURL {
+	if(!(self = [super init])) return nil;
+	__weak __typeof__(self) weakSelf = self;
+	
+	self.printerManager = manager;
+	self.spoolFileURL = spoolFileURL;
+	self.jobs = @[];
+	self.loadedFilamentTypes = [NSMutableDictionary new];
+	self.observedPrinters = [NSHashTable weakObjectsHashTable];
+	self.warmPrinters = [NSHashTable weakObjectsHashTable];
+	[self loadJobs];
+	
+	[self observeTarget:manager keyPath:@"printers" options:NSKeyValueObservingOptionInitial block:^(MAKVONotification *notification) {
+		TFMainThread(^{
+			[weakSelf observePrinters:weakSelf.printerManager.printers];
+			[weakSelf requeueJobsOnRemovedPrinters];
+			[weakSelf dispatchJobs];
+		});
+	}];
+	
+	return self;
+}
+
+
+- (void)observePrinters:(NSArray<TFPPrinter*> *)printers {
+	__weak __typeof__(self) weakSelf = self;
+	
+	for(TFPPrinter *printer in printers) {
+		if([self.observedPrinters containsObject:printer]) {
+			continue;
+		}
+		[self.observedPrinters addObject:printer];
+		
+		// Printers change these from their own queues; scheduling decisions are made on the main queue
+		[self observeTarget:printer keyPath:@[@"currentOperation", @"pendingConnection", @"serialNumber"] options:0 block:^(MAKVONotification *notification) {
+			dispatch_async(dispatch_get_main_queue(), ^{
+				[weakSelf dispatchJobs];
+			});
+		}];
+	}
+}
+
+
+#pragma mark - Persistence
+
+
+- (void)loadJobs {
+	self.jobs = @[];
+	NSData *data = self.spoolFileURL ? [NSData dataWithContentsOfURL:self.spoolFileURL] : nil;
+	if(!data) {
+		return;
+	}
+	
+	NSKeyedUnarchiver *unarchiver = [[NSKeyedUnarchiver alloc] initForReadingWithData:data];
+	unarchiver.requiresSecureCoding = YES;
+	NSSet *classes = [NSSet setWithObjects:NSDictionary.class, NSArray.class, NSNumber.class, NSString.class, NSUUID.class, NSURL.class, NSNull.class, nil];
+	
+	NSDictionary *values;
+	@try {
+		values = [unarchiver decodeObjectOfClasses:classes forKey:NSKeyedArchiveRootObjectKey];
+	} @catch(NSException *exception) {
+		TFLog(@"Failed to read print spool: %@", exception);
+	}
+	if(![values isKindOfClass:[NSDictionary class]] || ![values[@"jobs"] isKindOfClass:[NSArray class]]) {
+		return;
+	}
+	
+	self.jobs = [[values[@"jobs"] tf_selectWithBlock:^BOOL(id jobValues) {
+		return [jobValues isKindOfClass:[NSDictionary class]];
+	}] tf_mapWithBlock:^TFPSpooledJob*(NSDictionary *jobValues) {
+		return [[TFPSpooledJob alloc] initWithEncodedValues:jobValues];
+	}];
+	if([values[@"loadedFilamentTypes"] isKindOfClass:[NSDictionary class]]) {
+		[self.loadedFilamentTypes addEntriesFromDictionary:values[@"loadedFilamentTypes"]];
+	}
+}
+
+
+- (void)saveJobs {
+	if(!self.spoolFileURL) {
+		return;
+	}
+	
+	NSDictionary *values = @{@"formatVersion": @1,
+							 @"jobs": [self.jobs valueForKey:@"encodedValues"],
+							 @"loadedFilamentTypes": [self.loadedFilamentTypes copy],
+							 };
+	
+	NSData *data = [NSKeyedArchiver archivedDataWithRootObject:values];
+	[[NSFileManager defaultManager] createDirectoryAtURL:self.spoolFileURL.URLByDeletingLastPathComponent withIntermediateDirectories:YES attributes:nil error:nil];
+	
+	NSError *error;
+	if(![data writeToURL:self.spoolFileURL options:NSDataWritingAtomic error:&error]) {
+		TFLog(@"Failed to save print spool: %@", error);
+	}
+}
+
+
+#pragma mark - Jobs
+
+
+- (void)addJob:(TFPSpooledJob*)job {
+	TFAssertMainThread();
+	[[self mutableArrayValueForKey:@"jobs"] addObject:job];
+	[self saveJobs];
+	[self dispatchJobs];
+}
+
+
+- (void)removeJob:(TFPSpooledJob*)job {
+	TFAssertMainThread();
+	if(job.state == TFPSpooledJobStatePrinting) {
+		return;
+	}
+	[[self mutableArrayValueForKey:@"jobs"] removeObject:job];
+	[self saveJobs];
+}
+
+
+- (NSArray<TFPSpooledJob*> *)addJobsForLibraryFilesMatchingPredicate:(NSPredicate*)predicate configuration:(void(^)(TFPSpooledJob *job))configuration {
+	TFAssertMainThread();
+	NSPredicate *printable = [NSPredicate predicateWithFormat:@"compatible == YES AND fitsPrintableVolume == YES"];
+	if(predicate) {
+		printable = [NSCompoundPredicate andPredicateWithSubpredicates:@[printable, predicate]];
+	}
+	
+	NSArray *jobs = [[self.printerManager.libraryIndex summariesMatchingPredicate:printable] tf_mapWithBlock:^TFPSpooledJob*(TFPGCodeFileSummary *summary) {
+		TFPSpooledJob *job = [[TFPSpooledJob alloc] initWithFileURL:summary.fileURL];
+		if(configuration) {
+			configuration(job);
+		}
+		return job;
+	}];
+	
+	[[self mutableArrayValueForKey:@"jobs"] addObjectsFromArray:jobs];
+	[self saveJobs];
+	[self dispatchJobs];
+	return jobs;
+}
+
+
+- (void)setLoadedFilamentType:(TFPFilamentType)type forPrinterWithSerialNumber:(NSString*)serialNumber {
+	TFAssertMainThread();
+	self.loadedFilamentTypes[serialNumber] = @(type);
+	[self saveJobs];
+	[self dispatchJobs];
+}
+
+
+#pragma mark - Dispatch
+
+
+- (BOOL)printerIsAvailable:(TFPPrinter*)printer {
+	if(printer.pendingConnection || printer.currentOperation || !printer.serialNumber) {
+		return NO;
+	}
+	
+	// Reserved while its program is loading
+	for(TFPSpooledJob *job in self.jobs) {
+		if(job.state == TFPSpooledJobStatePrinting && job.printer == printer) {
+			return NO;
+		}
+	}
+	return YES;
+}
+
+
+- (TFPSpooledJob*)nextJobForPrinter:(TFPPrinter*)printer {
+	TFPFilamentType filamentType = self.loadedFilamentTypes[printer.serialNumber].unsignedIntegerValue;
+	
+	for(TFPSpooledJob *job in self.jobs) {
+		if(job.state == TFPSpooledJobStateWaiting && [job acceptsPrinter:printer loadedFilamentType:filamentType]) {
+			return job;
+		}
+	}
+	return nil;
+}
+
+
+- (BOOL)hasWaitingJobForPrinter:(TFPPrinter*)printer {
+	return [self nextJobForPrinter:printer] != nil;
+}
+
+
+// Called on main queue. Printers left hot for a job that never came shouldn't stay that way.
+- (void)coolDownIdleWarmPrinters {
+	for(TFPPrinter *printer in self.warmPrinters.allObjects) {
+		if(![self printerIsAvailable:printer]) {
+			continue;
+		}
+		[self.warmPrinters removeObject:printer];
+		[printer sendGCode:[TFPGCode codeForTurningOffHeater] responseHandler:nil];
+		[printer sendGCode:[TFPGCode turnOffFanCode] responseHandler:nil];
+		[printer sendGCode:[TFPGCode turnOffMotorsCode] responseHandler:nil];
+	}
+}
+
+
+// Called on main queue
+- (void)dispatchJobs {
+	for(TFPPrinter *printer in self.printerManager.printers) {
+		if(![self printerIsAvailable:printer]) {
+			continue;
+		}
+		
+		TFPSpooledJob *job = [self nextJobForPrinter:printer];
+		if(job) {
+			[self startJob:job onPrinter:printer];
+		}
+	}
+}
+
+
+// Jobs interrupted by a crash or disconnect pick up from their journal the next time they're started
+- (NSURL*)journalURLForJob:(TFPSpooledJob*)job {
+	if(!self.spoolFileURL) {
+		return nil;
+	}
+	
+	NSURL *directory = [self.spoolFileURL.URLByDeletingLastPathComponent URLByAppendingPathComponent:@"Journals"];
+	[[NSFileManager defaultManager] createDirectoryAtURL:directory withIntermediateDirectories:YES attributes:nil error:nil];
+	return [directory URLByAppendingPathComponent:[job.identifier.UUIDString stringByAppendingPathExtension:@"journal"]];
+}
+
+
+// Called on main queue. A print whose printer disconnected goes back in line for that same printer, since resuming
+// relies on the firmware still knowing Z. Without a journal there's nothing to resume from, so the job ends.
+- (void)requeueJobsOnRemovedPrinters {
+	NSArray *printers = self.printerManager.printers;
+	
+	for(TFPSpooledJob *job in [self.jobs copy]) {
+		TFPPrintJob *printJob = job.printJob;
+		if(job.state != TFPSpooledJobStatePrinting || !printJob || [printers containsObject:job.printer]) {
+			continue;
+		}
+		
+		NSString *serialNumber = printJob.context.printer.serialNumber;
+		printJob.completionBlock = nil;
+		printJob.abortionBlock = nil;
+		[printJob abandon];
+		
+		if(![self journalURLForJob:job] || !serialNumber) {
+			[self job:job endedWithState:TFPSpooledJobStateAborted];
+			continue;
+		}
+		if(self.verbose) {
+			TFLog(@"Spooler: printer %@ went away; %@ will resume when it's back", serialNumber, job);
+		}
+		
+		job.printerSerialNumber = job.printerSerialNumber ?: serialNumber;
+		job.printJob = nil;
+		job.printer = nil;
+		job.state = TFPSpooledJobStateWaiting;
+		[self saveJobs];
+	}
+}
+
+
+- (void)startJob:(TFPSpooledJob*)job onPrinter:(TFPPrinter*)printer {
+	__weak __typeof__(self) weakSelf = self;
+	
+	job.state = TFPSpooledJobStatePrinting;
+	job.printer = printer;
+	if(self.verbose) {
+		TFLog(@"Spooler: starting %@ on printer %@", job, printer.serialNumber);
+	}
+	
+	// Parsing is the expensive part; keep it off the main queue
+	dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+		NSError *error;
+		TFPGCodeProgram *program = [[TFPGCodeProgram alloc] initWithFileURL:job.fileURL options:TFPGCodeProgramOptionSeparateComments | TFPGCodeProgramOptionCached error:&error];
+		if(program && ![program validateForM3D:&error]) {
+			program = nil;
+		}
+		
+		TFPPrintParameters *parameters = [job printParameters];
+		parameters.boundingBox = [program measureBoundingBox];
+		parameters.journalURL = [weakSelf journalURLForJob:job];
+		
+		TFPMotionOptimizer *optimizer = [TFPMotionOptimizer optimizerForProgram:program parameters:parameters];
+		if(optimizer) {
+			program = optimizer.optimizedProgram;
+		}
+		
+		dispatch_async(dispatch_get_main_queue(), ^{
+			if(!program) {
+				job.error = error;
+				[weakSelf job:job endedWithState:TFPSpooledJobStateFailed];
+				return;
+			}
+			
+			BOOL startsWarm = [weakSelf.warmPrinters containsObject:printer];
+			[weakSelf.warmPrinters removeObject:printer];
+			parameters.startsWarm = startsWarm;
+			parameters.finishesWarm = weakSelf.usesHotHandoff && [weakSelf hasWaitingJobForPrinter:printer];
+			parameters.handoffPurgeLength = handoffPurgeLength;
+			
+			TFPPrintJob *printJob = [[TFPPrintJob alloc] initWithProgram:program printer:printer printParameters:parameters];
+			printJob.motionOptimizer = optimizer;
+			printJob.completionBlock = ^{
+				if(parameters.finishesWarm) {
+					[weakSelf.warmPrinters addObject:printer];
+				}
+				[weakSelf job:job endedWithState:TFPSpooledJobStateCompleted];
+			};
+			printJob.abortionBlock = ^{
+				[weakSelf job:job endedWithState:TFPSpooledJobStateAborted];
+			};
+			if([printJob prepareToResumeFromJournal:nil] && weakSelf.verbose) {
+				TFLog(@"Spooler: resuming %@ from its journal", job);
+			}
+			
+			job.printJob = printJob;
+			void(^startPrintJob)(void) = ^{
+				if(![printJob start]) {
+					// Someone else got to the printer first; put the job back in line
+					job.printJob = nil;
+					job.printer = nil;
+					job.state = TFPSpooledJobStateWaiting;
+					[weakSelf dispatchJobs];
+				}
+			};
+			
+			if(startsWarm && weakSelf.plateSwapHandler) {
+				weakSelf.plateSwapHandler(printer, ^{
+					TFMainThread(startPrintJob);
+				});
+			}else{
+				startPrintJob();
+			}
+		});
+	});
+}
+
+
+// Called on main queue
+- (void)job:(TFPSpooledJob*)job endedWithState:(TFPSpooledJobState)state {
+	job.state = state;
+	job.printJob.completionBlock = nil;
+	job.printJob.abortionBlock = nil;
+	if(self.verbose) {
+		TFLog(@"Spooler: %@ ended with state %ld on printer %@", job, (long)state, job.printer.serialNumber);
+	}
+	
+	[[self mutableArrayValueForKey:@"jobs"] removeObject:job];
+	[self saveJobs];
+	
+	if(self.jobEndedBlock) {
+		self.jobEndedBlock(job);
+	}
+	[self dispatchJobs];
+	[self coolDownIdleWarmPrinters];
+}
+
+
+@end
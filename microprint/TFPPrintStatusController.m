@@ -8,7 +8,6 @@
 
 #import "TFPPrintStatusController.h"
 #import "TFPExtras.h"
-#import "TFP3DVector.h"
 
 #import "TFTimer.h"
 #import "MAKVONotificationCenter.h"
@@ -122,17 +121,17 @@ static const NSInteger minimumPrintCodeOffsetForEstimation = 100;
 		
 		TFPAbsolutePosition newPosition = self.position;
 		double newF = self.feedRate;
-		TFP3DVector *vector = upcomingCode.movementVector;
+		TFPVector vector = upcomingCode.movement;
 
 		if(self.relativeMode) {
-			newPosition.x += vector.x.doubleValue;
-			newPosition.y += vector.y.doubleValue;
-			newPosition.z += vector.z.doubleValue;
+			newPosition.x += vector.x;
+			newPosition.y += vector.y;
+			newPosition.z += vector.z;
 			newPosition.e += [upcomingCode valueForField:'E' fallback:0];
 		} else {
-			newPosition.x = vector.x ? vector.x.doubleValue : newPosition.x;
-			newPosition.y = vector.y ? vector.y.doubleValue : newPosition.y;
-			newPosition.z = vector.z ? vector.z.doubleValue : newPosition.z;
+			newPosition.x = (vector.fields & TFPVectorFieldX) ? vector.x : newPosition.x;
+			newPosition.y = (vector.fields & TFPVectorFieldY) ? vector.y : newPosition.y;
+			newPosition.z = (vector.fields & TFPVectorFieldZ) ? vector.z : newPosition.z;
 			newPosition.e = [upcomingCode valueForField:'E' fallback:newPosition.e];
 		}
 		
@@ -49,6 +49,10 @@ enum VirtualEEPROMIndexes {
 };
 
 
+// Reads and writes go through a cache that is persisted per serial number and firmware version. Values already known
+// cost no round trips, misses are queued back to back, and writes are coalesced, skipped if nothing changed and retried
+// if they fail. The cache follows every M618/M619 sent to the printer and is invalidated by calibration (G30, G32),
+// by a firmware change, and on connection if a value read back from the printer doesn't match it.
 @interface TFPPrinter (VirtualEEPROM)
 
 + (uint32_t)encodeVirtualEEPROMIntegerValueForFloat:(float)value;
@@ -66,7 +70,13 @@ enum VirtualEEPROMIndexes {
 - (void)readVirtualEEPROMValuesAtIndexes:(NSArray*)indexes completionHandler:(void(^)(BOOL success, NSArray *values))completionHandler;
 - (void)writeVirtualEEPROMValues:(NSDictionary*)valuesForIndexes completionHandler:(void(^)(BOOL success))completionHandler;
 
+// Contiguous ranges, such as the G32 samples
+- (void)readVirtualEEPROMValuesInRange:(NSRange)range completionHandler:(void(^)(BOOL success, NSArray *values))completionHandler;
+
 // Multiple values, converted from/to float
 - (void)readVirtualEEPROMFloatValuesAtIndexes:(NSArray*)indexes completionHandler:(void(^)(BOOL success, NSArray *values))completionHandler;
 - (void)writeVirtualEEPROMFloatValues:(NSDictionary*)valuesForIndexes completionHandler:(void(^)(BOOL success))completionHandler;
+
+// For when the EEPROM may have been changed behind our back, like by other software
+- (void)invalidateVirtualEEPROMCache;
 @end
\ No newline at end of file
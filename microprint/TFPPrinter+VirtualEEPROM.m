@@ -10,6 +10,206 @@
 #import "TFPExtras.h"
 #import "TFPGCodeHelpers.h"
 
+#import <objc/runtime.h>
+
+
+static const NSTimeInterval cacheSaveDelay = 1;
+static const NSUInteger cacheFormatVersion = 2;
+
+static const NSUInteger maximumWriteAttempts = 3;
+static const NSTimeInterval writeRetryDelay = 0.5;
+
+static char virtualEEPROMCacheKey;
+
+
+
+// Mirror of the printer's virtual EEPROM. Values present can be served without asking the printer.
+// Dirty values have been written locally but not yet acknowledged by the printer.
+@interface TFPVirtualEEPROMCache : NSObject
+@property NSMutableDictionary<NSNumber*, NSNumber*> *values;
+@property NSMutableIndexSet *dirtyIndexes;
+
+@property (copy) NSURL *fileURL;
+@property (copy) NSDictionary *identity; // Serial number and firmware version the saved values belong to
+@property BOOL savePending;
+
+// Main queue only
+@property BOOL flushScheduled;
+@property NSMutableArray<void(^)(BOOL)> *flushHandlers;
+@end
+
+
+@implementation TFPVirtualEEPROMCache
+
+
+- (instancetype)init {
+	if(!(self = [super init])) return nil;
+	
+	self.values = [NSMutableDictionary new];
+	self.dirtyIndexes = [NSMutableIndexSet new];
+	self.flushHandlers = [NSMutableArray new];
+	
+	return self;
+}
+
+
+- (BOOL)getValue:(int32_t*)value atIndex:(NSUInteger)index {
+	@synchronized(self) {
+		NSNumber *number = self.values[@(index)];
+		if(!number) {
+			return NO;
+		}
+		*value = number.intValue;
+		return YES;
+	}
+}
+
+
+// A value read back from the printer. Dirty values are newer than whatever the printer has.
+- (void)storeReadValue:(int32_t)value atIndex:(NSUInteger)index {
+	@synchronized(self) {
+		if([self.dirtyIndexes containsIndex:index] || [self.values[@(index)] isEqual:@(value)]) {
+			return;
+		}
+		self.values[@(index)] = @(value);
+	}
+	[self setNeedsSave];
+}
+
+
+// Returns NO if the printer already has this value
+- (BOOL)stageValue:(int32_t)value atIndex:(NSUInteger)index {
+	@synchronized(self) {
+		if([self.values[@(index)] isEqual:@(value)]) {
+			return [self.dirtyIndexes containsIndex:index];
+		}
+		self.values[@(index)] = @(value);
+		[self.dirtyIndexes addIndex:index];
+		return YES;
+	}
+}
+
+
+// A write acknowledged by the printer. Leaves the index dirty if it has been changed again since.
+- (void)confirmWrittenValue:(int32_t)value atIndex:(NSUInteger)index {
+	@synchronized(self) {
+		if([self.dirtyIndexes containsIndex:index] && ![self.values[@(index)] isEqual:@(value)]) {
+			return;
+		}
+		self.values[@(index)] = @(value);
+		[self.dirtyIndexes removeIndex:index];
+	}
+	[self setNeedsSave];
+}
+
+
+- (NSDictionary<NSNumber*, NSNumber*> *)dirtyValues {
+	NSMutableDictionary *values = [NSMutableDictionary new];
+	@synchronized(self) {
+		[self.dirtyIndexes enumerateIndexesUsingBlock:^(NSUInteger index, BOOL *stop) {
+			values[@(index)] = self.values[@(index)];
+		}];
+	}
+	return values;
+}
+
+
+- (void)invalidate {
+	@synchronized(self) {
+		self.values = [[self dirtyValues] mutableCopy];
+	}
+	[self setNeedsSave];
+}
+
+
+#pragma mark - Persistence
+
+
+// Loads values for indexes that aren't already valid and returns them. Values saved for another printer or
+// firmware version are ignored, and overwritten by the next save.
+- (NSDictionary<NSNumber*, NSNumber*> *)loadFromURL:(NSURL*)URL identity:(NSDictionary*)identity {
+	self.fileURL = URL;
+	self.identity = identity;
+	
+	NSData *data = [NSData dataWithContentsOfURL:URL];
+	if(!data) {
+		return @{};
+	}
+	
+	NSKeyedUnarchiver *unarchiver = [[NSKeyedUnarchiver alloc] initForReadingWithData:data];
+	unarchiver.requiresSecureCoding = YES;
+	NSSet *classes = [NSSet setWithObjects:NSDictionary.class, NSNumber.class, NSString.class, nil];
+	
+	NSDictionary *archive;
+	@try {
+		archive = [unarchiver decodeObjectOfClasses:classes forKey:NSKeyedArchiveRootObjectKey];
+	} @catch(NSException *exception) {
+		TFLog(@"Failed to read virtual EEPROM cache: %@", exception);
+	}
+	
+	// Anything unexpected counts as an empty image
+	NSDictionary *values = [archive isKindOfClass:[NSDictionary class]] ? archive[@"values"] : nil;
+	if(![values isKindOfClass:[NSDictionary class]] || ![archive[@"formatVersion"] isKindOfClass:[NSNumber class]]
+	   || [archive[@"formatVersion"] unsignedIntegerValue] != cacheFormatVersion || ![archive[@"identity"] isEqual:identity]) {
+		return @{};
+	}
+	for(id index in values) {
+		if(![index isKindOfClass:[NSNumber class]] || ![values[index] isKindOfClass:[NSNumber class]]) {
+			return @{};
+		}
+	}
+	
+	NSMutableDictionary *loadedValues = [NSMutableDictionary new];
+	@synchronized(self) {
+		for(NSNumber *index in values) {
+			if(!self.values[index]) {
+				self.values[index] = values[index];
+				loadedValues[index] = values[index];
+			}
+		}
+	}
+	return loadedValues;
+}
+
+
+- (void)setNeedsSave {
+	@synchronized(self) {
+		if(!self.fileURL || self.savePending) {
+			return;
+		}
+		self.savePending = YES;
+	}
+	
+	dispatch_after(dispatch_time(DISPATCH_TIME_NOW, cacheSaveDelay * NSEC_PER_SEC), dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_BACKGROUND, 0), ^{
+		[self save];
+	});
+}
+
+
+- (void)save {
+	NSMutableDictionary *values = [NSMutableDictionary new];
+	@synchronized(self) {
+		self.savePending = NO;
+		
+		// Only what the printer is known to have
+		[values addEntriesFromDictionary:self.values];
+		[values removeObjectsForKeys:[self dirtyValues].allKeys];
+	}
+	
+	NSData *data = [NSKeyedArchiver archivedDataWithRootObject:@{@"formatVersion": @(cacheFormatVersion), @"identity": self.identity, @"values": values}];
+	[[NSFileManager defaultManager] createDirectoryAtURL:self.fileURL.URLByDeletingLastPathComponent withIntermediateDirectories:YES attributes:nil error:nil];
+	
+	NSError *error;
+	if(![data writeToURL:self.fileURL options:NSDataWritingAtomic error:&error]) {
+		TFLog(@"Failed to save virtual EEPROM cache: %@", error);
+	}
+}
+
+
+@end
+
+
+
 
 @implementation TFPPrinter (VirtualEEPROM)
 
@@ -29,24 +229,150 @@
 }
 
 
-- (void)readVirtualEEPROMValueAtIndex:(NSUInteger)index completionHandler:(void(^)(BOOL success, int32_t value))completionHandler {
-	[self sendGCode:[TFPGCode codeForReadingVirtualEEPROMAtIndex:index] responseHandler:^(BOOL success, NSDictionary *values) {
+#pragma mark - Cache
+
+
+- (TFPVirtualEEPROMCache*)virtualEEPROMCache {
+	@synchronized(self) {
+		TFPVirtualEEPROMCache *cache = objc_getAssociatedObject(self, &virtualEEPROMCacheKey);
+		if(!cache) {
+			cache = [TFPVirtualEEPROMCache new];
+			objc_setAssociatedObject(self, &virtualEEPROMCacheKey, cache, OBJC_ASSOCIATION_RETAIN);
+		}
+		return cache;
+	}
+}
+
+
++ (NSURL*)virtualEEPROMCacheURLForSerialNumber:(NSString*)serialNumber {
+	NSURL *supportURL = [[NSFileManager defaultManager] URLsForDirectory:NSApplicationSupportDirectory inDomains:NSUserDomainMask].firstObject;
+	NSString *path = [NSString stringWithFormat:@"MicroPrint/EEPROM/%@.plist", serialNumber];
+	return [supportURL URLByAppendingPathComponent:path];
+}
+
+
+- (NSDictionary<NSNumber*, NSNumber*> *)loadVirtualEEPROMCache {
+	TFPVirtualEEPROMCache *cache = self.virtualEEPROMCache;
+	if(cache.fileURL || !self.serialNumber || !self.firmwareVersion) {
+		return @{};
+	}
+	NSDictionary *identity = @{@"serialNumber": self.serialNumber, @"firmwareVersion": self.firmwareVersion};
+	return [cache loadFromURL:[self.class virtualEEPROMCacheURLForSerialNumber:self.serialNumber] identity:identity];
+}
+
+
+// Reads one of the loaded values back from the printer, bypassing the cache. A mismatch means the EEPROM was changed
+// elsewhere since the cache was saved, and invalidates it.
+- (void)verifyVirtualEEPROMCacheWithLoadedValues:(NSDictionary<NSNumber*, NSNumber*> *)values completionHandler:(void(^)(BOOL valid))completionHandler {
+	NSNumber *index = values[@(VirtualEEPROMIndexBedOffsetCommon)] ? @(VirtualEEPROMIndexBedOffsetCommon) : [values.allKeys sortedArrayUsingSelector:@selector(compare:)].firstObject;
+	if(!index) {
+		completionHandler(YES);
+		return;
+	}
+	
+	[self sendGCode:[TFPGCode codeForReadingVirtualEEPROMAtIndex:index.unsignedIntegerValue] responseHandler:^(BOOL success, TFPGCodeResponseDictionary value) {
 		if(!success) {
-			completionHandler(NO, 0);
+			// Nothing learned either way
+			completionHandler(YES);
 			return;
 		}
-		completionHandler(YES, [values[@"DT"] intValue]);
+		
+		BOOL valid = (value[@"DT"].intValue == values[index].intValue);
+		if(!valid) {
+			[self invalidateVirtualEEPROMCache];
+		}
+		completionHandler(valid);
 	}];
 }
 
 
-- (void)writeVirtualEEPROMValueAtIndex:(NSUInteger)index value:(int32_t)value completionHandler:(void(^)(BOOL success))completionHandler {
-	[self sendGCode:[TFPGCode codeForWritingVirtualEEPROMAtIndex:index value:value] responseHandler:^(BOOL success, NSDictionary *value) {
-		completionHandler(success);
+// Called on communication queue for every confirmed code, including ones that didn't come from here
+- (void)updateVirtualEEPROMCacheForCode:(TFPGCode*)code response:(TFPGCodeResponseDictionary)values {
+	NSInteger G = [code valueForField:'G' fallback:-1];
+	NSInteger M = [code valueForField:'M' fallback:-1];
+	NSInteger index = [code valueForField:'S' fallback:-1];
+	
+	if(M == 619 && index >= 0 && values[@"DT"]) {
+		[self.virtualEEPROMCache storeReadValue:values[@"DT"].intValue atIndex:index];
+	
+	}else if(M == 618 && index >= 0 && [code hasField:'P']) {
+		[self.virtualEEPROMCache confirmWrittenValue:(int32_t)[code valueForField:'P'] atIndex:index];
+	
+	}else if(G == 30 || G == 32) {
+		// Calibration makes the firmware rewrite its own values
+		[self.virtualEEPROMCache invalidate];
+	}
+}
+
+
+- (void)invalidateVirtualEEPROMCache {
+	[self.virtualEEPROMCache invalidate];
+}
+
+
+// Called on main queue
+- (void)flushVirtualEEPROMCache {
+	TFPVirtualEEPROMCache *cache = self.virtualEEPROMCache;
+	cache.flushScheduled = NO;
+	
+	NSArray *handlers = [cache.flushHandlers copy];
+	[cache.flushHandlers removeAllObjects];
+	[self writeDirtyVirtualEEPROMValuesWithAttempt:1 completionHandlers:handlers];
+}
+
+
+// Called on main queue. Failed writes stay dirty and are sent again a few times before the handlers hear about it.
+- (void)writeDirtyVirtualEEPROMValuesWithAttempt:(NSUInteger)attempt completionHandlers:(NSArray<void(^)(BOOL)> *)handlers {
+	NSDictionary<NSNumber*, NSNumber*> *dirtyValues = self.virtualEEPROMCache.dirtyValues;
+	
+	__block NSUInteger remainingCount = dirtyValues.count;
+	__block BOOL allSucceeded = YES;
+	
+	void(^finish)(void) = ^{
+		if(!allSucceeded && attempt < maximumWriteAttempts) {
+			dispatch_after(dispatch_time(DISPATCH_TIME_NOW, writeRetryDelay * NSEC_PER_SEC), dispatch_get_main_queue(), ^{
+				[self writeDirtyVirtualEEPROMValuesWithAttempt:attempt+1 completionHandlers:handlers];
+			});
+			return;
+		}
+		
+		for(void(^handler)(BOOL) in handlers) {
+			handler(allSucceeded);
+		}
+	};
+	
+	if(!remainingCount) {
+		finish();
+		return;
+	}
+	
+	for(NSNumber *index in dirtyValues) {
+		TFPGCode *code = [TFPGCode codeForWritingVirtualEEPROMAtIndex:index.unsignedIntegerValue value:dirtyValues[index].intValue];
+		[self sendGCode:code responseHandler:^(BOOL success, TFPGCodeResponseDictionary value) {
+			allSucceeded = allSucceeded && success;
+			if(--remainingCount == 0) {
+				finish();
+			}
+		}];
+	}
+}
+
+
+#pragma mark - Access
+
+
+- (void)readVirtualEEPROMValueAtIndex:(NSUInteger)index completionHandler:(void(^)(BOOL success, int32_t value))completionHandler {
+	[self readVirtualEEPROMValuesAtIndexes:@[@(index)] completionHandler:^(BOOL success, NSArray *values) {
+		completionHandler(success, [values.firstObject intValue]);
 	}];
 }
 
 
+- (void)writeVirtualEEPROMValueAtIndex:(NSUInteger)index value:(int32_t)value completionHandler:(void(^)(BOOL success))completionHandler {
+	[self writeVirtualEEPROMValues:@{@(index): @(value)} completionHandler:completionHandler];
+}
+
+
 - (void)readVirtualEEPROMFloatValueAtIndex:(NSUInteger)index completionHandler:(void(^)(BOOL success, float value))completionHandler {
 	[self readVirtualEEPROMValueAtIndex:index completionHandler:^(BOOL success, int32_t value) {
 		completionHandler(success, [self.class decodeVirtualEEPROMFloatValueForInteger:value]);
@@ -61,18 +387,65 @@
 
 
 - (void)readVirtualEEPROMValuesAtIndexes:(NSArray*)indexes completionHandler:(void(^)(BOOL success, NSArray *values))completionHandler {
+	TFPVirtualEEPROMCache *cache = self.virtualEEPROMCache;
 	NSMutableArray *values = [NSMutableArray new];
-	[indexes enumerateObjectsUsingBlock:^(NSNumber *indexNumber, NSUInteger index, BOOL *stop) {
-		[self readVirtualEEPROMValueAtIndex:indexNumber.integerValue completionHandler:^(BOOL success, int32_t value) {
+	NSMutableIndexSet *missingIndexes = [NSMutableIndexSet new];
+	
+	for(NSNumber *indexNumber in indexes) {
+		int32_t value;
+		if([cache getValue:&value atIndex:indexNumber.unsignedIntegerValue]) {
 			[values addObject:@(value)];
-			if(index == indexes.count-1) {
-				completionHandler(YES, values);
+		}else{
+			[values addObject:[NSNull null]];
+			[missingIndexes addIndex:indexNumber.unsignedIntegerValue];
+		}
+	}
+	
+	__block NSUInteger remainingCount = missingIndexes.count;
+	__block BOOL allSucceeded = YES;
+	
+	void(^finish)(void) = ^{
+		if(completionHandler) {
+			completionHandler(allSucceeded, allSucceeded ? values : nil);
+		}
+	};
+	
+	if(!remainingCount) {
+		dispatch_async(dispatch_get_main_queue(), finish);
+		return;
+	}
+	
+	// All misses are queued at once so they go out back to back instead of one per callback
+	[missingIndexes enumerateIndexesUsingBlock:^(NSUInteger missingIndex, BOOL *stop) {
+		[self sendGCode:[TFPGCode codeForReadingVirtualEEPROMAtIndex:missingIndex] responseHandler:^(BOOL success, TFPGCodeResponseDictionary value) {
+			if(success) {
+				NSNumber *valueNumber = @(value[@"DT"].intValue);
+				[indexes enumerateObjectsUsingBlock:^(NSNumber *indexNumber, NSUInteger position, BOOL *stop) {
+					if(indexNumber.unsignedIntegerValue == missingIndex) {
+						values[position] = valueNumber;
+					}
+				}];
+			}else{
+				allSucceeded = NO;
+			}
+			
+			if(--remainingCount == 0) {
+				finish();
 			}
 		}];
 	}];
 }
 
 
+- (void)readVirtualEEPROMValuesInRange:(NSRange)range completionHandler:(void(^)(BOOL success, NSArray *values))completionHandler {
+	NSMutableArray *indexes = [NSMutableArray new];
+	for(NSUInteger index = range.location; index < NSMaxRange(range); index++) {
+		[indexes addObject:@(index)];
+	}
+	[self readVirtualEEPROMValuesAtIndexes:indexes completionHandler:completionHandler];
+}
+
+
 - (void)readVirtualEEPROMFloatValuesAtIndexes:(NSArray*)indexes completionHandler:(void(^)(BOOL success, NSArray *values))completionHandler {
 	[self readVirtualEEPROMValuesAtIndexes:indexes completionHandler:^(BOOL success, NSArray *values) {
 		NSArray *floatValues = [values tf_mapWithBlock:^NSNumber*(NSNumber *intNumber) {
@@ -84,28 +457,38 @@
 }
 
 
-- (void)writeVirtualEEPROMValues:(NSArray*)values forIndexes:(NSArray*)keys completionHandler:(void(^)(BOOL success))completionHandler {
-	[keys enumerateObjectsUsingBlock:^(NSNumber *indexNumber, NSUInteger index, BOOL *stop) {
-		uint32_t value = [values[index] unsignedIntValue];
+- (void)writeVirtualEEPROMValues:(NSDictionary*)valuesForIndexes completionHandler:(void(^)(BOOL success))completionHandler {
+	TFMainThread(^{
+		TFPVirtualEEPROMCache *cache = self.virtualEEPROMCache;
+		BOOL changed = NO;
 		
-		[self writeVirtualEEPROMValueAtIndex:indexNumber.unsignedIntegerValue value:value completionHandler:^(BOOL success) {
-			if(index == keys.count-1) {
-				completionHandler(YES);
+		for(NSNumber *index in valuesForIndexes) {
+			if([cache stageValue:[valuesForIndexes[index] intValue] atIndex:index.unsignedIntegerValue]) {
+				changed = YES;
 			}
-		}];
-	}];
-}
+		}
 
+		if(!changed) {
+			if(completionHandler) {
+				dispatch_async(dispatch_get_main_queue(), ^{
+					completionHandler(YES);
+				});
+			}
+			return;
+		}
 
-- (void)writeVirtualEEPROMValues:(NSDictionary*)valuesForIndexes completionHandler:(void(^)(BOOL success))completionHandler {
-	NSMutableArray *keys = [NSMutableArray new];
-	NSMutableArray *values = [NSMutableArray new];
-	[valuesForIndexes enumerateKeysAndObjectsUsingBlock:^(NSNumber *key, NSNumber *value, BOOL *stop) {
-		[keys addObject:key];
-		[values addObject:value];
-	}];
-	
-	[self writeVirtualEEPROMValues:values forIndexes:keys completionHandler:completionHandler];
+		if(completionHandler) {
+			[cache.flushHandlers addObject:completionHandler];
+		}
+		
+		// Coalesces writes made in the same run loop cycle, like those from dragging a slider
+		if(!cache.flushScheduled) {
+			cache.flushScheduled = YES;
+			dispatch_async(dispatch_get_main_queue(), ^{
+				[self flushVirtualEEPROMCache];
+			});
+		}
+	});
 }
 
 
@@ -11,7 +11,7 @@
 #import "TFPPrintParameters.h"
 #import "TFPGCodeProgram.h"
 
-@class TFPOperation, TFPPrinterConnection, TFPPrinterContext;
+@class TFPOperation, TFPPrinterConnection, TFPPrinterContext, TFPTemperatureMonitor;
 
 
 typedef NS_ENUM(NSUInteger, TFPPrinterColor) {
@@ -41,6 +41,8 @@ typedef NS_ENUM(NSUInteger, TFPPrinterResponseErrorCode) {
 	
 	TFPPrinterResponseErrorCodeMin = TFPPrinterResponseErrorCodeM110MissingLineNumber,
 	TFPPrinterResponseErrorCodeMax = TFPPrinterResponseErrorCodeTargetAddressOutOfRange,
+	
+	TFPPrinterResponseErrorCodeCancelled = 2000, // Not from the printer. The code was dropped from the queue before it was sent.
 };
 
 
@@ -84,6 +86,9 @@ typedef NSDictionary<NSString *, NSString*>* TFPGCodeResponseDictionary;
 
 - (TFPPrinterContext*)acquireContextWithOptions:(TFPPrinterContextOptions)options queue:(dispatch_queue_t)queue;
 
+// Drops every queued code and turns off motors, heater and fan ahead of anything else. The handler runs on the main queue once they're done.
+- (void)emergencyStopWithCompletionHandler:(void(^)(void))completionHandler;
+
 
 + (NSString*)descriptionForErrorCode:(TFPPrinterResponseErrorCode)code;
 
@@ -96,6 +101,7 @@ typedef NSDictionary<NSString *, NSString*>* TFPGCodeResponseDictionary;
 @property (nonatomic) double feedrate;
 @property (readonly) double heaterTargetTemperature;
 @property (readonly) double heaterTemperature;
+@property (readonly) TFPTemperatureMonitor *temperatureMonitor; // History and polling
 
 @property (readonly) BOOL hasValidZLevel;
 @property (readonly) BOOL hasOutOfBoundsZLevel;
@@ -107,6 +113,7 @@ typedef NSDictionary<NSString *, NSString*>* TFPGCodeResponseDictionary;
 @property (nonatomic) TFPBacklashValues backlashValues;
 
 @property (nonatomic) TFPAbsolutePosition position;
+@property (readonly) BOOL relativeMode;
 
 + (NSString*)nameForPrinterColor:(TFPPrinterColor)color;
 + (NSString*)minimumTestedFirmwareVersion;
@@ -120,6 +127,16 @@ typedef NSDictionary<NSString *, NSString*>* TFPGCodeResponseDictionary;
 - (void)sendGCode:(TFPGCode*)code responseHandler:(void(^)(BOOL success, TFPGCodeResponseDictionary value))block;
 - (void)runGCodeProgram:(TFPGCodeProgram*)program completionHandler:(void(^)(BOOL success, NSArray<TFPGCodeResponseDictionary> *values))completionHandler;
 
+// Queues the program up front, or at most windowSize codes at a time if non-zero. The first failure drops the rest of the
+// program, along with the context's other unsent codes, and completes with the values of the lines before it. Preempting
+// the context completes it as failed. Completion is called once, on the context's queue. Queueing starts from the
+// context's queue too, so codes sent right after this call from another queue may go first.
+- (void)runGCodeProgram:(TFPGCodeProgram*)program windowSize:(NSUInteger)windowSize completionHandler:(void(^)(BOOL success, NSArray<TFPGCodeResponseDictionary> *values))completionHandler;
+
+// Control lane. Cancels this context's codes that haven't been sent yet and runs the program ahead of everything else.
+// cancelledCodes are in their original order. Their response handlers are called afterwards, failing with TFPPrinterResponseErrorCodeCancelled.
+- (void)preemptWithGCodeProgram:(TFPGCodeProgram*)program cancellationHandler:(void(^)(NSArray<TFPGCode*> *cancelledCodes))cancellationHandler completionHandler:(void(^)(BOOL success))completionHandler;
+
 - (void)invalidate;
 @end
 
@@ -17,6 +17,8 @@
 #import "TFPPrinterConnection.h"
 #import "TFTimer.h"
 #import "TFPBedLevelCompensator.h"
+#import "TFPTemperatureMonitor.h"
+#import "TFPVirtualClock.h"
 
 #import "MAKVONotificationCenter.h"
 
@@ -36,6 +38,12 @@ static const double maximumFeedRateForZMovement = 2900;
 - (void)setBedOffsets:(TFPBedLevelOffsets)offsets completionHandler:(void(^)(BOOL success))completionHandler;
 @end
 
+@interface TFPPrinter (VirtualEEPROMPrivate)
+- (NSDictionary<NSNumber*, NSNumber*> *)loadVirtualEEPROMCache;
+- (void)verifyVirtualEEPROMCacheWithLoadedValues:(NSDictionary<NSNumber*, NSNumber*> *)values completionHandler:(void(^)(BOOL valid))completionHandler;
+- (void)updateVirtualEEPROMCacheForCode:(TFPGCode*)code response:(TFPGCodeResponseDictionary)values;
+@end
+
 @interface TFPPrinterContext (Private)
 - (instancetype)initWithPrinter:(TFPPrinter*)printer queue:(dispatch_queue_t)queue options:(TFPPrinterContextOptions)options;
 @end
@@ -47,6 +55,7 @@ typedef NS_OPTIONS(NSUInteger, TFPGCodeOptions) {
 	TFPGCodeOptionNoBacklashCompensation = 1<<1,
 	TFPGCodeOptionNoFeedRateConversion = 1<<2,
 	TFPGCodeOptionNoZFeedRateLimiting = 1<<3,
+	TFPGCodeOptionStopOwnerOnFailure = 1<<4, // An error drops the owner's remaining queued codes before anything else is sent
 
 	TFPGCodeOptionPrioritized = 1<<10,
 };
@@ -59,6 +68,7 @@ typedef NS_OPTIONS(NSUInteger, TFPGCodeOptions) {
 
 @property dispatch_queue_t responseQueue;
 @property (copy) void(^responseBlock)(BOOL success, TFPGCodeResponseDictionary values);
+@property (weak) id owner;
 @end
 
 
@@ -125,9 +135,11 @@ typedef NS_ENUM(NSUInteger, TFPMovementDirection) {
 @property (readwrite) TFPPrinterColor color;
 @property (readwrite, copy) NSString *serialNumber;
 @property (readwrite, copy) NSString *firmwareVersion;
+@property (copy) NSDictionary<NSString*, NSString*> *capabilities;
 
 @property (readwrite) double heaterTemperature;
 @property (readwrite) double heaterTargetTemperature;
+@property (readwrite) TFPTemperatureMonitor *temperatureMonitor;
 
 @property (readwrite) BOOL hasValidZLevel;
 @property (readwrite) BOOL hasOutOfBoundsZLevel;
@@ -141,7 +153,7 @@ typedef NS_ENUM(NSUInteger, TFPMovementDirection) {
 @property double positionZ;
 @property double unadjustedPositionZ;
 @property double positionE;
-@property BOOL relativeMode;
+@property (readwrite) BOOL relativeMode;
 @property double currentFeedRate;
 @property BOOL needsFeedRateReset;
 
@@ -184,7 +196,9 @@ typedef NS_ENUM(NSUInteger, TFPMovementDirection) {
 	};
 	
 	self.communicationQueue = dispatch_queue_create("se.tomasf.microprint.serialPortQueue", DISPATCH_QUEUE_SERIAL);
+	[TFPVirtualClock registerQueue:self.communicationQueue];
 		
+	self.temperatureMonitor = [[TFPTemperatureMonitor alloc] initWithPrinter:self];
 	self.establishmentBlocks = [NSMutableArray new];
 	self.queuedCodeEntries = [NSMutableArray new];
 	self.codeRegistry = [NSMutableDictionary new];
@@ -194,6 +208,12 @@ typedef NS_ENUM(NSUInteger, TFPMovementDirection) {
     self.blockGCodes = [NSIndexSet indexSet];
     self.blockMCodes = self.blockGCodes;
 	
+	// Known right away for printers we've seen before, so affinity and UI don't have to wait for the handshake
+	NSDictionary *cachedIdentity = [self.class cachedIdentityForUSBSerialNumber:self.connection.serialPort.USBSerialNumber];
+	if(cachedIdentity) {
+		[self processCapabilities:cachedIdentity];
+	}
+	
 	[self.connection openWithCompletionHandler:^(NSError *error) {
 		self.pendingConnection = NO;
 		self.lineNumberCounter = 1;
@@ -205,8 +225,15 @@ typedef NS_ENUM(NSUInteger, TFPMovementDirection) {
 			[self.establishmentBlocks removeAllObjects];
 		}else{
 			[self sendGCode:[TFPGCode codeForSettingLineNumber:0] responseHandler:nil];
-			[weakSelf identifyWithCompletionHandler:^(BOOL success) {
-			}];
+			
+			if(self.connection.capabilities) {
+				// The handshake already told us who this is
+				[self processCapabilities:self.connection.capabilities];
+				[self finishConnection];
+			}else{
+				[weakSelf identifyWithCompletionHandler:^(BOOL success) {
+				}];
+			}
 		}
 	}];
 	
@@ -244,10 +271,6 @@ typedef NS_ENUM(NSUInteger, TFPMovementDirection) {
 
 
 - (void)identifyWithCompletionHandler:(void(^)(BOOL success))completionHandler {
-	if(self.serialNumber) {
-		return; // Identification not needed
-	}
-	
 	TFPGCode *getCapabilities = [TFPGCode codeWithString:@"M115"];
 	[self sendGCode:getCapabilities responseHandler:^(BOOL success, NSDictionary *value) {
 		if(success) {
@@ -257,17 +280,69 @@ typedef NS_ENUM(NSUInteger, TFPMovementDirection) {
 			completionHandler(NO);
 		}
 		
-		self.connectionFinished = YES;
-		[self refreshState];
-		
-		for(void(^block)(NSError*) in self.establishmentBlocks) {
-			block(nil);
-		}
-		[self.establishmentBlocks removeAllObjects];
+		[self finishConnection];
 	}];
 }
 
 
+- (void)finishConnection {
+	self.connectionFinished = YES;
+	[self refreshState];
+	[self saveIdentity];
+	
+	for(void(^block)(NSError*) in self.establishmentBlocks) {
+		block(nil);
+	}
+	[self.establishmentBlocks removeAllObjects];
+}
+
+
++ (NSString*)identitiesDefaultsKey {
+	return @"PrinterIdentities";
+}
+
+
+// Capabilities by printer serial number. Ports are matched by the USB serial number stored with each, since port
+// paths can move between printers.
++ (NSDictionary<NSString*, NSDictionary*> *)cachedIdentities {
+	return [[NSUserDefaults standardUserDefaults] dictionaryForKey:[self identitiesDefaultsKey]] ?: @{};
+}
+
+
++ (NSDictionary*)cachedIdentityForUSBSerialNumber:(NSString*)USBSerialNumber {
+	if(!USBSerialNumber) {
+		return nil;
+	}
+	for(NSDictionary *identity in [self cachedIdentities].allValues) {
+		if([identity[@"USBSerialNumber"] isEqual:USBSerialNumber]) {
+			return [identity dictionaryWithValuesForKeys:@[@"X-SERIAL_NUMBER", @"FIRMWARE_VERSION"]];
+		}
+	}
+	return nil;
+}
+
+
+- (void)saveIdentity {
+	NSString *serialNumber = self.capabilities[@"X-SERIAL_NUMBER"];
+	NSString *USBSerialNumber = self.connection.serialPort.USBSerialNumber;
+	if(!serialNumber || !USBSerialNumber) {
+		return;
+	}
+	
+	NSMutableDictionary *identity = [NSMutableDictionary new];
+	for(NSString *key in @[@"X-SERIAL_NUMBER", @"FIRMWARE_VERSION"]) {
+		identity[key] = self.capabilities[key];
+	}
+	identity[@"USBSerialNumber"] = USBSerialNumber;
+	
+	NSMutableDictionary *identities = [[self.class cachedIdentities] mutableCopy];
+	if(![identities[serialNumber] isEqual:identity]) {
+		identities[serialNumber] = identity;
+		[[NSUserDefaults standardUserDefaults] setObject:identities forKey:[self.class identitiesDefaultsKey]];
+	}
+}
+
+
 + (NSString*)minimumTestedFirmwareVersion {
 	return @"2015080602";
 }
@@ -302,10 +377,32 @@ typedef NS_ENUM(NSUInteger, TFPMovementDirection) {
     self.blockGCodes = [NSIndexSet ww_indexSetFromArray:blockCodes[0]];
     self.blockMCodes = [NSIndexSet ww_indexSetFromArray:blockCodes[1]];
 
+	// Values cached from an earlier session apply right away; the fetches below only ask for what's missing
+	NSDictionary<NSNumber*, NSNumber*> *cachedValues = [self loadVirtualEEPROMCache];
+	dispatch_async(self.communicationQueue, ^{
+		for(NSNumber *index in cachedValues) {
+			[self updateStateForVirtualEEPROMIndex:index.unsignedIntegerValue value:cachedValues[index].intValue];
+		}
+	});
+	
+	if(cachedValues.count) {
+		[self verifyVirtualEEPROMCacheWithLoadedValues:cachedValues completionHandler:^(BOOL valid) {
+			if(!valid) {
+				[self sendNotice:@"Virtual EEPROM was changed elsewhere; reading it again"];
+				[self fetchVirtualEEPROMState];
+			}
+		}];
+	}
+	
+	[self fetchVirtualEEPROMState];
+	[self syncPositionFastTracked:NO];
+}
+
+
+- (void)fetchVirtualEEPROMState {
 	[self fetchBedOffsetsWithCompletionHandler:nil];
 	[self fetchBacklashValuesWithCompletionHandler:nil];
 	[self fetchBedBaseLevelsWithCompletionHandler:nil];
-	[self syncPositionFastTracked:NO];
 }
 
 
@@ -376,6 +473,7 @@ typedef NS_ENUM(NSUInteger, TFPMovementDirection) {
 	if(G == 0 || G == 1) {
 		if([entry.code hasField:'E'] && self.heaterTargetTemperature <= 100) {
 			[self sendNotice:@"Warning: Tried to cold extrude. Skipping to avoid firmware bugs. Code: %@", entry.code];
+			[self dropCodesAfterFailedEntry:entry];
 			[entry deliverErrorResponseWithErrorCode:TFPPrinterResponseErrorCodeCannotColdExtrude];
 			return YES;
 		}
@@ -647,21 +745,41 @@ typedef NS_ENUM(NSUInteger, TFPMovementDirection) {
 }
 
 
-- (BOOL)sendReplacementsForGCodeIfNeeded:(TFPGCode*)code responseHandler:(void(^)(BOOL success, NSDictionary *value))block responseQueue:(dispatch_queue_t)queue {
+// Returns nil if the code can be sent as is
+- (NSArray<TFPGCode*> *)replacementCodesForGCode:(TFPGCode*)code {
 	NSInteger M = [code valueForField:'M' fallback:-1];
 	
 	if(M == 0) {
 		// The Micro's firmware goes mad if you send M0 with a line number and keeps requesting a re-send over and over.
 		// So let's replace it with M18 + M104 S0, which is equivalent and works properly. Sigh.
-
 		[self sendNotice:@"Issuing replacement for M0."];
-		
-		[self sendGCode:[TFPGCode turnOffMotorsCode] responseHandler:nil responseQueue:nil];
-		[self sendGCode:[TFPGCode codeForTurningOffHeater] responseHandler:block responseQueue:queue];
-		return YES;
+		return @[[TFPGCode turnOffMotorsCode], [TFPGCode codeForTurningOffHeater]];
 	}else{
+		return nil;
+	}
+}
+
+
+- (NSArray<TFPGCode*> *)codesWithReplacements:(NSArray<TFPGCode*> *)codes {
+	NSMutableArray *result = [NSMutableArray new];
+	for(TFPGCode *code in codes) {
+		[result addObjectsFromArray:[self replacementCodesForGCode:code] ?: @[code]];
+	}
+	return result;
+}
+
+
+- (BOOL)sendReplacementsForGCodeIfNeeded:(TFPGCode*)code responseHandler:(void(^)(BOOL success, NSDictionary *value))block responseQueue:(dispatch_queue_t)queue {
+	NSArray<TFPGCode*> *replacements = [self replacementCodesForGCode:code];
+	if(!replacements) {
 		return NO;
 	}
+	
+	[replacements enumerateObjectsUsingBlock:^(TFPGCode *replacement, NSUInteger index, BOOL *stop) {
+		BOOL last = (index == replacements.count-1);
+		[self sendGCode:replacement responseHandler:(last ? block : nil) responseQueue:(last ? queue : nil)];
+	}];
+	return YES;
 }
 
 
@@ -683,8 +801,19 @@ typedef NS_ENUM(NSUInteger, TFPMovementDirection) {
 
 // Called on communication queue!
 - (void)enqueueCode:(TFPGCode*)code options:(TFPGCodeOptions)options responseHandler:(void(^)(BOOL success, NSDictionary<NSString *, NSString*> *value))block responseQueue:(dispatch_queue_t)queue {
+	[self enqueueCode:code options:options owner:nil responseHandler:block responseQueue:queue];
+}
+
+
+// Called on communication queue!
+- (void)enqueueCode:(TFPGCode*)code options:(TFPGCodeOptions)options owner:(id)owner responseHandler:(void(^)(BOOL success, NSDictionary<NSString *, NSString*> *value))block responseQueue:(dispatch_queue_t)queue {
 	BOOL prio = !!(options & TFPGCodeOptionPrioritized);
 	TFPPrinterGCodeEntry *entry = [[TFPPrinterGCodeEntry alloc] initWithCode:code options:options responseBlock:block queue:queue];
+	entry.owner = owner;
+	
+	if([code valueForField:'M' fallback:-1] == 105) {
+		[self.temperatureMonitor noteTemperatureRequest];
+	}
 	
 	if(prio) {
 		[self.queuedCodeEntries insertObject:entry atIndex:0];
@@ -696,16 +825,102 @@ typedef NS_ENUM(NSUInteger, TFPMovementDirection) {
 
 
 - (void)sendGCode:(TFPGCode*)code options:(TFPGCodeOptions)options responseHandler:(void(^)(BOOL success, NSDictionary<NSString *, NSString*> *value))block responseQueue:(dispatch_queue_t)queue {
+	[self sendGCode:code options:options owner:nil responseHandler:block responseQueue:queue];
+}
+
+
+- (void)sendGCode:(TFPGCode*)code options:(TFPGCodeOptions)options owner:(id)owner responseHandler:(void(^)(BOOL success, NSDictionary<NSString *, NSString*> *value))block responseQueue:(dispatch_queue_t)queue {
 	if([self sendReplacementsForGCodeIfNeeded:code responseHandler:block responseQueue:queue]) {
 		return;
 	}
 	
 	dispatch_async(self.communicationQueue, ^{
-		[self enqueueCode:code options:options responseHandler:block responseQueue:queue];
+		[self enqueueCode:code options:options owner:owner responseHandler:block responseQueue:queue];
 	});
 }
 
 
+#pragma mark - Control lane
+
+
+// Called on communication queue. A nil owner cancels codes from everyone.
+// Resends and line number resets carry N and are never cancelled; the firmware is waiting for them.
+- (NSArray<TFPPrinterGCodeEntry*> *)removeQueuedEntriesForOwner:(id)owner {
+	NSIndexSet *indexes = [self.queuedCodeEntries indexesOfObjectsPassingTest:^BOOL(TFPPrinterGCodeEntry *entry, NSUInteger index, BOOL *stop) {
+		return (!owner || entry.owner == owner) && ![entry.code hasField:'N'];
+	}];
+	
+	NSArray *entries = [self.queuedCodeEntries objectsAtIndexes:indexes];
+	[self.queuedCodeEntries removeObjectsAtIndexes:indexes];
+	return entries;
+}
+
+
+// Called on communication queue
+- (void)deliverCancellationToEntries:(NSArray<TFPPrinterGCodeEntry*> *)entries {
+	for(TFPPrinterGCodeEntry *entry in entries) {
+		[entry deliverErrorResponseWithErrorCode:TFPPrinterResponseErrorCodeCancelled];
+	}
+}
+
+
+// Called on communication queue
+- (void)dropCodesAfterFailedEntry:(TFPPrinterGCodeEntry*)entry {
+	id owner = entry.owner;
+	if((entry.options & TFPGCodeOptionStopOwnerOnFailure) && owner) {
+		[self deliverCancellationToEntries:[self removeQueuedEntriesForOwner:owner]];
+	}
+}
+
+
+// Removes the owner's codes that haven't been sent yet and puts the given codes first in line.
+// Cancelled codes are handed to cancellationHandler in their original order. Their response handlers then fail
+// with TFPPrinterResponseErrorCodeCancelled; on a shared response queue, always after cancellationHandler.
+- (void)preemptCodesForOwner:(id)owner withCodes:(NSArray<TFPGCode*> *)codes options:(TFPGCodeOptions)options responseQueue:(dispatch_queue_t)queue cancellationHandler:(void(^)(NSArray<TFPGCode*> *cancelledCodes))cancellationHandler completionHandler:(void(^)(BOOL success))completionHandler {
+	queue = queue ?: dispatch_get_main_queue();
+	codes = [self codesWithReplacements:codes];
+	
+	dispatch_async(self.communicationQueue, ^{
+		NSArray *cancelledEntries = [self removeQueuedEntriesForOwner:owner];
+		if(cancellationHandler) {
+			NSArray *cancelledCodes = [cancelledEntries valueForKey:@"code"];
+			dispatch_async(queue, ^{
+				cancellationHandler(cancelledCodes);
+			});
+		}
+		[self deliverCancellationToEntries:cancelledEntries];
+		
+		__block BOOL allSucceeded = YES;
+		[codes enumerateObjectsUsingBlock:^(TFPGCode *code, NSUInteger index, BOOL *stop) {
+			BOOL last = (index == codes.count-1);
+			TFPPrinterGCodeEntry *entry = [[TFPPrinterGCodeEntry alloc] initWithCode:code options:options responseBlock:^(BOOL success, TFPGCodeResponseDictionary values) {
+				allSucceeded = allSucceeded && success;
+				if(last && completionHandler) {
+					completionHandler(allSucceeded);
+				}
+			} queue:queue];
+			entry.owner = owner;
+			[self.queuedCodeEntries insertObject:entry atIndex:index];
+		}];
+		
+		[self dequeueCode];
+	});
+}
+
+
+- (void)emergencyStopWithCompletionHandler:(void(^)(void))completionHandler {
+	NSArray *codes = @[[TFPGCode turnOffMotorsCode], [TFPGCode codeForTurningOffHeater], [TFPGCode turnOffFanCode]];
+	[self sendNotice:@"Emergency stop"];
+	[self preemptCodesForOwner:nil withCodes:codes options:0 responseQueue:nil cancellationHandler:^(NSArray<TFPGCode*> *cancelledCodes) {
+		[self sendNotice:@"Emergency stop cancelled %ld queued codes", (long)cancelledCodes.count];
+	} completionHandler:^(BOOL success) {
+		if(completionHandler) {
+			completionHandler();
+		}
+	}];
+}
+
+
 - (void)sendGCode:(TFPGCode*)inputCode responseHandler:(void(^)(BOOL success, NSDictionary<NSString *, NSString*> *value))block responseQueue:(dispatch_queue_t)queue {
 	[self sendGCode:inputCode options:0 responseHandler:block responseQueue:queue];
 }
@@ -779,6 +994,10 @@ typedef NS_ENUM(NSUInteger, TFPMovementDirection) {
 
 - (void)processCapability:(NSString*)key value:(NSString*)value {
 	if([key isEqual:@"FIRMWARE_VERSION"]) {
+		if(self.firmwareVersion && ![self.firmwareVersion isEqual:value]) {
+			// Different firmware may have reset or laid out its EEPROM differently
+			[self invalidateVirtualEEPROMCache];
+		}
 		self.firmwareVersion = value;
 	}else if([key isEqual:@"X-SERIAL_NUMBER"]) {
 		self.serialNumber = [self formatSerialNumber:value];
@@ -788,6 +1007,7 @@ typedef NS_ENUM(NSUInteger, TFPMovementDirection) {
 
 
 - (void)processCapabilities:(NSDictionary*)dictionary {
+	self.capabilities = dictionary;
 	for(NSString *key in dictionary) {
 		[self processCapability:key value:dictionary[key]];
 	}
@@ -803,6 +1023,8 @@ typedef NS_ENUM(NSUInteger, TFPMovementDirection) {
 	}else{
 		_heaterTemperature = temperature;
 	}
+	[self.temperatureMonitor recordTemperature:_heaterTemperature targetTemperature:_heaterTargetTemperature];
+	
 	
 	TFMainThread(^{
 		self.heaterTemperature = _heaterTemperature;
@@ -939,6 +1161,7 @@ typedef NS_ENUM(NSUInteger, TFPMovementDirection) {
 
 - (void)updateStateForResponse:(NSDictionary<NSString*, NSString*> *)values entry:(TFPPrinterGCodeEntry*)entry {
 	NSInteger M = [entry.code valueForField:'M' fallback:-1];
+	[self updateVirtualEEPROMCacheForCode:entry.code response:values];
 	
 	if(M == 114) {
 		if(values[@"X"]) {
@@ -960,6 +1183,9 @@ typedef NS_ENUM(NSUInteger, TFPMovementDirection) {
 		[self updatePosition];
 		[self sendNotice:@"Synced position to (%.02f, %.02f, %.02f [%.02f])", self.positionX, self.positionY, self.unadjustedPositionZ, self.positionZ];
 
+	}else if(M == 105 && values[@"T"]) {
+		[self processTemperatureUpdate:values[@"T"].doubleValue];
+	
 	}else if(M == 619) {
 		NSInteger index = [entry.code valueForField:'S' fallback:-1];
 		uint32_t value = [values[@"DT"] intValue];
@@ -1011,6 +1237,7 @@ typedef NS_ENUM(NSUInteger, TFPMovementDirection) {
 			
 			TFPPrinterGCodeEntry *entry = self.pendingCodeEntry;
 			self.pendingCodeEntry = nil;
+			[self dropCodesAfterFailedEntry:entry];
 			[self dequeueCode];
 			
 			[self sendNotice:@"Got error %d in response to %@", (int)errorCode, entry.code];
@@ -1041,7 +1268,9 @@ typedef NS_ENUM(NSUInteger, TFPMovementDirection) {
 							  @"Target address out of range"
 							  ];
 	
-	if(code < TFPPrinterResponseErrorCodeMin || code > TFPPrinterResponseErrorCodeMax) {
+	if(code == TFPPrinterResponseErrorCodeCancelled) {
+		return @"Cancelled before it was sent";
+	}else if(code < TFPPrinterResponseErrorCodeMin || code > TFPPrinterResponseErrorCodeMax) {
 		return nil;
 	} else {
 		return descriptions[code-TFPPrinterResponseErrorCodeMin];
@@ -1104,36 +1333,84 @@ typedef NS_ENUM(NSUInteger, TFPMovementDirection) {
 
 
 - (void)sendGCode:(TFPGCode*)code responseHandler:(void(^)(BOOL success, TFPGCodeResponseDictionary value))block {
-	[self.printer sendGCode:code options:self.codeOptions responseHandler:block responseQueue:self.queue];
+	[self.printer sendGCode:code options:self.codeOptions owner:self responseHandler:block responseQueue:self.queue];
+}
+
+
+- (void)preemptWithGCodeProgram:(TFPGCodeProgram*)program cancellationHandler:(void(^)(NSArray<TFPGCode*> *cancelledCodes))cancellationHandler completionHandler:(void(^)(BOOL success))completionHandler {
+	[self.printer preemptCodesForOwner:self withCodes:program.lines options:self.codeOptions responseQueue:self.queue cancellationHandler:cancellationHandler completionHandler:completionHandler];
 }
 
 
 - (void)runGCodeProgram:(TFPGCodeProgram*)program completionHandler:(void(^)(BOOL success, NSArray<TFPGCodeResponseDictionary> *values))completionHandler {
-	[self runGCodeProgram:program previousValues:@[] completionHandler:completionHandler];
+	[self runGCodeProgram:program windowSize:0 completionHandler:completionHandler];
 }
 
 
-- (void)runGCodeProgram:(TFPGCodeProgram *)program previousValues:(NSArray*)previousValues completionHandler:(void (^)(BOOL success, NSArray *valueDictionaries))completionHandler {
-	if(previousValues.count < program.lines.count) {
-		TFPGCode *code = program.lines[previousValues.count];
-		[self.printer sendGCode:code options:self.codeOptions responseHandler:^(BOOL success, NSDictionary *value) {
-			if(success) {
-				NSMutableArray *newValues = [previousValues mutableCopy];
-				[newValues addObject:value];
-				[self runGCodeProgram:program previousValues:newValues completionHandler:completionHandler];
-			}else{
-				if(completionHandler) {
-					completionHandler(NO, previousValues);
-				}
-			}
-		} responseQueue:self.queue];
-	}else{
+- (void)runGCodeProgram:(TFPGCodeProgram*)program windowSize:(NSUInteger)windowSize completionHandler:(void(^)(BOOL success, NSArray<TFPGCodeResponseDictionary> *values))completionHandler {
+	NSArray<TFPGCode*> *lines = program.lines;
+	NSUInteger lineCount = lines.count;
+	NSUInteger window = windowSize ?: lineCount;
+	TFPPrinter *printer = self.printer;
+	TFPGCodeOptions options = self.codeOptions | TFPGCodeOptionStopOwnerOnFailure;
+	
+	if(!lineCount) {
 		if(completionHandler) {
 			dispatch_async(self.queue ?: dispatch_get_main_queue(), ^{
-				completionHandler(YES, previousValues);
+				completionHandler(YES, @[]);
 			});
 		}
+		return;
 	}
+	
+	// Responses are filled in by line. Codes are owned by the context like any others it sends, so preempting the
+	// context cancels the run, and a failure drops what's left of it along with anything else the context queued.
+	NSMutableArray *values = [NSMutableArray arrayWithCapacity:lineCount];
+	for(NSUInteger i=0; i<lineCount; i++) {
+		[values addObject:[NSNull null]];
+	}
+	
+	__block NSUInteger sentCount = 0;
+	__block NSUInteger completedCount = 0;
+	__block void(^fillWindow)();
+	
+	fillWindow = ^{
+		while(sentCount < lineCount && sentCount - completedCount < window) {
+			NSUInteger index = sentCount++;
+			
+			[printer sendGCode:lines[index] options:options owner:self responseHandler:^(BOOL success, NSDictionary *value) {
+				// Already completed; the rest of the run is failing as cancelled
+				if(!fillWindow) {
+					return;
+				}
+				
+				if(!success) {
+					fillWindow = nil;
+					if(completionHandler) {
+						completionHandler(NO, [values subarrayWithRange:NSMakeRange(0, index)]);
+					}
+					return;
+				}
+				
+				values[index] = value;
+				completedCount++;
+				
+				if(completedCount == lineCount) {
+					fillWindow = nil;
+					if(completionHandler) {
+						completionHandler(YES, values);
+					}
+				}else if(windowSize) {
+					fillWindow();
+				}
+			} responseQueue:self.queue];
+		}
+	};
+	
+	// The counters and the window block are only touched on the context's queue, where the responses arrive
+	dispatch_async(self.queue ?: dispatch_get_main_queue(), ^{
+		fillWindow();
+	});
 }
 
 
@@ -8,7 +8,7 @@
 
 @import Foundation;
 
-@class TFPGCode, ORSSerialPort;
+@class TFPGCode, ORSSerialPort, TFPSerialCapture;
 
 
 typedef NS_ENUM(NSInteger, TFPPrinterMessageType) {
@@ -32,12 +32,19 @@ typedef NS_ENUM(NSUInteger, TFPPrinterConnectionState) {
 @interface TFPPrinterConnection : NSObject
 - (instancetype)initWithSerialPort:(ORSSerialPort*)serialPort;
 @property (readonly) ORSSerialPort *serialPort;
+@property (readonly) TFPSerialCapture *capture; // Raw traffic, on unless the SerialCaptureDisabled default is set
 
 - (void)openWithCompletionHandler:(void(^)(NSError *error))completionHandler;
 - (void)sendGCode:(TFPGCode*)code;
 
 @property (readonly) TFPPrinterConnectionState state;
 
+// M115 values from the handshake, if the firmware answered with them. Available once opened.
+@property (readonly, copy) NSDictionary<NSString*, NSString*> *capabilities;
+
+// Seconds from open to established over recent connections. Keys: count, p50, p90, p99.
++ (NSDictionary<NSString*, NSNumber*> *)connectionTimePercentiles;
+
 // Blocks are called on a private queue, remember to dispatch!
 @property (copy) void(^messageHandler)(TFPPrinterMessageType type, NSInteger lineNumber, id value);
 @property (copy) void(^rawLineHandler)(NSString *line);
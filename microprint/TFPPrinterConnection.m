@@ -11,22 +11,39 @@
 #import "TFPExtras.h"
 #import "TFPGCodeHelpers.h"
 #import "TFStringScanner.h"
+#import "TFPVirtualClock.h"
+#import "TFPSerialCapture.h"
 #import "ORSSerialPort.h"
+#import "ORSSerialPortManager.h"
 
 
-static const NSTimeInterval firmwareReconnectionDelay = 4;
+// Fallback in case we miss the port coming back after switching to firmware mode
+static const NSTimeInterval firmwareReconnectionTimeout = 4;
+static const NSUInteger connectionTimeHistoryLength = 100;
+
+
+typedef NS_ENUM(NSUInteger, TFPPrinterConnectionPhase) {
+	TFPPrinterConnectionPhaseIdle,
+	TFPPrinterConnectionPhaseHandshake, // Port opened, M115 sent
+	TFPPrinterConnectionPhaseSwitchingToFirmware, // Bootloader told to start the firmware. The port goes away.
+	TFPPrinterConnectionPhaseWaitingForPort, // Reopens as soon as the port reappears
+	TFPPrinterConnectionPhaseEstablished,
+};
 
 
 
 @interface TFPPrinterConnection () <ORSSerialPortDelegate>
 @property (readwrite) ORSSerialPort *serialPort;
+@property (readwrite) TFPSerialCapture *capture;
 @property dispatch_queue_t serialPortQueue;
 
 @property NSMutableData *incomingData;
 
 @property (readwrite) TFPPrinterConnectionState state;
-@property BOOL pendingConnection;
-@property BOOL connectionFinished;
+@property TFPPrinterConnectionPhase phase;
+@property uint64_t openTime;
+@property (readwrite, copy) NSDictionary<NSString*, NSString*> *capabilities;
+@property id portConnectionObserver;
 @property BOOL removed;
 
 @property (copy) void(^connectionCompletionHandler)(NSError *error);
@@ -42,21 +59,42 @@ static const NSTimeInterval firmwareReconnectionDelay = 4;
 	
 	self.serialPort = serialPort;
 	self.serialPortQueue = dispatch_queue_create("se.tomasf.microprint.printerSerialQueue", DISPATCH_QUEUE_SERIAL);
+	[TFPVirtualClock registerQueue:self.serialPortQueue];
 	
 	self.serialPort.delegate = self;
 	self.serialPort.delegateQueue = self.serialPortQueue;
 	
+	if(serialPort && ![[NSUserDefaults standardUserDefaults] boolForKey:@"SerialCaptureDisabled"]) {
+		self.capture = [[TFPSerialCapture alloc] initWithURL:[TFPSerialCapture defaultURLForPortName:serialPort.name]];
+	}
+	
 	self.incomingData = [NSMutableData data];
 	
+	__weak __typeof__(self) weakSelf = self;
+	self.portConnectionObserver = [[NSNotificationCenter defaultCenter] addObserverForName:ORSSerialPortsWereConnectedNotification object:nil queue:nil usingBlock:^(NSNotification *notification) {
+		if([notification.userInfo[ORSConnectedSerialPortsKey] containsObject:weakSelf.serialPort]) {
+			dispatch_async(weakSelf.serialPortQueue, ^{
+				[weakSelf reopenAfterFirmwareSwitchAsLastAttempt:NO];
+			});
+		}
+	}];
+	
 	return self;
 }
 
 
+- (void)dealloc {
+	[[NSNotificationCenter defaultCenter] removeObserver:self.portConnectionObserver];
+	[self.capture close];
+}
+
+
 - (void)openWithCompletionHandler:(void(^)(NSError *error))completionHandler {
-	if(self.connectionFinished) {
+	if(self.phase == TFPPrinterConnectionPhaseEstablished) {
 		completionHandler(nil);
 	}else{
-		self.pendingConnection = YES;
+		self.phase = TFPPrinterConnectionPhaseHandshake;
+		self.openTime = TFNanosecondTime();
 		self.connectionCompletionHandler = completionHandler;
 		self.state = TFPPrinterConnectionStatePending;
 		
@@ -65,14 +103,89 @@ static const NSTimeInterval firmwareReconnectionDelay = 4;
 }
 
 
+- (BOOL)pendingConnection {
+	return self.phase != TFPPrinterConnectionPhaseIdle && self.phase != TFPPrinterConnectionPhaseEstablished;
+}
+
+
+// On serial port queue. The port can be announced before it's ready to open. An early attempt that fails goes back
+// to waiting, leaving it to the fallback; only a failed last attempt fails the connection.
+- (void)reopenAfterFirmwareSwitchAsLastAttempt:(BOOL)lastAttempt {
+	if(self.phase != TFPPrinterConnectionPhaseWaitingForPort) {
+		return;
+	}
+	
+	self.phase = TFPPrinterConnectionPhaseHandshake;
+	[self.serialPort open];
+	if(!self.serialPort.isOpen && !lastAttempt) {
+		self.phase = TFPPrinterConnectionPhaseWaitingForPort;
+	}
+}
+
+
+#pragma mark - Connection Time
+
+
++ (NSMutableArray<NSNumber*> *)connectionTimes {
+	static NSMutableArray *times;
+	static dispatch_once_t once;
+	dispatch_once(&once, ^{
+		times = [NSMutableArray new];
+	});
+	return times;
+}
+
+
++ (void)recordConnectionTime:(NSTimeInterval)duration {
+	NSMutableArray *times = [self connectionTimes];
+	@synchronized(times) {
+		[times addObject:@(duration)];
+		if(times.count > connectionTimeHistoryLength) {
+			[times removeObjectAtIndex:0];
+		}
+	}
+}
+
+
++ (NSDictionary<NSString*, NSNumber*> *)connectionTimePercentiles {
+	NSMutableArray *times = [self connectionTimes];
+	NSArray<NSNumber*> *sortedTimes;
+	@synchronized(times) {
+		sortedTimes = [times sortedArrayUsingSelector:@selector(compare:)];
+	}
+	
+	if(!sortedTimes.count) {
+		return @{@"count": @0};
+	}
+	
+	NSNumber *(^percentile)(double) = ^(double fraction) {
+		return sortedTimes[MIN((NSUInteger)(fraction * sortedTimes.count), sortedTimes.count-1)];
+	};
+	
+	return @{@"count": @(sortedTimes.count),
+			 @"p50": percentile(0.5),
+			 @"p90": percentile(0.9),
+			 @"p99": percentile(0.99),
+			 };
+}
+
+
+
 - (void)sendGCode:(TFPGCode*)code {
 	NSData *data = code.repetierV2Representation;
 	dispatch_async(self.serialPortQueue, ^{
-		[self.serialPort sendData:data];
+		[self writeData:data];
 	});
 }
 
 
+// On serial port queue. Everything we send goes through here so it ends up in the capture.
+- (void)writeData:(NSData*)data {
+	[self.capture recordEvent:TFPSerialCaptureEventOutgoingData data:data];
+	[self.serialPort sendData:data];
+}
+
+
 + (NSDictionary*)dictionaryFromResponseValueString:(NSString*)string {
 	NSMutableDictionary *dictionary = [NSMutableDictionary new];
 	NSArray *parts = [string componentsSeparatedByString:@" "];
@@ -148,8 +261,13 @@ static const NSTimeInterval firmwareReconnectionDelay = 4;
 
 
 - (void)finishEstablishment {
-	self.pendingConnection = NO;
-	self.connectionFinished = YES;
+	self.phase = TFPPrinterConnectionPhaseEstablished;
+	
+	if(self.openTime) {
+		NSTimeInterval duration = (double)(TFNanosecondTime() - self.openTime) / NSEC_PER_SEC;
+		[self.class recordConnectionTime:duration];
+		TFLog(@"Connected to %@ in %.02f s", self.serialPort.name, duration);
+	}
 	
 	dispatch_async(dispatch_get_main_queue(), ^{
 		self.state = TFPPrinterConnectionStateConnected;
@@ -161,11 +279,12 @@ static const NSTimeInterval firmwareReconnectionDelay = 4;
 - (void)processIncomingData {
 	// On serial port thread here
 	
-	if(self.pendingConnection && [self.incomingData isEqual:[NSData tf_singleByte:'?']]) {
+	if(self.phase == TFPPrinterConnectionPhaseHandshake && [self.incomingData isEqual:[NSData tf_singleByte:'?']]) {
 		TFLog(@"Switching from bootloader to firmware mode...");
+		self.phase = TFPPrinterConnectionPhaseSwitchingToFirmware;
 		
 		[self.incomingData setLength:0];
-		[self.serialPort sendData:[NSData tf_singleByte:'Q']];
+		[self writeData:[NSData tf_singleByte:'Q']];
 		return;
 	}
 	
@@ -178,7 +297,10 @@ static const NSTimeInterval firmwareReconnectionDelay = 4;
 		
 		NSString *string = [[NSString alloc] initWithData:line encoding:NSUTF8StringEncoding];
 		
-		if(self.pendingConnection && [string hasPrefix:@"ok"]) {
+		if(self.phase == TFPPrinterConnectionPhaseHandshake && [string hasPrefix:@"ok"]) {
+			// The handshake response carries the capabilities, which saves the printer from asking again
+			NSDictionary *capabilities = [self.class dictionaryFromResponseValueString:[string substringFromIndex:2]];
+			self.capabilities = capabilities[@"X-SERIAL_NUMBER"] ? capabilities : nil;
 			[self finishEstablishment];
 		}else{
 			[self processIncomingString:string];
@@ -193,16 +315,20 @@ static const NSTimeInterval firmwareReconnectionDelay = 4;
 
 
 - (void)serialPortWasOpened:(ORSSerialPort * __nonnull)serialPort {
+	[self.capture recordEvent:TFPSerialCaptureEventPortOpened data:nil];
 	self.removed = NO;
 	[self sendGCode:[TFPGCode codeWithString:@"M115"]];
 }
 
 
 - (void)serialPortWasClosed:(ORSSerialPort * __nonnull)serialPort {
+	[self.capture recordEvent:TFPSerialCaptureEventPortClosed data:nil];
 	
 	if(self.pendingConnection) {
-		dispatch_after(dispatch_time(0, firmwareReconnectionDelay * NSEC_PER_SEC), self.serialPortQueue, ^{
-			[self.serialPort open];
+		// Normally the device re-enumerates and the port comes back well before this
+		self.phase = TFPPrinterConnectionPhaseWaitingForPort;
+		dispatch_after(dispatch_time(0, firmwareReconnectionTimeout * NSEC_PER_SEC), self.serialPortQueue, ^{
+			[self reopenAfterFirmwareSwitchAsLastAttempt:YES];
 		});
 	}else{
 		TFMainThread(^{
@@ -213,6 +339,11 @@ static const NSTimeInterval firmwareReconnectionDelay = 4;
 
 
 - (void)serialPort:(ORSSerialPort *)serialPort didEncounterError:(NSError *)error {
+	// From an early reopen that didn't take; the fallback tries again
+	if(self.phase == TFPPrinterConnectionPhaseWaitingForPort) {
+		return;
+	}
+	
 	if(self.pendingConnection) {
 		dispatch_async(dispatch_get_main_queue(), ^{
 			self.connectionCompletionHandler(error);
@@ -222,6 +353,7 @@ static const NSTimeInterval firmwareReconnectionDelay = 4;
 
 
 - (void)serialPort:(ORSSerialPort * __nonnull)serialPort didReceiveData:(NSData * __nonnull)data {
+	[self.capture recordEvent:TFPSerialCaptureEventIncomingData data:data];
 	[self.incomingData appendData:data];
 	[self processIncomingData];
 }
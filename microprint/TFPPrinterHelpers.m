@@ -11,10 +11,11 @@
 #import "TFP3DVector.h"
 #import "TFPExtras.h"
 
-#import "TFTimer.h"
 #import "MAKVONotificationCenter.h"
 
 
+static const NSUInteger maximumMoveStepsInFlight = 4;
+
 
 @implementation TFPPrinter (CommandHelpers)
 
@@ -28,9 +29,13 @@
 	
 	[self readVirtualEEPROMFloatValuesAtIndexes:indexes completionHandler:^(BOOL success, NSArray *values) {
 		TFPBedLevelOffsets offsets = {0};
+		if(!completionHandler) {
+			return;
+		}
 		
 		if(!success) {
 			completionHandler(NO, offsets);
+			return;
 		}
 		
 		offsets.backLeft = [values[0] floatValue];
@@ -39,9 +44,7 @@
 		offsets.frontLeft = [values[3] floatValue];
 		offsets.common = [values[4] floatValue];
 		
-		if(completionHandler) {
-			completionHandler(YES, offsets);
-		}
+		completionHandler(YES, offsets);
 	}];
 }
 
@@ -60,6 +63,7 @@
 		
 		if(!success) {
 			completionHandler(NO, offsets);
+			return;
 		}
 		
 		offsets.backLeft = [values[0] floatValue];
@@ -209,62 +213,82 @@
 	__weak __typeof__(self) weakSelf = self;
 	__block BOOL done = NO;
 	
+	// The printer's temperature monitor polls quickly while the heater is far from its target
 	[self sendGCode:[TFPGCode codeForHeaterTemperature:targetTemperature waitUntilDone:NO] responseHandler:nil];
 	
-	TFTimer *timer = [TFTimer timerWithInterval:0.5 repeating:YES block:^{
-		[weakSelf sendGCode:[TFPGCode codeForReadingHeaterTemperature] responseHandler:nil];
-	}];
-	__weak TFTimer *weakTimer = timer;
-	
-	void(^cancelBlock)() = [^{
-		if(done) {
-			return;
-		}
-		[timer invalidate];
-		[weakSelf sendGCode:[TFPGCode codeForTurningOffHeater] responseHandler:nil];
-	} copy];
-	
-	[self.printer addObserver:timer keyPath:@"heaterTemperature" options:0 block:^(MAKVONotification *notification) {
+	__block id<MAKVOObservation> observation = [self.printer addObserver:self keyPath:@"heaterTemperature" options:0 block:^(MAKVONotification *notification) {
 		if(done) {
 			return;
 		}
 		
 		if(weakSelf.printer.heaterTemperature >= targetTemperature-3) {
-			[weakTimer invalidate];
 			done = YES;
+			[observation remove];
+			observation = nil;
 			completionBlock();
 		}else{
 			progressBlock(weakSelf.printer.heaterTemperature);
 		}
 	}];
 	
+	void(^cancelBlock)() = [^{
+		if(done) {
+			return;
+		}
+		done = YES;
+		[observation remove];
+		observation = nil;
+		[weakSelf sendGCode:[TFPGCode codeForTurningOffHeater] responseHandler:nil];
+	} copy];
+	
 	return cancelBlock;
 }
 
 
-- (void)moveStepFromPosition:(TFP3DVector*)from toPosition:(TFP3DVector*)to steps:(NSUInteger)stepCount currentStep:(NSUInteger)step feedRate:(double)feedRate cancelBlock:(BOOL(^)())cancelBlock progressBlock:(void(^)(double fraction, TFP3DVector *position))progressBlock completionBlock:(void(^)())completionBlock {
+// Keeps a few steps queued so each one goes out as soon as the previous is acknowledged, instead of the head
+// stopping between steps while we react. On cancel, steps already queued still run but nothing is reported.
+- (void)moveInSteps:(NSUInteger)stepCount fromPosition:(TFP3DVector*)from toPosition:(TFP3DVector*)to feedRate:(double)feedRate cancelBlock:(BOOL(^)())cancelBlock progressBlock:(void(^)(double fraction, TFP3DVector *position))progressBlock completionBlock:(void(^)())completionBlock {
+	__weak __typeof__(self) weakSelf = self;
 	
-	from = [from vectorWithFieldsPresentInVector:to];
+	TFPVector start = TFPVectorWithFields(from.vector, from.vector.fields & to.vector.fields);
+	TFPVector deltaPerStep = TFPVectorDivide(TFPVectorSubtract(to.vector, start), TFPVectorMake(stepCount, stepCount, stepCount));
 	
-	TFP3DVector *fullDelta = [to vectorBySubtracting:from];
-	TFP3DVector *deltaPerStep = [fullDelta vectorByDividingByScalar:stepCount];
-	TFP3DVector *currentDelta = [deltaPerStep vectorByMultiplyingByScalar:step];
-	TFP3DVector *absolutePosition = [from vectorByAdding:currentDelta];
+	__block NSUInteger sentStepCount = 0;
+	__block NSUInteger acknowledgedStepCount = 0;
+	__block void(^fillWindow)();
 	
-	[self moveToPosition:absolutePosition usingFeedRate:feedRate completionHandler:^(BOOL success) {
-		if(cancelBlock()) {
-			return;
-		}
-		
-		progressBlock((double)step/stepCount, absolutePosition);
-		
-		if(step == stepCount) {
-			completionBlock();
-		}else{
-			[self moveStepFromPosition:from toPosition:to steps:stepCount currentStep:step+1 feedRate:feedRate cancelBlock:cancelBlock progressBlock:progressBlock completionBlock:completionBlock];
+	fillWindow = ^{
+		while(!cancelBlock() && sentStepCount < stepCount && sentStepCount - acknowledgedStepCount < maximumMoveStepsInFlight) {
+			NSUInteger step = ++sentStepCount;
+			TFP3DVector *position = (step == stepCount) ? to : [TFP3DVector vectorWithVector:TFPVectorAdd(start, TFPVectorScale(deltaPerStep, step))];
+			
+			[weakSelf moveToPosition:position usingFeedRate:feedRate completionHandler:^(BOOL success) {
+				if(cancelBlock()) {
+					fillWindow = nil;
+					return;
+				}
+				
+				acknowledgedStepCount++;
+				progressBlock((double)acknowledgedStepCount/stepCount, position);
+				
+				if(acknowledgedStepCount == stepCount) {
+					fillWindow = nil;
+					completionBlock();
+				}else{
+					fillWindow();
+					// Cancelled with nothing left in flight; no handler is coming to break the cycle
+					if(sentStepCount == acknowledgedStepCount) {
+						fillWindow = nil;
+					}
+				}
+			}];
 		}
-	}];
+	};
 	
+	fillWindow();
+	if(cancelBlock() && sentStepCount == acknowledgedStepCount) {
+		fillWindow = nil;
+	}
 }
 
 
@@ -277,13 +301,13 @@
 	targetPosition = [TFP3DVector zVector:targetPosition.z.doubleValue];
 	
 	TFP3DVector *originPosition = [TFP3DVector vectorWithPosition:self.printer.position];
-	TFP3DVector *delta = [targetPosition vectorBySubtracting:originPosition];
+	TFPVector delta = TFPVectorSubtract(targetPosition.vector, originPosition.vector);
 	
-	TFP3DVector *stepVector = [[delta vectorByDividingBy:[TFP3DVector vectorWithX:@2 Y:@2 Z:@0.1]] absoluteVector];
-	NSUInteger numSteps = ceil(MAX(MAX(stepVector.x.integerValue, stepVector.y.integerValue), stepVector.z.integerValue));
+	TFPVector stepVector = TFPVectorAbsolute(TFPVectorDivide(delta, TFPVectorMake(2, 2, 0.1)));
+	NSUInteger numSteps = ceil(MAX(MAX((NSInteger)stepVector.x, (NSInteger)stepVector.y), (NSInteger)stepVector.z));
 	
 	if(numSteps > 0) {
-		[self moveStepFromPosition:originPosition toPosition:targetPosition steps:numSteps currentStep:0 feedRate:feedRate cancelBlock:^BOOL{
+		[self moveInSteps:numSteps fromPosition:originPosition toPosition:targetPosition feedRate:feedRate cancelBlock:^BOOL{
 			return cancelFlag;
 		} progressBlock:progressBlock completionBlock:^{
 			completionBlock();
@@ -7,6 +7,8 @@
 
 #import <Foundation/Foundation.h>
 
+@class TFPPrintSpooler, TFPPrinter, TFPGCodeLibraryIndex;
+
 
 @interface TFPPrinterManager : NSObject
 
@@ -14,5 +16,14 @@
 
 - (void)startDryRunMode;
 
+// Adds a printer that plays back a serial capture, at the recorded pace or as fast as the host keeps up
+- (TFPPrinter*)startReplayWithCaptureURL:(NSURL*)URL realTime:(BOOL)realTime error:(NSError**)outError;
+
 @property (readonly) NSArray *printers; // Observable
+
+// Shared job spooler, saved in Application Support. Created on first use.
+@property (readonly) TFPPrintSpooler *spooler;
+
+// Shared index of G-code files to pick jobs from, saved in Application Support. Created on first use.
+@property (readonly) TFPGCodeLibraryIndex *libraryIndex;
 @end
\ No newline at end of file
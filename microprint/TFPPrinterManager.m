@@ -9,7 +9,10 @@
 #import "TFPPrinter.h"
 #import "TFPExtras.h"
 #import "TFPDryRunPrinterConnection.h"
+#import "TFPReplayPrinterConnection.h"
 #import "TFPPrinterConnection.h"
+#import "TFPPrintSpooler.h"
+#import "TFPGCodeLibraryIndex.h"
 
 #import "MAKVONotificationCenter.h"
 #import "ORSSerialPortManager.h"
@@ -21,6 +24,8 @@ static const uint16_t M3DMicroUSBProductID = 0x2404;
 
 @interface TFPPrinterManager ()
 @property (readwrite) NSArray *printers; // Observable
+@property (readwrite) TFPPrintSpooler *spooler;
+@property (readwrite) TFPGCodeLibraryIndex *libraryIndex;
 @end
 
 
@@ -39,6 +44,37 @@ static const uint16_t M3DMicroUSBProductID = 0x2404;
 }
 
 
+- (TFPPrinter*)startReplayWithCaptureURL:(NSURL*)URL realTime:(BOOL)realTime error:(NSError**)outError {
+	TFPReplayPrinterConnection *connection = [[TFPReplayPrinterConnection alloc] initWithCaptureURL:URL realTime:realTime error:outError];
+	if(!connection) {
+		return nil;
+	}
+	
+	TFPPrinter *printer = [[TFPPrinter alloc] initWithConnection:connection];
+	[[self mutableArrayValueForKey:@"printers"] addObject:printer];
+	return printer;
+}
+
+
+- (TFPPrintSpooler *)spooler {
+	if(!_spooler) {
+		NSURL *supportURL = [[NSFileManager defaultManager] URLsForDirectory:NSApplicationSupportDirectory inDomains:NSUserDomainMask].firstObject;
+		NSURL *spoolURL = [supportURL URLByAppendingPathComponent:@"MicroPrint/Spool.plist"];
+		_spooler = [[TFPPrintSpooler alloc] initWithPrinterManager:self spoolFileURL:spoolURL];
+	}
+	return _spooler;
+}
+
+
+- (TFPGCodeLibraryIndex *)libraryIndex {
+	if(!_libraryIndex) {
+		NSURL *supportURL = [[NSFileManager defaultManager] URLsForDirectory:NSApplicationSupportDirectory inDomains:NSUserDomainMask].firstObject;
+		_libraryIndex = [[TFPGCodeLibraryIndex alloc] initWithIndexURL:[supportURL URLByAppendingPathComponent:@"MicroPrint/Library.plist"]];
+	}
+	return _libraryIndex;
+}
+
+
 - (NSArray*)printersForSerialPorts:(NSArray*)serialPorts {
 	return [[serialPorts tf_selectWithBlock:^BOOL(ORSSerialPort *port) {
 		return port.USBVendorID.unsignedShortValue == M3DMicroUSBVendorID && port.USBProductID.unsignedShortValue == M3DMicroUSBProductID;
@@ -53,6 +89,9 @@ static const uint16_t M3DMicroUSBProductID = 0x2404;
 	if(!(self = [super init])) return nil;
 	__weak __typeof__(self) weakSelf = self;
 	
+	// Opt-in: one event-driven read queue for all printers instead of a reader thread and pin poll timer per port
+	[ORSSerialPort setUsesSharedReadQueue:[[NSUserDefaults standardUserDefaults] boolForKey:@"UseSharedSerialReadQueue"]];
+	
 	self.printers = [self printersForSerialPorts:[ORSSerialPortManager sharedSerialPortManager].availablePorts];
 	
 	[[ORSSerialPortManager sharedSerialPortManager] addObserver:self keyPath:@"availablePorts" options:NSKeyValueObservingOptionNew|NSKeyValueObservingOptionOld block:^(MAKVONotification *notification) {
@@ -0,0 +1,18 @@
+//
+//  TFPReplayPrinterConnection.h
+//  microprint
+//
+//
+
+#import "TFPPrinterConnection.h"
+
+
+// Plays a serial capture back as if it were the printer. The host drives the replay: each recorded chunk from the
+// printer is delivered once the host has sent as much as it had at that point in the capture, then after the recorded
+// delay in real time, or right away otherwise.
+@interface TFPReplayPrinterConnection : TFPPrinterConnection
+- (instancetype)initWithCaptureURL:(NSURL*)URL realTime:(BOOL)realTime error:(NSError**)outError;
+
+// Called on the main queue once the capture runs out, with the time the replay took
+@property (copy) void(^replayCompletionHandler)(NSTimeInterval duration);
+@end
@@ -0,0 +1,158 @@
+//
+//  TFPReplayPrinterConnection.m
+//  microprint
+//
+//
+
+#import "TFPReplayPrinterConnection.h"
+#import "TFPSerialCapture.h"
+#import "TFPExtras.h"
+
+
+@interface TFPPrinterConnection (ReplayPrivate)
+@property dispatch_queue_t serialPortQueue;
+- (void)writeData:(NSData*)data;
+- (void)reopenAfterFirmwareSwitchAsLastAttempt:(BOOL)lastAttempt;
+- (void)serialPortWasOpened:(ORSSerialPort*)serialPort;
+- (void)serialPortWasClosed:(ORSSerialPort*)serialPort;
+- (void)serialPort:(ORSSerialPort*)serialPort didReceiveData:(NSData*)data;
+@end
+
+
+
+@interface TFPReplayRecord : NSObject
+@property TFPSerialCaptureEvent event;
+@property uint64_t time;
+@property NSData *data;
+@end
+
+
+@implementation TFPReplayRecord
+@end
+
+
+
+@interface TFPReplayPrinterConnection ()
+@property NSArray<TFPReplayRecord*> *records;
+@property BOOL realTime;
+
+// On serial port queue
+@property NSUInteger nextRecordIndex;
+@property uint64_t previousRecordTime;
+@property uint64_t capturedByteCount; // Sent by the host in the capture, up to the next record
+@property uint64_t sentByteCount; // Sent by the host during the replay
+@property BOOL deliveryScheduled;
+@property uint64_t startTime;
+@end
+
+
+
+@implementation TFPReplayPrinterConnection
+
+
+- (instancetype)initWithCaptureURL:(NSURL*)URL realTime:(BOOL)realTime error:(NSError**)outError {
+	if(!(self = [super initWithSerialPort:nil])) return nil;
+	
+	NSMutableArray *records = [NSMutableArray new];
+	BOOL success = [TFPSerialCapture enumerateRecordsInFileAtURL:URL error:outError usingBlock:^(TFPSerialCaptureEvent event, uint64_t time, NSData *data) {
+		TFPReplayRecord *record = [TFPReplayRecord new];
+		record.event = event;
+		record.time = time;
+		record.data = data;
+		[records addObject:record];
+	}];
+	if(!success) {
+		return nil;
+	}
+	
+	self.records = records;
+	self.realTime = realTime;
+	return self;
+}
+
+
+- (void)openWithCompletionHandler:(void(^)(NSError *error))completionHandler {
+	[super openWithCompletionHandler:completionHandler];
+	
+	dispatch_async(self.serialPortQueue, ^{
+		self.startTime = TFNanosecondTime();
+		[self advance];
+	});
+}
+
+
+// On serial port queue. Instead of going out, the host's data lets the replay move on.
+- (void)writeData:(NSData*)data {
+	self.sentByteCount += data.length;
+	[self advance];
+}
+
+
+// On serial port queue
+- (void)advance {
+	while(!self.deliveryScheduled && self.nextRecordIndex < self.records.count) {
+		TFPReplayRecord *record = self.records[self.nextRecordIndex];
+		
+		if(record.event == TFPSerialCaptureEventOutgoingData) {
+			// Wait for the host to catch up with the capture
+			if(self.sentByteCount < self.capturedByteCount + record.data.length) {
+				return;
+			}
+			self.capturedByteCount += record.data.length;
+			self.previousRecordTime = record.time;
+			self.nextRecordIndex++;
+			continue;
+		}
+		
+		NSTimeInterval delay = self.realTime ? (double)(record.time - self.previousRecordTime) / NSEC_PER_SEC : 0;
+		self.deliveryScheduled = YES;
+		
+		dispatch_after(dispatch_time(DISPATCH_TIME_NOW, delay * NSEC_PER_SEC), self.serialPortQueue, ^{
+			self.deliveryScheduled = NO;
+			self.previousRecordTime = record.time;
+			self.nextRecordIndex++;
+			
+			[self deliverRecord:record];
+			[self advance];
+		});
+		return;
+	}
+	
+	if(!self.deliveryScheduled && self.nextRecordIndex == self.records.count && self.startTime) {
+		NSTimeInterval duration = (double)(TFNanosecondTime() - self.startTime) / NSEC_PER_SEC;
+		self.startTime = 0;
+		TFLog(@"Replayed %ld capture records in %.02f s", (long)self.records.count, duration);
+		
+		dispatch_async(dispatch_get_main_queue(), ^{
+			if(self.replayCompletionHandler) {
+				self.replayCompletionHandler(duration);
+			}
+		});
+	}
+}
+
+
+// On serial port queue
+- (void)deliverRecord:(TFPReplayRecord*)record {
+	switch(record.event) {
+		case TFPSerialCaptureEventIncomingData:
+			[self serialPort:nil didReceiveData:record.data];
+			break;
+		
+		case TFPSerialCaptureEventPortOpened:
+			// There's no port to wait for; the capture says it's open
+			[self reopenAfterFirmwareSwitchAsLastAttempt:YES];
+			[self serialPortWasOpened:nil];
+			break;
+		
+		case TFPSerialCaptureEventPortClosed:
+			[self serialPortWasClosed:nil];
+			break;
+		
+		case TFPSerialCaptureEventOutgoingData:
+			break;
+	}
+}
+
+
+@end
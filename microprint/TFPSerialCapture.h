@@ -0,0 +1,36 @@
+//
+//  TFPSerialCapture.h
+//  microprint
+//
+//
+
+#import <Foundation/Foundation.h>
+
+
+typedef NS_ENUM(uint8_t, TFPSerialCaptureEvent) {
+	TFPSerialCaptureEventOutgoingData = 1,
+	TFPSerialCaptureEventIncomingData,
+	TFPSerialCaptureEventPortOpened,
+	TFPSerialCaptureEventPortClosed,
+};
+
+
+// Binary capture of everything that goes over a printer's serial port, for reproducing problems offline.
+// Recording only copies bytes into a buffer; a background queue writes it out in batches and rotates
+// the file when it grows past maximumFileSize, keeping a couple of older files as name.1, name.2.
+// If the file can't be opened or written, the capture logs it and stops recording.
+@interface TFPSerialCapture : NSObject
+- (instancetype)initWithURL:(NSURL*)URL;
++ (NSURL*)defaultURLForPortName:(NSString*)name; // Application Support/MicroPrint/Captures/name.tfpcapture
+
+@property NSUInteger maximumFileSize; // Default 16 MB
+
+// Any queue. If the writer falls far behind, records are dropped rather than blocking the caller.
+- (void)recordEvent:(TFPSerialCaptureEvent)event data:(NSData*)data;
+
+- (void)flush; // Waits until everything recorded so far is written
+- (void)close;
+
+// Records in order, with nanoseconds since the capture started. Rotated files keep counting from the same start.
++ (BOOL)enumerateRecordsInFileAtURL:(NSURL*)URL error:(NSError**)outError usingBlock:(void(^)(TFPSerialCaptureEvent event, uint64_t time, NSData *data))block;
+@end
@@ -0,0 +1,306 @@
+//
+//  TFPSerialCapture.m
+//  microprint
+//
+//
+
+#import "TFPSerialCapture.h"
+#import "TFPExtras.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+
+static const uint32_t captureMagic = 'TFPS';
+static const uint32_t captureVersion = 1;
+
+static const NSUInteger defaultMaximumFileSize = 16 * 1024 * 1024;
+static const NSUInteger previousFileCount = 2;
+
+static const NSUInteger batchSize = 64 * 1024;
+static const NSUInteger maximumBufferSize = 4 * 1024 * 1024;
+static const NSTimeInterval writeInterval = 1;
+
+
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t startTime; // TFNanosecondTime when the capture started
+	double startDate; // Seconds since 1970, for reference
+} TFPSerialCaptureHeader;
+
+
+typedef struct {
+	uint64_t time; // Nanoseconds since startTime
+	uint32_t length;
+	uint8_t event;
+	uint8_t reserved[3];
+} TFPSerialCaptureRecord;
+
+
+// Writes everything, continuing after short writes. On failure, returns NO with errno set.
+static BOOL TFPSerialCaptureWrite(int fd, const void *bytes, size_t length) {
+	while(length) {
+		ssize_t written = write(fd, bytes, length);
+		if(written < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+			return NO;
+		}
+		bytes = (const uint8_t*)bytes + written;
+		length -= written;
+	}
+	return YES;
+}
+
+
+
+@interface TFPSerialCapture ()
+@property (copy) NSURL *URL;
+@property uint64_t startTime;
+@property double startDate;
+
+// Guarded by @synchronized(self)
+@property NSMutableData *buffer;
+@property BOOL writeScheduled;
+@property NSUInteger droppedRecordCount;
+@property BOOL stopped; // After a write error
+
+// On writer queue
+@property dispatch_queue_t writerQueue;
+@property dispatch_source_t writeTimer;
+@property int fileDescriptor;
+@property NSUInteger fileSize;
+@end
+
+
+
+@implementation TFPSerialCapture
+
+
++ (NSURL*)defaultURLForPortName:(NSString*)name {
+	NSURL *supportURL = [[NSFileManager defaultManager] URLsForDirectory:NSApplicationSupportDirectory inDomains:NSUserDomainMask].firstObject;
+	NSString *fileName = [[name stringByReplacingOccurrencesOfString:@"/" withString:@"_"] stringByAppendingPathExtension:@"tfpcapture"];
+	return [[supportURL URLByAppendingPathComponent:@"MicroPrint/Captures"] URLByAppendingPathComponent:fileName];
+}
+
+
+- (instancetype)initWithURL:(NSURL*)URL {
+	if(!(self = [super init])) return nil;
+	
+	self.URL = URL;
+	self.maximumFileSize = defaultMaximumFileSize;
+	self.startTime = TFNanosecondTime();
+	self.startDate = [NSDate timeIntervalSinceReferenceDate] + NSTimeIntervalSince1970;
+	self.buffer = [NSMutableData dataWithCapacity:batchSize];
+	self.fileDescriptor = -1;
+	
+	self.writerQueue = dispatch_queue_create("se.tomasf.microprint.serialCapture", DISPATCH_QUEUE_SERIAL);
+	self.writeTimer = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, self.writerQueue);
+	dispatch_source_set_timer(self.writeTimer, dispatch_time(DISPATCH_TIME_NOW, writeInterval * NSEC_PER_SEC), writeInterval * NSEC_PER_SEC, 0.5 * NSEC_PER_SEC);
+	
+	__weak __typeof__(self) weakSelf = self;
+	dispatch_source_set_event_handler(self.writeTimer, ^{
+		[weakSelf writeBuffer];
+	});
+	dispatch_resume(self.writeTimer);
+	
+	return self;
+}
+
+
+- (void)dealloc {
+	if(self.writeTimer) {
+		dispatch_source_cancel(self.writeTimer);
+	}
+	if(self.fileDescriptor >= 0) {
+		close(self.fileDescriptor);
+	}
+}
+
+
+- (void)recordEvent:(TFPSerialCaptureEvent)event data:(NSData*)data {
+	TFPSerialCaptureRecord record = {.time = TFNanosecondTime() - self.startTime, .length = (uint32_t)data.length, .event = event};
+	BOOL scheduleWrite = NO;
+	
+	@synchronized(self) {
+		if(self.stopped) {
+			return;
+		}
+		if(self.buffer.length + sizeof(record) + data.length > maximumBufferSize) {
+			self.droppedRecordCount++;
+			return;
+		}
+		
+		[self.buffer appendBytes:&record length:sizeof(record)];
+		[self.buffer appendData:data];
+		
+		if(self.buffer.length >= batchSize && !self.writeScheduled) {
+			self.writeScheduled = YES;
+			scheduleWrite = YES;
+		}
+	}
+	
+	if(scheduleWrite) {
+		__weak __typeof__(self) weakSelf = self;
+		dispatch_async(self.writerQueue, ^{
+			[weakSelf writeBuffer];
+		});
+	}
+}
+
+
+#pragma mark - Writing
+
+
+// On writer queue. A capture already at the URL, from an earlier connection or from before rotation, becomes name.1.
+- (BOOL)openFile {
+	[[NSFileManager defaultManager] createDirectoryAtURL:self.URL.URLByDeletingLastPathComponent withIntermediateDirectories:YES attributes:nil error:nil];
+	[self shiftPreviousFiles];
+	
+	self.fileDescriptor = open(self.URL.fileSystemRepresentation, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+	if(self.fileDescriptor < 0) {
+		// Trying again would rotate away the previous captures every time
+		[self stopWithError:errno];
+		return NO;
+	}
+	
+	TFPSerialCaptureHeader header = {captureMagic, captureVersion, self.startTime, self.startDate};
+	if(!TFPSerialCaptureWrite(self.fileDescriptor, &header, sizeof(header))) {
+		[self stopWithError:errno];
+		return NO;
+	}
+	self.fileSize = sizeof(header);
+	return YES;
+}
+
+
+// On writer queue. A full disk or a vanished volume won't get better by retrying, so nothing more is recorded.
+- (void)stopWithError:(int)error {
+	TFLog(@"Serial capture %@ stopped: %s", self.URL.path, strerror(error));
+	
+	if(self.fileDescriptor >= 0) {
+		close(self.fileDescriptor);
+		self.fileDescriptor = -1;
+	}
+	@synchronized(self) {
+		self.stopped = YES;
+		self.buffer = [NSMutableData data];
+	}
+}
+
+
+- (NSURL*)URLForPreviousFile:(NSUInteger)index {
+	NSString *name = [NSString stringWithFormat:@"%@.%ld.%@", self.URL.lastPathComponent.stringByDeletingPathExtension, (long)index, self.URL.pathExtension];
+	return [self.URL.URLByDeletingLastPathComponent URLByAppendingPathComponent:name];
+}
+
+
+// On writer queue
+- (void)shiftPreviousFiles {
+	NSFileManager *fileManager = [NSFileManager defaultManager];
+	for(NSUInteger i=previousFileCount; i>0; i--) {
+		NSURL *source = (i > 1) ? [self URLForPreviousFile:i-1] : self.URL;
+		NSURL *destination = [self URLForPreviousFile:i];
+		[fileManager removeItemAtURL:destination error:nil];
+		[fileManager moveItemAtURL:source toURL:destination error:nil];
+	}
+}
+
+
+// On writer queue
+- (void)writeBuffer {
+	NSData *data;
+	NSUInteger droppedRecordCount;
+	
+	@synchronized(self) {
+		if(self.stopped) {
+			return;
+		}
+		data = self.buffer;
+		droppedRecordCount = self.droppedRecordCount;
+		self.buffer = [NSMutableData dataWithCapacity:batchSize];
+		self.droppedRecordCount = 0;
+		self.writeScheduled = NO;
+	}
+	
+	if(droppedRecordCount) {
+		TFLog(@"Serial capture fell behind and dropped %ld records", (long)droppedRecordCount);
+	}
+	if(!data.length || (self.fileDescriptor < 0 && ![self openFile])) {
+		return;
+	}
+	
+	if(!TFPSerialCaptureWrite(self.fileDescriptor, data.bytes, data.length)) {
+		[self stopWithError:errno];
+		return;
+	}
+	self.fileSize += data.length;
+	
+	// The next write starts a new file
+	if(self.fileSize >= self.maximumFileSize) {
+		close(self.fileDescriptor);
+		self.fileDescriptor = -1;
+	}
+}
+
+
+- (void)flush {
+	dispatch_sync(self.writerQueue, ^{
+		[self writeBuffer];
+	});
+}
+
+
+- (void)close {
+	dispatch_source_cancel(self.writeTimer);
+	self.writeTimer = nil;
+	
+	dispatch_sync(self.writerQueue, ^{
+		[self writeBuffer];
+		if(self.fileDescriptor >= 0) {
+			close(self.fileDescriptor);
+			self.fileDescriptor = -1;
+		}
+	});
+}
+
+
+#pragma mark - Reading
+
+
++ (BOOL)enumerateRecordsInFileAtURL:(NSURL*)URL error:(NSError**)outError usingBlock:(void(^)(TFPSerialCaptureEvent event, uint64_t time, NSData *data))block {
+	NSData *data = [NSData dataWithContentsOfURL:URL options:NSDataReadingMappedIfSafe error:outError];
+	if(!data) {
+		return NO;
+	}
+	
+	const TFPSerialCaptureHeader *header = data.bytes;
+	if(data.length < sizeof(TFPSerialCaptureHeader) || header->magic != captureMagic || header->version != captureVersion) {
+		if(outError) {
+			*outError = [NSError errorWithDomain:TFPErrorDomain code:TFPErrorCodeInvalidCapture userInfo:@{NSLocalizedRecoverySuggestionErrorKey: @"The file isn't a serial capture."}];
+		}
+		return NO;
+	}
+	
+	// A torn record at the end is ignored
+	NSUInteger offset = sizeof(TFPSerialCaptureHeader);
+	while(offset + sizeof(TFPSerialCaptureRecord) <= data.length) {
+		TFPSerialCaptureRecord record;
+		[data getBytes:&record range:NSMakeRange(offset, sizeof(record))];
+		offset += sizeof(record);
+		
+		if(offset + record.length > data.length) {
+			break;
+		}
+		
+		block(record.event, record.time, [data subdataWithRange:NSMakeRange(offset, record.length)]);
+		offset += record.length;
+	}
+	
+	return YES;
+}
+
+
+@end
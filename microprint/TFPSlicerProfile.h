@@ -20,6 +20,7 @@ typedef NS_ENUM (NSInteger, SlicerProfileType) {
 @interface TFPSlicerProfile : NSObject
 @property SlicerProfileType profileType;
 - (instancetype)initFromLines: (NSArray<TFPGCode *> *)lines;
++ (NSIndexSet *)profileLineIndexesInLines:(NSArray<TFPGCode *> *)lines;
 - (void)setValue:(id)value forUndefinedKey:(NSString *)key;
 - (id)objectForKeyedSubscript:(id)key;
 - (id)valueForUndefinedKey:(NSString *)key;
@@ -62,6 +62,57 @@ typedef NSMutableDictionary<NSString*, NSString*> ProfileDict;
     return self;
 }
 
+// Used when stripping comments from a program. Returns the comment lines the load methods below would read:
+// the Cura profile string, "; key = value" lines in the header and footer blocks of a Slic3r file, and the
+// "   key,value" block following the Simplify3D header.
++ (NSIndexSet *)profileLineIndexesInLines:(NSArray<TFPGCode *> *)lines {
+    NSMutableIndexSet *indexes = [NSMutableIndexSet indexSet];
+
+    [lines enumerateObjectsUsingBlock:^(TFPGCode *code, NSUInteger idx, BOOL *stop) {
+        if([code.comment hasPrefix:CURA_COMMENT]) {
+            [indexes addIndex:idx];
+        }
+    }];
+
+    if(lines.count > 0 && [lines[0].comment hasPrefix:SLIC3R_COMMENT]) {
+        NSRegularExpression *regex = [NSRegularExpression regularExpressionWithPattern:PROFILE_REGEX options:0 error:NULL];
+        void (^addMatchingLine)(NSUInteger) = ^(NSUInteger i) {
+            NSString *comment = lines[i].comment;
+            if(comment && [regex firstMatchInString:comment options:0 range:NSMakeRange(0, comment.length)]) {
+                [indexes addIndex:i];
+            }
+        };
+
+        [indexes addIndex:0];
+        NSUInteger headerEnd = 1;
+        for(; headerEnd < lines.count && !lines[headerEnd].hasFields; headerEnd++) {
+            addMatchingLine(headerEnd);
+        }
+
+        for(NSUInteger i = lines.count; i > headerEnd && !lines[i-1].hasFields; i--) {
+            addMatchingLine(i-1);
+        }
+    }
+
+    for(NSUInteger i = 0; i < lines.count && i < S3D_COMMENT_RANGE; i++) {
+        if([lines[i].comment hasPrefix:S3D_COMMENT]) {
+            NSRegularExpression *regex = [NSRegularExpression regularExpressionWithPattern:S3D_REGEX options:0 error:NULL];
+            [indexes addIndex:i];
+
+            // Same extent as loadS3dProfile: up to the first line without a comment
+            for(NSUInteger j = i+1; j < lines.count && j < S3D_MAX_RANGE && lines[j].comment; j++) {
+                NSString *comment = lines[j].comment;
+                if([regex firstMatchInString:comment options:0 range:NSMakeRange(0, comment.length)]) {
+                    [indexes addIndex:j];
+                }
+            }
+            break;
+        }
+    }
+
+    return indexes;
+}
+
 // Defined in TFPPrintSettingViewController
 // @[@"Layer Height", @"Wall Thickness", @"Fill Density", @"Bed Adhesion", @"Support", @"Print Speed"]
 // The keys used here are defined in TFPPrintSettingViewController. Each proifle type needs to
@@ -0,0 +1,39 @@
+//
+//  TFPTemperatureMonitor.h
+//  microprint
+//
+//
+
+#import <Foundation/Foundation.h>
+
+@class TFPPrinter;
+
+
+typedef struct {
+	NSTimeInterval time; // Seconds, on the TFNanosecondTime clock
+	double temperature;
+	double targetTemperature;
+} TFPTemperatureSample;
+
+
+// Keeps an eye on the heater without getting in the way of other codes. Polls with M105 only when it's needed:
+// often while heating, rarely while holding a temperature or cooling down, and never once the heater is off and back
+// near room temperature.
+// Polls are skipped while other temperature reports are coming in, such as those during M109 or from someone else's M105.
+@interface TFPTemperatureMonitor : NSObject
+- (instancetype)initWithPrinter:(TFPPrinter*)printer;
+
+// Fed by the printer with every temperature it learns about. Any queue.
+- (void)recordTemperature:(double)temperature targetTemperature:(double)targetTemperature;
+- (void)noteTemperatureRequest;
+
+// Packed TFPTemperatureSample values, oldest first. The history holds the most recent few thousand samples.
+- (NSData*)samplesSinceTime:(NSTimeInterval)time;
+- (BOOL)getLatestSample:(TFPTemperatureSample*)sample;
+
+// Temperature change over the last interval, or 0 if the history doesn't reach that far back.
+// A heater with a target well above its temperature that isn't rising is probably broken.
+- (double)temperatureChangeOverInterval:(NSTimeInterval)interval;
+
+- (void)stop;
+@end
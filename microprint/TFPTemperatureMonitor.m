@@ -0,0 +1,207 @@
+//
+//  TFPTemperatureMonitor.m
+//  microprint
+//
+//
+
+#import "TFPTemperatureMonitor.h"
+#import "TFPPrinter.h"
+#import "TFPGCodeHelpers.h"
+#import "TFPExtras.h"
+#import "TFPVirtualClock.h"
+
+
+static const NSUInteger historyCapacity = 4096;
+
+static const NSTimeInterval heatingPollInterval = 0.5;
+static const NSTimeInterval stablePollInterval = 5;
+static const NSTimeInterval coolingPollInterval = 10;
+static const NSTimeInterval idleCheckInterval = 2;
+
+static const double stableTemperatureTolerance = 3;
+static const double ambientTemperature = 30; // Roughly what an idle printer reads; cooling is done below this
+
+
+static NSTimeInterval TFPTemperatureMonitorTime(void) {
+	return (double)TFNanosecondTime() / NSEC_PER_SEC;
+}
+
+
+
+@interface TFPTemperatureMonitor () {
+	TFPTemperatureSample _samples[historyCapacity];
+}
+@property (weak) TFPPrinter *printer;
+@property dispatch_queue_t queue;
+@property (atomic) BOOL stopped;
+
+// Ring buffer; guarded by @synchronized(self)
+@property NSUInteger nextSampleIndex;
+@property NSUInteger sampleCount;
+
+// On queue
+@property NSTimeInterval lastReportTime;
+@property NSTimeInterval lastRequestTime;
+@property NSTimeInterval currentPollInterval;
+@property BOOL pollInFlight;
+@end
+
+
+@implementation TFPTemperatureMonitor
+
+
+- (instancetype)initWithPrinter:(TFPPrinter*)printer {
+	if(!(self = [super init])) return nil;
+	
+	self.printer = printer;
+	self.queue = dispatch_queue_create("se.tomasf.microprint.temperatureMonitor", DISPATCH_QUEUE_SERIAL);
+	[TFPVirtualClock registerQueue:self.queue];
+	
+	dispatch_async(self.queue, ^{
+		[self schedulePollAfter:idleCheckInterval];
+	});
+	
+	return self;
+}
+
+
+- (void)stop {
+	self.stopped = YES;
+}
+
+
+// On queue. Each poll schedules the next one through the virtual clock, so simulated runs see the same polls every time.
+- (void)schedulePollAfter:(NSTimeInterval)interval {
+	self.currentPollInterval = interval;
+	
+	__weak __typeof__(self) weakSelf = self;
+	[TFPVirtualClock dispatchAfter:interval queue:self.queue block:^{
+		__typeof__(self) strongSelf = weakSelf;
+		if(strongSelf && !strongSelf.stopped) {
+			[strongSelf poll];
+		}
+	}];
+}
+
+
+// On queue. Zero means no polling is needed.
+- (NSTimeInterval)desiredPollInterval {
+	TFPPrinter *printer = self.printer;
+	if(!printer) {
+		return 0;
+	}
+	
+	double target = printer.heaterTargetTemperature;
+	TFPTemperatureSample sample;
+	if(printer.pendingConnection || ![self getLatestSample:&sample]) {
+		// Nothing known yet; the heater may still be hot from an earlier session
+		return target > 0 ? heatingPollInterval : coolingPollInterval;
+	}
+	
+	if(target > 0) {
+		return (fabs(target - sample.temperature) > stableTemperatureTolerance) ? heatingPollInterval : stablePollInterval;
+	}else if(sample.temperature > ambientTemperature) {
+		return coolingPollInterval;
+	}else{
+		return 0;
+	}
+}
+
+
+// On queue
+- (void)poll {
+	NSTimeInterval interval = [self desiredPollInterval];
+	[self schedulePollAfter:interval ?: idleCheckInterval];
+	
+	NSTimeInterval now = TFPTemperatureMonitorTime();
+	if(!interval || self.pollInFlight || now - self.lastReportTime < interval || now - self.lastRequestTime < interval) {
+		return;
+	}
+	
+	self.pollInFlight = YES;
+	self.lastRequestTime = now;
+	
+	__weak __typeof__(self) weakSelf = self;
+	dispatch_queue_t queue = self.queue;
+	[self.printer sendGCode:[TFPGCode codeForReadingHeaterTemperature] responseHandler:^(BOOL success, TFPGCodeResponseDictionary value) {
+		dispatch_async(queue, ^{
+			weakSelf.pollInFlight = NO;
+		});
+	}];
+}
+
+
+- (void)noteTemperatureRequest {
+	dispatch_async(self.queue, ^{
+		self.lastRequestTime = TFPTemperatureMonitorTime();
+	});
+}
+
+
+- (void)recordTemperature:(double)temperature targetTemperature:(double)targetTemperature {
+	NSTimeInterval now = TFPTemperatureMonitorTime();
+	
+	@synchronized(self) {
+		_samples[self.nextSampleIndex] = (TFPTemperatureSample){.time = now, .temperature = temperature, .targetTemperature = targetTemperature};
+		self.nextSampleIndex = (self.nextSampleIndex + 1) % historyCapacity;
+		self.sampleCount = MIN(self.sampleCount + 1, historyCapacity);
+	}
+	
+	dispatch_async(self.queue, ^{
+		self.lastReportTime = now;
+	});
+}
+
+
+#pragma mark - History
+
+
+- (BOOL)getLatestSample:(TFPTemperatureSample*)sample {
+	@synchronized(self) {
+		if(!self.sampleCount) {
+			return NO;
+		}
+		*sample = _samples[(self.nextSampleIndex + historyCapacity - 1) % historyCapacity];
+		return YES;
+	}
+}
+
+
+- (NSData*)samplesSinceTime:(NSTimeInterval)time {
+	NSMutableData *data = [NSMutableData data];
+	
+	@synchronized(self) {
+		NSUInteger firstIndex = (self.nextSampleIndex + historyCapacity - self.sampleCount) % historyCapacity;
+		for(NSUInteger i=0; i<self.sampleCount; i++) {
+			const TFPTemperatureSample *sample = &_samples[(firstIndex + i) % historyCapacity];
+			if(sample->time >= time) {
+				[data appendBytes:sample length:sizeof(TFPTemperatureSample)];
+			}
+		}
+	}
+	
+	return data;
+}
+
+
+- (double)temperatureChangeOverInterval:(NSTimeInterval)interval {
+	@synchronized(self) {
+		if(!self.sampleCount) {
+			return 0;
+		}
+		
+		TFPTemperatureSample latest = _samples[(self.nextSampleIndex + historyCapacity - 1) % historyCapacity];
+		
+		// Walk back to the newest sample that is at least interval old
+		for(NSUInteger i=1; i<self.sampleCount; i++) {
+			TFPTemperatureSample sample = _samples[(self.nextSampleIndex + historyCapacity - 1 - i) % historyCapacity];
+			if(latest.time - sample.time >= interval) {
+				return latest.temperature - sample.temperature;
+			}
+		}
+		return 0;
+	}
+}
+
+
+@end
@@ -0,0 +1,28 @@
+//
+//  TFPThermalBondingScheduler.h
+//  microprint
+//
+//
+
+#import <Foundation/Foundation.h>
+#import "TFPGCodeHelpers.h"
+#import "TFPPrintParameters.h"
+
+
+@interface TFPTemperatureChange : NSObject
+@property (readonly) NSUInteger boundaryLine; // First line of the layer that needs the new temperature
+@property (readonly) NSUInteger issueLine; // Line at which the non-blocking temperature change should be sent
+@property (readonly) double temperature;
+@property (readonly) NSTimeInterval estimatedTransitionTime;
+@end
+
+
+@interface TFPThermalBondingScheduler : NSObject
+- (instancetype)initWithProgram:(TFPGCodeProgram*)program layers:(NSArray<TFPPrintLayer*> *)layers parameters:(TFPPrintParameters*)parameters;
+
+@property (readonly, copy) NSArray<TFPTemperatureChange*> *changes;
+
+// Time a blocking M109 at each boundary would have spent idle, from the rough heating and cooling rates. An
+// estimate, not a measurement.
+@property (readonly) NSTimeInterval estimatedBlockingWaitTime;
+@end
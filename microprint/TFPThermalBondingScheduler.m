@@ -0,0 +1,97 @@
+//
+//  TFPThermalBondingScheduler.m
+//  microprint
+//
+//
+
+#import "TFPThermalBondingScheduler.h"
+#import "TFPExtras.h"
+
+
+// Rough heater characteristics of the Micro, in degrees per second
+static const double heatingRate = 1.5;
+static const double coolingRate = 0.5;
+static const NSTimeInterval minimumLeadTime = 5;
+
+
+@interface TFPTemperatureChange ()
+@property (readwrite) NSUInteger boundaryLine;
+@property (readwrite) NSUInteger issueLine;
+@property (readwrite) double temperature;
+@property (readwrite) NSTimeInterval estimatedTransitionTime;
+@end
+
+
+@implementation TFPTemperatureChange
+
+
+- (NSString *)description {
+	return [NSString stringWithFormat:@"<%@ %.0f °C at line %ld, issued at line %ld (%.0f s ahead)>",
+			self.class, self.temperature, (long)self.boundaryLine+1, (long)self.issueLine+1, self.estimatedTransitionTime];
+}
+
+
+@end
+
+
+
+@interface TFPThermalBondingScheduler ()
+@property (readwrite, copy) NSArray<TFPTemperatureChange*> *changes;
+@property (readwrite) NSTimeInterval estimatedBlockingWaitTime;
+@end
+
+
+@implementation TFPThermalBondingScheduler
+
+
+- (instancetype)initWithProgram:(TFPGCodeProgram*)program layers:(NSArray<TFPPrintLayer*> *)layers parameters:(TFPPrintParameters*)parameters {
+	if(!(self = [super init])) return nil;
+	
+	NSMutableArray *changes = [NSMutableArray new];
+	double baseTemperature = TFPBoundedTemperature(parameters.temperature);
+	double firstLayerTemperature = TFPBoundedTemperature(parameters.temperature + parameters.filament.temperatureIncreaseForFirstLayer);
+	
+	// Same layers as the old blocking behavior: the first layer gets a boost, the second goes back to normal
+	double temperatures[] = {firstLayerTemperature, baseTemperature};
+	double currentTemperature = baseTemperature;
+	
+	double *lineDurations = calloc(MAX(program.lines.count, 1), sizeof(double));
+	[program estimateDurationWithLineDurations:lineDurations];
+	NSUInteger earliestLine = 0;
+	
+	for(NSUInteger i=0; i<MIN(layers.count, 2); i++) {
+		double temperature = temperatures[i];
+		NSUInteger boundary = layers[i].lineRange.location;
+		
+		double delta = temperature - currentTemperature;
+		NSTimeInterval transitionTime = fabs(delta) / (delta > 0 ? heatingRate : coolingRate);
+		NSTimeInterval leadTime = MAX(transitionTime, minimumLeadTime);
+		
+		// Walk backwards until we've covered enough estimated print time to finish the transition
+		NSUInteger issueLine = boundary;
+		NSTimeInterval coveredTime = 0;
+		while(!parameters.thermalBondingWaitsAtBoundaries && issueLine > earliestLine && coveredTime < leadTime) {
+			issueLine--;
+			coveredTime += lineDurations[issueLine];
+		}
+		
+		TFPTemperatureChange *change = [TFPTemperatureChange new];
+		change.boundaryLine = boundary;
+		change.issueLine = issueLine;
+		change.temperature = temperature;
+		change.estimatedTransitionTime = transitionTime;
+		[changes addObject:change];
+		
+		self.estimatedBlockingWaitTime += transitionTime;
+		currentTemperature = temperature;
+		earliestLine = boundary;
+	}
+	
+	free(lineDurations);
+	self.changes = changes;
+	
+	return self;
+}
+
+
+@end
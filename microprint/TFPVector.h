@@ -0,0 +1,91 @@
+//
+//  TFPVector.h
+//  microprint
+//
+//
+
+#import <Foundation/Foundation.h>
+
+
+typedef NS_OPTIONS(uint8_t, TFPVectorFields) {
+	TFPVectorFieldX = 1<<0,
+	TFPVectorFieldY = 1<<1,
+	TFPVectorFieldZ = 1<<2,
+	TFPVectorFieldsAll = TFPVectorFieldX | TFPVectorFieldY | TFPVectorFieldZ,
+};
+
+
+// Unboxed counterpart of TFP3DVector for per-move code. Values missing from fields are kept at 0 and,
+// like nil values in TFP3DVector, count as 0 in arithmetic. Results have the fields of the first operand.
+typedef struct {
+	double x;
+	double y;
+	double z;
+	TFPVectorFields fields;
+} TFPVector;
+
+
+static const TFPVector TFPVectorEmpty = {0, 0, 0, 0};
+
+
+static inline TFPVector TFPVectorMake(double x, double y, double z) {
+	return (TFPVector){x, y, z, TFPVectorFieldsAll};
+}
+
+
+static inline TFPVector TFPVectorWithFields(TFPVector vector, TFPVectorFields fields) {
+	return (TFPVector){
+		(fields & TFPVectorFieldX) ? vector.x : 0,
+		(fields & TFPVectorFieldY) ? vector.y : 0,
+		(fields & TFPVectorFieldZ) ? vector.z : 0,
+		fields,
+	};
+}
+
+
+static inline TFPVector TFPVectorDefaultingToValues(TFPVector vector, TFPVector defaults) {
+	return (TFPVector){
+		(vector.fields & TFPVectorFieldX) ? vector.x : defaults.x,
+		(vector.fields & TFPVectorFieldY) ? vector.y : defaults.y,
+		(vector.fields & TFPVectorFieldZ) ? vector.z : defaults.z,
+		vector.fields | defaults.fields,
+	};
+}
+
+
+static inline TFPVector TFPVectorAdd(TFPVector a, TFPVector b) {
+	return TFPVectorWithFields((TFPVector){a.x + b.x, a.y + b.y, a.z + b.z}, a.fields);
+}
+
+
+static inline TFPVector TFPVectorSubtract(TFPVector a, TFPVector b) {
+	return TFPVectorWithFields((TFPVector){a.x - b.x, a.y - b.y, a.z - b.z}, a.fields);
+}
+
+
+static inline TFPVector TFPVectorMultiply(TFPVector a, TFPVector b) {
+	return TFPVectorWithFields((TFPVector){a.x * b.x, a.y * b.y, a.z * b.z}, a.fields);
+}
+
+
+static inline TFPVector TFPVectorDivide(TFPVector a, TFPVector b) {
+	return TFPVectorWithFields((TFPVector){a.x / b.x, a.y / b.y, a.z / b.z}, a.fields);
+}
+
+
+static inline TFPVector TFPVectorScale(TFPVector vector, double factor) {
+	return TFPVectorWithFields((TFPVector){vector.x * factor, vector.y * factor, vector.z * factor}, vector.fields);
+}
+
+
+static inline TFPVector TFPVectorAbsolute(TFPVector vector) {
+	return (TFPVector){fabs(vector.x), fabs(vector.y), fabs(vector.z), vector.fields};
+}
+
+
+// Values missing from b are taken from a
+static inline double TFPVectorDistance(TFPVector a, TFPVector b) {
+	b = TFPVectorDefaultingToValues(b, a);
+	double dx = b.x - a.x, dy = b.y - a.y, dz = b.z - a.z;
+	return sqrt(dx*dx + dy*dy + dz*dz);
+}
@@ -0,0 +1,27 @@
+//
+//  TFPVirtualClock.h
+//  microprint
+//
+//
+
+#import <Foundation/Foundation.h>
+
+
+// Discrete-event clock for simulated printing. While it's running, TFNanosecondTime reports simulated time and work
+// scheduled through the clock runs in time order as soon as everything else is idle, so hours of printing pass in
+// seconds and every run sees the same timestamps. When it's stopped, scheduling falls through to dispatch_after.
+@interface TFPVirtualClock : NSObject
++ (void)start;
++ (void)stop; // Events still pending are handed to dispatch_after with their remaining simulated delay
++ (BOOL)isRunning;
+
++ (void)dispatchAfter:(NSTimeInterval)delay queue:(dispatch_queue_t)queue block:(dispatch_block_t)block;
+
+// Serial queues that take part in simulations. The clock only advances once these and the main queue are idle.
+// Queues are held weakly and can be registered whether the clock is running or not.
++ (void)registerQueue:(dispatch_queue_t)queue;
+@end
+
+
+// Simulated time in nanoseconds, or 0 if the clock isn't running. Starts at one second so it's never mistaken for an unset time.
+extern uint64_t TFPVirtualClockTime(void);
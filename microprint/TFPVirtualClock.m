@@ -0,0 +1,217 @@
+//
+//  TFPVirtualClock.m
+//  microprint
+//
+//
+
+#import "TFPVirtualClock.h"
+#import <stdatomic.h>
+
+
+static const NSUInteger quietPassesBeforeAdvancing = 3;
+
+static _Atomic uint64_t currentTime = 0;
+
+
+uint64_t TFPVirtualClockTime(void) {
+	return atomic_load_explicit(&currentTime, memory_order_relaxed);
+}
+
+
+
+@interface TFPVirtualClockEvent : NSObject
+@property uint64_t time;
+@property dispatch_queue_t queue;
+@property (copy) dispatch_block_t block;
+@end
+
+
+@implementation TFPVirtualClockEvent
+@end
+
+
+
+@interface TFPVirtualClock ()
+// Guarded by condition
+@property NSCondition *condition;
+@property NSThread *thread;
+@property NSMutableArray<TFPVirtualClockEvent*> *events; // Sorted by time, then by scheduling order
+@property uint64_t generation; // Bumped whenever something is scheduled
+
+// Guarded by @synchronized(queues)
+@property NSHashTable *queues;
+@end
+
+
+
+@implementation TFPVirtualClock
+
+
++ (instancetype)sharedClock {
+	static TFPVirtualClock *clock;
+	static dispatch_once_t once;
+	dispatch_once(&once, ^{
+		clock = [self new];
+	});
+	return clock;
+}
+
+
+- (instancetype)init {
+	if(!(self = [super init])) return nil;
+	
+	self.condition = [NSCondition new];
+	self.events = [NSMutableArray new];
+	self.queues = [NSHashTable weakObjectsHashTable];
+	
+	return self;
+}
+
+
++ (void)start {
+	[[self sharedClock] start];
+}
+
+
++ (void)stop {
+	[[self sharedClock] stop];
+}
+
+
++ (BOOL)isRunning {
+	return TFPVirtualClockTime() != 0;
+}
+
+
++ (void)dispatchAfter:(NSTimeInterval)delay queue:(dispatch_queue_t)queue block:(dispatch_block_t)block {
+	[[self sharedClock] dispatchAfter:delay queue:queue block:block];
+}
+
+
++ (void)registerQueue:(dispatch_queue_t)queue {
+	TFPVirtualClock *clock = [self sharedClock];
+	@synchronized(clock.queues) {
+		[clock.queues addObject:queue];
+	}
+}
+
+
+- (void)start {
+	[self.condition lock];
+	if(self.thread) {
+		[self.condition unlock];
+		return;
+	}
+	
+	atomic_store(&currentTime, NSEC_PER_SEC);
+	self.thread = [[NSThread alloc] initWithTarget:self selector:@selector(run) object:nil];
+	self.thread.name = @"se.tomasf.microprint.virtualClock";
+	[self.thread start];
+	[self.condition unlock];
+}
+
+
+- (void)stop {
+	[self.condition lock];
+	if(!self.thread) {
+		[self.condition unlock];
+		return;
+	}
+	
+	uint64_t now = TFPVirtualClockTime();
+	NSArray<TFPVirtualClockEvent*> *events = [self.events copy];
+	[self.events removeAllObjects];
+	self.thread = nil;
+	atomic_store(&currentTime, 0);
+	[self.condition broadcast];
+	[self.condition unlock];
+	
+	for(TFPVirtualClockEvent *event in events) {
+		dispatch_after(dispatch_time(DISPATCH_TIME_NOW, event.time - now), event.queue, event.block);
+	}
+}
+
+
+- (void)dispatchAfter:(NSTimeInterval)delay queue:(dispatch_queue_t)queue block:(dispatch_block_t)block {
+	[self.condition lock];
+	if(!self.thread) {
+		[self.condition unlock];
+		dispatch_after(dispatch_time(DISPATCH_TIME_NOW, delay * NSEC_PER_SEC), queue, block);
+		return;
+	}
+	
+	TFPVirtualClockEvent *event = [TFPVirtualClockEvent new];
+	event.time = TFPVirtualClockTime() + (uint64_t)(MAX(delay, 0) * NSEC_PER_SEC);
+	event.queue = queue;
+	event.block = block;
+	
+	// Inserting after equal times keeps simultaneous events in the order they were scheduled
+	NSUInteger index = [self.events indexOfObject:event inSortedRange:NSMakeRange(0, self.events.count) options:NSBinarySearchingInsertionIndex | NSBinarySearchingLastEqual usingComparator:^NSComparisonResult(TFPVirtualClockEvent *event1, TFPVirtualClockEvent *event2) {
+		return event1.time < event2.time ? NSOrderedAscending : (event1.time > event2.time ? NSOrderedDescending : NSOrderedSame);
+	}];
+	[self.events insertObject:event atIndex:index];
+	self.generation++;
+	
+	[self.condition signal];
+	[self.condition unlock];
+}
+
+
+- (uint64_t)currentGeneration {
+	[self.condition lock];
+	uint64_t generation = self.generation;
+	[self.condition unlock];
+	return generation;
+}
+
+
+// On clock thread. Work hops between queues, so keep draining them until several passes in a row schedule nothing new.
+- (void)waitUntilIdle {
+	NSUInteger quietPasses = 0;
+	
+	while(quietPasses < quietPassesBeforeAdvancing) {
+		uint64_t generation = [self currentGeneration];
+		NSArray *queues;
+		@synchronized(self.queues) {
+			queues = [self.queues.allObjects arrayByAddingObject:dispatch_get_main_queue()];
+		}
+		
+		for(dispatch_queue_t queue in queues) {
+			dispatch_sync(queue, ^{});
+		}
+		quietPasses = (generation == [self currentGeneration]) ? quietPasses + 1 : 0;
+	}
+}
+
+
+// On clock thread
+- (void)run {
+	NSThread *thread = [NSThread currentThread];
+	
+	for(;;) {
+		[self waitUntilIdle];
+		
+		[self.condition lock];
+		if(self.thread != thread) {
+			[self.condition unlock];
+			break;
+		}
+		
+		if(!self.events.count) {
+			// Whoever schedules the next event may not be done yet, so settle again before running it
+			[self.condition wait];
+			[self.condition unlock];
+			continue;
+		}
+		
+		TFPVirtualClockEvent *event = self.events.firstObject;
+		[self.events removeObjectAtIndex:0];
+		atomic_store(&currentTime, MAX(event.time, TFPVirtualClockTime()));
+		[self.condition unlock];
+		
+		dispatch_async(event.queue, event.block);
+	}
+}
+
+
+@end
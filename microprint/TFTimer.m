@@ -7,9 +7,15 @@
 //
 
 #import "TFTimer.h"
+#import "TFPVirtualClock.h"
 
 @interface TFTimer ()
 @property (weak) NSTimer *timer;
+
+// Timers made while the virtual clock runs fire on the main queue in simulated time
+@property NSTimeInterval virtualInterval;
+@property BOOL virtualRepeat;
+@property (copy) void(^virtualAction)();
 @end
 
 
@@ -31,6 +37,14 @@
 	if(!(self = [super init])) return nil;
 	
 	action = [action copy];
+	if([TFPVirtualClock isRunning]) {
+		self.virtualInterval = interval;
+		self.virtualRepeat = repeat;
+		self.virtualAction = action;
+		[self scheduleVirtualFire];
+		return self;
+	}
+	
 	self.timer = [NSTimer scheduledTimerWithTimeInterval:interval target:action selector:@selector(tftimer_invoke) userInfo:nil repeats:repeat];
 	
 	return self;
@@ -47,9 +61,29 @@
 }
 
 
+- (void)scheduleVirtualFire {
+	__weak __typeof__(self) weakSelf = self;
+	
+	[TFPVirtualClock dispatchAfter:self.virtualInterval queue:dispatch_get_main_queue() block:^{
+		void(^action)() = weakSelf.virtualAction;
+		if(!action) {
+			return;
+		}
+		
+		if(weakSelf.virtualRepeat) {
+			[weakSelf scheduleVirtualFire];
+		}else{
+			weakSelf.virtualAction = nil;
+		}
+		action();
+	}];
+}
+
+
 - (void)invalidate {
 	[self.timer invalidate];
 	self.timer = nil;
+	self.virtualAction = nil;
 }
 
 